@@ -0,0 +1,455 @@
+#include "AsyncLookup.h"
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Name: Constructor
+ * Params:
+ *	PersistentBpTree& tree - an open tree
+ *	const int queueDepth - the maximum number of page reads in flight
+ *	const size_t cachePages - the number of pages to keep cached (0 for none)
+ *	const bool direct - true to read with O_DIRECT, bypassing the kernel's page cache (falls
+ *		back to buffered reads where O_DIRECT is not supported)
+ * Description:
+ *	Opens the tree's file for reading and sets up the reads (on io_uring where available).
+ */
+AsyncLookup::AsyncLookup(PersistentBpTree& tree, const int queueDepth, const size_t cachePages, const bool direct)
+	: tree(tree), ring(queueDepth, true)
+{
+	this->fd = -1;
+	if (direct) {
+		this->fd = open(tree.getPath().c_str(), O_RDONLY | O_DIRECT);
+	}
+	if (this->fd < 0) {
+		this->fd = open(tree.getPath().c_str(), O_RDONLY);
+	}
+	this->pageSize = 0;
+	this->root = 0;
+	this->generation = 0;
+	this->cacheCapacity = cachePages;
+	this->hand = 0;
+	this->cachedLeaves = 0;
+	this->pending = 0;
+	this->numFinished = 0;
+	this->numReads = 0;
+	this->cacheHits = 0;
+	this->errors = 0;
+	this->refresh();
+}
+
+/* Name: Destructor
+ * Params:
+ *	None
+ * Description:
+ *	Waits for the reads in flight (without calling back the lookups waiting for them), then
+ *	frees the cache and closes the file.
+ */
+AsyncLookup::~AsyncLookup()
+{
+	while (this->ring.getInFlight() > 0) {
+		if (this->ring.complete(this->completions, true) == 0) {
+			break;
+		}
+	}
+	for (std::unordered_map<uint64_t, Read>::iterator it = this->reads.begin(); it != this->reads.end(); ++it) {
+		free(it->second.buffer);
+	}
+	for (size_t i = 0; i < this->pages.size(); i++) {
+		free(this->pages[i].data);
+	}
+	for (size_t i = 0; i < this->spareBuffers.size(); i++) {
+		free(this->spareBuffers[i]);
+	}
+	if (this->fd >= 0) {
+		close(this->fd);
+	}
+}
+
+/* Name: isReady
+ * Params:
+ *	None
+ * Description:
+ *	Checks whether the tree's file could be opened for reading.
+ * Returns: true if lookups can be made, false otherwise
+ */
+bool AsyncLookup::isReady()
+{
+	return this->fd >= 0;
+}
+
+/* Name: refresh
+ * Params:
+ *	None
+ * Description:
+ *	Makes later lookups see the tree as it is now. The cache is emptied if the tree was
+ *	updated, since the updates may have reused the pages of the cached nodes. Must not be
+ *	called while lookups are pending.
+ * Returns: None
+ */
+void AsyncLookup::refresh()
+{
+	this->root = this->tree.getRoot();
+	this->pageSize = this->tree.getPageSize();
+	if (this->generation != this->tree.getGeneration()) {
+		for (size_t i = 0; i < this->pages.size(); i++) {
+			this->releaseBuffer(this->pages[i].data);
+		}
+		this->pages.clear();
+		this->cacheIndex.clear();
+		this->hand = 0;
+		this->cachedLeaves = 0;
+		this->generation = this->tree.getGeneration();
+	}
+}
+
+/* Name: find
+ * Params:
+ *	const int key - the key to look up
+ *	LookupCallback callback - called when the lookup finishes
+ *	void* argument - passed to the callback
+ * Description:
+ *	Queues a lookup. It starts on the next poll() or wait().
+ * Returns: None
+ */
+void AsyncLookup::find(const int key, LookupCallback callback, void* argument)
+{
+	Lookup lookup;
+	lookup.key = key;
+	lookup.page = this->root;
+	lookup.callback = callback;
+	lookup.argument = argument;
+	this->queued.push_back(lookup);
+	this->pending += 1;
+}
+
+/* Name: poll
+ * Params:
+ *	None
+ * Description:
+ *	Moves the lookups along without waiting: collects the reads that finished and walks the
+ *	lookups waiting for them and the queued lookups down the tree until each one finishes or
+ *	needs a page that is not cached, whose read is then submitted. Lookups queued by the
+ *	callbacks of this call wait for the next one. When the queue depth is reached, the
+ *	remaining lookups stay queued.
+ * Returns: the number of lookups that finished
+ */
+int AsyncLookup::poll()
+{
+	size_t before = this->numFinished;
+	this->collect(false);
+	size_t count = this->queued.size();
+	for (size_t i = 0; i < count && !this->queued.empty(); i++) {
+		Lookup lookup = this->queued.front();
+		this->queued.pop_front();
+		if (!this->advance(lookup)) {
+			this->queued.push_front(lookup);
+			break;
+		}
+	}
+	//submits the reads started above
+	this->collect(false);
+	return this->numFinished - before;
+}
+
+/* Name: wait
+ * Params:
+ *	None
+ * Description:
+ *	Runs until no lookup is pending (including those queued by callbacks meanwhile), sleeping
+ *	in the kernel whenever every lookup is waiting for a read. Stops early if reads can no
+ *	longer be collected, leaving the remaining lookups pending.
+ * Returns: the number of lookups that finished
+ */
+int AsyncLookup::wait()
+{
+	size_t before = this->numFinished;
+	while (this->pending > 0) {
+		this->poll();
+		if (this->pending == 0) {
+			break;
+		}
+		if (this->ring.getInFlight() > 0) {
+			if (this->collect(true) == 0) {
+				break;
+			}
+		} else if (this->queued.empty()) {
+			break;
+		}
+	}
+	return this->numFinished - before;
+}
+
+/* Name: advance
+ * Params:
+ *	Lookup& lookup - a lookup that is not parked
+ * Description:
+ *	Walks a lookup down through the cached pages until it finishes or needs a page that is
+ *	not cached. It is then parked on the read of that page, starting the read if no other
+ *	lookup already did.
+ * Returns: true if the lookup finished or was parked, false if it needs a new read but the
+ *	queue depth is reached
+ */
+bool AsyncLookup::advance(Lookup& lookup)
+{
+	if (this->root == 0 || this->fd < 0) {
+		this->finish(lookup, false, std::string());
+		return true;
+	}
+	char * data = this->findCached(lookup.page);
+	while (data != 0) {
+		this->cacheHits += 1;
+		if (this->step(lookup, data)) {
+			return true;
+		}
+		data = this->findCached(lookup.page);
+	}
+	std::unordered_map<uint64_t, Read>::iterator it = this->reads.find(lookup.page);
+	if (it != this->reads.end()) {
+		it->second.waiting.push_back(lookup);
+		return true;
+	}
+	char * buffer = this->allocateBuffer();
+	if (buffer == 0 || !this->ring.read(this->fd, lookup.page, buffer, this->pageSize, lookup.page)) {
+		if (buffer != 0) {
+			this->releaseBuffer(buffer);
+		}
+		return false;
+	}
+	this->numReads += 1;
+	Read& read = this->reads[lookup.page];
+	read.buffer = buffer;
+	read.waiting.push_back(lookup);
+	return true;
+}
+
+/* Name: step
+ * Params:
+ *	Lookup& lookup - a lookup
+ *	const char* data - the page the lookup needs
+ * Description:
+ *	Searches a page for a lookup: an interior node moves it to the child it needs next, and a
+ *	leaf finishes it.
+ * Returns: true if the lookup finished, false otherwise
+ */
+bool AsyncLookup::step(Lookup& lookup, const char* data)
+{
+	int result = this->tree.searchPage(data, lookup.key, lookup.page, this->value);
+	if (result == PERSIST_SEARCH_CHILD) {
+		return false;
+	}
+	this->finish(lookup, result == PERSIST_SEARCH_FOUND, this->value);
+	return true;
+}
+
+/* Name: finish
+ * Params:
+ *	Lookup& lookup - a lookup that finished
+ *	bool found - whether its key was found
+ *	const std::string& value - the value of its key
+ * Description:
+ *	Calls back a lookup that finished.
+ * Returns: None
+ */
+void AsyncLookup::finish(Lookup& lookup, bool found, const std::string& value)
+{
+	this->pending -= 1;
+	this->numFinished += 1;
+	lookup.callback(lookup.key, found, value, lookup.argument);
+}
+
+/* Name: collect
+ * Params:
+ *	const bool block - true to wait until at least one read finishes
+ * Description:
+ *	Submits the reads started so far and collects those that finished. Lookups parked on a
+ *	finished read take their step on the page: those that need another page go to the front
+ *	of the queue (ahead of lookups that have not started, so that few lookups are half done
+ *	at any time), and the others finish. The page is then cached. Lookups parked on a failed
+ *	read finish as not found and are counted as errors.
+ * Returns: the number of reads collected
+ */
+int AsyncLookup::collect(const bool block)
+{
+	this->completions.clear();
+	int collected = this->ring.complete(this->completions, block);
+	for (size_t i = 0; i < this->completions.size(); i++) {
+		uint64_t offset = this->completions[i].first;
+		std::unordered_map<uint64_t, Read>::iterator it = this->reads.find(offset);
+		Read read;
+		read.buffer = it->second.buffer;
+		read.waiting.swap(it->second.waiting);
+		this->reads.erase(it);
+		bool ok = this->completions[i].second == (long)this->pageSize;
+		bool leaf = false; //a step on a leaf always finishes the lookup
+		for (size_t j = 0; j < read.waiting.size(); j++) {
+			if (!ok) {
+				this->errors += 1;
+				this->finish(read.waiting[j], false, std::string());
+			} else if (this->step(read.waiting[j], read.buffer)) {
+				leaf = true;
+			} else {
+				this->queued.push_front(read.waiting[j]);
+			}
+		}
+		if (ok) {
+			this->cache(offset, read.buffer, leaf);
+		} else {
+			this->releaseBuffer(read.buffer);
+		}
+	}
+	return collected;
+}
+
+/* Name: findCached
+ * Params:
+ *	uint64_t offset - the offset of a page
+ * Description:
+ *	Looks for a page in the cache, marking it as referenced.
+ * Returns: the cached copy of the page, or 0 if it is not cached
+ */
+char * AsyncLookup::findCached(uint64_t offset)
+{
+	std::unordered_map<uint64_t, size_t>::iterator it = this->cacheIndex.find(offset);
+	if (it == this->cacheIndex.end()) {
+		return 0;
+	}
+	this->pages[it->second].referenced = true;
+	return this->pages[it->second].data;
+}
+
+/* Name: cache
+ * Params:
+ *	uint64_t offset - the offset of a page that was read
+ *	char* data - the buffer holding the page (owned by the cache from now on)
+ *	bool leaf - whether the page is a leaf
+ * Description:
+ *	Caches a page, evicting with CLOCK when the cache is full: the hand skips (and unmarks)
+ *	pages that were referenced since it last passed. While the cache holds any leaf, the
+ *	hand passes over interior nodes without touching them, so only leaves are evicted.
+ * Returns: None
+ */
+void AsyncLookup::cache(uint64_t offset, char* data, bool leaf)
+{
+	if (this->cacheCapacity == 0) {
+		this->releaseBuffer(data);
+		return;
+	}
+	CachedPage page;
+	page.offset = offset;
+	page.referenced = false;
+	page.leaf = leaf;
+	page.data = data;
+	this->cachedLeaves += leaf ? 1 : 0;
+	if (this->pages.size() < this->cacheCapacity) {
+		this->cacheIndex[offset] = this->pages.size();
+		this->pages.push_back(page);
+		return;
+	}
+	bool leavesOnly = this->cachedLeaves > (leaf ? 1 : 0);
+	while (this->pages[this->hand].referenced || (leavesOnly && !this->pages[this->hand].leaf)) {
+		if (this->pages[this->hand].leaf || !leavesOnly) {
+			this->pages[this->hand].referenced = false;
+		}
+		this->hand = (this->hand + 1) % this->pages.size();
+	}
+	this->cachedLeaves -= this->pages[this->hand].leaf ? 1 : 0;
+	this->cacheIndex.erase(this->pages[this->hand].offset);
+	this->releaseBuffer(this->pages[this->hand].data);
+	this->pages[this->hand] = page;
+	this->cacheIndex[offset] = this->hand;
+	this->hand = (this->hand + 1) % this->pages.size();
+}
+
+/* Name: allocateBuffer
+ * Params:
+ *	None
+ * Description:
+ *	Takes a page buffer, aligned for O_DIRECT reads.
+ * Returns: the buffer, or 0 if it could not be allocated
+ */
+char * AsyncLookup::allocateBuffer()
+{
+	if (!this->spareBuffers.empty()) {
+		char * buffer = this->spareBuffers.back();
+		this->spareBuffers.pop_back();
+		return buffer;
+	}
+	void * buffer = 0;
+	if (posix_memalign(&buffer, 4096, this->pageSize) != 0) {
+		return 0;
+	}
+	return (char *)buffer;
+}
+
+/* Name: releaseBuffer
+ * Params:
+ *	char* buffer - a buffer from allocateBuffer()
+ * Description:
+ *	Keeps a page buffer for reuse.
+ * Returns: None
+ */
+void AsyncLookup::releaseBuffer(char* buffer)
+{
+	this->spareBuffers.push_back(buffer);
+}
+
+/* Name: getEngine
+ * Params:
+ *	None
+ * Description:
+ *	Tells which engine performs the reads (see IoRing).
+ * Returns: IO_ENGINE_URING or IO_ENGINE_PREAD
+ */
+int AsyncLookup::getEngine()
+{
+	return this->ring.getEngine();
+}
+
+/* Name: getPending
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of lookups that have not finished.
+ * Returns: the number of pending lookups
+ */
+size_t AsyncLookup::getPending()
+{
+	return this->pending;
+}
+
+/* Name: getReads
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of pages read from the file so far.
+ * Returns: the number of reads
+ */
+size_t AsyncLookup::getReads()
+{
+	return this->numReads;
+}
+
+/* Name: getCacheHits
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of lookup steps that found their page in the cache so far.
+ * Returns: the number of cache hits
+ */
+size_t AsyncLookup::getCacheHits()
+{
+	return this->cacheHits;
+}
+
+/* Name: getErrors
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of lookups that failed because a read failed (they were reported as not
+ *	found).
+ * Returns: the number of failed lookups
+ */
+size_t AsyncLookup::getErrors()
+{
+	return this->errors;
+}
@@ -0,0 +1,97 @@
+#ifndef ASYNCLOOKUP_H
+#define ASYNCLOOKUP_H
+
+#include "IoRing.h"
+#include "PersistentBpTree.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Called once for every lookup, with its key, whether the key was found and its value */
+typedef void (*LookupCallback)(int key, bool found, const std::string& value, void* argument);
+
+/* Looks up keys of a PersistentBpTree by reading its pages from the file instead of going
+ * through the mapping, so that a lookup whose page is not cached never blocks the thread:
+ * it is parked until the read of the page completes, and the thread meanwhile moves the
+ * other lookups along. Many lookups thereby keep up to the queue depth reads in flight at
+ * once (on io_uring, see IoRing), which a single thread needs to keep a fast drive busy.
+ * find() only queues a lookup; poll() and wait() move the queued lookups along and call
+ * their callbacks as they finish (callbacks may queue more lookups). Lookups that need the
+ * same page share one read. Recently read pages are kept in a cache evicting with CLOCK; it
+ * evicts leaves before interior nodes, so that a burst of leaf reads (as many as the queue
+ * depth) cannot push the upper levels of the tree out. Lookups see the tree as of the last
+ * refresh(); the tree must not be updated while lookups are in flight, and refresh() must
+ * be called after updates. Not safe for concurrent use. Cannot be copied, as it owns its
+ * IoRing and the read buffers in flight. */
+class AsyncLookup {
+public:
+	AsyncLookup(PersistentBpTree&, const int, const size_t, const bool);
+	~AsyncLookup();
+	AsyncLookup(const AsyncLookup&) = delete;
+	AsyncLookup& operator=(const AsyncLookup&) = delete;
+
+	bool isReady();
+	void refresh();
+	void find(const int, LookupCallback, void*);
+	int poll();
+	int wait();
+
+	int getEngine();
+	size_t getPending();
+	size_t getReads();
+	size_t getCacheHits();
+	size_t getErrors();
+private:
+	struct Lookup {
+		int key;
+		uint64_t page; //the page the lookup needs next
+		LookupCallback callback;
+		void * argument;
+	};
+	struct CachedPage {
+		uint64_t offset;
+		bool referenced; //set on every hit, cleared as the clock hand passes
+		bool leaf;
+		char * data;
+	};
+	struct Read {
+		char * buffer;
+		std::vector<Lookup> waiting; //lookups parked until the page arrives
+	};
+
+	bool advance(Lookup&);
+	bool step(Lookup&, const char*);
+	void finish(Lookup&, bool, const std::string&);
+	char * findCached(uint64_t);
+	void cache(uint64_t, char*, bool);
+	char * allocateBuffer();
+	void releaseBuffer(char*);
+	int collect(const bool);
+
+	PersistentBpTree& tree;
+	IoRing ring;
+	int fd; //the tree's file, opened again for reading (-1 if it could not be opened)
+	size_t pageSize;
+	uint64_t root; //the root as of the last refresh()
+	uint64_t generation; //the generation of the tree as of the last refresh()
+	std::deque<Lookup> queued; //lookups waiting to be moved along by poll()
+	std::unordered_map<uint64_t, Read> reads; //reads in flight by page offset
+	std::vector<CachedPage> pages; //the cache (at most cacheCapacity pages)
+	std::unordered_map<uint64_t, size_t> cacheIndex; //the index in pages of each cached page
+	size_t cacheCapacity;
+	size_t hand; //the page the clock hand points at
+	size_t cachedLeaves; //the number of leaves in the cache
+	std::vector<char*> spareBuffers; //page buffers free for reuse
+	std::vector<std::pair<uint64_t, long> > completions; //scratch space for collect()
+	std::string value; //scratch space for step()
+	size_t pending; //lookups queued, parked or in progress
+	size_t numFinished;
+	size_t numReads;
+	size_t cacheHits;
+	size_t errors; //lookups that failed because a read failed (reported as not found)
+};
+
+#endif
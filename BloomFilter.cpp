@@ -0,0 +1,181 @@
+#include "BloomFilter.h"
+
+/* Name: BloomFilter Constructor
+ * Params:
+ *	size_t capacity - the number of keys the filter is sized for
+ *	int bitsPerKey - the number of bits of filter per key (more bits give fewer false positives)
+ * Description:
+ *	Creates an empty filter with capacity * bitsPerKey bits, rounded up to whole 512-bit
+ *	blocks. The number of bits set per key is bitsPerKey * ln(2), which gives the lowest
+ *	false positive rate for the size of the filter.
+ */
+BloomFilter::BloomFilter(size_t capacity, int bitsPerKey)
+{
+	this->capacity = capacity > 0 ? capacity : 1;
+	this->bitsPerKey = bitsPerKey > 0 ? bitsPerKey : 1;
+	this->numHashes = (int)(this->bitsPerKey * 0.69 + 0.5);
+	if (this->numHashes < 1) {
+		this->numHashes = 1;
+	}
+	if (this->numHashes > 16) {
+		this->numHashes = 16;
+	}
+	this->numBlocks = (this->capacity * this->bitsPerKey + 511) / 512;
+	this->words.assign(this->numBlocks * 8, 0);
+	this->numKeys = 0;
+}
+
+/* Name: hash
+ * Params:
+ *	int key - the key to hash
+ * Description:
+ *	Mixes the bits of the key (the splitmix64 finalizer) so that neighbouring keys end up
+ *	in unrelated blocks.
+ * Returns: the 64-bit hash of the key
+ */
+uint64_t BloomFilter::hash(int key)
+{
+	uint64_t h = (uint64_t)(uint32_t)key + 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+/* Name: remix
+ * Params:
+ *	uint64_t h - a hash
+ * Description:
+ *	Derives a new hash from a hash, used for picking the bits of a key inside its block
+ *	independently of the block that was picked.
+ * Returns: the new 64-bit hash
+ */
+uint64_t BloomFilter::remix(uint64_t h)
+{
+	h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+	h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 33);
+}
+
+/* Name: add
+ * Params:
+ *	int key - the key to add
+ * Description:
+ *	Adds a key to the filter. The high half of the hash picks the block, and the bit
+ *	positions inside the block are taken 9 bits at a time from rehashes of the hash. The bits
+ *	are set atomically, so keys can be added while other threads add or look up keys.
+ * Returns: None
+ */
+void BloomFilter::add(int key)
+{
+	uint64_t h = hash(key);
+	uint64_t * block = &this->words[(size_t)(((h >> 32) * this->numBlocks) >> 32) * 8];
+	uint64_t bits = h;
+	for (int i = 0; i < this->numHashes; i++) {
+		if (i % 7 == 0) {
+			bits = remix(bits);
+		}
+		uint32_t bit = (uint32_t)(bits & 511);
+		__atomic_fetch_or(&block[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+		bits >>= 9;
+	}
+	__atomic_fetch_add(&this->numKeys, 1, __ATOMIC_RELAXED);
+}
+
+/* Name: mayContain
+ * Params:
+ *	int key - the key to look for
+ * Description:
+ *	Checks whether the key may have been added to the filter.
+ * Returns: false if the key was definitely never added, true if it may have been
+ */
+bool BloomFilter::mayContain(int key) const
+{
+	uint64_t h = hash(key);
+	const uint64_t * block = &this->words[(size_t)(((h >> 32) * this->numBlocks) >> 32) * 8];
+	uint64_t bits = h;
+	for (int i = 0; i < this->numHashes; i++) {
+		if (i % 7 == 0) {
+			bits = remix(bits);
+		}
+		uint32_t bit = (uint32_t)(bits & 511);
+		if ((__atomic_load_n(&block[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63))) == 0) {
+			return false;
+		}
+		bits >>= 9;
+	}
+	return true;
+}
+
+/* Name: clear
+ * Params:
+ *	None
+ * Description:
+ *	Removes every key from the filter, keeping its size.
+ * Returns: None
+ */
+void BloomFilter::clear()
+{
+	this->words.assign(this->words.size(), 0);
+	this->numKeys = 0;
+}
+
+/* Name: getCapacity
+ * Params:
+ *	None
+ * Description:
+ *	Returns the number of keys the filter was sized for. Once more keys than this have been
+ *	added the false positive rate climbs above the one the filter was sized for.
+ * Returns: the number of keys the filter was sized for
+ */
+size_t BloomFilter::getCapacity() const
+{
+	return this->capacity;
+}
+
+/* Name: getNumKeys
+ * Params:
+ *	None
+ * Description:
+ *	Returns the number of keys added to the filter (counting keys added more than once).
+ * Returns: the number of keys added to the filter
+ */
+size_t BloomFilter::getNumKeys() const
+{
+	return __atomic_load_n(&this->numKeys, __ATOMIC_RELAXED);
+}
+
+/* Name: getBitsPerKey
+ * Params:
+ *	None
+ * Description:
+ *	Returns the number of bits per key the filter was sized with.
+ * Returns: the number of bits per key
+ */
+int BloomFilter::getBitsPerKey() const
+{
+	return this->bitsPerKey;
+}
+
+/* Name: getNumHashes
+ * Params:
+ *	None
+ * Description:
+ *	Returns the number of bits that are set for each key.
+ * Returns: the number of bits set per key
+ */
+int BloomFilter::getNumHashes() const
+{
+	return this->numHashes;
+}
+
+/* Name: getBytes
+ * Params:
+ *	None
+ * Description:
+ *	Returns the memory used by the bits of the filter.
+ * Returns: the size of the filter in bytes
+ */
+size_t BloomFilter::getBytes() const
+{
+	return this->words.size() * sizeof(uint64_t);
+}
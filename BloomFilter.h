@@ -0,0 +1,37 @@
+#ifndef BLOOMFILTER_H
+#define BLOOMFILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Blocked Bloom filter over int keys. Every key sets its bits inside a single 512-bit block
+ * (one cache line), so a lookup touches one cache line no matter how many hash functions
+ * are used. Keys cannot be removed; removed keys only add to the false positive rate. Trees
+ * sharing a filter (see SharedFilter) may add and look up keys from different threads. */
+class BloomFilter {
+public:
+	BloomFilter(size_t, int);
+
+	void add(int);
+	bool mayContain(int) const;
+	void clear();
+
+	size_t getCapacity() const;
+	size_t getNumKeys() const;
+	int getBitsPerKey() const;
+	int getNumHashes() const;
+	size_t getBytes() const;
+private:
+	static uint64_t hash(int);
+	static uint64_t remix(uint64_t);
+
+	std::vector<uint64_t> words; //the bits of the filter, 8 words (512 bits) per block
+	size_t numBlocks; //the number of 512-bit blocks
+	size_t capacity; //the number of keys the filter was sized for
+	size_t numKeys; //the number of keys added since the filter was created or cleared
+	int bitsPerKey; //the number of bits per key the filter was sized with
+	int numHashes; //the number of bits set per key
+};
+
+#endif
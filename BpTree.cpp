@@ -1,6 +1,10 @@
 #include "BpTree.h"
 #include <vector>
 #include <iostream>
+#include <thread>
+#include <utility>
+#include <algorithm>
+#include <climits>
 
 /* Name: Constructor
  * Params:
@@ -13,7 +17,13 @@ BpTree::BpTree(const int maxKeys)
 {
 	this->maxNodes = maxKeys; //maxNodes and maxKeys are the same
 	this->head = 0;
-	this->isACopy = false;
+	this->keyFilter = 0;
+	this->filterBitsPerKey = 0;
+	this->cache = 0;
+	this->scanPrefetchDistance = 4;
+	this->leafPlacement = NODE_PLACEMENT_DEFAULT;
+	this->interiorPlacement = NODE_PLACEMENT_DEFAULT;
+	this->replicaLevels = 0;
 }
 
 /* Name: Copy Constructor
@@ -21,39 +31,930 @@ BpTree::BpTree(const int maxKeys)
  *	const BpTree &tree - The BpTree that is being copied from
  * Author: Joshua Campbell
  * Description:
- *  Creates a new BpTree by copying an existing tree. Performs a shallow
- *	copy of the existing tree (both trees will point to the same nodes).
+ *  Creates a point-in-time snapshot of an existing tree in O(1): both trees point at the same
+ *	head node, which counts one more reference. A node is never changed while more than one
+ *	node or tree points at it; a write to either tree copies only the shared nodes on the path
+ *	from the head down to the nodes it changes (see getWritableChild()) and keeps sharing every
+ *	other subtree, so each write after the snapshot copies at most one node per level. The
+ *	snapshot can be scanned by another thread while the original tree keeps being updated,
+ *	and both trees can be written from different threads at once. A node is freed when the
+ *	last tree or node pointing at it lets go of it (see releaseSubtree()).
+ *	Taking the snapshot itself must not race with a write to the tree being copied.
+ *	If the tree has a lookup cache, the snapshot gets its own empty cache of the same size.
+ *	The snapshot shares the tree's key filter (see SharedFilter) and places new nodes like the
+ *	tree does, but has no replicas (see setReplicas()).
  */
 BpTree::BpTree(const BpTree &tree) {
 	this->maxNodes = tree.maxNodes;
 	this->head = tree.head;
-	this->isACopy = true;
+	this->keyFilter = tree.keyFilter;
+	this->filterBitsPerKey = tree.filterBitsPerKey;
+	this->scanPrefetchDistance = tree.scanPrefetchDistance;
+	this->leafPlacement = tree.leafPlacement;
+	this->interiorPlacement = tree.interiorPlacement;
+	this->replicaLevels = 0;
+	this->cache = tree.cache != 0 ? new LookupCache(tree.cache->getCapacity(), tree.cache->getNumShards()) : 0;
+	if (this->head != 0) {
+		this->head->addReference();
+	}
+	if (this->keyFilter != 0) {
+		this->keyFilter->references.fetch_add(1);
+	}
+}
+
+/* Name: Move Constructor
+ * Params:
+ *	BpTree &&tree - The BpTree whose nodes are taken over
+ * Description:
+ *  Creates a new BpTree by taking over the nodes of an existing tree in O(1). The
+ *	existing tree is left empty.
+ */
+BpTree::BpTree(BpTree &&tree) {
+	this->maxNodes = tree.maxNodes;
+	this->head = tree.head;
+	this->keyFilter = tree.keyFilter;
+	this->filterBitsPerKey = tree.filterBitsPerKey;
+	this->scanPrefetchDistance = tree.scanPrefetchDistance;
+	this->cache = tree.cache;
+	this->leafPlacement = tree.leafPlacement;
+	this->interiorPlacement = tree.interiorPlacement;
+	this->replicas.swap(tree.replicas);
+	this->replicaLevels = tree.replicaLevels;
+	tree.head = 0;
+	tree.keyFilter = 0;
+	tree.cache = 0;
 }
 
 /* Name: Destructor
  * Author: Joshua Campbell
  * Description:
- *	Destroys the BpTree and deletes all of the nodes on the tree.
+ *	Destroys the BpTree and deletes all of the nodes on the tree that no snapshot
+ *	is still referring to.
+ */
+BpTree::~BpTree() {
+	this->releaseNodes();
+	delete this->cache;
+}
+
+/* Name: Overloaded Operator: =
+ * Params:
+ *	const BpTree& other - The tree that is used as the source of information for the assignment
+ * Author: Joshua Campbell
+ * Description:
+ *	Releases the nodes currently held by the tree and turns it into a snapshot of an
+ *	existing tree (see the copy constructor).
+ */
+BpTree& BpTree::operator=(const BpTree& other) {
+	if (this != &other) {
+		//the references are taken first, in case the two trees share their nodes
+		if (other.head != 0) {
+			other.head->addReference();
+		}
+		if (other.keyFilter != 0) {
+			other.keyFilter->references.fetch_add(1);
+		}
+		this->releaseNodes();
+		this->maxNodes = other.maxNodes;
+		this->head = other.head;
+		this->keyFilter = other.keyFilter;
+		this->filterBitsPerKey = other.filterBitsPerKey;
+		this->scanPrefetchDistance = other.scanPrefetchDistance;
+		this->leafPlacement = other.leafPlacement;
+		this->interiorPlacement = other.interiorPlacement;
+		delete this->cache;
+		this->cache = other.cache != 0 ? new LookupCache(other.cache->getCapacity(), other.cache->getNumShards()) : 0;
+	}
+	return (*this);
+}
+
+/* Name: Overloaded Operator: = (move)
+ * Params:
+ *	BpTree&& other - The tree whose nodes are taken over
+ * Description:
+ *	Releases the nodes currently held by the tree and takes over the nodes of another tree
+ *	in O(1). The other tree is left empty.
+ */
+BpTree& BpTree::operator=(BpTree&& other) {
+	if (this != &other) {
+		this->releaseNodes();
+		this->maxNodes = other.maxNodes;
+		this->head = other.head;
+		this->keyFilter = other.keyFilter;
+		this->filterBitsPerKey = other.filterBitsPerKey;
+		this->scanPrefetchDistance = other.scanPrefetchDistance;
+		this->leafPlacement = other.leafPlacement;
+		this->interiorPlacement = other.interiorPlacement;
+		this->replicas.swap(other.replicas);
+		this->replicaLevels = other.replicaLevels;
+		delete this->cache;
+		this->cache = other.cache;
+		other.head = 0;
+		other.keyFilter = 0;
+		other.cache = 0;
+	}
+	return (*this);
+}
+
+/* Name: swap
+ * Params:
+ *	BpTree& other - The tree to exchange nodes with
+ * Description:
+ *	Exchanges the nodes (along with the maximum number of keys per node, the key filter
+ *	settings, the lookup caches, the scan prefetch distances, the node placements and the
+ *	replicas) of the two trees in O(1).
+ * Returns: None
+ */
+void BpTree::swap(BpTree& other) {
+	std::swap(this->maxNodes, other.maxNodes);
+	std::swap(this->head, other.head);
+	std::swap(this->keyFilter, other.keyFilter);
+	std::swap(this->filterBitsPerKey, other.filterBitsPerKey);
+	std::swap(this->cache, other.cache);
+	std::swap(this->scanPrefetchDistance, other.scanPrefetchDistance);
+	std::swap(this->leafPlacement, other.leafPlacement);
+	std::swap(this->interiorPlacement, other.interiorPlacement);
+	this->replicas.swap(other.replicas);
+	std::swap(this->replicaLevels, other.replicaLevels);
+}
+
+/* Name: clear
+ * Params:
+ *	None
+ * Description:
+ *	Removes every key/value pair from the tree. The nodes are deleted without recursion,
+ *	except for the subtrees a snapshot is still sharing, which are left to the snapshot.
+ * Returns: None
+ */
+void BpTree::clear() {
+	this->releaseNodes();
+	this->rebuildFilter();
+	if (this->cache != 0) {
+		this->cache->clear();
+	}
+}
+
+/* Name: clear
+ * Params:
+ *	const int numThreads - the number of threads used to delete the nodes
+ * Description:
+ *	Removes every key/value pair from the tree, splitting the deletion of the nodes by
+ *	subtree across numThreads threads (see releaseSubtree()).
+ * Returns: None
+ */
+void BpTree::clear(const int numThreads) {
+	this->dropReplicas();
+	releaseSubtree(this->head, numThreads);
+	this->head = 0;
+	this->releaseFilter();
+	this->rebuildFilter();
+	if (this->cache != 0) {
+		this->cache->clear();
+	}
+}
+
+/* Name: clearInBackground
+ * Params:
+ *	const int numThreads - the number of threads used to delete the nodes
+ * Description:
+ *	Empties the tree in O(1) and hands its nodes to a new thread that deletes them (using
+ *	numThreads threads), so that replacing a large tree does not stall the calling thread.
+ *	The tree can be used again as soon as this returns. The caller must join or detach the
+ *	returned thread.
+ * Returns: the thread deleting the nodes
+ */
+std::thread BpTree::clearInBackground(const int numThreads) {
+	this->dropReplicas();
+	Node * oldHead = this->head;
+	this->head = 0;
+	this->releaseFilter();
+	this->rebuildFilter();
+	if (this->cache != 0) {
+		this->cache->clear();
+	}
+	return std::thread(releaseSubtree, oldHead, numThreads);
+}
+
+/* Name: setFilter
+ * Params:
+ *	const int bitsPerKey - the number of bits of filter per key, 0 to remove the filter
+ * Description:
+ *	Gives the tree a Bloom filter of its keys that find(), update() and the duplicate check
+ *	of insert() look at before walking down the tree, so that most lookups of keys that are
+ *	not in the tree skip the descent. More bits per key lower the false positive rate
+ *	(at most about 2% at 8 bits and 0.5% at 12 bits, and less while the tree is smaller
+ *	than the filter was sized for) at the cost of memory. The filter is rebuilt from
+ *	the leaves when the tree has grown past the size it was built for, or when enough keys
+ *	were removed that the stale bits of the removed keys would noticeably raise the false
+ *	positive rate. Snapshots share the filter (see SharedFilter) until one of them rebuilds it.
+ * Returns: None
+ */
+void BpTree::setFilter(const int bitsPerKey)
+{
+	this->filterBitsPerKey = bitsPerKey > 0 ? bitsPerKey : 0;
+	this->rebuildFilter();
+}
+
+/* Name: getFilterBytes
+ * Params:
+ *	None
+ * Description:
+ *	Returns the memory used by the tree's key filter.
+ * Returns: the size of the key filter in bytes, 0 if the tree has no filter
+ */
+size_t BpTree::getFilterBytes()
+{
+	if (this->keyFilter == 0) {
+		return 0;
+	}
+	return this->keyFilter->filter->getBytes();
+}
+
+/* Name: setCache
+ * Params:
+ *	const size_t bytes - the size of the cache in bytes, 0 to remove the cache
+ *	const int numShards - the number of independently locked parts of the cache
+ * Description:
+ *	Puts a cache of recently found key/value pairs in front of find(), so that keys that are
+ *	read over and over skip the descent (see LookupCache for the eviction policy). Only keys
+ *	that were found are cached, so inserting a new key never needs to touch the cache; keys
+ *	are dropped from the cache when their value changes or they are removed. Any existing
+ *	cache is replaced by an empty one. Threads calling find() at the same time only wait on
+ *	each other when their keys fall in the same shard.
+ * Returns: None
+ */
+void BpTree::setCache(const size_t bytes, const int numShards)
+{
+	delete this->cache;
+	this->cache = bytes > 0 ? new LookupCache(bytes, numShards) : 0;
+}
+
+/* Name: getCacheHits
+ * Params:
+ *	None
+ * Description:
+ *	Returns the number of find() calls answered by the lookup cache.
+ * Returns: the number of cache hits, 0 if the tree has no cache
+ */
+size_t BpTree::getCacheHits()
+{
+	return this->cache != 0 ? this->cache->getHits() : 0;
+}
+
+/* Name: getCacheMisses
+ * Params:
+ *	None
+ * Description:
+ *	Returns the number of find() calls that had to walk the tree because the key was not in
+ *	the lookup cache.
+ * Returns: the number of cache misses, 0 if the tree has no cache
+ */
+size_t BpTree::getCacheMisses()
+{
+	return this->cache != 0 ? this->cache->getMisses() : 0;
+}
+
+/* Name: setScanPrefetch
+ * Params:
+ *	const int distance - how many leaves ahead of a scan to prefetch, 0 to turn prefetching off
+ * Description:
+ *	Sets how many leaves ahead scan(), scanBackward() and scanParallel() prefetch (see
+ *	prefetchLeaves()). Each leaf is a separate allocation, so a scan that only moves from leaf
+ *	to leaf waits on a cache miss for every leaf; prefetching a few leaves ahead overlaps those
+ *	misses with the work done on the current leaf. Long scans over trees much larger than the cache gain the
+ *	most from a larger distance, short scans waste the leaves prefetched past their end. The
+ *	default distance is 4.
+ * Returns: None
+ */
+void BpTree::setScanPrefetch(const int distance)
+{
+	this->scanPrefetchDistance = distance > 0 ? distance : 0;
+}
+
+/* Name: setNodePlacement
+ * Params:
+ *	const int leafPlacement - where new leaves (and the value nodes of their pairs) are placed
+ *	const int interiorPlacement - where new interior nodes are placed
+ * Description:
+ *	Sets the NUMA node (or NODE_PLACEMENT_ constant) that the nodes the tree allocates from now
+ *	on are placed on (see NodeArena). On a multi-socket machine, interleaving the interior nodes
+ *	(NODE_PLACEMENT_INTERLEAVE) keeps the levels every descent passes through from being remote
+ *	for all but one socket, while leaves are best kept on the node of the threads that use
+ *	them (NODE_PLACEMENT_LOCAL, or a node number for a tree that is one partition of a bigger
+ *	data set, see ShardedBpTree). Existing nodes stay where they are; the placements only take
+ *	effect in a build with BPTREE_NUMA. Both default to NODE_PLACEMENT_DEFAULT (the heap).
+ * Returns: None
+ */
+void BpTree::setNodePlacement(const int leafPlacement, const int interiorPlacement)
+{
+	this->leafPlacement = leafPlacement;
+	this->interiorPlacement = interiorPlacement;
+}
+
+/* Name: setReplicas
+ * Params:
+ *	const int levels - the number of interior levels to copy from the head down (0 to remove
+ *		the replicas; levels past the last interior level are ignored)
+ * Description:
+ *	Gives every NUMA node its own copy of the top interior levels of the tree, placed on that
+ *	node, so that lookups (find(), findBatch() and the descents of the other read methods) from
+ *	any socket read the levels every descent goes through from local memory and only reach
+ *	across sockets below them. The interior levels are small next to the leaves (about one
+ *	node per maxKeys leaves), so copying them costs little memory. The copies only route
+ *	descents; they are not updated by writes. A write that changes the interior nodes (a
+ *	split, a removal, a batch, or a write that has to copy nodes a snapshot shares) drops them
+ *	and descents use the tree's own nodes again until this is called again, so replicas suit
+ *	trees that are read far more often than they are restructured, e.g. after loading. Values
+ *	replaced with update() or modify() keep them unless a snapshot shares the leaf.
+ *	Must not race with any other use of the tree.
+ * Returns: None
+ */
+void BpTree::setReplicas(const int levels)
+{
+	this->dropReplicas();
+	this->replicaLevels = levels > 0 ? levels : 0;
+	if (this->replicaLevels == 0 || this->head == 0 || this->head->getNodeType() != NODE_TYPE_INTERIOR) {
+		return;
+	}
+	for (int node = 0; node < NodeArena::getNumNodes(); node++) {
+		NodePlacementScope placement(node, node);
+		this->replicas.push_back(copyInteriorLevels(this->head, this->replicaLevels));
+	}
+}
+
+/* Name: hasReplicas
+ * Params:
+ *	None
+ * Description:
+ *	Checks whether descents currently start in the per NUMA node replicas (see setReplicas()),
+ *	i.e. they were made and no write has dropped them since.
+ * Returns: true if the tree has replicas, false otherwise
+ */
+bool BpTree::hasReplicas()
+{
+	return !this->replicas.empty();
+}
+
+/* Name: metrics
+ * Params:
+ *	None
+ * Description:
+ *	Takes a snapshot of the instrumentation counters (descents, nodes visited, splits and how
+ *	far they cascaded, redistributions, coalesces and nodes copied for snapshots) and of the latency
+ *	histograms of insert, find, remove and update (see Metrics::setLatencyTracking()). The
+ *	counters are only kept when the tree is built with BPTREE_METRICS, and they are shared by
+ *	every tree in the process.
+ * Returns: the counts since the start of the process or the last resetMetrics()
+ */
+MetricsSnapshot BpTree::metrics()
+{
+	return Metrics::snapshot();
+}
+
+/* Name: resetMetrics
+ * Params:
+ *	None
+ * Description:
+ *	Starts the counts of metrics() over from zero.
+ * Returns: None
+ */
+void BpTree::resetMetrics()
+{
+	Metrics::reset();
+}
+
+/* Name: prefetchLeaves
+ * Params:
+ *	const std::vector<Node*>& path - the path from the head down to the leaf a scan is visiting
+ *	const bool backward - true for a scan moving to the left, false for one moving to the right
+ *	const bool starting - true for the first leaf of the scan
+ * Description:
+ *	Called once for every leaf a scan visits. Leaves are reached through their parent (see
+ *	findNextLeaf()), so the leaves ahead of the scan are prefetched from the parent's child
+ *	pointers: the leaf the prefetch distance ahead, or every leaf up to it when the scan has
+ *	just started or just moved to a new parent. Leaves under the next parent are prefetched
+ *	once the scan reaches it.
+ * Returns: None
+ */
+void BpTree::prefetchLeaves(const std::vector<Node*>& path, const bool backward, const bool starting)
+{
+	if (this->scanPrefetchDistance == 0 || path.size() < 2) {
+		return;
+	}
+	Node * parent = path[path.size() - 2];
+	int index = parent->getChildIndex(path.back());
+	int step = backward ? -1 : 1;
+	bool entering = index == (backward ? parent->getNumChildren() - 1 : 0);
+	size_t bytes = Node::getAllocationSize(this->maxNodes, NODE_TYPE_LEAF);
+	for (int distance = starting || entering ? 1 : this->scanPrefetchDistance; distance <= this->scanPrefetchDistance; distance++) {
+		Node * leaf = parent->getChild(index + step * distance);
+		if (leaf != 0) {
+			leaf->prefetch(bytes);
+		}
+	}
+}
+
+/* Name: filterMayContain
+ * Params:
+ *	const int key - the key to look for
+ * Description:
+ *	Checks the key against the tree's key filter.
+ * Returns: false if the key is definitely not in the tree, true if it may be (or the tree has no filter)
+ */
+bool BpTree::filterMayContain(const int key)
+{
+	return this->keyFilter == 0 || this->keyFilter->filter->mayContain(key);
+}
+
+/* Name: addToFilter
+ * Params:
+ *	const int key - a key that was inserted into the tree
+ * Description:
+ *	Adds a key to the tree's key filter (if it has one), rebuilding the filter at twice the
+ *	size of the tree once more keys were added than it was built for.
+ * Returns: None
+ */
+void BpTree::addToFilter(const int key)
+{
+	BloomFilter * filter = this->keyFilter != 0 ? this->keyFilter->filter : 0;
+	if (filter != 0) {
+		filter->add(key);
+		if (filter->getNumKeys() > filter->getCapacity()) {
+			this->rebuildFilter();
+		}
+	}
+}
+
+/* Name: trimFilter
+ * Params:
+ *	None
+ * Description:
+ *	Called after keys were removed. Rebuilds the tree's key filter once it holds more than
+ *	twice as many keys as the tree, since the removed keys can't be taken out of the filter.
+ * Returns: None
+ */
+void BpTree::trimFilter()
+{
+	BloomFilter * filter = this->keyFilter != 0 ? this->keyFilter->filter : 0;
+	if (filter != 0) {
+		size_t numKeys = this->head != 0 ? this->head->countKeys() : 0;
+		if (filter->getNumKeys() > numKeys * 2 + 1024) {
+			this->rebuildFilter();
+		}
+	}
+}
+
+/* Name: rebuildFilter
+ * Params:
+ *	None
+ * Description:
+ *	Replaces the tree's key filter with a new filter of its own holding the keys of the
+ *	leaves, sized for twice the number of keys so that the tree can double before the next
+ *	rebuild. The filter is removed if the tree is not set up to have one.
+ * Returns: None
+ */
+void BpTree::rebuildFilter()
+{
+	this->releaseFilter();
+	if (this->filterBitsPerKey <= 0) {
+		return;
+	}
+	size_t numKeys = this->head != 0 ? this->head->countKeys() : 0;
+	BloomFilter * filter = new BloomFilter(numKeys * 2 > 1024 ? numKeys * 2 : 1024, this->filterBitsPerKey);
+	std::vector<Node*> path;
+	for (Node * current = this->findLeaf(INT_MIN, path); current != 0; current = findNextLeaf(path, false)) {
+		for (int i = 0; i < current->getNumKeys(); i++) {
+			filter->add(current->getKey(i));
+		}
+	}
+	this->keyFilter = new SharedFilter(filter);
+}
+
+/* Name: releaseFilter
+ * Params:
+ *	None
+ * Description:
+ *	Drops the tree's reference to its key filter, deleting the filter if no snapshot is
+ *	sharing it. The tree is left without a filter.
+ * Returns: None
+ */
+void BpTree::releaseFilter()
+{
+	if (this->keyFilter != 0 && this->keyFilter->references.fetch_sub(1) == 1) {
+		delete this->keyFilter;
+	}
+	this->keyFilter = 0;
+}
+
+/* Name: getWritableHead
+ * Params:
+ *	None
+ * Description:
+ *	Makes sure that the head node can be modified: if a snapshot shares it, the tree gets its
+ *	own copy of it (see getWritableChild()).
+ * Returns: the head node (0 if the tree is empty)
+ */
+Node* BpTree::getWritableHead() {
+	if (this->head != 0 && this->head->isShared()) {
+		this->dropReplicas();
+		Node * copy = copyNode(this->head);
+		METRICS_ADD(METRIC_NODE_COPIES, 1);
+		releaseSubtree(this->head, 1);
+		this->head = copy;
+	}
+	return this->head;
+}
+
+/* Name: getWritableChild
+ * Params:
+ *	Node* parent - a node that can be modified (not shared)
+ *	const int index - the index of one of its children
+ * Description:
+ *	Makes sure that a child can be modified before a write changes it. A child that more than
+ *	one node points at (because a snapshot of the tree shares it, see the copy constructor) is
+ *	replaced in the parent by a copy of it, which shares the child's own children; the tree's
+ *	reference to the old child is dropped, so the snapshot keeps seeing it unchanged. Writes
+ *	walk down from the head making each node on their way writable, which copies only the
+ *	path to the nodes they change. The replicas are dropped before a node is replaced.
+ * Returns: the child that can be modified (0 if there is no child at the index)
+ */
+Node* BpTree::getWritableChild(Node* parent, const int index) {
+	Node * child = parent->getChild(index);
+	if (child != 0 && child->isShared()) {
+		this->dropReplicas();
+		Node * copy = copyNode(child);
+		METRICS_ADD(METRIC_NODE_COPIES, 1);
+		parent->setChild(index, copy);
+		releaseSubtree(child, 1);
+		child = copy;
+	}
+	return child;
+}
+
+/* Name: findWritablePath
+ * Params:
+ *	const int key - the key whose leaf is searched for
+ *	std::vector<Node*>& path - receives the nodes from the head down to the leaf
+ * Description:
+ *	Walks down from the head node to the leaf that holds (or would hold) the key, making every
+ *	node on the way writable (see getWritableChild()), for a write that changes the leaf or the
+ *	nodes above it.
+ * Returns: the leaf for the key, 0 if the tree is empty
+ */
+Node* BpTree::findWritablePath(const int key, std::vector<Node*>& path) {
+	path.clear();
+	if (this->getWritableHead() == 0) {
+		return 0;
+	}
+	path.push_back(this->head);
+	return this->extendWritablePath(key, path);
+}
+
+/* Name: extendWritablePath
+ * Params:
+ *	const int key - the key whose leaf is searched for
+ *	std::vector<Node*>& path - a path of writable nodes from the head down, extended down to the leaf
+ * Description:
+ *	Continues a writable descent (see findWritablePath()) from the last node of the path.
+ * Returns: the leaf for the key
+ */
+Node* BpTree::extendWritablePath(const int key, std::vector<Node*>& path) {
+	METRICS_ADD(METRIC_DESCENTS, 1);
+	while (path.back()->getNodeType() == NODE_TYPE_INTERIOR) {
+		METRICS_ADD(METRIC_NODES_VISITED, 1);
+		InteriorNode * node = static_cast<InteriorNode*>(path.back());
+		path.push_back(this->getWritableChild(node, node->findChildIndex(key)));
+	}
+	return path.back();
+}
+
+/* Name: copyNode
+ * Params:
+ *	Node* node - the leaf or interior node to copy
+ * Description:
+ *	Copies a single node for getWritableChild(). A leaf is copied with its key/value pairs; an
+ *	interior node is copied with its keys and subtree counts and points at the same children,
+ *	each of which counts the copy as one more reference.
+ * Returns: the copy of the node
+ */
+Node* BpTree::copyNode(Node* node) {
+	if (node->getNodeType() == NODE_TYPE_LEAF) {
+		return static_cast<LeafNode*>(node)->copy();
+	}
+	InteriorNode * copy = static_cast<InteriorNode*>(node)->copy();
+	for (int i = 0; i < node->getNumChildren(); i++) {
+		copy->setChild(i, node->getChild(i));
+		node->getChild(i)->addReference();
+	}
+	return copy;
+}
+
+/* Name: releaseNodes
+ * Params:
+ *	None
+ * Description:
+ *	Drops the tree's reference to its nodes and key filter. Nodes that no snapshot is sharing
+ *	are deleted. The tree is left without any nodes, replicas or key filter.
+ * Returns: None
+ */
+void BpTree::releaseNodes() {
+	this->dropReplicas();
+	releaseSubtree(this->head, 1);
+	this->head = 0;
+	this->releaseFilter();
+}
+
+/* Name: deleteUnreferenced
+ * Params:
+ *	std::vector<Node*>& stack - nodes whose last reference was dropped
+ * Description:
+ *	Deletes the nodes on the stack using the stack instead of recursion. Each deleted interior
+ *	node drops its reference to each of its children, and the children that lose their last
+ *	reference are deleted too.
+ * Returns: None
+ */
+static void deleteUnreferenced(std::vector<Node*>& stack) {
+	while (!stack.empty()) {
+		Node * current = stack.back();
+		stack.pop_back();
+		if (current->getNodeType() == NODE_TYPE_INTERIOR) {
+			for (int i = 0; i < current->getNumChildren(); i++) {
+				if (current->getChild(i)->dropReference()) {
+					stack.push_back(current->getChild(i));
+				}
+			}
+		}
+		delete current;
+	}
+}
+
+/* Name: releaseSubtree
+ * Params:
+ *	Node* node - the node to drop a reference to (may be 0)
+ *	const int numThreads - the number of threads used to delete the nodes
+ * Description:
+ *	Drops one reference to a node. If it was the last one, the node is deleted along with
+ *	every node below it that no other node points at; subtrees still shared with a snapshot
+ *	only lose a reference. With more than one thread, the upper levels are deleted first until
+ *	there are a few subtrees per thread, and the subtrees are then deleted in parallel.
+ * Returns: None
+ */
+void BpTree::releaseSubtree(Node* node, const int numThreads) {
+	std::vector<Node*> stack;
+	if (node != 0 && node->dropReference()) {
+		stack.push_back(node);
+	}
+	if (numThreads > 1) {
+		while (!stack.empty() && stack.size() < (size_t)numThreads * 4 && stack[0]->getNodeType() == NODE_TYPE_INTERIOR) {
+			std::vector<Node*> subtrees;
+			for (size_t i = 0; i < stack.size(); i++) {
+				for (int k = 0; k < stack[i]->getNumChildren(); k++) {
+					if (stack[i]->getChild(k)->dropReference()) {
+						subtrees.push_back(stack[i]->getChild(k));
+					}
+				}
+				delete stack[i];
+			}
+			stack = subtrees;
+		}
+		std::vector<std::thread> workers;
+		for (int t = 0; t < numThreads; t++) {
+			workers.push_back(std::thread([&stack, t, numThreads]() {
+				std::vector<Node*> subtrees;
+				for (size_t i = t; i < stack.size(); i += numThreads) {
+					subtrees.push_back(stack[i]);
+				}
+				deleteUnreferenced(subtrees);
+			}));
+		}
+		for (size_t t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+		return;
+	}
+	deleteUnreferenced(stack);
+}
+
+/* Name: copySubtree
+ * Params:
+ *	Node* node - the node to copy along with all of its children
+ * Description:
+ *	Copies a node and all of the nodes below it level by level (without recursion), including
+ *	the key/value pairs stored in the leaves. The copies share nothing with the originals.
+ * Returns: the copy of the node, 0 if the node is 0
+ */
+Node* BpTree::copySubtree(Node* node) {
+	if (node == 0) {
+		return 0;
+	}
+	std::vector<Node*> originals;
+	std::vector<Node*> copies;
+	originals.push_back(node);
+	if (node->getNodeType() == NODE_TYPE_INTERIOR) {
+		copies.push_back(static_cast<InteriorNode*>(node)->copy());
+	}
+	else {
+		copies.push_back(static_cast<LeafNode*>(node)->copy());
+	}
+	for (size_t i = 0; i < originals.size(); i++) {
+		Node * original = originals[i];
+		Node * copy = copies[i];
+		if (original->getNodeType() == NODE_TYPE_INTERIOR) {
+			for (int k = 0; k < original->getNumChildren(); k++) {
+				Node * child = original->getChild(k);
+				Node * childCopy = 0;
+				if (child->getNodeType() == NODE_TYPE_INTERIOR) {
+					childCopy = static_cast<InteriorNode*>(child)->copy();
+				}
+				else {
+					childCopy = static_cast<LeafNode*>(child)->copy();
+				}
+				copy->setChild(k, childCopy);
+				originals.push_back(child);
+				copies.push_back(childCopy);
+			}
+		}
+	}
+	return copies[0];
+}
+
+/* Name: getDescentHead
+ * Params:
+ *	None
+ * Description:
+ *	Picks where a lookup's descent starts: the replica of the calling thread's NUMA node if
+ *	the tree has replicas (see setReplicas()), the head node otherwise.
+ * Returns: the node to start descents from (0 if the tree is empty)
+ */
+Node* BpTree::getDescentHead() {
+	if (this->replicas.empty()) {
+		return this->head;
+	}
+	return this->replicas[NodeArena::getCurrentNode() % this->replicas.size()];
+}
+
+/* Name: copyInteriorLevels
+ * Params:
+ *	Node* head - the head node of a tree (an interior node)
+ *	const int levels - the number of interior levels to copy
+ * Description:
+ *	Copies the top interior levels of a tree level by level, for a replica (see
+ *	setReplicas()). The copies of the lowest copied level point at the tree's own nodes below
+ *	them without counting as references to them, so the copies can only be used to route a
+ *	descent, and must be dropped before the tree replaces or deletes any of its nodes.
+ * Returns: the copy of the head node
+ */
+Node* BpTree::copyInteriorLevels(Node* head, const int levels) {
+	Node * top = static_cast<InteriorNode*>(head)->copy();
+	std::vector<Node*> originals(1, head);
+	std::vector<Node*> copies(1, top);
+	for (int level = 1; !originals.empty(); level++) {
+		std::vector<Node*> nextOriginals;
+		std::vector<Node*> nextCopies;
+		for (size_t i = 0; i < originals.size(); i++) {
+			for (int k = 0; k < originals[i]->getNumChildren(); k++) {
+				Node * child = originals[i]->getChild(k);
+				if (level < levels && child->getNodeType() == NODE_TYPE_INTERIOR) {
+					Node * copy = static_cast<InteriorNode*>(child)->copy();
+					copies[i]->setChild(k, copy);
+					nextOriginals.push_back(child);
+					nextCopies.push_back(copy);
+				}
+				else {
+					copies[i]->setChild(k, child);
+				}
+			}
+		}
+		originals.swap(nextOriginals);
+		copies.swap(nextCopies);
+	}
+	return top;
+}
+
+/* Name: deleteInteriorLevels
+ * Params:
+ *	Node* top - the copy of the head node made by copyInteriorLevels()
+ *	const int levels - the number of interior levels that were copied
+ * Description:
+ *	Deletes the copied interior levels of a replica, leaving the tree's own nodes below them.
+ * Returns: None
+ */
+void BpTree::deleteInteriorLevels(Node* top, const int levels) {
+	std::vector<Node*> nodes(1, top);
+	for (int level = 1; !nodes.empty(); level++) {
+		std::vector<Node*> nextNodes;
+		for (size_t i = 0; i < nodes.size(); i++) {
+			for (int k = 0; level < levels && k < nodes[i]->getNumChildren(); k++) {
+				if (nodes[i]->getChild(k)->getNodeType() == NODE_TYPE_INTERIOR) {
+					nextNodes.push_back(nodes[i]->getChild(k));
+				}
+			}
+			delete nodes[i];
+		}
+		nodes.swap(nextNodes);
+	}
+}
+
+/* Name: dropReplicas
+ * Params:
+ *	None
+ * Description:
+ *	Deletes the replicas of the tree (see setReplicas()); called by every write that changes
+ *	the interior nodes or replaces a node shared with a snapshot, before the change.
+ * Returns: None
  */
-BpTree::~BpTree() {
-	if (this->head != 0 && !(this->isACopy)) {
-		delete head;
+void BpTree::dropReplicas() {
+	if (this->replicas.empty()) {
+		return;
 	}
-	this->head = 0;
+	for (size_t i = 0; i < this->replicas.size(); i++) {
+		deleteInteriorLevels(this->replicas[i], this->replicaLevels);
+	}
+	this->replicas.clear();
 }
 
-/* Name: Overloaded Operator: =
+/* Name: clone
  * Params:
- *	const BpTree& other - The tree that is used as the source of information for the assignment
- * Author: Joshua Campbell
+ *	const int numThreads - the number of threads used to copy the tree
  * Description:
- *	Assigns the data from an existing tree to a different tree.
+ *	Creates a deep copy of the tree that shares no nodes with it, for when the copy must not
+ *	keep any of the tree's nodes alive (the copy constructor is the O(1) alternative: it shares
+ *	the nodes and later writes copy only the paths they change). The key filter is shared
+ *	like a snapshot shares it (see SharedFilter). The upper levels of the tree are copied until
+ *	there are enough subtrees to keep every thread busy, and the subtrees are then copied in
+ *	parallel. Nodes placed through NodeArena (see setNodePlacement()) are taken from its pools
+ *	in batches (see NodeAllocationBatch); nodes on the heap come from each thread's own malloc
+ *	arena. Either way every node keeps its own block, so remove() can free them one at a time.
+ * Returns: a tree holding copies of all of the key/value pairs of the tree
  */
-BpTree& BpTree::operator=(const BpTree& other) {
-	this->maxNodes = other.maxNodes;
-	this->head = other.head;
-	this->isACopy = true;
-	return (*this);
+BpTree BpTree::clone(const int numThreads) {
+	BpTree tree(this->maxNodes);
+	tree.filterBitsPerKey = this->filterBitsPerKey;
+	tree.scanPrefetchDistance = this->scanPrefetchDistance;
+	tree.leafPlacement = this->leafPlacement;
+	tree.interiorPlacement = this->interiorPlacement;
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+	NodeAllocationBatch batch;
+	if (this->cache != 0) {
+		tree.setCache(this->cache->getCapacity(), this->cache->getNumShards());
+	}
+	tree.keyFilter = this->keyFilter;
+	if (tree.keyFilter != 0) {
+		tree.keyFilter->references.fetch_add(1);
+	}
+	if (this->head == 0) {
+		return tree;
+	}
+	if (numThreads <= 1 || this->head->getNodeType() != NODE_TYPE_INTERIOR) {
+		tree.head = copySubtree(this->head);
+		return tree;
+	}
+
+	//copying the upper levels until there are a few subtrees per thread
+	std::vector<Node*> subtrees(1, this->head);
+	std::vector<Node*> subtreeParents(1, (Node*)0);
+	std::vector<int> subtreeIndexes(1, 0);
+	while (subtrees.size() < (size_t)numThreads * 4 && subtrees[0]->getNodeType() == NODE_TYPE_INTERIOR) {
+		std::vector<Node*> nextSubtrees;
+		std::vector<Node*> nextParents;
+		std::vector<int> nextIndexes;
+		for (size_t i = 0; i < subtrees.size(); i++) {
+			InteriorNode * copy = static_cast<InteriorNode*>(subtrees[i])->copy();
+			if (subtreeParents[i] == 0) {
+				tree.head = copy;
+			}
+			else {
+				subtreeParents[i]->setChild(subtreeIndexes[i], copy);
+			}
+			for (int k = 0; k < subtrees[i]->getNumChildren(); k++) {
+				nextSubtrees.push_back(subtrees[i]->getChild(k));
+				nextParents.push_back(copy);
+				nextIndexes.push_back(k);
+			}
+		}
+		subtrees = nextSubtrees;
+		subtreeParents = nextParents;
+		subtreeIndexes = nextIndexes;
+	}
+
+	//copying the subtrees in parallel
+	std::vector<Node*> copies(subtrees.size(), (Node*)0);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < numThreads; t++) {
+		workers.push_back(std::thread([this, &subtrees, &copies, t, numThreads]() {
+			NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+			NodeAllocationBatch batch;
+			for (size_t i = t; i < subtrees.size(); i += numThreads) {
+				copies[i] = copySubtree(subtrees[i]);
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+	for (size_t i = 0; i < subtrees.size(); i++) {
+		subtreeParents[i]->setChild(subtreeIndexes[i], copies[i]);
+	}
+	return tree;
 }
 
 /* Name: insert
@@ -64,502 +965,815 @@ BpTree& BpTree::operator=(const BpTree& other) {
  * Description:
  *	Inserts a new key/value pair into the existing tree. If no tree currently exists,
  *  a new head node (leaf node) is created and is set as the head node for the tree.
+ *  The nodes on the way down that a snapshot shares are copied first (see getWritableChild()).
  * Returns: true if the key/value pair was inserted, false otherwise
  */
 bool BpTree::insert(const int key, const std::string value)
 {
+	METRICS_TIME(OPERATION_INSERT);
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
 	if (this->head != 0)
 	{
 		if (this->findKey(key) == true) {
 			return false;
 		}
-		Node * current = this->head;
-		while (current != 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
-			current = static_cast<InteriorNode*>(current)->findNextNode(key);
-		}
-		if (current != 0 && current->getNodeType() == NODE_TYPE_LEAF) {
-			//handling insertions when the current leaf node is full
-			if (current->isFull())
-			{
-				Node * parent = current->getParent();
-				//inserting a leaf node when it's parent is not full
-				if (parent != 0 && parent->getNodeType() == NODE_TYPE_INTERIOR && !parent->isFull()) {
-					Node** children = 0;
-					if (current->getNodeType() == NODE_TYPE_INTERIOR)
-					{
-						children = static_cast<InteriorNode*>(current)->split();
-					}
-					else if (current->getNodeType() == NODE_TYPE_LEAF)
-					{
-						children = static_cast<LeafNode*>(current)->split(key, value);
-					}
-					static_cast<InteriorNode*>(parent)->addChild(children[1], children[1]->getKey(0));
-					
-					delete children;
-					return true;
-				}
-				//Inserting a leaf node when its parent is full
-				else if (parent != 0 && parent->getNodeType() == NODE_TYPE_INTERIOR && parent->isFull()) {
-					Node** leafChildren = 0;
-					if (current->getNodeType() == NODE_TYPE_INTERIOR)
-					{
-						leafChildren = static_cast<InteriorNode*>(current)->split();
-					}
-					else if (current->getNodeType() == NODE_TYPE_LEAF)
-					{
-						leafChildren = static_cast<LeafNode*>(current)->split(key, value);
-					}
-					InteriorNode * interiorNode = static_cast<InteriorNode*>(parent);
-					int middleKey = interiorNode->getMiddleKey(leafChildren[1]->findIdentifierKey());
-					if (interiorNode->getParent() != 0) {
-						Node** interiorChildren = interiorNode->split(leafChildren[1]);
-						
-						if (interiorNode->getParent()->isFull()) {
-							this->insertWithParentFull(interiorNode->getParent(), interiorChildren, middleKey, value);
-						}
-						else {
-							static_cast<InteriorNode*>(interiorNode->getParent())->addChild(interiorChildren[1], middleKey);
-						}
-						delete interiorChildren;
-					}
-					else {
-						this->head = new InteriorNode(this->maxNodes);
-						Node** interiorChildren = interiorNode->split(leafChildren[1]);
-						static_cast<InteriorNode*>(this->head)->addChild(interiorChildren[0]);
-						static_cast<InteriorNode*>(this->head)->addChild(interiorChildren[1], middleKey);
-						delete interiorChildren;
-					}
-					delete leafChildren;
-					return true;
-				}
-				//inserting a leaf node when the head is a leaf node
-				else if (parent == 0 && current == head && current->getNodeType() == NODE_TYPE_LEAF)
-				{
-					Node** children = 0;
-					if (current->getNodeType() == NODE_TYPE_INTERIOR)
-					{
-						children = static_cast<InteriorNode*>(current)->split();
-					}
-					else if (current->getNodeType() == NODE_TYPE_LEAF)
-					{
-						children = static_cast<LeafNode*>(current)->split(key, value);
-					}
-					this->head = new InteriorNode(this->maxNodes);
-					static_cast<InteriorNode*>(this->head)->addChild(children[0]);
-					static_cast<InteriorNode*>(this->head)->addChild(children[1], children[1]->getKey(0));
-					
-					delete children;
-					return true;
-				}
-				else {
-					return false;
-				}
-			}
-			else //inserting into the leaf when it is not full
-			{
-				LeafNode* leaf = static_cast<LeafNode*>(current);
-				leaf->addPair(key, value);
-				return true;
-			}
-		}
-		else
-		{
-			return false;
+		std::vector<Node*> path;
+		this->findWritablePath(key, path);
+		if (this->insertIntoPath(path, key, value, 0)) {
+			this->addToFilter(key);
+			return true;
 		}
+		return false;
 	}
 	else //creating a new head node when there was none previously
 	{
-		this->head = new LeafNode(this->maxNodes);
+		this->head = new (this->maxNodes) LeafNode(this->maxNodes);
 		LeafNode * temp = static_cast<LeafNode*>(this->head);
 		temp->addPair(key, value);
+		this->addToFilter(key);
 		return true;
 	}
 	return false;
 }
 
-/* Name: insertWithParentFull
+/* Name: upsert
  * Params:
- *	Node* node - the parent node of a previous node that was split/divided into two new nodes
- *	Node** children - the two children node from a previous Node split/divided into two new nodes
- *	int key - the key value that will be used if there is a new Interior Node split
- *	std::string value - the value that needs to be inserted (unused)
- * Author: Joshua Campbell
+ *	int key - The key that will identify the position of a string value in the tree.
+ *	std::string value - The string value that will be stored on the key.
  * Description:
- *	Handles updating parent nodes that are full and may need to be split after their children were
- *  split. If the parent node is full and needs to be split, this function will handle updating its
- *  parent node as well until no more parent nodes need to be split. If the parent node is a head 
- *  node and it needs to be split, a new head node will be made that contains the previous split 
- *  head node and its split sibling.
- * Returns: true in all cases
+ *	Inserts the key/value pair, or replaces the value if the key is already in the tree
+ *	(insert-or-assign). The leaf is found with a single descent; replacing a value changes
+ *	it in place without any structural change to the tree.
+ * Returns: true if the key/value pair was inserted, false if an existing value was replaced
  */
-bool BpTree::insertWithParentFull(Node* node, Node** children, const int key, const std::string value) {
-	InteriorNode * interiorNode = static_cast<InteriorNode*>(node);
-	int middleKey = interiorNode->getMiddleKey(key);
-	if (interiorNode->getParent() != 0) {
-		Node** interiorChildren = interiorNode->split(children[1], key);
-		
-		if (!static_cast<InteriorNode*>(interiorNode->getParent())->addChild(interiorChildren[1], middleKey)) {
-			this->insertWithParentFull(interiorNode->getParent(), interiorChildren, middleKey, value);
+bool BpTree::upsert(const int key, const std::string value)
+{
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+	std::vector<Node*> path;
+	Node * leaf = this->findWritablePath(key, path);
+	if (leaf == 0) {
+		return this->insert(key, value);
+	}
+	int index = leaf->getKeyIndex(key);
+	if (index != -1) {
+		if (this->cache != 0) {
+			this->cache->erase(key);
 		}
-		delete interiorChildren;
+		static_cast<LeafNode*>(leaf)->setValue(index, value);
+		return false;
 	}
-	else {
-		this->head = new InteriorNode(this->maxNodes);
-		Node** interiorChildren = interiorNode->split(children[1], key);
-		
-		static_cast<InteriorNode*>(this->head)->addChild(interiorChildren[0]);
-		static_cast<InteriorNode*>(this->head)->addChild(interiorChildren[1], middleKey);
-		delete interiorChildren;
+	if (this->insertIntoPath(path, key, value, 0)) {
+		this->addToFilter(key);
+		return true;
+	}
+	return false;
+}
+
+/* Name: update
+ * Params:
+ *	int key - The key whose value is replaced.
+ *	std::string value - The new string value for the key.
+ * Description:
+ *	Replaces the value stored on a key that is already in the tree, in place and with a
+ *	single descent. Nothing is inserted if the key is not in the tree.
+ * Returns: true if the value was replaced, false if the key was not found
+ */
+bool BpTree::update(const int key, const std::string value)
+{
+	METRICS_TIME(OPERATION_UPDATE);
+	if (!this->filterMayContain(key)) {
+		return false;
+	}
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+	std::vector<Node*> path;
+	Node * leaf = this->findWritablePath(key, path);
+	int index = leaf != 0 ? leaf->getKeyIndex(key) : -1;
+	if (index == -1) {
+		return false;
+	}
+	if (this->cache != 0) {
+		this->cache->erase(key);
 	}
+	static_cast<LeafNode*>(leaf)->setValue(index, value);
 	return true;
 }
 
-/* Name: remove
+/* Name: insertIntoPath
  * Params:
- *	int key - the key that identifies a key/value pair that needs to be removed
- * Author: Joshua Campbell
+ *	std::vector<Node*>& path - the writable nodes from the head down to the leaf that the key
+ *		belongs in (the key must not already be in the tree); a new head is added to the front
+ *	int key - The key that will identify the position of a string value in the tree.
+ *	std::string value - The string value that will be inserted on a key.
+ *	size_t top - the depth of the highest node whose subtree counts are updated (0 for the
+ *		head node); the counts stored above it are left for the caller
  * Description:
- *	Removes a key/value pair from the tree if it exists. If a leaf node is less than
- *  half full after the key/value pair is removed, it may undergo redistribution from
- *  a left or a right neighbour, or it may undergo being coalesced into a neighbour.
- *  If upon being coalesced, the leaf node's parent is less than half full, the
- *  removeOrCoalesceInteriorNodes() method is called to handle its Interior parent
- *  node. Pointers between leaf nodes are updated upon coalescence.
- *  In order to ensure that parent interior nodes have the correct keys, the 
- *  updateInteriorNodeKeys() method is called to make sure that each the lowest value of
- *  each interior node's leaves can be reached (updates parent interior node keys).
- * Returns: true if the key was removed, false otherwise
+ *	Inserts a new key/value pair into the leaf at the end of the path. If the leaf is full it
+ *  is split, and the new half is added to the parent above it; a full parent is split in turn,
+ *  up the path until a parent has room. If the head node is split, a new head node is made
+ *  that holds the old head and its new half. The subtree counts of the nodes on the path and
+ *  of the new halves are then updated from the leaf up.
+ * Returns: true if the key/value pair was inserted, false otherwise
  */
-bool BpTree::remove(const int key)
+bool BpTree::insertIntoPath(std::vector<Node*>& path, const int key, const std::string value, const size_t top)
 {
-	if (this->head != 0) {
-		Node * current = this->head;
-		//finding the leaf node that might contain the key/value pair to remove
-		while (current != 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
-			current = static_cast<InteriorNode*>(current)->findNextNode(key);
+	Node * current = path.empty() ? 0 : path.back();
+	if (current == 0 || current->getNodeType() != NODE_TYPE_LEAF) {
+		return false;
+	}
+	//inserting into the leaf when it is not full
+	if (!current->isFull()) {
+		static_cast<LeafNode*>(current)->addPair(key, value);
+		updateCounts(path, top);
+		return true;
+	}
+	//splitting the leaf and adding the new half to its parent, splitting full parents on the way up
+	this->dropReplicas();
+	Node** halves = static_cast<LeafNode*>(current)->split(key, value);
+	METRICS_SPLIT(METRIC_LEAF_SPLITS, key);
+	Node * sibling = halves[1];
+	int separator = sibling->getKey(0);
+	delete[] halves;
+	std::vector<Node*> siblings(path.size(), (Node*)0); //the new half of each node that was split, by depth
+	siblings.back() = sibling;
+	size_t depth = path.size() - 1;
+	while (sibling != 0) {
+		if (depth == 0) {
+			//the head was split, so a new head is made above the two halves
+			InteriorNode * newHead = new (this->maxNodes) InteriorNode(this->maxNodes);
+			newHead->appendChild(path[0], 0);
+			newHead->appendChild(sibling, separator);
+			this->head = newHead;
+			path.insert(path.begin(), newHead);
+			siblings.insert(siblings.begin(), (Node*)0);
+			sibling = 0;
 		}
-		if (current != 0 && current->getNodeType() == NODE_TYPE_LEAF) {
-			LeafNode * leafNode = static_cast<LeafNode*>(current);
-			Node * parent = current->getParent();
-			int keyIndex = leafNode->getKeyIndex(key);
-			Node** neighbours = current->findNeighbours();
-			int identifierKey = current->findIdentifierKey();
-			Node * parentLeaf = this->findLeafNodeNeighbour(leafNode);
-			Node * childLeaf = leafNode->getChild(leafNode->getMaxKeys());
-			leafNode->deletePair(keyIndex); //deleting the key value pair
-			int numberChildrenMidpoint = (leafNode->getMaxKeys() + 1) / 2;
-			
-			//if the node is less than half full...
-			if (leafNode->getNumChildren() < numberChildrenMidpoint && neighbours != 0 && parent != 0) {
-				if (neighbours[0] != 0 && neighbours[0]->getNumChildren() - 1 >= (neighbours[0]->getMaxKeys() + 1) / 2) {
-					//redistribute values from left sibling to the current node
-					int childKey = neighbours[0]->getKey(neighbours[0]->getNumKeys() - 1);
-					std::string childValue = static_cast<LeafNode*>(neighbours[0])->getValue(neighbours[0]->getNumKeys() - 1);
-					neighbours[0]->removeChild(neighbours[0]->getNumChildren() - 1);
-					neighbours[0]->removeKey(neighbours[0]->getNumKeys() - 1);
-					leafNode->addPair(childKey, childValue);
-					int newCurrentIdentifierKey = current->findIdentifierKey();
-					parent->setKey(static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey), newCurrentIdentifierKey);
+		else {
+			InteriorNode * parent = static_cast<InteriorNode*>(path[depth - 1]);
+			if (!parent->isFull()) {
+				parent->addChild(sibling, separator);
+				sibling = 0;
+			}
+			else {
+				int middleKey = parent->getMiddleKey(separator);
+				Node** interiorChildren = parent->split(sibling, separator);
+				METRICS_SPLIT(METRIC_INTERIOR_SPLITS, key);
+				if (depth < path.size() - 1) {
+					METRICS_ADD(METRIC_CASCADE_SPLITS, 1);
 				}
-				else if (neighbours[1] != 0 && neighbours[1]->getNumChildren() - 1 >= (neighbours[1]->getMaxKeys() + 1) / 2) {
-					//redistribute values from right sibling to the current node
-					int childKey = neighbours[1]->getKey(0);
-					std::string childValue = static_cast<LeafNode*>(neighbours[1])->getValue(0);
-					neighbours[1]->removeChild(0);
-					neighbours[1]->removeKey(0);
-					int newRightIdentifierKey = neighbours[1]->findIdentifierKey();
-					parent->setKey(static_cast<InteriorNode*>(parent)->getKeyIndex(childKey), newRightIdentifierKey);
-					leafNode->addPair(childKey, childValue);
-					if (parent != 0 && parent->getChildIndex(current) > 0) {
-						int keyIndex = static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey);
-						parent->setKey(keyIndex, current->findIdentifierKey());
-					}
-				} 
-				else if (neighbours[0] != 0 && neighbours[0]->getNumChildren() + leafNode->getNumChildren() <= neighbours[0]->getMaxKeys()) {
-					//coalesce the current node with the left sibling
-					LeafNode * neighbourNode = static_cast<LeafNode*>(neighbours[0]);
-					
-					for (int i = 0; i < leafNode->getNumChildren(); i++) {
-						int tempKey = leafNode->getKey(i);
-						std::string tempValue = leafNode->getValue(i);
-						neighbourNode->addPair(tempKey, tempValue);
-					}
-					int numChildren = leafNode->getNumChildren();
-					for (int i = 0; i < numChildren; i++) {
-						leafNode->removePair(0);
-					}
+				sibling = interiorChildren[1];
+				separator = middleKey;
+				siblings[depth - 1] = sibling;
+				delete[] interiorChildren;
+			}
+			depth--;
+		}
+	}
+	//recounting the subtrees from the leaf up; each new half is under its old half's parent or that parent's new half
+	for (size_t d = path.size() - 1; d > top; d--) {
+		for (int side = 0; side < 2; side++) {
+			Node * node = side == 0 ? path[d] : siblings[d];
+			if (node == 0) {
+				continue;
+			}
+			InteriorNode * parent = static_cast<InteriorNode*>(path[d - 1]);
+			int index = parent->getChildIndex(node);
+			if (index == -1 && siblings[d - 1] != 0) {
+				parent = static_cast<InteriorNode*>(siblings[d - 1]);
+				index = parent->getChildIndex(node);
+			}
+			parent->updateCount(index);
+		}
+	}
+	METRICS_SPLIT_END();
+	return true;
+}
 
-					if (childLeaf != 0 && neighbourNode->getNumChildren() >= 1 && neighbourNode != leafNode) {
-						neighbourNode->setChild(neighbourNode->getMaxKeys(), childLeaf);
-					}
-					else if (childLeaf != 0 && parentLeaf != 0 && neighbourNode->getNumChildren() == 0 && neighbourNode == leafNode) {
-						parentLeaf->setChild(parentLeaf->getMaxKeys(), childLeaf);
-					}
-					
-					current = parent->deleteChild(current);
-					parent->removeKey(static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey));
-					
-					int maxKeys = (neighbourNode->getMaxKeys() + 1) / 2;
-					if (parent->getNumChildren() < maxKeys || parent->getNumKeys() == 0) {
-						removeOrCoalesceInteriorNodes(parent);
-					}
-					parent = neighbourNode->getParent();
-				}
-				else if (neighbours[1] != 0 && neighbours[1]->getNumChildren() + leafNode->getNumChildren() <= neighbours[1]->getMaxKeys()) {
-					//coalesce the current node with the right sibling
-					LeafNode * neighbourNode = static_cast<LeafNode*>(neighbours[1]);
-					for (int i = 0; i < leafNode->getNumChildren(); i++) {
-						int tempKey = leafNode->getKey(i);
-						std::string tempValue = leafNode->getValue(i);
-						neighbourNode->addPair(tempKey, tempValue);
-					}
-					int numChildren = leafNode->getNumChildren();
-					for (int i = 0; i < numChildren; i++) {
-						leafNode->removePair(0);
-					}
+/* Name: insertBatch
+ * Params:
+ *	const std::vector<std::pair<int, std::string> >& pairs - the key/value pairs to insert (in any order)
+ *	const int numThreads - the number of threads used to sort and insert the pairs
+ * Description:
+ *	Inserts a batch of key/value pairs. The batch is sorted in parallel and split up by the
+ *	keys of the head node, and each part is inserted into the head's child subtree that it
+ *	belongs to by its own thread. Splits that stay inside a subtree are done by the thread
+ *	that owns the subtree. Pairs whose insertion would split the head's child (and so change
+ *	the head node) are put aside and inserted one at a time once the threads are done.
+ *	Like insert(), keys that are already in the tree are skipped; if a key appears more than
+ *	once in the batch, the first pair wins.
+ * Returns: the number of key/value pairs that were inserted
+ */
+int BpTree::insertBatch(const std::vector<std::pair<int, std::string> >& pairs, const int numThreads)
+{
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+	this->dropReplicas();
+	std::vector<std::pair<int, std::string> > sorted(pairs);
+	sortPairs(sorted, numThreads);
 
-					current = parent->deleteChild(current);
-					parent->removeKey(static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey));
-					
-					if (parentLeaf != 0) {
-						parentLeaf->setChild(parentLeaf->getMaxKeys(), neighbourNode);
-					}
+	int inserted = 0;
+	size_t next = 0;
+	//growing the tree until the head has children that can be handed out to the threads
+	while (next < sorted.size() && (this->head == 0 || this->head->getNodeType() != NODE_TYPE_INTERIOR)) {
+		if ((next == 0 || sorted[next].first != sorted[next - 1].first) && this->insert(sorted[next].first, sorted[next].second)) {
+			inserted += 1;
+		}
+		next += 1;
+	}
+	if (next > 0) {
+		//skipping the remaining duplicates of the last key that was inserted
+		while (next < sorted.size() && sorted[next].first == sorted[next - 1].first) {
+			next += 1;
+		}
+	}
+	if (next >= sorted.size()) {
+		return inserted;
+	}
 
-					if (parent->getNumChildren() < (neighbourNode->getMaxKeys() + 1) / 2 || parent->getNumKeys() == 0) {
-						removeOrCoalesceInteriorNodes(parent);
-					}
-					parent = neighbourNode->getParent();
-				}
+	//making the head and its children writable (see getWritableChild()) before they are handed
+	//out, so that the threads only copy nodes inside their own subtrees
+	Node * head = this->getWritableHead();
+	for (int i = 0; i < head->getNumChildren(); i++) {
+		this->getWritableChild(head, i);
+	}
+
+	//splitting the batch up between the head's children using the head's keys
+	std::vector<size_t> bounds(1, next);
+	for (int i = 0; i < head->getNumChildren() - 1; i++) {
+		std::pair<int, std::string> separator(head->getKey(i), std::string());
+		size_t bound = std::lower_bound(sorted.begin() + bounds.back(), sorted.end(), separator,
+			[](const std::pair<int, std::string>& a, const std::pair<int, std::string>& b) { return a.first < b.first; }) - sorted.begin();
+		bounds.push_back(bound);
+	}
+	bounds.push_back(sorted.size());
+
+	std::vector<int> insertedCounts(head->getNumChildren(), 0);
+	std::vector<std::vector<std::pair<int, std::string> > > deferred(head->getNumChildren());
+	std::vector<std::thread> workers;
+	int threads = numThreads < 1 ? 1 : numThreads;
+	for (int t = 0; t < threads; t++) {
+		workers.push_back(std::thread([this, head, &sorted, &bounds, &insertedCounts, &deferred, t, threads]() {
+			NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+			for (int i = t; i < head->getNumChildren(); i += threads) {
+				insertedCounts[i] = this->insertIntoSubtree(head, i, sorted, bounds[i], bounds[i + 1], deferred[i]);
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+	for (int i = 0; i < head->getNumChildren(); i++) {
+		static_cast<InteriorNode*>(head)->updateCount(i);
+	}
+	for (size_t i = next; i < sorted.size(); i++) {
+		this->addToFilter(sorted[i].first);
+	}
+
+	//inserting the pairs that change the head node one at a time
+	for (size_t i = 0; i < insertedCounts.size(); i++) {
+		inserted += insertedCounts[i];
+		for (size_t k = 0; k < deferred[i].size(); k++) {
+			if (this->insert(deferred[i][k].first, deferred[i][k].second)) {
+				inserted += 1;
+			}
+		}
+	}
+	return inserted;
+}
+
+/* Name: insertIntoSubtree
+ * Params:
+ *	Node* head - the head node (writable)
+ *	const int index - the index of the head's child whose subtree the pairs are inserted into
+ *	const std::vector<std::pair<int, std::string> >& pairs - sorted key/value pairs
+ *	size_t begin - the index of the first pair that belongs in the subtree
+ *	size_t end - the index after the last pair that belongs in the subtree
+ *	std::vector<std::pair<int, std::string> >& deferred - receives the pairs that were not inserted
+ *		because the head node would have to change
+ * Description:
+ *	Inserts pairs into one of the head's child subtrees without touching any node outside of
+ *	it, so that the subtrees can be filled by different threads. A split only reaches the
+ *	head if every node from the leaf up to the subtree's root is full; such pairs are added
+ *	to deferred instead. Repeated keys in the pairs are skipped.
+ * Returns: the number of key/value pairs that were inserted
+ */
+int BpTree::insertIntoSubtree(Node* head, const int index, const std::vector<std::pair<int, std::string> >& pairs, size_t begin, size_t end,
+	std::vector<std::pair<int, std::string> >& deferred)
+{
+	int inserted = 0;
+	std::vector<Node*> path;
+	for (size_t i = begin; i < end; i++) {
+		int key = pairs[i].first;
+		if (i > 0 && key == pairs[i - 1].first) {
+			continue;
+		}
+		path.assign(1, head);
+		path.push_back(head->getChild(index));
+		Node * current = this->extendWritablePath(key, path);
+		if (current == 0 || current->getKeyIndex(key) != -1) {
+			continue;
+		}
+		bool reachesHead = true;
+		for (size_t depth = 1; depth < path.size(); depth++) {
+			if (!path[depth]->isFull()) {
+				reachesHead = false;
+				break;
 			}
+		}
+		if (reachesHead) {
+			deferred.push_back(pairs[i]);
+		}
+		else if (this->insertIntoPath(path, key, pairs[i].second, 1)) {
+			inserted += 1;
+		}
+	}
+	return inserted;
+}
 
-			updateInteriorNodeKeys(this->head); //validate and update any interior node keys that may have fallen out of sync after
-												//a strange redistribution or coalescence
+/* Name: sortPairs
+ * Params:
+ *	std::vector<std::pair<int, std::string> >& pairs - the key/value pairs to sort
+ *	const int numThreads - the number of threads used to sort the pairs
+ * Description:
+ *	Sorts pairs by key, keeping pairs with the same key in their original order. Each thread
+ *	sorts one slice of the pairs and the sorted slices are then merged pairwise in parallel.
+ * Returns: None
+ */
+void BpTree::sortPairs(std::vector<std::pair<int, std::string> >& pairs, const int numThreads)
+{
+	struct KeyLess {
+		bool operator()(const std::pair<int, std::string>& a, const std::pair<int, std::string>& b) const {
+			return a.first < b.first;
+		}
+	};
+	int threads = numThreads < 1 ? 1 : numThreads;
+	size_t sliceSize = (pairs.size() + threads - 1) / threads;
+	if (threads == 1 || sliceSize < 1024) {
+		std::stable_sort(pairs.begin(), pairs.end(), KeyLess());
+		return;
+	}
+	std::vector<size_t> slices;
+	for (size_t i = 0; i < pairs.size(); i += sliceSize) {
+		slices.push_back(i);
+	}
+	slices.push_back(pairs.size());
 
-			for (int i = 1; i < this->head->getNumChildren(); i++) {
-				Node * child = this->head->getChild(i);
-				if (child->getNodeType() == NODE_TYPE_INTERIOR) {
-					this->head->setKey(i - 1, static_cast<InteriorNode*>(child)->findLeastLeafKey());
-				}
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i + 1 < slices.size(); i++) {
+		workers.push_back(std::thread([&pairs, &slices, i]() {
+			std::stable_sort(pairs.begin() + slices[i], pairs.begin() + slices[i + 1], KeyLess());
+		}));
+	}
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	while (slices.size() > 2) {
+		std::vector<size_t> merged;
+		workers.clear();
+		for (size_t i = 0; i + 2 < slices.size(); i += 2) {
+			workers.push_back(std::thread([&pairs, &slices, i]() {
+				std::inplace_merge(pairs.begin() + slices[i], pairs.begin() + slices[i + 1], pairs.begin() + slices[i + 2], KeyLess());
+			}));
+		}
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+		for (size_t i = 0; i < slices.size(); i += 2) {
+			merged.push_back(slices[i]);
+		}
+		if (merged.back() != pairs.size()) {
+			merged.push_back(pairs.size());
+		}
+		slices = merged;
+	}
+}
+
+/* Name: updateCounts
+ * Params:
+ *	const std::vector<Node*>& path - the nodes from the head down to a node whose subtree changed
+ *	const size_t top - the depth of the highest node whose counts are updated (0 for the head node)
+ * Description:
+ *	Recounts the subtree count that each node of the path from top down stores for the next
+ *	node of the path, from the bottom up.
+ * Returns: None
+ */
+void BpTree::updateCounts(const std::vector<Node*>& path, const size_t top)
+{
+	for (size_t depth = path.size() - 1; depth > top && depth < path.size(); depth--) {
+		InteriorNode * parent = static_cast<InteriorNode*>(path[depth - 1]);
+		parent->updateCount(parent->getChildIndex(path[depth]));
+	}
+}
+
+/* Name: remove
+ * Params:
+ *	int key - the key that identifies a key/value pair that needs to be removed
+ * Author: Joshua Campbell
+ * Description:
+ *	Removes a key/value pair from the tree if it exists. The leaf is found with a single
+ *  descent, copying the nodes on the way that a snapshot shares (see getWritableChild()). If
+ *  the leaf is left less than half full, it is redistributed with or coalesced into a
+ *  sibling, and so is every node above it that is left less than half full in turn (see
+ *  repairPaths()). A head node left with a single child is replaced by that child.
+ * Returns: true if the key was removed, false otherwise
+ */
+bool BpTree::remove(const int key)
+{
+	METRICS_TIME(OPERATION_REMOVE);
+	if (this->cache != 0) {
+		this->cache->erase(key);
+	}
+	if (this->head == 0) {
+		return false;
+	}
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+	std::vector<Node*> path;
+	Node * leaf = this->findWritablePath(key, path);
+	int keyIndex = leaf->getKeyIndex(key);
+	if (keyIndex == -1) {
+		return false;
+	}
+	static_cast<LeafNode*>(leaf)->deletePair(keyIndex); //deleting the key value pair
+	updateCounts(path, 0);
+	this->repairPaths(key, key);
+	this->trimFilter();
+	return true;
+}
+
+/* Name: removeRange
+ * Params:
+ *	int lo - the lowest key to remove
+ *	int hi - the highest key to remove
+ * Description:
+ *	Removes every key/value pair with lo <= key <= hi without visiting the rest of the tree.
+ *	The writable paths to the leaves for lo and hi are found with one descent each (see
+ *	findWritablePath()). Below the node where the two paths split, the subtrees between the
+ *	paths are fully covered by the range and are released whole, their pairs counted from the
+ *	subtree counts. The two boundary leaves are trimmed. Only the nodes on the two paths can be
+ *	left less than half full; they are repaired once at the end (see repairPaths()) instead of
+ *	after every key, as remove() does. The cost is the number of released nodes plus a few
+ *	nodes per level.
+ * Returns: the number of key/value pairs that were removed
+ */
+int BpTree::removeRange(const int lo, const int hi)
+{
+	if (this->head == 0 || lo > hi || this->count(lo, hi) == 0) {
+		return 0;
+	}
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+	this->dropReplicas();
+	if (this->cache != 0) {
+		this->cache->eraseRange(lo, hi);
+	}
+	//the writable paths from the head down to the leaves for lo and hi
+	std::vector<Node*> lowPath;
+	std::vector<Node*> highPath;
+	this->findWritablePath(lo, lowPath);
+	this->findWritablePath(hi, highPath);
+	size_t height = lowPath.size() - 1;
+	size_t split = 0; //the depth of the lowest node on both paths
+	while (split < height && lowPath[split + 1] == highPath[split + 1]) {
+		split++;
+	}
+	LeafNode * lowLeaf = static_cast<LeafNode*>(lowPath[height]);
+	LeafNode * highLeaf = static_cast<LeafNode*>(highPath[height]);
+	int removed = 0;
+	if (split < height) {
+		//the children of the split node between the two paths are fully covered by the range
+		InteriorNode * top = static_cast<InteriorNode*>(lowPath[split]);
+		int first = top->getChildIndex(lowPath[split + 1]);
+		for (int i = top->getChildIndex(highPath[split + 1]) - 1; i > first; i--) {
+			removed += top->getCount(i);
+			releaseSubtree(top->removeChild(i), 1);
+			top->removeKey(i);
+		}
+		//and so are the children right of the path for lo and left of the path for hi below it
+		for (size_t depth = split + 1; depth < height; depth++) {
+			InteriorNode * node = static_cast<InteriorNode*>(lowPath[depth]);
+			int index = node->getChildIndex(lowPath[depth + 1]);
+			while (node->getNumChildren() > index + 1) {
+				int last = node->getNumChildren() - 1;
+				removed += node->getCount(last);
+				releaseSubtree(node->removeChild(last), 1);
+				node->removeKey(last - 1);
 			}
-			
-			if (parent != 0 && current != 0) {
-				identifierKey = current->findIdentifierKey();
-				int partitionKeyIndex = static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey);
-				int partitionKey = parent->getKey(partitionKeyIndex);
-				if (identifierKey >= partitionKey && current == parent->getChild(0)) {
-					for (int i = 1; i < current->getNumKeys(); i++) {
-						if (current->getKey(i) > partitionKey) {
-							parent->setKey(partitionKeyIndex, current->getKey(i));
-							break;
-						}
-					}
+			node = static_cast<InteriorNode*>(highPath[depth]);
+			for (int i = node->getChildIndex(highPath[depth + 1]); i > 0; i--) {
+				removed += node->getCount(0);
+				releaseSubtree(node->removeChild(0), 1);
+				node->removeKey(0);
+			}
+		}
+	}
+	//trimming the boundary leaves
+	for (int i = lowLeaf->getNumKeys() - 1; i >= 0; i--) {
+		if (lowLeaf->getKey(i) >= lo && lowLeaf->getKey(i) <= hi) {
+			lowLeaf->deletePair(i);
+			removed += 1;
+		}
+	}
+	if (highLeaf != lowLeaf) {
+		while (highLeaf->getNumKeys() > 0 && highLeaf->getKey(0) <= hi) {
+			highLeaf->deletePair(0);
+			removed += 1;
+		}
+	}
+	updateCounts(lowPath, 0);
+	updateCounts(highPath, 0);
+	this->repairPaths(lo, hi);
+	this->trimFilter();
+	return removed;
+}
+
+/* Name: repairPaths
+ * Params:
+ *	const int lo - a key whose path may hold nodes that are less than half full
+ *	const int hi - another such key (the same as lo after a single remove)
+ * Description:
+ *	Brings the nodes on the paths to the leaves for lo and hi back to at least half full after
+ *	a removal, which can only have emptied nodes on those paths. The deepest such node that has
+ *	a sibling is joined with it (see joinChildren()), and the paths are walked again, since a
+ *	coalesce can leave the parent less than half full in turn; a node without siblings is left
+ *	to the repair of its parent. A head node left with a single child is then replaced by that
+ *	child, and an empty head leaf is deleted.
+ * Returns: None
+ */
+void BpTree::repairPaths(const int lo, const int hi)
+{
+	int minimum = (this->maxNodes + 1) / 2;
+	std::vector<Node*> path;
+	while (this->head != 0) {
+		bool repaired = false;
+		for (int side = 0; side < 2 && !repaired; side++) {
+			if (side == 1 && hi == lo) {
+				break;
+			}
+			this->findWritablePath(side == 0 ? lo : hi, path);
+			for (size_t depth = path.size() - 1; depth > 0 && !repaired; depth--) {
+				Node * node = path[depth];
+				int size = node->getNodeType() == NODE_TYPE_LEAF ? node->getNumKeys() : node->getNumChildren();
+				Node * parent = path[depth - 1];
+				if (size < minimum && parent->getNumChildren() > 1) {
+					this->joinChildren(parent, parent->getChildIndex(node));
+					repaired = true;
 				}
 			}
 		}
-	 else {
-		 return false;
-	 }
-		
-		return true;
+		if (repaired) {
+			continue;
+		}
+		//a head left with a single child is replaced by that child, an empty head leaf is deleted
+		if (this->head->getNodeType() == NODE_TYPE_INTERIOR && this->head->getNumChildren() == 1) {
+			this->dropReplicas();
+			Node * child = this->head->getChild(0);
+			delete this->head;
+			this->head = child;
+		}
+		else if (this->head->getNodeType() == NODE_TYPE_LEAF && this->head->getNumKeys() == 0) {
+			this->dropReplicas();
+			delete this->head;
+			this->head = 0;
+		}
+		else {
+			return;
+		}
+	}
+}
+
+/* Name: joinChildren
+ * Params:
+ *	Node* parent - a writable interior node with more than one child
+ *	const int index - the index of a child that is less than half full
+ * Description:
+ *	Joins a child with its left sibling (or its right sibling if it is the first child):
+ *	coalesces the right one of the two into the left one if their children fit in one node,
+ *	otherwise redistributes them evenly (see balanceLeaves() and balanceInteriorNodes()). The
+ *	key separating the two in the parent and the parent's subtree counts are updated, and a
+ *	coalesced right node is removed from the parent and deleted.
+ * Returns: None
+ */
+void BpTree::joinChildren(Node* parent, const int index)
+{
+	int left = index > 0 ? index - 1 : index;
+	Node * leftNode = this->getWritableChild(parent, left);
+	Node * rightNode = this->getWritableChild(parent, left + 1);
+	this->dropReplicas();
+	bool coalesced = false;
+	int separator = 0;
+	if (leftNode->getNodeType() == NODE_TYPE_LEAF) {
+		coalesced = this->balanceLeaves(leftNode, rightNode);
+		separator = coalesced ? 0 : rightNode->getKey(0);
+	}
+	else {
+		coalesced = balanceInteriorNodes(leftNode, rightNode, parent->getKey(left), separator);
+	}
+	InteriorNode * interiorParent = static_cast<InteriorNode*>(parent);
+	if (coalesced) {
+		interiorParent->removeChild(left + 1);
+		interiorParent->removeKey(left);
+		delete rightNode;
+	}
+	else {
+		interiorParent->setKey(left, separator);
+		interiorParent->updateCount(left + 1);
+	}
+	interiorParent->updateCount(left);
+}
+
+/* Name: balanceLeaves
+ * Params:
+ *	Node* left - a leaf
+ *	Node* right - the leaf to the right of left
+ * Description:
+ *	Coalesces two neighbouring leaves into the left one if all of their pairs fit in one leaf,
+ *	otherwise redistributes the pairs so that both leaves hold about the same number of pairs.
+ * Returns: true if the leaves were coalesced (right is empty and should be deleted), false otherwise
+ */
+bool BpTree::balanceLeaves(Node* left, Node* right)
+{
+	LeafNode * leftLeaf = static_cast<LeafNode*>(left);
+	LeafNode * rightLeaf = static_cast<LeafNode*>(right);
+	int total = leftLeaf->getNumKeys() + rightLeaf->getNumKeys();
+	int leftTarget = total <= leftLeaf->getMaxKeys() ? total : total / 2;
+	METRICS_EVENT(total <= leftLeaf->getMaxKeys() ? METRIC_COALESCES : METRIC_REDISTRIBUTIONS, rightLeaf->getKey(0));
+	while (leftLeaf->getNumKeys() < leftTarget) {
+		leftLeaf->addPair(rightLeaf->getKey(0), rightLeaf->getValue(0));
+		rightLeaf->deletePair(0);
+	}
+	while (leftLeaf->getNumKeys() > leftTarget) {
+		int last = leftLeaf->getNumKeys() - 1;
+		rightLeaf->addPair(leftLeaf->getKey(last), leftLeaf->getValue(last));
+		leftLeaf->deletePair(last);
+	}
+	return rightLeaf->getNumKeys() == 0;
+}
+
+/* Name: balanceInteriorNodes
+ * Params:
+ *	Node* left - an interior node
+ *	Node* right - the interior node to the right of left on the same level
+ *	const int separator - the key separating the two nodes in the node above them
+ *	int& newSeparator - receives the key that separates them after a redistribution
+ * Description:
+ *	The interior node counterpart of balanceLeaves(): lines up the children of both nodes
+ *	with the keys between them (separator between the last child of left and the first child
+ *	of right) and hands them back out, all to left if they fit in one node, otherwise half
+ *	to each. The subtree counts of both nodes are recounted as the children are added.
+ * Returns: true if the nodes were coalesced (right has no children and should be removed), false otherwise
+ */
+bool BpTree::balanceInteriorNodes(Node* left, Node* right, const int separator, int& newSeparator)
+{
+	std::vector<Node*> children;
+	std::vector<int> keys;
+	for (int side = 0; side < 2; side++) {
+		Node * node = side == 0 ? left : right;
+		if (side == 1) {
+			keys.push_back(separator);
+		}
+		for (int i = 0; i < node->getNumChildren(); i++) {
+			children.push_back(node->getChild(i));
+		}
+		for (int i = 0; i < node->getNumKeys(); i++) {
+			keys.push_back(node->getKey(i));
+		}
+		while (node->getNumChildren() > 0) {
+			node->removeChild(node->getNumChildren() - 1);
+		}
+		node->setNumKeys(0);
 	}
-	else {
-		return false;
+	int total = (int)children.size();
+	int leftTarget = total <= left->getMaxKeys() + 1 ? total : total / 2;
+	METRICS_EVENT(leftTarget == total ? METRIC_COALESCES : METRIC_REDISTRIBUTIONS, separator);
+	for (int i = 0; i < total; i++) {
+		static_cast<InteriorNode*>(i < leftTarget ? left : right)->appendChild(children[i], i > 0 ? keys[i - 1] : 0);
 	}
+	newSeparator = leftTarget < total ? keys[leftTarget - 1] : 0;
+	return leftTarget == total;
 }
 
-/* Name: removeOrCoalesceInteriorNodes
+/* Name: findScanPartitions
  * Params:
- *	Node* node - the node that is half full and needs to undergo redistribution or coalescence
- * Author: Joshua Campbell
+ *	const int lo - the lowest key of the scan
+ *	const int hi - the highest key of the scan
+ *	const int numParts - the number of runs of keys to split the scan into
+ *	std::vector<int>& starts - receives the lowest key of each run, in ascending order; each
+ *		run ends just below where the next one starts, and the last one ends at hi
  * Description:
- *	Handles redistribution or coalescence of interior nodes if they are less than half full.
- *  Checks if their parent is half full and if so, the removeOrCoalesceInteriorNodes()
- *  method is called for that parent. If the head node has only one child, that head node is
- *  removed and its child becomes the new head node.
+ *	Splits the keys between lo and hi into at most numParts runs that each cover about the
+ *	same number of leaves. The interior nodes are walked down level by level, keeping only the
+ *	children whose keys (bounded by their parent's keys) can overlap the range, until there
+ *	are a few subtrees per run; the subtrees are then divided evenly between the runs, each
+ *	run starting at the lowest key its first subtree can hold. The first run starts at lo.
  * Returns: None
  */
-void BpTree::removeOrCoalesceInteriorNodes(Node* node) {
-	if (node != 0) {
-		InteriorNode * interiorNode = static_cast<InteriorNode*>(node);
-		Node * parent = interiorNode->getParent();
-		Node** neighbours = interiorNode->findNeighbours();
-		int identifierKey = interiorNode->findIdentifierKey();
-
-		//if the interior node is less than half full...
-		if (interiorNode->getNumKeys() <= (interiorNode->getMaxKeys() + 1) / 2) {
-			if (neighbours != 0 && neighbours[0] != 0 && neighbours[0]->getNumChildren() - 1 >= (neighbours[0]->getMaxKeys() + 1) / 2 && neighbours[0]->getNumKeys() > 1) {
-				//redistribute values from left sibling to the current node
-				int leastKeyValue = static_cast<InteriorNode*>(neighbours[0])->leastChildValue();
-				int newKey = interiorNode->getChild(0)->findIdentifierKey();
-				Node* childValue = static_cast<InteriorNode*>(neighbours[0])->getChild(neighbours[0]->getNumKeys());
-				
-				neighbours[0]->removeChild(neighbours[0]->getNumChildren() - 1);
-				neighbours[0]->removeKey(neighbours[0]->getNumKeys() - 1);
-
-				interiorNode->addChild(childValue, newKey);
-				
-				parent->setKey(static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey), leastKeyValue);
-			}
-			else if (neighbours != 0 && neighbours[1] != 0 && neighbours[1]->getNumChildren() - 1 >= (neighbours[1]->getMaxKeys() + 1) / 2 && neighbours[1]->getNumKeys() > 1) {
-				//redistribute values from right sibling to the current node
-				int childKey = neighbours[1]->getKey(0);
-				Node* childValue = static_cast<InteriorNode*>(neighbours[1])->getChild(0);
-				childKey = childValue->findIdentifierKey();
-				neighbours[1]->removeChild(0);
-				neighbours[1]->removeKey(0);
-				
-				int newRightIdentifierKey = static_cast<InteriorNode*>(neighbours[1])->leastChildValue();
-				parent->setKey(static_cast<InteriorNode*>(parent)->getKeyIndex(childKey), newRightIdentifierKey);
-				interiorNode->addChild(childValue, childKey);
-			}
-			else if (neighbours != 0 && neighbours[0] != 0 && neighbours[0]->getNumKeys() + interiorNode->getNumKeys() - 1 <= neighbours[0]->getMaxKeys()) {
-				//coalesce the current node with the left sibling
-				InteriorNode * neighbourNode = static_cast<InteriorNode*>(neighbours[0]);
-				for (int i = 0; i < interiorNode->getNumChildren(); i++) {
-					Node* tempValue = interiorNode->getChild(i);
-					int tempKey = tempValue->getKey(0);
-					neighbourNode->addChild(tempValue, tempKey);
-				}
-				
-				int numChildren = interiorNode->getNumChildren();
-				for (int i = 0; i < numChildren; i++) {
-					interiorNode->removeChild(0);
-				}
-				
-				parent->deleteChild(interiorNode);
-				interiorNode = 0;
-				parent->removeKey(static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey));
-				
-				if (parent->getNumChildren() < (neighbourNode->getMaxKeys() + 1) / 2 || parent->getNumKeys() == 0) {
-					removeOrCoalesceInteriorNodes(parent);
+void BpTree::findScanPartitions(const int lo, const int hi, const int numParts, std::vector<int>& starts)
+{
+	starts.clear();
+	if (this->head == 0 || lo > hi) {
+		return;
+	}
+	std::vector<Node*> subtrees(1, this->head);
+	std::vector<int> lows(1, lo); //the lowest key each subtree can hold
+	while (!subtrees.empty() && subtrees.size() < (size_t)numParts * 4 && subtrees[0]->getNodeType() == NODE_TYPE_INTERIOR) {
+		std::vector<Node*> nextSubtrees;
+		std::vector<int> nextLows;
+		for (size_t i = 0; i < subtrees.size(); i++) {
+			Node * node = subtrees[i];
+			for (int k = 0; k < node->getNumChildren(); k++) {
+				//child k only holds keys from key k - 1 up to (but not including) key k
+				if (k > 0 && node->getKey(k - 1) > hi) {
+					break;
 				}
-				parent = neighbourNode->getParent();
-				
-				if (parent != 0 && neighbourNode->getNumChildren() > 0 && neighbourNode != node) {
-					int leastChildValue = neighbourNode->leastChildValue();
-					
-					if (neighbourNode != parent->getChild(0)) {
-						int neighbourKeyIndex = static_cast<InteriorNode*>(parent)->getKeyIndex(neighbourNode->findIdentifierKey());
-						parent->setKey(neighbourKeyIndex, leastChildValue);
-					}
-					else if (parent->getNumChildren() > 1){
-						leastChildValue = static_cast<InteriorNode*>(parent->getChild(1))->leastChildValue();
-						parent->setKey(0, leastChildValue);
-					}
+				if (k < node->getNumKeys() && node->getKey(k) <= lo) {
+					continue;
 				}
+				nextSubtrees.push_back(node->getChild(k));
+				nextLows.push_back(k > 0 ? node->getKey(k - 1) : lows[i]);
 			}
-			else if (neighbours != 0 && neighbours[1] != 0 && neighbours[1]->getNumKeys() + interiorNode->getNumKeys() - 1 <= neighbours[1]->getMaxKeys()) {
-				//coalesce the current node with the right sibling
-				InteriorNode * neighbourNode = static_cast<InteriorNode*>(neighbours[1]);
+		}
+		subtrees = nextSubtrees;
+		lows = nextLows;
+	}
+	if (subtrees.empty()) {
+		return;
+	}
 
-				for (int i = interiorNode->getNumChildren() - 1; i >= 0; i--) {
-					if (i == interiorNode->getNumChildren() - 1 && neighbourNode->getNumChildren() > 1) {
-						int tempKey = neighbourNode->getChild(0)->getKey(0);
-						Node* tempValue = interiorNode->getChild(i);
-						neighbourNode->addChild(tempValue, tempKey);
-					}
-					else if (i == interiorNode->getNumChildren() - 1 && neighbourNode->getNumChildren() == 1 && neighbourNode->getNumKeys() == 1) {
-						Node* tempValue = interiorNode->getChild(i);
-						neighbourNode->addChildToLeft(tempValue);
-					}
-					else {
-						int tempKey = interiorNode->getKey(i);
-						if (tempKey != -1) {
-							Node* tempValue = interiorNode->getChild(i);
-							neighbourNode->addChild(tempValue, tempKey);
-						}
-						else {
-							Node* tempValue = interiorNode->getChild(i);
-							tempKey = tempValue->getKey(0);
-							neighbourNode->addChild(tempValue, tempKey);
-						}
-					}
-				}
-				int numChildren = interiorNode->getNumChildren();
-				for (int i = 0; i < numChildren; i++) {
-					interiorNode->removeChild(0);
-				}
-				
-				parent->deleteChild(interiorNode);
-				interiorNode = 0;
-				parent->removeKey(static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey));
+	size_t perPart = (subtrees.size() + numParts - 1) / numParts;
+	for (size_t i = 0; i < subtrees.size(); i += perPart) {
+		starts.push_back(i == 0 ? lo : lows[i]);
+	}
+}
 
-				if (parent->getNumChildren() < (neighbourNode->getMaxKeys() + 1) / 2 || parent->getNumKeys() == 0) {
-					removeOrCoalesceInteriorNodes(parent);
-				}
-			}
-			else if (interiorNode == this->head && this->head->getNumChildren() == 1) {
-				//if the head only contains one child, the current head is set to that child
-				//and the previous head node is deleted/removed.
-				Node * temp = this->head;
-				this->head = interiorNode->getChild(0);
-				this->head->setParent(0);
+/* Name: findLeaf
+ * Params:
+ *	int key - the key whose leaf is searched for
+ * Description:
+ *	Walks down from the head node (or the replica of the calling thread's NUMA node, see
+ *	setReplicas()) to the leaf that holds (or would hold) the key.
+ * Returns: the leaf for the key, 0 if the tree is empty
+ */
+Node* BpTree::findLeaf(const int key) {
+	Node * current = this->getDescentHead();
+	METRICS_ADD(METRIC_DESCENTS, 1);
+	while (current != 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
+		METRICS_ADD(METRIC_NODES_VISITED, 1);
+		current = static_cast<InteriorNode*>(current)->findNextNode(key);
+	}
+	return current;
+}
 
-				const int numChildren = temp->getNumChildren();
-				for (int i = 0; i < numChildren; i++) {
-					temp->removeChild(0);
-				}
-				delete temp;
-				
-				for (int i = 1; i < this->head->getNumChildren(); i++) {
-					Node * child = this->head->getChild(i);
-					if (child->getNodeType() == NODE_TYPE_INTERIOR) {
-						int leastChildValue = static_cast<InteriorNode*>(child)->leastChildValue();
-						this->head->setKey(i - 1, leastChildValue);
-					}
-					else if (child->getNodeType() == NODE_TYPE_LEAF) {
-						int leastChildValue = static_cast<LeafNode*>(child)->findIdentifierKey();
-						this->head->setKey(i - 1, leastChildValue);
-					}
-				}
-				return;
-			}
-			if (parent != 0 && interiorNode != 0) {
-				identifierKey = interiorNode->findIdentifierKey();
-				int partitionKeyIndex = static_cast<InteriorNode*>(parent)->getKeyIndex(identifierKey);
-				int partitionKey = parent->getKey(partitionKeyIndex);
-				if (identifierKey >= partitionKey && interiorNode == parent->getChild(0)) {	
-					for (int i = 1; i < interiorNode->getNumKeys(); i++) {
-						if (interiorNode->getKey(i) > partitionKey) {
-							parent->setKey(partitionKeyIndex, interiorNode->getKey(i));
-							break;
-						}
-					}
-				}
-			}
+/* Name: findLeaf
+ * Params:
+ *	int key - the key whose leaf is searched for
+ *	std::vector<Node*>& path - receives the nodes from the head down to the leaf
+ * Description:
+ *	Walks down to the leaf for the key like findLeaf(int), keeping the path of the descent so
+ *	that the leaves next to it can be reached from it (see findNextLeaf()).
+ * Returns: the leaf for the key, 0 if the tree is empty
+ */
+Node* BpTree::findLeaf(const int key, std::vector<Node*>& path) {
+	path.clear();
+	Node * current = this->getDescentHead();
+	METRICS_ADD(METRIC_DESCENTS, 1);
+	while (current != 0) {
+		path.push_back(current);
+		if (current->getNodeType() != NODE_TYPE_INTERIOR) {
+			break;
 		}
+		METRICS_ADD(METRIC_NODES_VISITED, 1);
+		current = static_cast<InteriorNode*>(current)->findNextNode(key);
 	}
+	return current;
 }
 
-/* Name: findLeafNodeNeighbour
+/* Name: findNextLeaf
  * Params:
- *	Node * rightMostChildNode - the node that the leaves are searched for to see if
-								their right-most child is a pointer to this node.
- * Author: Joshua Campbell
+ *	std::vector<Node*>& path - the nodes from the head down to a leaf, changed to the path to
+ *		the next leaf
+ *	const bool backward - true for the leaf to the left, false for the one to the right
  * Description:
- *	Finds the leaf node that is directly to the left of rightMostChildNode node.
- * Returns: the node that has its righmost child pointer equal to the rightMostChildNode node
+ *	Finds the leaf next to the one at the end of the path: walks up the path until a node has
+ *	a child on that side of the path's child, and back down that child's nearest edge. Nodes do
+ *	not point at their neighbours (see Node), so scans move between leaves this way; on
+ *	average it only climbs to the leaf's parent.
+ * Returns: the next leaf, 0 if the leaf at the end of the path is the last one on that side
  */
-Node* BpTree::findLeafNodeNeighbour(Node * rightMostChildNode) {
-	Node * current = this->head;
-	if (current != 0) {
-		while (current->getNodeType() == NODE_TYPE_INTERIOR) {
-			current = current->getChild(0);
-		}
-		while (current != 0 && current->getNodeType() == NODE_TYPE_LEAF) {
-			if (current->getChild(current->getMaxKeys()) == rightMostChildNode) {
-				return current;
-			}
-			current = current->getChild(current->getMaxKeys());
-			if (current == 0) {
-				break;
+Node* BpTree::findNextLeaf(std::vector<Node*>& path, const bool backward) {
+	size_t depth = path.size();
+	while (depth > 1) {
+		Node * parent = path[depth - 2];
+		int index = parent->getChildIndex(path[depth - 1]) + (backward ? -1 : 1);
+		if (index >= 0 && index < parent->getNumChildren()) {
+			path.resize(depth - 1);
+			Node * current = parent->getChild(index);
+			path.push_back(current);
+			while (current->getNodeType() == NODE_TYPE_INTERIOR) {
+				current = current->getChild(backward ? current->getNumChildren() - 1 : 0);
+				path.push_back(current);
 			}
+			return current;
 		}
-		return 0;
-	}
-	else {
-		return 0;
+		depth--;
 	}
+	return 0;
 }
 
 /* Name: findKey
@@ -572,6 +1786,9 @@ Node* BpTree::findLeafNodeNeighbour(Node * rightMostChildNode) {
  */
 bool BpTree::findKey(const int key) {
 	bool notFound = false;
+	if (!this->filterMayContain(key)) {
+		return notFound;
+	}
 	if (this->head != 0 && this->head->getNodeType() == NODE_TYPE_LEAF) {
 		int index = this->head->getKeyIndex(key);
 		if (index != -1)
@@ -585,8 +1802,12 @@ bool BpTree::findKey(const int key) {
 	}
 	else if (this->head != 0 && this->head->getNodeType() == NODE_TYPE_INTERIOR)
 	{
+		//the header and keys of the next node are prefetched as soon as it is picked
+		size_t keyBytes = NODE_CACHE_LINE + this->maxNodes * sizeof(int);
 		Node * current = this->head;
+		METRICS_ADD(METRIC_DESCENTS, 1);
 		while (current != 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
+			METRICS_ADD(METRIC_NODES_VISITED, 1);
 			int index = static_cast<InteriorNode*>(current)->getKeyIndex(key);
 			int currentKey = current->getKey(index);
 			if (key < currentKey) {
@@ -608,6 +1829,9 @@ bool BpTree::findKey(const int key) {
 					current = 0;
 				}
 			}
+			if (current != 0) {
+				current->prefetch(keyBytes);
+			}
 		}
 		if (current != 0 && current->getNodeType() == NODE_TYPE_LEAF) {
 			int index = current->getKeyIndex(key);
@@ -634,18 +1858,34 @@ bool BpTree::findKey(const int key) {
  * Author: Joshua Campbell
  * Description:
  *	Searches the tree for the key and returns its string value if found.
- *  If it cannot be found, the empty string is returned.
+ *  If it cannot be found, the empty string is returned. When the tree has a key filter
+ *  (see setFilter()), most keys that are not in the tree are turned away before the descent.
+ *  When the tree has a lookup cache (see setCache()), the cache is checked first and values
+ *  that were found in the tree are added to it. When the tree has replicas (see
+ *  setReplicas()), the descent starts in the replica of the calling thread's NUMA node.
  * Returns: a string containing the value stored on the key
  */
 std::string BpTree::find(const int key)
 {
+	METRICS_TIME(OPERATION_FIND);
 	std::string errorMessage = "";
+	if (this->head == 0 || !this->filterMayContain(key)) {
+		return errorMessage;
+	}
+	std::string value;
+	if (this->cache != 0 && this->cache->get(key, value)) {
+		return value;
+	}
 	if (this->head->getNodeType() == NODE_TYPE_LEAF) {
 		int index = this->head->getKeyIndex(key);
 		if (index != -1)
 		{
 			LeafNode * temp = static_cast<LeafNode*>(this->head);
-			return temp->getValue(index);
+			value = temp->getValue(index);
+			if (this->cache != 0) {
+				this->cache->put(key, value);
+			}
+			return value;
 		}
 		else 
 		{
@@ -654,8 +1894,12 @@ std::string BpTree::find(const int key)
 	}
 	else if (this->head->getNodeType() == NODE_TYPE_INTERIOR)
 	{
-		Node * current = this->head;
+		//the header and keys of the next node are prefetched as soon as it is picked
+		size_t keyBytes = NODE_CACHE_LINE + this->maxNodes * sizeof(int);
+		Node * current = this->getDescentHead();
+		METRICS_ADD(METRIC_DESCENTS, 1);
 		while (current != 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
+			METRICS_ADD(METRIC_NODES_VISITED, 1);
 			int index = static_cast<InteriorNode*>(current)->getKeyIndex(key);
 			int currentKey = current->getKey(index);
 			if (key < currentKey && current->getNumChildren() >= 1) {
@@ -671,13 +1915,20 @@ std::string BpTree::find(const int key)
 			else {
 				current = 0;
 			}
+			if (current != 0) {
+				current->prefetch(keyBytes);
+			}
 		}
 		if (current != 0 && current->getNodeType() == NODE_TYPE_LEAF) {
 			int index = current->getKeyIndex(key);
 			if (index != -1)
 			{
 				LeafNode * temp = static_cast<LeafNode*>(current);
-				return temp->getValue(index);
+				value = temp->getValue(index);
+				if (this->cache != 0) {
+					this->cache->put(key, value);
+				}
+				return value;
 			}
 			else
 			{
@@ -692,6 +1943,341 @@ std::string BpTree::find(const int key)
 	return errorMessage;
 }
 
+/* Constants used for the step a lookup of findBatch() takes next */
+#define BATCH_SEARCH			0	//search the keys of the node (prefetched by the previous step)
+#define BATCH_CHILD				1	//follow the child pointer picked by the search (prefetched by it)
+#define BATCH_VALUE				2	//copy the value out of the DataNode (prefetched by the previous step)
+
+/* The state of one lookup of findBatch() between its steps */
+struct BatchLookup {
+	Node * node; //the node the lookup is at (0 for an idle slot)
+	size_t position; //the index of the lookup's key in the batch
+	int index; //the child (or pair) picked by the last search
+	int stage; //the BATCH_ constant of the next step
+};
+
+/* Name: findBatch
+ * Params:
+ *	const std::vector<int>& keys - the keys to look up
+ *	std::vector<std::string>& values - set to the value of each key, in the same order ("" for
+ *		keys that are not in the tree, as find() returns)
+ *	const int groupSize - the number of lookups run at once (1 runs them one after another)
+ * Description:
+ *	Looks up many keys, overlapping their cache misses. A descent of a tree much larger than
+ *	the cache spends most of its time waiting for the next node to arrive from memory, so
+ *	instead of following one key down at a time, groupSize lookups take turns: each step of
+ *	a lookup does the work on data prefetched by its previous step, prefetches what it needs
+ *	next (the slot of the child pointer it picked, the child's header and keys, or the
+ *	DataNode of its value) and yields to the next lookup of the group, by which time that
+ *	lookup's data has usually arrived. A slot whose lookup finishes starts the next key. The
+ *	steps are a hand-written state machine (BatchLookup) instead of coroutines, which the
+ *	C++11 build does not have. The key filter, the lookup cache and the replicas are used as
+ *	by find().
+ *	Must not race with a write to the tree.
+ * Returns: the number of keys found
+ */
+int BpTree::findBatch(const std::vector<int>& keys, std::vector<std::string>& values, const int groupSize)
+{
+	values.assign(keys.size(), std::string());
+	if (this->head == 0) {
+		return 0;
+	}
+	size_t keyBytes = NODE_CACHE_LINE + this->maxNodes * sizeof(int);
+	Node * head = this->getDescentHead();
+	std::vector<BatchLookup> group(groupSize > 1 ? groupSize : 1);
+	size_t next = 0;
+	int found = 0;
+	//starts the next key that the filter and the cache do not settle in a slot
+	auto start = [&](BatchLookup& lookup) -> bool {
+		while (next < keys.size()) {
+			size_t position = next++;
+			if (!this->filterMayContain(keys[position])) {
+				continue;
+			}
+			if (this->cache != 0 && this->cache->get(keys[position], values[position])) {
+				found += 1;
+				continue;
+			}
+			METRICS_ADD(METRIC_DESCENTS, 1);
+			lookup.node = head;
+			lookup.position = position;
+			lookup.stage = BATCH_SEARCH;
+			head->prefetch(keyBytes);
+			return true;
+		}
+		lookup.node = 0;
+		return false;
+	};
+	size_t active = 0;
+	for (size_t i = 0; i < group.size(); i++) {
+		active += start(group[i]) ? 1 : 0;
+	}
+	while (active > 0) {
+		for (size_t i = 0; i < group.size(); i++) {
+			BatchLookup& lookup = group[i];
+			if (lookup.node == 0) {
+				continue;
+			}
+			int key = keys[lookup.position];
+			bool done = false;
+			if (lookup.stage == BATCH_SEARCH) {
+				if (lookup.node->getNodeType() == NODE_TYPE_INTERIOR) {
+					METRICS_ADD(METRIC_NODES_VISITED, 1);
+					lookup.index = static_cast<InteriorNode*>(lookup.node)->findChildIndex(key);
+				} else {
+					lookup.index = lookup.node->getKeyIndex(key);
+				}
+				if (lookup.index < 0) {
+					done = true;
+				} else {
+					lookup.node->prefetchChild(lookup.index);
+					lookup.stage = BATCH_CHILD;
+				}
+			} else if (lookup.stage == BATCH_CHILD) {
+				bool leaf = lookup.node->getNodeType() == NODE_TYPE_LEAF;
+				lookup.node = lookup.node->getChild(lookup.index);
+				if (lookup.node == 0) {
+					done = true;
+				} else {
+					lookup.node->prefetch(leaf ? sizeof(DataNode) : keyBytes);
+					lookup.stage = leaf ? BATCH_VALUE : BATCH_SEARCH;
+				}
+			} else {
+				values[lookup.position] = static_cast<DataNode*>(lookup.node)->value;
+				if (this->cache != 0) {
+					this->cache->put(key, values[lookup.position]);
+				}
+				found += 1;
+				done = true;
+			}
+			if (done && !start(lookup)) {
+				active -= 1;
+			}
+		}
+	}
+	return found;
+}
+
+/* Name: lowerBound
+ * Params:
+ *	int key - the key to search from
+ *	int& foundKey - receives the key that was found
+ *	std::string& value - receives the value stored on the key that was found
+ * Description:
+ *	Finds the smallest key in the tree that is greater than or equal to key.
+ * Returns: true if such a key exists, false otherwise
+ */
+bool BpTree::lowerBound(const int key, int& foundKey, std::string& value)
+{
+	return this->findAbove(key, true, foundKey, value);
+}
+
+/* Name: upperBound
+ * Params:
+ *	int key - the key to search from
+ *	int& foundKey - receives the key that was found
+ *	std::string& value - receives the value stored on the key that was found
+ * Description:
+ *	Finds the smallest key in the tree that is strictly greater than key.
+ * Returns: true if such a key exists, false otherwise
+ */
+bool BpTree::upperBound(const int key, int& foundKey, std::string& value)
+{
+	return this->findAbove(key, false, foundKey, value);
+}
+
+/* Name: ceiling
+ * Params:
+ *	int key - the key to search from
+ *	int& foundKey - receives the key that was found
+ *	std::string& value - receives the value stored on the key that was found
+ * Description:
+ *	Finds the smallest key in the tree that is greater than or equal to key (the same as
+ *	lowerBound()).
+ * Returns: true if such a key exists, false otherwise
+ */
+bool BpTree::ceiling(const int key, int& foundKey, std::string& value)
+{
+	return this->findAbove(key, true, foundKey, value);
+}
+
+/* Name: floor
+ * Params:
+ *	int key - the key to search from
+ *	int& foundKey - receives the key that was found
+ *	std::string& value - receives the value stored on the key that was found
+ * Description:
+ *	Finds the greatest key in the tree that is less than or equal to key. The leaf for the key
+ *	is found with a single descent; if none of its keys are small enough, the search continues
+ *	in the leaves to its left (see findNextLeaf()).
+ * Returns: true if such a key exists, false otherwise
+ */
+bool BpTree::floor(const int key, int& foundKey, std::string& value)
+{
+	std::vector<Node*> path;
+	for (Node * current = this->findLeaf(key, path); current != 0; current = findNextLeaf(path, true)) {
+		for (int i = current->getNumKeys() - 1; i >= 0; i--) {
+			if (current->getKey(i) <= key) {
+				foundKey = current->getKey(i);
+				value = static_cast<LeafNode*>(current)->getValue(i);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* Name: first
+ * Params:
+ *	int& foundKey - receives the smallest key of the tree
+ *	std::string& value - receives the value stored on the smallest key
+ * Description:
+ *	Finds the smallest key in the tree.
+ * Returns: true if the tree is not empty, false otherwise
+ */
+bool BpTree::first(int& foundKey, std::string& value)
+{
+	return this->findAbove(INT_MIN, true, foundKey, value);
+}
+
+/* Name: last
+ * Params:
+ *	int& foundKey - receives the greatest key of the tree
+ *	std::string& value - receives the value stored on the greatest key
+ * Description:
+ *	Finds the greatest key in the tree.
+ * Returns: true if the tree is not empty, false otherwise
+ */
+bool BpTree::last(int& foundKey, std::string& value)
+{
+	return this->floor(INT_MAX, foundKey, value);
+}
+
+/* Name: count
+ * Params:
+ *	int lo - the lowest key to count
+ *	int hi - the highest key to count
+ * Description:
+ *	Counts the keys with lo <= key <= hi using the subtree counts of the interior nodes, so
+ *	only the paths to the leaves of lo and hi are walked rather than the leaves in between.
+ * Returns: the number of keys in the range
+ */
+int BpTree::count(const int lo, const int hi)
+{
+	if (lo > hi) {
+		return 0;
+	}
+	return this->countBelow(hi, true) - this->countBelow(lo, false);
+}
+
+/* Name: rank
+ * Params:
+ *	int key - the key to rank
+ * Description:
+ *	Finds the position that the key has (or would have) in key order, using the subtree
+ *	counts of the interior nodes on the way down to its leaf.
+ * Returns: the number of keys in the tree that are less than key
+ */
+int BpTree::rank(const int key)
+{
+	return this->countBelow(key, false);
+}
+
+/* Name: select
+ * Params:
+ *	int index - the position of the key to find in key order (0 for the least key)
+ *	int& foundKey - receives the key at the position
+ *	std::string& value - receives the value stored on the key
+ * Description:
+ *	Finds the key at a position in key order. At each interior node the subtree counts of
+ *	the children are skipped over until the child that holds the position is reached.
+ * Returns: true if the tree holds more than index keys, false otherwise
+ */
+bool BpTree::select(const int index, int& foundKey, std::string& value)
+{
+	if (index < 0) {
+		return false;
+	}
+	int remaining = index;
+	Node * current = this->head;
+	while (current != 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
+		InteriorNode * interiorNode = static_cast<InteriorNode*>(current);
+		int child = 0;
+		while (child < interiorNode->getNumChildren() - 1 && remaining >= interiorNode->getCount(child)) {
+			remaining -= interiorNode->getCount(child);
+			child += 1;
+		}
+		current = interiorNode->getChild(child);
+	}
+	if (current == 0 || remaining >= current->getNumKeys()) {
+		return false;
+	}
+	foundKey = current->getKey(remaining);
+	value = static_cast<LeafNode*>(current)->getValue(remaining);
+	return true;
+}
+
+/* Name: countBelow
+ * Params:
+ *	int key - the key to count up to
+ *	bool inclusive - whether key itself is counted
+ * Description:
+ *	Walks down to the leaf for the key, adding up the subtree counts of the children to the
+ *	left of the path, and then counts the keys below key in the leaf.
+ * Returns: the number of keys less than key (or less than or equal to key if inclusive)
+ */
+int BpTree::countBelow(const int key, const bool inclusive)
+{
+	int below = 0;
+	Node * current = this->head;
+	METRICS_ADD(METRIC_DESCENTS, 1);
+	while (current != 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
+		METRICS_ADD(METRIC_NODES_VISITED, 1);
+		InteriorNode * interiorNode = static_cast<InteriorNode*>(current);
+		Node * next = interiorNode->findNextNode(key);
+		for (int i = 0; i < interiorNode->getNumChildren() && interiorNode->getChild(i) != next; i++) {
+			below += interiorNode->getCount(i);
+		}
+		current = next;
+	}
+	if (current != 0) {
+		for (int i = 0; i < current->getNumKeys(); i++) {
+			if (current->getKey(i) < key || (inclusive && current->getKey(i) == key)) {
+				below += 1;
+			}
+		}
+	}
+	return below;
+}
+
+/* Name: findAbove
+ * Params:
+ *	int key - the key to search from
+ *	bool inclusive - whether key itself counts as a match
+ *	int& foundKey - receives the key that was found
+ *	std::string& value - receives the value stored on the key that was found
+ * Description:
+ *	Finds the smallest key that is greater than (or equal to, if inclusive) key. The leaf for
+ *	the key is found with a single descent; if none of its keys match, the search continues
+ *	in the leaves to its right (see findNextLeaf()).
+ * Returns: true if such a key exists, false otherwise
+ */
+bool BpTree::findAbove(const int key, const bool inclusive, int& foundKey, std::string& value)
+{
+	std::vector<Node*> path;
+	for (Node * current = this->findLeaf(key, path); current != 0; current = findNextLeaf(path, false)) {
+		for (int i = 0; i < current->getNumKeys(); i++) {
+			int currentKey = current->getKey(i);
+			if (currentKey > key || (inclusive && currentKey == key)) {
+				foundKey = currentKey;
+				value = static_cast<LeafNode*>(current)->getValue(i);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
 /* Name: printKeys
  * Params:
  *	None
@@ -738,55 +2324,228 @@ void BpTree::printKeys()
 	}
 }
 
-/* Name: printValues
+/* Name: validate
  * Params:
  *	None
- * Author: Joshua Campbell
  * Description:
- *	Prints the string values stored in the tree from the lowest key value to the highest key value.
- * Returns: None 
+ *	Checks the structure of the tree (see validate(std::string&)).
+ * Returns: true if the tree is well formed, false otherwise
  */
-void BpTree::printValues()
+bool BpTree::validate()
 {
-	Node* current = this->head;
-	if (current != 0) {
-		while (current != 0 && current->getNumChildren() > 0 && current->getNodeType() == NODE_TYPE_INTERIOR) {
-			current = current->getChild(0);
+	std::string problem;
+	return this->validate(problem);
+}
+
+/* Name: validate
+ * Params:
+ *	std::string& problem - receives a description of the first problem found
+ * Description:
+ *	Checks every invariant the operations of the tree rely on, for testing changes to the
+ *	split, redistribution and coalesce code:
+ *	- the keys of every node are in strictly increasing order
+ *	- every key of a child lies between the separator keys around it in its parent
+ *	  (child i holds the keys from keys[i - 1] up to but not including keys[i])
+ *	- interior nodes have one more child than keys, and every node other than the head is at
+ *	  least half full: leaves hold (maxKeys + 1) / 2 to maxKeys keys and interior nodes hold
+ *	  (maxKeys + 1) / 2 to maxKeys + 1 children (the head needs at least 2 if it is interior)
+ *	- all leaves are on the same level
+ *	- the subtree counts of the interior nodes match the number of keys below them
+ *	- the replicas (see setReplicas()) match the top interior levels and lead to the tree's
+ *	  own nodes below them
+ *	- every key of the tree passes the key filter (see setFilter()), and every pair in the
+ *	  lookup cache (see setCache()) is in the tree with the same value
+ *	It visits every node, so it is meant for tests rather than for use between operations.
+ * Returns: true if the tree is well formed, false otherwise
+ */
+bool BpTree::validate(std::string& problem)
+{
+	problem = "";
+	if (this->head == 0) {
+		return true;
+	}
+	int height = 0;
+	for (Node * node = this->head; node->getNodeType() == NODE_TYPE_INTERIOR && node->getNumChildren() > 0; node = node->getChild(0)) {
+		height++;
+	}
+	if (this->validateSubtree(this->head, LONG_MIN, LONG_MAX, height, problem) < 0) {
+		return false;
+	}
+	return this->validateReplicas(problem) && this->validateLookups(problem);
+}
+
+/* Name: validateLookups
+ * Params:
+ *	std::string& problem - receives a description of the first problem found
+ * Description:
+ *	Checks for validate() that the key filter has no false negatives and that the lookup
+ *	cache holds no value the tree no longer has, since find() trusts both without looking
+ *	at the tree.
+ * Returns: true if the filter and the cache agree with the tree, false otherwise
+ */
+bool BpTree::validateLookups(std::string& problem)
+{
+	if (this->keyFilter != 0) {
+		std::vector<Node*> path;
+		for (Node * leaf = this->findLeaf(INT_MIN, path); leaf != 0; leaf = findNextLeaf(path, false)) {
+			for (int i = 0; i < leaf->getNumKeys(); i++) {
+				if (!this->keyFilter->filter->mayContain(leaf->getKey(i))) {
+					problem = "key " + std::to_string(leaf->getKey(i)) + " is missing from the key filter";
+					return false;
+				}
+			}
 		}
-		while (current != 0 && current->getNodeType() == NODE_TYPE_LEAF) {
-			for (int i = 0; i < current->getNumKeys(); i++) {
-				std::cout << static_cast<LeafNode*>(current)->getValue(i) << std::endl;
+	}
+	if (this->cache != 0) {
+		std::vector<std::pair<int, std::string> > entries;
+		this->cache->getEntries(entries);
+		for (size_t i = 0; i < entries.size(); i++) {
+			Node * leaf = this->findLeaf(entries[i].first);
+			int index = leaf != 0 ? leaf->getKeyIndex(entries[i].first) : -1;
+			if (index == -1 || static_cast<LeafNode*>(leaf)->getValue(index) != entries[i].second) {
+				problem = "the lookup cache holds a stale value for key " + std::to_string(entries[i].first);
+				return false;
 			}
-			current = current->getChild(current->getMaxKeys());
-			if (current == 0) {
-				break;
+		}
+	}
+	return true;
+}
+
+/* Name: validateReplicas
+ * Params:
+ *	std::string& problem - receives a description of the first problem found
+ * Description:
+ *	Checks for validate() that every replica has the keys and children of the interior nodes
+ *	it copies, and that its lowest copied level points at the tree's own nodes.
+ * Returns: true if the replicas match the tree, false otherwise
+ */
+bool BpTree::validateReplicas(std::string& problem)
+{
+	for (size_t r = 0; r < this->replicas.size(); r++) {
+		std::vector<Node*> copies(1, this->replicas[r]);
+		std::vector<Node*> originals(1, this->head);
+		for (int level = 1; !copies.empty(); level++) {
+			std::vector<Node*> nextCopies;
+			std::vector<Node*> nextOriginals;
+			for (size_t i = 0; i < copies.size(); i++) {
+				Node * copy = copies[i];
+				Node * original = originals[i];
+				bool same = copy != original && copy->getNumKeys() == original->getNumKeys() &&
+					copy->getNumChildren() == original->getNumChildren();
+				for (int k = 0; same && k < copy->getNumKeys(); k++) {
+					same = copy->getKey(k) == original->getKey(k);
+				}
+				for (int k = 0; same && k < copy->getNumChildren(); k++) {
+					Node * child = original->getChild(k);
+					if (level < this->replicaLevels && child->getNodeType() == NODE_TYPE_INTERIOR) {
+						nextCopies.push_back(copy->getChild(k));
+						nextOriginals.push_back(child);
+					}
+					else {
+						same = copy->getChild(k) == child;
+					}
+				}
+				if (!same) {
+					problem = "replica " + std::to_string(r) + " differs from the tree on level " + std::to_string(level);
+					return false;
+				}
 			}
+			copies.swap(nextCopies);
+			originals.swap(nextOriginals);
 		}
 	}
+	return true;
 }
 
-/* Name: updateInteriorNodeKeys
+/* Name: validateSubtree
  * Params:
- *	Node* node - starting node from where to update its keys and its childrens keys
- * Author: Joshua Campbell
+ *	Node* node - the root of the subtree to check
+ *	const long low - the smallest key the subtree may hold (LONG_MIN for no limit)
+ *	const long high - the key the subtree's keys must be below (LONG_MAX for no limit)
+ *	const int depth - the number of interior levels expected below and including node
+ *	std::string& problem - receives a description of the first problem found
  * Description:
- *	Updates the keys of all interior nodes from a starting node so that they can be used to find
- *  the lowest key value of the leftmost child leaf. It does not update the leaf nodes' keys or 
- *  their direct parent node's keys.
- * Returns: None
+ *	Checks the invariants of one subtree for validate().
+ * Returns: the number of keys in the subtree, -1 if a problem was found
  */
-void BpTree::updateInteriorNodeKeys(Node* node) {
-	for (int i = 0; i < node->getNumChildren(); i++) {
+int BpTree::validateSubtree(Node* node, const long low, const long high, const int depth, std::string& problem)
+{
+	bool isHead = node == this->head;
+	int numKeys = node->getNumKeys();
+	std::string where = (node->getNodeType() == NODE_TYPE_LEAF ? "leaf" : "interior node") + std::string(" starting with key ") +
+		std::to_string(node->getKey(0));
+	if (node->getMaxKeys() != this->maxNodes) {
+		problem = "the " + where + " has the wrong capacity";
+		return -1;
+	}
+	for (int i = 0; i < numKeys; i++) {
+		if (node->getKey(i) < low || node->getKey(i) >= high) {
+			problem = "the " + where + " holds key " + std::to_string(node->getKey(i)) + " outside of its parent's separators";
+			return -1;
+		}
+		if (i > 0 && node->getKey(i) <= node->getKey(i - 1)) {
+			problem = "the keys of the " + where + " are out of order";
+			return -1;
+		}
+	}
+	if (node->getNodeType() == NODE_TYPE_LEAF) {
+		if (depth != 0) {
+			problem = "the " + where + " is not on the bottom level";
+			return -1;
+		}
+		if (node->getNumChildren() != numKeys || numKeys > this->maxNodes || (!isHead && numKeys < (this->maxNodes + 1) / 2)) {
+			problem = "the " + where + " holds " + std::to_string(numKeys) + " keys";
+			return -1;
+		}
+		return numKeys;
+	}
+	if (node->getNodeType() != NODE_TYPE_INTERIOR || depth == 0) {
+		problem = "the " + where + " is not a leaf but is on the bottom level";
+		return -1;
+	}
+	InteriorNode * interiorNode = static_cast<InteriorNode*>(node);
+	int numChildren = node->getNumChildren();
+	if (numChildren != numKeys + 1 || numChildren > this->maxNodes + 1 || numChildren < (isHead ? 2 : (this->maxNodes + 1) / 2)) {
+		problem = "the " + where + " has " + std::to_string(numKeys) + " keys and " + std::to_string(numChildren) + " children";
+		return -1;
+	}
+	int count = 0;
+	for (int i = 0; i < numChildren; i++) {
 		Node * child = node->getChild(i);
-		if (child != 0 && child->getNodeType() == NODE_TYPE_INTERIOR && child->getNumChildren() > 0 && child->getChild(0)->getNodeType() == NODE_TYPE_INTERIOR) {
-			this->updateInteriorNodeKeys(child);
-			for (int k = 1; k < child->getNumChildren(); k++) {
-				int lowestLeafKeyValue = static_cast<InteriorNode*>(child->getChild(k))->findLeastLeafKey();
-				child->setKey(k - 1, lowestLeafKeyValue);
-			}
+		if (child == 0) {
+			problem = "child " + std::to_string(i) + " of the " + where + " is missing";
+			return -1;
 		}
-		else {
-			return;
+		long childLow = i > 0 ? node->getKey(i - 1) : low;
+		long childHigh = i < numKeys ? node->getKey(i) : high;
+		int childCount = this->validateSubtree(child, childLow, childHigh, depth - 1, problem);
+		if (childCount < 0) {
+			return -1;
+		}
+		if (interiorNode->getCount(i) != childCount) {
+			problem = "the subtree count of child " + std::to_string(i) + " of the " + where + " is " +
+				std::to_string(interiorNode->getCount(i)) + " instead of " + std::to_string(childCount);
+			return -1;
+		}
+		count += childCount;
+	}
+	return count;
+}
+
+/* Name: printValues
+ * Params:
+ *	None
+ * Author: Joshua Campbell
+ * Description:
+ *	Prints the string values stored in the tree from the lowest key value to the highest key value.
+ * Returns: None 
+ */
+void BpTree::printValues()
+{
+	std::vector<Node*> path;
+	for (Node * current = this->findLeaf(INT_MIN, path); current != 0; current = findNextLeaf(path, false)) {
+		for (int i = 0; i < current->getNumKeys(); i++) {
+			std::cout << static_cast<LeafNode*>(current)->getValue(i) << std::endl;
 		}
 	}
 }
@@ -3,40 +3,288 @@
 
 #include <string>
 #include <fstream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <utility>
 #include "Node.h"
+#include "BloomFilter.h"
+#include "LookupCache.h"
+#include "Metrics.h"
+#include "NodeArena.h"
+
+/* Key filter of a tree (see BpTree::setFilter()). Trees created through the copy constructor
+ * or the overloaded = operator share it with the tree they were copied from, and both add the
+ * keys they insert to it: a key one of them added only shows up as a false positive in the
+ * other. A tree that rebuilds its filter drops its reference and gets a filter of its own. */
+struct SharedFilter {
+	SharedFilter(BloomFilter* filter) : references(1), filter(filter) {}
+	~SharedFilter() { delete filter; }
+	std::atomic<int> references; //the number of trees currently sharing the filter
+	BloomFilter * filter; //filter of the keys of the trees sharing it
+};
 
 class BpTree {
 public:
 	//Constructor
 	BpTree(const int);
 	BpTree(const BpTree&);
+	BpTree(BpTree&&);
 
 	//Destructor
 	~BpTree();
 	
 	//Public Methods
 	bool insert(const int, const std::string);
+	int insertBatch(const std::vector<std::pair<int, std::string> >&, const int);
+	bool upsert(const int, const std::string);
+	bool update(const int, const std::string);
+	template <typename Function>
+	bool modify(const int, Function);
 	bool remove(const int);
+	int removeRange(const int, const int);
 	std::string find(const int);
+	int findBatch(const std::vector<int>&, std::vector<std::string>&, const int);
+	bool lowerBound(const int, int&, std::string&);
+	bool upperBound(const int, int&, std::string&);
+	bool floor(const int, int&, std::string&);
+	bool ceiling(const int, int&, std::string&);
+	bool first(int&, std::string&);
+	bool last(int&, std::string&);
+	int count(const int, const int);
+	int rank(const int);
+	bool select(const int, int&, std::string&);
+	void setFilter(const int);
+	size_t getFilterBytes();
+	void setCache(const size_t, const int);
+	size_t getCacheHits();
+	size_t getCacheMisses();
+	void setScanPrefetch(const int);
+	void setNodePlacement(const int, const int);
+	void setReplicas(const int);
+	bool hasReplicas();
+	static MetricsSnapshot metrics();
+	static void resetMetrics();
 	void printKeys();
 	void printValues();
+	bool validate();
+	bool validate(std::string&);
+	template <typename Visit>
+	int scan(const int, const int, Visit);
+	template <typename Visit>
+	int scanBackward(const int, const int, Visit);
+	template <typename Result, typename Map, typename Reduce>
+	Result scanParallel(const int, const int, const Result&, Map, Reduce, const int);
+	BpTree clone(const int);
+	void swap(BpTree&);
+	void clear();
+	void clear(const int);
+	std::thread clearInBackground(const int);
 
 	//Overloaded Operators
 	BpTree& operator=(const BpTree&);
+	BpTree& operator=(BpTree&&);
 private:
 	//Private Methods
-	bool insertWithParentFull(Node*, Node**, const int, const std::string);
+	bool insertIntoPath(std::vector<Node*>&, const int, const std::string, const size_t);
+	int insertIntoSubtree(Node*, const int, const std::vector<std::pair<int, std::string> >&, size_t, size_t,
+		std::vector<std::pair<int, std::string> >&);
+	static void sortPairs(std::vector<std::pair<int, std::string> >&, const int);
+	static void updateCounts(const std::vector<Node*>&, const size_t);
+	int countBelow(const int, const bool);
 	bool findKey(const int);
-	void removeOrCoalesceInteriorNodes(Node*);
-	void updateInteriorNodeKeys(Node*);
-	Node * findLeafNodeNeighbour(Node*);
+	Node * findLeaf(const int);
+	Node * findLeaf(const int, std::vector<Node*>&);
+	static Node * findNextLeaf(std::vector<Node*>&, const bool);
+	bool findAbove(const int, const bool, int&, std::string&);
+	void findScanPartitions(const int, const int, const int, std::vector<int>&);
+	int validateSubtree(Node*, const long, const long, const int, std::string&);
+	bool validateReplicas(std::string&);
+	bool validateLookups(std::string&);
+	void repairPaths(const int, const int);
+	void joinChildren(Node*, const int);
+	bool balanceLeaves(Node*, Node*);
+	static bool balanceInteriorNodes(Node*, Node*, const int, int&);
+	Node * getWritableHead();
+	Node * getWritableChild(Node*, const int);
+	Node * findWritablePath(const int, std::vector<Node*>&);
+	Node * extendWritablePath(const int, std::vector<Node*>&);
+	static Node * copyNode(Node*);
+	void releaseNodes();
+	void releaseFilter();
+	bool filterMayContain(const int);
+	void addToFilter(const int);
+	void trimFilter();
+	void rebuildFilter();
+	void prefetchLeaves(const std::vector<Node*>&, const bool, const bool);
+	static Node * copySubtree(Node*);
+	static void releaseSubtree(Node*, const int);
+	Node * getDescentHead();
+	static Node * copyInteriorLevels(Node*, const int);
+	static void deleteInteriorLevels(Node*, const int);
+	void dropReplicas();
 	
 	//Private Data
 	int maxNodes; //maximum number of keys/nodes(for leaves) that can be stored in a node
-	Node * head; //the head node of the tree
-	bool isACopy; //flag to ensure that trees created through the overloaded = operator or
-				  //the copy constructor do not delete head nodes that may have already been
-				  //deleted (due to being shallow copies).
+	Node * head; //the head node of the tree (nodes below it may be shared with snapshots, see getWritableChild())
+	SharedFilter * keyFilter; //filter of the keys checked before lookups, shared with snapshots (0 for no filter)
+	int filterBitsPerKey; //bits per key of the key filter checked before lookups (0 for no filter)
+	LookupCache * cache; //cache of recently found values checked by find() (0 for no cache)
+	int scanPrefetchDistance; //how many leaves ahead of a scan are prefetched (0 for none)
+	int leafPlacement; //the NUMA node (or NODE_PLACEMENT_ constant) new leaves are placed on
+	int interiorPlacement; //the NUMA node (or NODE_PLACEMENT_ constant) new interior nodes are placed on
+	std::vector<Node*> replicas; //copies of the top interior levels, one per NUMA node (empty for none)
+	int replicaLevels; //the number of interior levels copied into each replica
 };
 
+/* Name: modify
+ * Params:
+ *	const int key - the key whose value is modified
+ *	Function function - called as function(std::string& value) to change the value in place
+ * Description:
+ *	Read-modify-write of the value stored on a key. The leaf holding the key is found with a
+ *	single descent and the value is changed where it is stored; the tree's structure is not
+ *	touched (the nodes on the way are copied first if a snapshot shares them, see
+ *	getWritableChild()).
+ * Returns: true if the key was found (and the function was called), false otherwise
+ */
+template <typename Function>
+bool BpTree::modify(const int key, Function function)
+{
+	NodePlacementScope placement(this->leafPlacement, this->interiorPlacement);
+	std::vector<Node*> path;
+	Node * leaf = this->findWritablePath(key, path);
+	int index = leaf != 0 ? leaf->getKeyIndex(key) : -1;
+	if (index == -1) {
+		return false;
+	}
+	if (this->cache != 0) {
+		this->cache->erase(key);
+	}
+	function(static_cast<LeafNode*>(leaf)->getValueReference(index));
+	return true;
+}
+
+/* Name: scan
+ * Params:
+ *	const int lo - the lowest key of the scan (where the scan starts)
+ *	const int hi - the highest key of the scan
+ *	Visit visit - called as visit(int key, const std::string& value) for every pair in range,
+ *		from the lowest key up; the scan stops early when it returns false
+ * Description:
+ *	Visits the key/value pairs with lo <= key <= hi in ascending key order: one descent to the
+ *	leaf for lo, then from leaf to leaf along the path of the descent (see findNextLeaf()),
+ *	prefetching the leaves ahead (see setScanPrefetch()). The forward counterpart of
+ *	scanBackward().
+ * Returns: the number of pairs that were visited
+ */
+template <typename Visit>
+int BpTree::scan(const int lo, const int hi, Visit visit)
+{
+	int visited = 0;
+	std::vector<Node*> path;
+	bool starting = true;
+	for (Node * leaf = this->findLeaf(lo, path); leaf != 0; leaf = findNextLeaf(path, false), starting = false) {
+		this->prefetchLeaves(path, false, starting);
+		for (int i = 0; i < leaf->getNumKeys(); i++) {
+			int key = leaf->getKey(i);
+			if (key > hi) {
+				return visited;
+			}
+			if (key >= lo) {
+				visited += 1;
+				if (!visit(key, static_cast<LeafNode*>(leaf)->getValueReference(i))) {
+					return visited;
+				}
+			}
+		}
+	}
+	return visited;
+}
+
+/* Name: scanBackward
+ * Params:
+ *	const int hi - the highest key of the scan (where the scan starts)
+ *	const int lo - the lowest key of the scan
+ *	Visit visit - called as visit(int key, const std::string& value) for every pair in range,
+ *		from the highest key down; the scan stops early when it returns false
+ * Description:
+ *	Visits the key/value pairs with lo <= key <= hi in descending key order. The leaf for hi is
+ *	found with a single descent and the scan then moves to the leaf on the left along the path
+ *	of the descent (see findNextLeaf()), so reading the latest N pairs costs one descent plus
+ *	N pairs. Leaves further to the left are prefetched while the current one is visited (see
+ *	setScanPrefetch()).
+ * Returns: the number of pairs that were visited
+ */
+template <typename Visit>
+int BpTree::scanBackward(const int hi, const int lo, Visit visit)
+{
+	int visited = 0;
+	std::vector<Node*> path;
+	bool starting = true;
+	for (Node * leaf = this->findLeaf(hi, path); leaf != 0; leaf = findNextLeaf(path, true), starting = false) {
+		this->prefetchLeaves(path, true, starting);
+		for (int i = leaf->getNumKeys() - 1; i >= 0; i--) {
+			int key = leaf->getKey(i);
+			if (key < lo) {
+				return visited;
+			}
+			if (key <= hi) {
+				visited += 1;
+				if (!visit(key, static_cast<LeafNode*>(leaf)->getValueReference(i))) {
+					return visited;
+				}
+			}
+		}
+	}
+	return visited;
+}
+
+/* Name: scanParallel
+ * Params:
+ *	const int lo - the lowest key of the scan
+ *	const int hi - the highest key of the scan
+ *	const Result& initial - the starting value of every thread's partial result
+ *	Map map - called as map(Result& partial, int key, const std::string& value) for every pair in range
+ *	Reduce reduce - called as reduce(Result& result, const Result& partial) to combine partial results
+ *	const int numThreads - the number of threads scanning the leaves
+ * Description:
+ *	Visits every key/value pair with lo <= key <= hi without copying any of them. The range is
+ *	split into runs of keys using the keys of the interior nodes (see findScanPartitions()),
+ *	each thread scans its run (see scan()) folding the pairs into its own partial result with
+ *	map, and the partial results are combined in key order with reduce. For example, counting
+ *	the pairs in a range:
+ *		tree.scanParallel(lo, hi, 0L, [](long& n, int, const std::string&) { n++; },
+ *			[](long& n, const long& partial) { n += partial; }, 16);
+ *	The tree must not be modified during the scan (scan a snapshot instead).
+ * Returns: the combined result of all of the threads
+ */
+template <typename Result, typename Map, typename Reduce>
+Result BpTree::scanParallel(const int lo, const int hi, const Result& initial, Map map, Reduce reduce, const int numThreads)
+{
+	std::vector<int> starts;
+	this->findScanPartitions(lo, hi, numThreads < 1 ? 1 : numThreads, starts);
+	int numParts = (int)starts.size();
+	std::vector<Result> partials(numParts, initial);
+	std::vector<std::thread> workers;
+	for (int part = 0; part < numParts; part++) {
+		workers.push_back(std::thread([this, &starts, &partials, &map, hi, numParts, part]() {
+			Result & partial = partials[part];
+			int end = part + 1 < numParts ? starts[part + 1] - 1 : hi;
+			this->scan(starts[part], end, [&map, &partial](int key, const std::string& value) {
+				map(partial, key, value);
+				return true;
+			});
+		}));
+	}
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	Result result = initial;
+	for (int part = 0; part < numParts; part++) {
+		reduce(result, partials[part]);
+	}
+	return result;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,278 @@
+#include "IoRing.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Name: Constructor
+ * Params:
+ *	const int depth - the maximum number of reads in flight
+ *	const bool useUring - false to use the pread() fallback even where io_uring is available
+ * Description:
+ *	Sets up an io_uring with room for depth reads, or the pread() fallback if io_uring is
+ *	not wanted or cannot be set up (see getEngine()).
+ */
+IoRing::IoRing(const int depth, const bool useUring)
+{
+	this->ringFd = -1;
+	this->depth = depth > 0 ? depth : 1;
+	this->inFlight = 0;
+	this->queued = 0;
+	this->sqRing = 0;
+	this->sqRingSize = 0;
+	this->cqRing = 0;
+	this->cqRingSize = 0;
+	this->sqes = 0;
+	this->sqesSize = 0;
+	if (useUring && !this->setup(this->depth)) {
+		this->teardown();
+	}
+}
+
+/* Name: Destructor
+ * Params:
+ *	None
+ * Description:
+ *	Tears down the io_uring. Reads still in flight must have been collected first.
+ */
+IoRing::~IoRing()
+{
+	this->teardown();
+}
+
+/* Name: teardown
+ * Params:
+ *	None
+ * Description:
+ *	Unmaps the queues and closes the io_uring, leaving the pread() fallback in use.
+ * Returns: None
+ */
+void IoRing::teardown()
+{
+	if (this->sqes != 0) {
+		munmap(this->sqes, this->sqesSize);
+		this->sqes = 0;
+	}
+	if (this->cqRing != 0 && this->cqRing != this->sqRing) {
+		munmap(this->cqRing, this->cqRingSize);
+	}
+	this->cqRing = 0;
+	if (this->sqRing != 0) {
+		munmap(this->sqRing, this->sqRingSize);
+		this->sqRing = 0;
+	}
+	if (this->ringFd >= 0) {
+		close(this->ringFd);
+		this->ringFd = -1;
+	}
+}
+
+/* Name: setup
+ * Params:
+ *	const unsigned entries - the size of the submission queue
+ * Description:
+ *	Creates an io_uring and maps its queues, as liburing's io_uring_queue_init() does.
+ * Returns: true if the io_uring is ready, false otherwise
+ */
+bool IoRing::setup(const unsigned entries)
+{
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	this->ringFd = syscall(__NR_io_uring_setup, entries, &params);
+	if (this->ringFd < 0) {
+		return false;
+	}
+	this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	this->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		this->sqRingSize = this->cqRingSize = std::max(this->sqRingSize, this->cqRingSize);
+	}
+	this->sqRing = mmap(0, this->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQ_RING);
+	if (this->sqRing == MAP_FAILED) {
+		this->sqRing = 0;
+		return false;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		this->cqRing = this->sqRing;
+	} else {
+		this->cqRing = mmap(0, this->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_CQ_RING);
+		if (this->cqRing == MAP_FAILED) {
+			this->cqRing = 0;
+			return false;
+		}
+	}
+	this->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	this->sqes = mmap(0, this->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQES);
+	if (this->sqes == MAP_FAILED) {
+		this->sqes = 0;
+		return false;
+	}
+	char * sq = (char *)this->sqRing;
+	char * cq = (char *)this->cqRing;
+	this->sqHead = (unsigned *)(sq + params.sq_off.head);
+	this->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	this->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	this->sqArray = (unsigned *)(sq + params.sq_off.array);
+	this->cqHead = (unsigned *)(cq + params.cq_off.head);
+	this->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	this->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	this->cqes = cq + params.cq_off.cqes;
+	//the submission queue may be larger than asked for; the depth stays as asked
+	return true;
+}
+
+/* Name: read
+ * Params:
+ *	const int fd - the file to read from
+ *	const uint64_t offset - where to read from in the file
+ *	void* buffer - where to read to (aligned to 4096 bytes for a file opened with O_DIRECT)
+ *	const size_t length - the number of bytes to read
+ *	const uint64_t tag - handed back by complete() when the read finishes
+ * Description:
+ *	Queues a read. With io_uring it is only submitted by the next complete(); with the
+ *	fallback it is done right away.
+ * Returns: true if the read was queued, false if depth reads are already in flight
+ */
+bool IoRing::read(const int fd, const uint64_t offset, void* buffer, const size_t length, const uint64_t tag)
+{
+	if (this->inFlight >= this->depth) {
+		return false;
+	}
+	this->inFlight += 1;
+	if (this->ringFd < 0) {
+		ssize_t result = pread(fd, buffer, length, offset);
+		this->finished.push_back(std::make_pair(tag, result < 0 ? -(long)errno : (long)result));
+		return true;
+	}
+	unsigned tail = *this->sqTail;
+	unsigned index = tail & *this->sqMask;
+	struct io_uring_sqe * sqe = (struct io_uring_sqe *)this->sqes + index;
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = length;
+	sqe->user_data = tag;
+	this->sqArray[index] = index;
+	//the kernel must see the entry before it sees the new tail
+	__atomic_store_n(this->sqTail, tail + 1, __ATOMIC_RELEASE);
+	this->queued += 1;
+	return true;
+}
+
+/* Name: submit
+ * Params:
+ *	const bool wait - true to wait until at least one read has finished
+ * Description:
+ *	Hands the queued reads to the kernel with one io_uring_enter() call. If the kernel refuses
+ *	because the completion queue is full (EBUSY), the reads stay queued: complete() goes on to
+ *	collect the finished reads, which makes room, and the next complete() submits them. If it
+ *	refuses for lack of resources (EAGAIN), the call is retried after yielding the CPU, up to
+ *	IO_SUBMIT_ATTEMPTS times in a row, instead of spinning until the kernel recovers.
+ * Returns: true if the call succeeded (or was put off by EBUSY), false otherwise
+ */
+bool IoRing::submit(const bool wait)
+{
+	int attempts = 0;
+	while (true) {
+		long result = syscall(__NR_io_uring_enter, this->ringFd, this->queued, wait ? 1 : 0,
+			wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+		if (result >= 0) {
+			this->queued -= result;
+			return true;
+		}
+		if (errno == EBUSY) {
+			return true;
+		}
+		if (errno == EAGAIN) {
+			attempts += 1;
+			if (attempts >= IO_SUBMIT_ATTEMPTS) {
+				return false;
+			}
+			sched_yield();
+		}
+		else if (errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+/* Name: complete
+ * Params:
+ *	std::vector<std::pair<uint64_t, long> >& completions - the tags of the reads that finished
+ *		are appended, each with the number of bytes read or a negative errno value
+ *	const bool wait - true to wait until at least one read has finished (if any is in flight)
+ * Description:
+ *	Submits the queued reads and collects the reads that have finished. Reads the kernel
+ *	cannot take while its completion queue is full stay queued for the next call (see submit()).
+ * Returns: the number of reads collected (0 if the submission failed)
+ */
+int IoRing::complete(std::vector<std::pair<uint64_t, long> >& completions, const bool wait)
+{
+	if (this->ringFd < 0) {
+		int collected = this->finished.size();
+		completions.insert(completions.end(), this->finished.begin(), this->finished.end());
+		this->finished.clear();
+		this->inFlight -= collected;
+		return collected;
+	}
+	unsigned head = *this->cqHead;
+	bool empty = head == __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+	if (this->queued > 0 || (wait && empty && this->inFlight > 0)) {
+		if (!this->submit(wait && empty && this->inFlight > 0)) {
+			return 0;
+		}
+	}
+	int collected = 0;
+	unsigned tail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe * cqe = (struct io_uring_cqe *)this->cqes + (head & *this->cqMask);
+		completions.push_back(std::make_pair((uint64_t)cqe->user_data, (long)cqe->res));
+		collected += 1;
+	}
+	//the kernel may reuse the entries once it sees the new head
+	__atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+	this->inFlight -= collected;
+	return collected;
+}
+
+/* Name: getEngine
+ * Params:
+ *	None
+ * Description:
+ *	Tells which engine performs the reads.
+ * Returns: IO_ENGINE_URING or IO_ENGINE_PREAD
+ */
+int IoRing::getEngine()
+{
+	return this->ringFd >= 0 ? IO_ENGINE_URING : IO_ENGINE_PREAD;
+}
+
+/* Name: getDepth
+ * Params:
+ *	None
+ * Description:
+ *	Gets the maximum number of reads in flight.
+ * Returns: the queue depth
+ */
+int IoRing::getDepth()
+{
+	return this->depth;
+}
+
+/* Name: getInFlight
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of reads queued or submitted that complete() has not collected yet.
+ * Returns: the number of reads in flight
+ */
+int IoRing::getInFlight()
+{
+	return this->inFlight;
+}
@@ -0,0 +1,62 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/* Constants used for the engine that performs the reads */
+#define IO_ENGINE_URING		0	//io_uring: reads are queued and submitted in batches, and complete asynchronously
+#define IO_ENGINE_PREAD		1	//fallback when io_uring is not available: each read is a blocking pread()
+
+/* Constant used for how many times in a row a submission may be refused for lack of kernel
+ * resources (EAGAIN) before it counts as failed */
+#define IO_SUBMIT_ATTEMPTS	4
+
+/* Queue of file reads that run asynchronously, on io_uring (set up through the raw system
+ * calls, so no liburing is needed). read() only queues a read; complete() submits every queued
+ * read with one system call and collects the reads that finished, so one thread can keep up
+ * to the queue depth reads in flight. Where io_uring cannot be set up (old kernels, seccomp
+ * filters) the same interface is served by blocking pread() calls. Not safe for concurrent
+ * use. Cannot be copied, as it owns the ring's file descriptor and mappings. */
+class IoRing {
+public:
+	IoRing(const int, const bool);
+	~IoRing();
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+
+	bool read(const int, const uint64_t, void*, const size_t, const uint64_t);
+	int complete(std::vector<std::pair<uint64_t, long> >&, const bool);
+
+	int getEngine();
+	int getDepth();
+	int getInFlight();
+private:
+	bool setup(const unsigned);
+	void teardown();
+	bool submit(const bool);
+
+	int ringFd; //the io_uring (-1 for the pread() fallback)
+	int depth; //the maximum number of reads in flight
+	int inFlight; //reads queued or submitted that have not been collected
+	unsigned queued; //reads queued since the last submission
+	void * sqRing; //the mapping of the submission queue ring
+	size_t sqRingSize;
+	void * cqRing; //the mapping of the completion queue ring (the same as sqRing on kernels with IORING_FEAT_SINGLE_MMAP)
+	size_t cqRingSize;
+	void * sqes; //the mapping of the submission queue entries
+	size_t sqesSize;
+	unsigned * sqHead;
+	unsigned * sqTail;
+	unsigned * sqMask;
+	unsigned * sqArray;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned * cqMask;
+	void * cqes; //the completion queue entries (in cqRing)
+	std::vector<std::pair<uint64_t, long> > finished; //reads done by the pread() fallback, not collected yet
+};
+
+#endif
@@ -0,0 +1,401 @@
+#include "LookupCache.h"
+
+/* Name: LookupCache Constructor
+ * Params:
+ *	size_t capacity - the maximum size of the cache in bytes
+ *	int numShards - the number of independently locked shards (more shards let more threads
+ *		use the cache at once)
+ * Description:
+ *	Creates an empty cache. The capacity is divided evenly between the shards.
+ */
+LookupCache::LookupCache(size_t capacity, int numShards)
+{
+	this->numShards = numShards > 0 ? numShards : 1;
+	this->shardCapacity = capacity / this->numShards;
+	this->shards = new Shard[this->numShards];
+	for (int i = 0; i < this->numShards; i++) {
+		this->shards[i].numEntries = 0;
+		this->shards[i].hand = 0;
+		this->shards[i].bytes = 0;
+		this->shards[i].hits = 0;
+		this->shards[i].misses = 0;
+	}
+}
+
+/* Name: LookupCache Destructor
+ * Description:
+ *	Destroys the cache and all of its entries.
+ */
+LookupCache::~LookupCache()
+{
+	delete[] this->shards;
+	this->shards = 0;
+}
+
+/* Name: findShard
+ * Params:
+ *	int key - a key
+ * Description:
+ *	Picks the shard that holds the key. The key is hashed first so that runs of neighbouring
+ *	keys are spread over all of the shards.
+ * Returns: the shard for the key
+ */
+LookupCache::Shard& LookupCache::findShard(int key)
+{
+	unsigned int h = (unsigned int)key * 0x9e3779b1u;
+	return this->shards[(h >> 16) % (unsigned int)this->numShards];
+}
+
+/* Name: findSlot
+ * Params:
+ *	Shard& shard - the shard to search (its lock must be held)
+ *	int key - the key to look for
+ * Description:
+ *	Probes the shard's table from the key's home slot until it finds the key or an empty slot.
+ *	The home slot is taken from different bits of the key's hash than the shard was.
+ * Returns: the slot holding the key, or the empty slot where it would be added
+ */
+size_t LookupCache::findSlot(Shard& shard, int key)
+{
+	size_t mask = shard.slots.size() - 1;
+	size_t slot = ((unsigned int)key * 0x85ebca6bu) & mask;
+	while (shard.slots[slot].used && shard.slots[slot].key != key) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+/* Name: entryBytes
+ * Params:
+ *	const std::string& value - the value of an entry
+ * Description:
+ *	Estimates the memory used by an entry: the value and two slots of the table (the table
+ *	is kept at most half full).
+ * Returns: the size of the entry in bytes
+ */
+size_t LookupCache::entryBytes(const std::string& value)
+{
+	return value.size() + 2 * sizeof(Entry);
+}
+
+/* Name: get
+ * Params:
+ *	int key - the key to look up
+ *	std::string& value - receives the cached value
+ * Description:
+ *	Looks the key up in its shard, marking the entry as referenced on a hit, and counts the
+ *	hit or miss.
+ * Returns: true if the key was in the cache, false otherwise
+ */
+bool LookupCache::get(int key, std::string& value)
+{
+	Shard& shard = this->findShard(key);
+	std::lock_guard<std::mutex> guard(shard.lock);
+	if (shard.numEntries == 0) {
+		shard.misses += 1;
+		return false;
+	}
+	Entry& entry = shard.slots[findSlot(shard, key)];
+	if (!entry.used) {
+		shard.misses += 1;
+		return false;
+	}
+	entry.referenced = true;
+	value = entry.value;
+	shard.hits += 1;
+	return true;
+}
+
+/* Name: put
+ * Params:
+ *	int key - the key to cache
+ *	const std::string& value - the value stored on the key
+ * Description:
+ *	Adds a key/value pair to the cache (or replaces the cached value of the key), evicting
+ *	entries from the shard until the pair fits. Values too large for a shard are not cached.
+ * Returns: None
+ */
+void LookupCache::put(int key, const std::string& value)
+{
+	size_t bytes = entryBytes(value);
+	Shard& shard = this->findShard(key);
+	std::lock_guard<std::mutex> guard(shard.lock);
+	if (shard.numEntries > 0) {
+		size_t slot = findSlot(shard, key);
+		if (shard.slots[slot].used) {
+			eraseEntry(shard, slot);
+		}
+	}
+	if (bytes > this->shardCapacity) {
+		return;
+	}
+	this->evict(shard, bytes);
+	if ((shard.numEntries + 1) * 2 > shard.slots.size()) {
+		growTable(shard);
+	}
+	Entry& entry = shard.slots[findSlot(shard, key)];
+	entry.key = key;
+	entry.used = true;
+	entry.referenced = false;
+	entry.value = value;
+	shard.numEntries += 1;
+	shard.bytes += bytes;
+}
+
+/* Name: evict
+ * Params:
+ *	Shard& shard - the shard to make room in (its lock must be held)
+ *	size_t bytes - the number of bytes needed
+ * Description:
+ *	Moves the clock hand around the shard's slots, evicting entries that were not
+ *	referenced since the hand last passed them, until bytes more fit in the shard.
+ * Returns: None
+ */
+void LookupCache::evict(Shard& shard, size_t bytes)
+{
+	while (shard.bytes + bytes > this->shardCapacity && shard.numEntries > 0) {
+		if (shard.hand >= shard.slots.size()) {
+			shard.hand = 0;
+		}
+		Entry& entry = shard.slots[shard.hand];
+		if (entry.used && entry.referenced) {
+			entry.referenced = false;
+			shard.hand += 1;
+		}
+		else if (entry.used) {
+			//another entry may be shifted into the slot, so the hand stays to look at it
+			eraseEntry(shard, shard.hand);
+		}
+		else {
+			shard.hand += 1;
+		}
+	}
+}
+
+/* Name: growTable
+ * Params:
+ *	Shard& shard - the shard whose table is full (its lock must be held)
+ * Description:
+ *	Doubles the number of slots of the shard's table and adds the entries back in.
+ * Returns: None
+ */
+void LookupCache::growTable(Shard& shard)
+{
+	std::vector<Entry> oldSlots;
+	oldSlots.swap(shard.slots);
+	shard.slots.resize(oldSlots.empty() ? 16 : oldSlots.size() * 2);
+	for (size_t i = 0; i < shard.slots.size(); i++) {
+		shard.slots[i].used = false;
+		shard.slots[i].referenced = false;
+	}
+	for (size_t i = 0; i < oldSlots.size(); i++) {
+		if (oldSlots[i].used) {
+			Entry& entry = shard.slots[findSlot(shard, oldSlots[i].key)];
+			entry.key = oldSlots[i].key;
+			entry.used = true;
+			entry.referenced = oldSlots[i].referenced;
+			entry.value.swap(oldSlots[i].value);
+		}
+	}
+	shard.hand = 0;
+}
+
+/* Name: eraseEntry
+ * Params:
+ *	Shard& shard - the shard holding the entry (its lock must be held)
+ *	size_t slot - the slot of the entry
+ * Description:
+ *	Removes an entry from the shard. The entries after it in the same probe run are shifted
+ *	back so that no lookup stops early at the emptied slot.
+ * Returns: None
+ */
+void LookupCache::eraseEntry(Shard& shard, size_t slot)
+{
+	size_t mask = shard.slots.size() - 1;
+	shard.bytes -= entryBytes(shard.slots[slot].value);
+	shard.numEntries -= 1;
+	size_t empty = slot;
+	for (size_t next = (empty + 1) & mask; shard.slots[next].used; next = (next + 1) & mask) {
+		size_t home = ((unsigned int)shard.slots[next].key * 0x85ebca6bu) & mask;
+		//the entry can move back unless its home slot lies after the empty slot (cyclically)
+		bool movable = empty <= next ? (home <= empty || home > next) : (home <= empty && home > next);
+		if (movable) {
+			Entry& target = shard.slots[empty];
+			target.key = shard.slots[next].key;
+			target.referenced = shard.slots[next].referenced;
+			target.value.swap(shard.slots[next].value);
+			empty = next;
+		}
+	}
+	shard.slots[empty].used = false;
+	shard.slots[empty].referenced = false;
+	std::string().swap(shard.slots[empty].value);
+}
+
+/* Name: erase
+ * Params:
+ *	int key - the key to remove from the cache
+ * Description:
+ *	Removes the key from the cache if it is cached. Used when the key's value changes or
+ *	the key is removed from the tree.
+ * Returns: None
+ */
+void LookupCache::erase(int key)
+{
+	Shard& shard = this->findShard(key);
+	std::lock_guard<std::mutex> guard(shard.lock);
+	if (shard.numEntries > 0) {
+		size_t slot = findSlot(shard, key);
+		if (shard.slots[slot].used) {
+			eraseEntry(shard, slot);
+		}
+	}
+}
+
+/* Name: eraseRange
+ * Params:
+ *	int lo - the lowest key to remove
+ *	int hi - the highest key to remove
+ * Description:
+ *	Removes every cached key with lo <= key <= hi. The slots of every shard are checked,
+ *	so the cost is linear in the size of the cache rather than the size of the range. The
+ *	keys in range are collected before any is erased, so the scan never has to follow the
+ *	entries that erasing shifts back (around the end of the table, too).
+ * Returns: None
+ */
+void LookupCache::eraseRange(int lo, int hi)
+{
+	std::vector<int> keys;
+	for (int i = 0; i < this->numShards; i++) {
+		Shard& shard = this->shards[i];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		keys.clear();
+		for (size_t k = 0; k < shard.slots.size(); k++) {
+			if (shard.slots[k].used && shard.slots[k].key >= lo && shard.slots[k].key <= hi) {
+				keys.push_back(shard.slots[k].key);
+			}
+		}
+		for (size_t k = 0; k < keys.size(); k++) {
+			size_t slot = findSlot(shard, keys[k]);
+			if (shard.slots[slot].used) {
+				eraseEntry(shard, slot);
+			}
+		}
+	}
+}
+
+/* Name: clear
+ * Params:
+ *	None
+ * Description:
+ *	Removes every entry from the cache. The hit and miss counters are kept.
+ * Returns: None
+ */
+void LookupCache::clear()
+{
+	for (int i = 0; i < this->numShards; i++) {
+		Shard& shard = this->shards[i];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		std::vector<Entry>().swap(shard.slots);
+		shard.numEntries = 0;
+		shard.hand = 0;
+		shard.bytes = 0;
+	}
+}
+
+/* Name: getCapacity
+ * Params:
+ *	None
+ * Description:
+ *	Returns the maximum size of the cache.
+ * Returns: the capacity of the cache in bytes
+ */
+size_t LookupCache::getCapacity() const
+{
+	return this->shardCapacity * this->numShards;
+}
+
+/* Name: getNumShards
+ * Params:
+ *	None
+ * Description:
+ *	Returns the number of shards the cache is split into.
+ * Returns: the number of shards
+ */
+int LookupCache::getNumShards() const
+{
+	return this->numShards;
+}
+
+/* Name: getBytes
+ * Params:
+ *	None
+ * Description:
+ *	Adds up the size of the entries of every shard.
+ * Returns: the current size of the cache in bytes
+ */
+size_t LookupCache::getBytes()
+{
+	size_t bytes = 0;
+	for (int i = 0; i < this->numShards; i++) {
+		std::lock_guard<std::mutex> guard(this->shards[i].lock);
+		bytes += this->shards[i].bytes;
+	}
+	return bytes;
+}
+
+/* Name: getHits
+ * Params:
+ *	None
+ * Description:
+ *	Adds up the hit counters of every shard.
+ * Returns: the number of lookups that found their key in the cache
+ */
+size_t LookupCache::getHits()
+{
+	size_t hits = 0;
+	for (int i = 0; i < this->numShards; i++) {
+		std::lock_guard<std::mutex> guard(this->shards[i].lock);
+		hits += this->shards[i].hits;
+	}
+	return hits;
+}
+
+/* Name: getMisses
+ * Params:
+ *	None
+ * Description:
+ *	Adds up the miss counters of every shard.
+ * Returns: the number of lookups that did not find their key in the cache
+ */
+size_t LookupCache::getMisses()
+{
+	size_t misses = 0;
+	for (int i = 0; i < this->numShards; i++) {
+		std::lock_guard<std::mutex> guard(this->shards[i].lock);
+		misses += this->shards[i].misses;
+	}
+	return misses;
+}
+
+/* Name: getEntries
+ * Params:
+ *	std::vector<std::pair<int, std::string> >& entries - receives the key/value pair of every entry
+ * Description:
+ *	Copies out every entry of the cache, locking one shard at a time, for checking the cache
+ *	against the tree (see BpTree::validate()). The entries are in no particular order.
+ * Returns: None
+ */
+void LookupCache::getEntries(std::vector<std::pair<int, std::string> >& entries)
+{
+	entries.clear();
+	for (int i = 0; i < this->numShards; i++) {
+		Shard& shard = this->shards[i];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		for (size_t slot = 0; slot < shard.slots.size(); slot++) {
+			if (shard.slots[slot].used) {
+				entries.push_back(std::make_pair(shard.slots[slot].key, shard.slots[slot].value));
+			}
+		}
+	}
+}
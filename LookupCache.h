@@ -0,0 +1,63 @@
+#ifndef LOOKUPCACHE_H
+#define LOOKUPCACHE_H
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Bounded cache of key/value pairs, split into shards that each have their own lock so that
+ * lookups from different threads rarely wait on each other. The entries of a shard are kept
+ * in an open addressing table, so a lookup usually touches a single slot. Each shard evicts
+ * with the CLOCK algorithm: a hit marks its entry as referenced, and the eviction hand skips
+ * (and unmarks) referenced entries, so keys that keep being read stay in the cache. The size of the cache
+ * is given in bytes and covers the values plus an estimate of the per-entry overhead. */
+class LookupCache {
+public:
+	LookupCache(size_t, int);
+	~LookupCache();
+
+	bool get(int, std::string&);
+	void put(int, const std::string&);
+	void erase(int);
+	void eraseRange(int, int);
+	void clear();
+
+	size_t getCapacity() const;
+	int getNumShards() const;
+	size_t getBytes();
+	size_t getHits();
+	size_t getMisses();
+	void getEntries(std::vector<std::pair<int, std::string> >&);
+private:
+	struct Entry {
+		int key;
+		bool used; //false for empty slots
+		bool referenced; //set on every hit, cleared as the clock hand passes
+		std::string value;
+	};
+	struct Shard {
+		std::mutex lock;
+		std::vector<Entry> slots; //open addressing table of entries (linear probing, power of two size)
+		size_t numEntries; //the number of used slots
+		size_t hand; //the slot the clock hand points at
+		size_t bytes; //the size of the entries in the shard
+		size_t hits;
+		size_t misses;
+		char padding[64]; //keeps neighbouring shards' locks and counters off the same cache line
+	};
+
+	Shard& findShard(int);
+	static size_t findSlot(Shard&, int);
+	static size_t entryBytes(const std::string&);
+	void evict(Shard&, size_t);
+	static void growTable(Shard&);
+	static void eraseEntry(Shard&, size_t);
+
+	Shard * shards; //the shards of the cache (allocated array (dynamic memory))
+	int numShards; //the number of shards
+	size_t shardCapacity; //the maximum size of the entries of a shard in bytes
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "Metrics.h"
+#include <mutex>
+
+std::atomic<bool> Metrics::latencyTracking(false);
+std::atomic<TraceHook> Metrics::traceHook(0);
+std::atomic<void*> Metrics::traceArgument(0);
+
+static const char* metricNames[NUM_METRICS] = { "descents", "nodesVisited", "leafSplits", "interiorSplits",
+	"cascadeSplits", "redistributions", "coalesces", "nodeCopies" };
+static const char* operationNames[NUM_OPERATIONS] = { "insert", "find", "remove", "update" };
+
+/* The counts of the threads that are alive, the totals of those that have exited, and the
+ * totals at the last reset (subtracted from every snapshot). It is never deleted, so threads
+ * that exit while the program is shutting down can still fold their counts into it. */
+struct MetricsRegistry {
+	std::mutex lock;
+	Metrics::ThreadCounts * threads; //the first in the list of live threads
+	MetricsSnapshot retired;
+	MetricsSnapshot baseline;
+};
+
+/* Name: registry
+ * Params:
+ *	None
+ * Description:
+ *	Finds the registry of thread counts, creating it on first use.
+ * Returns: the registry
+ */
+static MetricsRegistry& registry()
+{
+	static MetricsRegistry * instance = new MetricsRegistry();
+	return *instance;
+}
+
+/* Name: ThreadCounts Constructor
+ * Description:
+ *	Creates zeroed counts for the calling thread and adds them to the list of live threads.
+ */
+Metrics::ThreadCounts::ThreadCounts()
+{
+	for (int i = 0; i < NUM_METRICS; i++) {
+		this->counters[i].store(0, std::memory_order_relaxed);
+	}
+	for (int i = 0; i < MAX_SPLIT_DEPTH; i++) {
+		this->splitDepths[i].store(0, std::memory_order_relaxed);
+	}
+	this->maxSplitDepth.store(0, std::memory_order_relaxed);
+	for (int op = 0; op < NUM_OPERATIONS; op++) {
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			this->latencies[op][i].store(0, std::memory_order_relaxed);
+		}
+	}
+	this->splitDepth = 0;
+	MetricsRegistry& metrics = registry();
+	std::lock_guard<std::mutex> guard(metrics.lock);
+	this->next = metrics.threads;
+	metrics.threads = this;
+}
+
+/* Name: ThreadCounts Destructor
+ * Description:
+ *	Called when the thread exits: adds its counts to the totals of the exited threads and
+ *	removes them from the list of live threads.
+ */
+Metrics::ThreadCounts::~ThreadCounts()
+{
+	MetricsRegistry& metrics = registry();
+	std::lock_guard<std::mutex> guard(metrics.lock);
+	MetricsSnapshot& retired = metrics.retired;
+	for (int i = 0; i < NUM_METRICS; i++) {
+		retired.counters[i] += this->counters[i].load(std::memory_order_relaxed);
+	}
+	for (int i = 0; i < MAX_SPLIT_DEPTH; i++) {
+		retired.splitDepths[i] += this->splitDepths[i].load(std::memory_order_relaxed);
+	}
+	if (this->maxSplitDepth.load(std::memory_order_relaxed) > retired.maxSplitDepth) {
+		retired.maxSplitDepth = this->maxSplitDepth.load(std::memory_order_relaxed);
+	}
+	for (int op = 0; op < NUM_OPERATIONS; op++) {
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			retired.latencies[op][i] += this->latencies[op][i].load(std::memory_order_relaxed);
+		}
+	}
+	ThreadCounts ** link = &metrics.threads;
+	while (*link != 0 && *link != this) {
+		link = &(*link)->next;
+	}
+	if (*link == this) {
+		*link = this->next;
+	}
+}
+
+/* Name: snapshot
+ * Params:
+ *	None
+ * Description:
+ *	Adds up the counts of every live thread and of the threads that have exited. The counts of
+ *	threads that are still working are read while they change, so a snapshot taken during a
+ *	run is only consistent per counter.
+ * Returns: the totals since the start of the process or the last reset()
+ */
+MetricsSnapshot Metrics::snapshot()
+{
+	MetricsRegistry& metrics = registry();
+	std::lock_guard<std::mutex> guard(metrics.lock);
+	MetricsSnapshot total = metrics.retired;
+	for (ThreadCounts * counts = metrics.threads; counts != 0; counts = counts->next) {
+		for (int i = 0; i < NUM_METRICS; i++) {
+			total.counters[i] += counts->counters[i].load(std::memory_order_relaxed);
+		}
+		for (int i = 0; i < MAX_SPLIT_DEPTH; i++) {
+			total.splitDepths[i] += counts->splitDepths[i].load(std::memory_order_relaxed);
+		}
+		if (counts->maxSplitDepth.load(std::memory_order_relaxed) > total.maxSplitDepth) {
+			total.maxSplitDepth = counts->maxSplitDepth.load(std::memory_order_relaxed);
+		}
+		for (int op = 0; op < NUM_OPERATIONS; op++) {
+			for (int i = 0; i < LATENCY_BUCKETS; i++) {
+				total.latencies[op][i] += counts->latencies[op][i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+	for (int i = 0; i < NUM_METRICS; i++) {
+		total.counters[i] -= metrics.baseline.counters[i];
+	}
+	for (int i = 0; i < MAX_SPLIT_DEPTH; i++) {
+		total.splitDepths[i] -= metrics.baseline.splitDepths[i];
+	}
+	for (int op = 0; op < NUM_OPERATIONS; op++) {
+		total.operations[op] = 0;
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			total.latencies[op][i] -= metrics.baseline.latencies[op][i];
+			total.operations[op] += total.latencies[op][i];
+		}
+	}
+#ifdef BPTREE_METRICS
+	total.enabled = true;
+#else
+	total.enabled = false;
+#endif
+	return total;
+}
+
+/* Name: reset
+ * Params:
+ *	None
+ * Description:
+ *	Starts the counts over from zero. The threads' own counters are not written (only their
+ *	owners write them); the current totals are remembered and subtracted from later snapshots
+ *	instead. The maximum split depth, which cannot be subtracted, is cleared.
+ * Returns: None
+ */
+void Metrics::reset()
+{
+	MetricsSnapshot current = snapshot();
+	MetricsRegistry& metrics = registry();
+	std::lock_guard<std::mutex> guard(metrics.lock);
+	for (int i = 0; i < NUM_METRICS; i++) {
+		metrics.baseline.counters[i] += current.counters[i];
+	}
+	for (int i = 0; i < MAX_SPLIT_DEPTH; i++) {
+		metrics.baseline.splitDepths[i] += current.splitDepths[i];
+	}
+	for (int op = 0; op < NUM_OPERATIONS; op++) {
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			metrics.baseline.latencies[op][i] += current.latencies[op][i];
+		}
+	}
+	metrics.retired.maxSplitDepth = 0;
+	for (ThreadCounts * counts = metrics.threads; counts != 0; counts = counts->next) {
+		counts->maxSplitDepth.store(0, std::memory_order_relaxed);
+	}
+}
+
+/* Name: setLatencyTracking
+ * Params:
+ *	bool enabled - true to time every insert, find, remove and update
+ * Description:
+ *	Turns the latency histograms on or off. Timing an operation reads the clock twice, which
+ *	costs about as much as a find in a small tree, so it is off by default. It has no effect
+ *	unless the tree is built with BPTREE_METRICS.
+ * Returns: None
+ */
+void Metrics::setLatencyTracking(bool enabled)
+{
+	latencyTracking.store(enabled, std::memory_order_relaxed);
+}
+
+/* Name: setTraceHook
+ * Params:
+ *	TraceHook hook - called for every split, redistribution and coalesce (0 for none)
+ *	void* argument - passed to every call of the hook
+ * Description:
+ *	Sets the function that structural events are reported to as they happen, e.g. to log them
+ *	or to count them per key range. The hook is called on the thread that caused the event,
+ *	in the middle of the operation, so it must not use the tree. It has no effect unless the
+ *	tree is built with BPTREE_METRICS.
+ * Returns: None
+ */
+void Metrics::setTraceHook(TraceHook hook, void* argument)
+{
+	traceArgument.store(argument, std::memory_order_relaxed);
+	traceHook.store(hook, std::memory_order_release);
+}
+
+/* Name: trace
+ * Params:
+ *	int event - the METRIC_ constant of the event
+ *	int key - the key of the operation that caused it
+ * Description:
+ *	Reports a structural event to the trace hook, if one is set.
+ * Returns: None
+ */
+void Metrics::trace(int event, int key)
+{
+	TraceHook hook = traceHook.load(std::memory_order_acquire);
+	if (hook != 0) {
+		hook(event, key, traceArgument.load(std::memory_order_relaxed));
+	}
+}
+
+/* Name: countSplit
+ * Params:
+ *	int metric - METRIC_LEAF_SPLITS or METRIC_INTERIOR_SPLITS
+ *	int key - the key being inserted
+ * Description:
+ *	Counts and traces a node split of the insert in progress. Interior splits also add to the
+ *	depth of the insert's split cascade, recorded by endSplit().
+ * Returns: None
+ */
+void Metrics::countSplit(int metric, int key)
+{
+	ThreadCounts& counts = local();
+	bump(counts.counters[metric], 1);
+	if (metric == METRIC_INTERIOR_SPLITS) {
+		counts.splitDepth++;
+	}
+	trace(metric, key);
+}
+
+/* Name: endSplit
+ * Params:
+ *	None
+ * Description:
+ *	Called once an insert that split its leaf is done: records how many interior nodes the
+ *	split cascaded through (0 if only the leaf was split) and starts the next count.
+ * Returns: None
+ */
+void Metrics::endSplit()
+{
+	ThreadCounts& counts = local();
+	uint64_t depth = (uint64_t)counts.splitDepth;
+	counts.splitDepth = 0;
+	bump(counts.splitDepths[depth < MAX_SPLIT_DEPTH ? depth : MAX_SPLIT_DEPTH - 1], 1);
+	if (depth > counts.maxSplitDepth.load(std::memory_order_relaxed)) {
+		counts.maxSplitDepth.store(depth, std::memory_order_relaxed);
+	}
+}
+
+/* Name: recordLatency
+ * Params:
+ *	int operation - the OPERATION_ constant of the operation
+ *	uint64_t nanoseconds - how long it took
+ * Description:
+ *	Adds an operation's latency to the calling thread's histogram for the operation, in the
+ *	bucket of the power of two below it.
+ * Returns: None
+ */
+void Metrics::recordLatency(int operation, uint64_t nanoseconds)
+{
+	int bucket = 0;
+	while (nanoseconds > 1 && bucket < LATENCY_BUCKETS - 1) {
+		nanoseconds >>= 1;
+		bucket++;
+	}
+	bump(local().latencies[operation][bucket], 1);
+}
+
+/* Name: latencyPercentile
+ * Params:
+ *	int operation - the OPERATION_ constant of the operation
+ *	double fraction - the percentile as a fraction (0.99 for p99)
+ * Description:
+ *	Estimates a latency percentile of an operation from its histogram, as the middle of the
+ *	bucket the percentile falls in (so within a factor of 1.5 of the real value).
+ * Returns: the estimated latency in nanoseconds, 0 if no operations were timed
+ */
+double MetricsSnapshot::latencyPercentile(int operation, double fraction) const
+{
+	if (this->operations[operation] == 0) {
+		return 0;
+	}
+	double target = fraction * this->operations[operation];
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += this->latencies[operation][i];
+		if (seen > 0 && seen >= target) {
+			return i == 0 ? 1.0 : 1.5 * (double)(1ULL << i);
+		}
+	}
+	return 1.5 * (double)(1ULL << (LATENCY_BUCKETS - 1));
+}
+
+/* Name: metricName
+ * Params:
+ *	int metric - a METRIC_ constant
+ * Description:
+ *	Names a counter, for printing snapshots.
+ * Returns: the name of the counter
+ */
+const char* MetricsSnapshot::metricName(int metric)
+{
+	return metric >= 0 && metric < NUM_METRICS ? metricNames[metric] : "unknown";
+}
+
+/* Name: operationName
+ * Params:
+ *	int operation - an OPERATION_ constant
+ * Description:
+ *	Names an operation, for printing snapshots.
+ * Returns: the name of the operation
+ */
+const char* MetricsSnapshot::operationName(int operation)
+{
+	return operation >= 0 && operation < NUM_OPERATIONS ? operationNames[operation] : "unknown";
+}
@@ -0,0 +1,180 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/* Counters of the structural work done by the tree (descents, splits, redistributions, ...),
+ * for finding out why some operations are slow. They are only compiled in when BPTREE_METRICS
+ * is defined (cmake -DBPTREE_METRICS=ON); otherwise the METRICS_ macros below expand to
+ * nothing and cost nothing. Each thread counts into its own cache line without atomic
+ * read-modify-writes, and Metrics::snapshot() adds up the counts of every thread (including
+ * threads that have exited). The counters are process wide: they cover every tree. */
+
+/* Constants used for picking a counter */
+#define METRIC_DESCENTS				0	//walks from the head node down to a leaf
+#define METRIC_NODES_VISITED		1	//interior nodes passed through by those walks
+#define METRIC_LEAF_SPLITS			2
+#define METRIC_INTERIOR_SPLITS		3	//including cascading ones
+#define METRIC_CASCADE_SPLITS		4	//interior splits caused by the split of a child interior node
+#define METRIC_REDISTRIBUTIONS		5	//pairs or children moved to an underfull sibling
+#define METRIC_COALESCES			6	//underfull nodes merged into a sibling
+#define METRIC_NODE_COPIES			7	//nodes copied because a snapshot shared them (see BpTree::getWritableChild())
+#define NUM_METRICS					8
+
+/* Constants used for picking the operation of a latency histogram */
+#define OPERATION_INSERT			0
+#define OPERATION_FIND				1
+#define OPERATION_REMOVE			2
+#define OPERATION_UPDATE			3
+#define NUM_OPERATIONS				4
+
+/* Number of buckets of the histograms: split cascade depths 0 .. MAX_SPLIT_DEPTH - 1 (deeper
+ * cascades fall in the last bucket), and latencies in powers of two of nanoseconds */
+#define MAX_SPLIT_DEPTH				32
+#define LATENCY_BUCKETS				40
+
+/* Called for every structural event (the METRIC_ constant of the event and the key of the
+ * operation that caused it) while a trace hook is set */
+typedef void (*TraceHook)(int event, int key, void* argument);
+
+/* Point-in-time totals of the counters and histograms of every thread */
+struct MetricsSnapshot {
+	bool enabled; //false if the tree was built without BPTREE_METRICS (everything else is 0)
+	uint64_t counters[NUM_METRICS];
+	uint64_t splitDepths[MAX_SPLIT_DEPTH]; //inserts by the number of interior nodes their split cascaded through
+	uint64_t maxSplitDepth;
+	uint64_t latencies[NUM_OPERATIONS][LATENCY_BUCKETS]; //operations taking [2^i, 2^(i+1)) ns
+	uint64_t operations[NUM_OPERATIONS]; //timed operations
+
+	double latencyPercentile(int, double) const;
+	static const char* metricName(int);
+	static const char* operationName(int);
+};
+
+class Metrics {
+public:
+	static MetricsSnapshot snapshot();
+	static void reset();
+	static void setLatencyTracking(bool);
+	static bool isLatencyTracking();
+	static void setTraceHook(TraceHook, void*);
+
+	static void add(int, uint64_t);
+	static void trace(int, int);
+	static void countSplit(int, int);
+	static void endSplit();
+	static void recordLatency(int, uint64_t);
+private:
+	friend struct MetricsRegistry;
+
+	/* The counts of one thread. Only the owning thread writes them (relaxed load + store, no
+	 * locked instructions); snapshot() reads them from other threads. */
+	struct alignas(64) ThreadCounts {
+		ThreadCounts();
+		~ThreadCounts();
+		std::atomic<uint64_t> counters[NUM_METRICS];
+		std::atomic<uint64_t> splitDepths[MAX_SPLIT_DEPTH];
+		std::atomic<uint64_t> maxSplitDepth;
+		std::atomic<uint64_t> latencies[NUM_OPERATIONS][LATENCY_BUCKETS];
+		int splitDepth; //interior nodes split so far by the insert in progress
+		ThreadCounts * next; //the next thread in the list of live threads
+	};
+
+	static ThreadCounts& local();
+	static void bump(std::atomic<uint64_t>&, uint64_t);
+
+	static std::atomic<bool> latencyTracking;
+	static std::atomic<TraceHook> traceHook;
+	static std::atomic<void*> traceArgument;
+};
+
+/* Times an operation from construction to destruction while latency tracking is on */
+class MetricsTimer {
+public:
+	explicit MetricsTimer(int operation) : operation(operation), timing(Metrics::isLatencyTracking()) {
+		if (this->timing) {
+			this->start = std::chrono::steady_clock::now();
+		}
+	}
+	~MetricsTimer() {
+		if (this->timing) {
+			std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - this->start;
+			Metrics::recordLatency(this->operation, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+		}
+	}
+private:
+	int operation;
+	bool timing;
+	std::chrono::steady_clock::time_point start;
+};
+
+/* Name: local
+ * Params:
+ *	None
+ * Description:
+ *	Finds the calling thread's counts, registering them on the thread's first use.
+ * Returns: the counts of the calling thread
+ */
+inline Metrics::ThreadCounts& Metrics::local()
+{
+	static thread_local ThreadCounts counts;
+	return counts;
+}
+
+/* Name: bump
+ * Params:
+ *	std::atomic<uint64_t>& counter - a counter of the calling thread
+ *	uint64_t amount - the amount to add
+ * Description:
+ *	Adds to a counter that only the calling thread writes, so a plain load and store are
+ *	enough (no locked read-modify-write).
+ * Returns: None
+ */
+inline void Metrics::bump(std::atomic<uint64_t>& counter, uint64_t amount)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/* Name: add
+ * Params:
+ *	int metric - the METRIC_ constant of the counter
+ *	uint64_t amount - the amount to add
+ * Description:
+ *	Adds to one of the calling thread's counters.
+ * Returns: None
+ */
+inline void Metrics::add(int metric, uint64_t amount)
+{
+	bump(local().counters[metric], amount);
+}
+
+/* Name: isLatencyTracking
+ * Params:
+ *	None
+ * Description:
+ *	Checks whether operations are being timed (see setLatencyTracking()).
+ * Returns: true if operations are timed, false otherwise
+ */
+inline bool Metrics::isLatencyTracking()
+{
+	return latencyTracking.load(std::memory_order_relaxed);
+}
+
+#ifdef BPTREE_METRICS
+#define METRICS_ADD(metric, amount)		Metrics::add(metric, amount)
+#define METRICS_EVENT(metric, key)		(Metrics::add(metric, 1), Metrics::trace(metric, key))
+#define METRICS_SPLIT(metric, key)		Metrics::countSplit(metric, key)
+#define METRICS_SPLIT_END()				Metrics::endSplit()
+#define METRICS_TIME(operation)			MetricsTimer metricsTimer(operation)
+#else
+#define METRICS_ADD(metric, amount)		((void)0)
+#define METRICS_EVENT(metric, key)		((void)0)
+#define METRICS_SPLIT(metric, key)		((void)0)
+#define METRICS_SPLIT_END()				((void)0)
+#define METRICS_TIME(operation)			((void)0)
+#endif
+
+#endif
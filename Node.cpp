@@ -1,4 +1,26 @@
 #include "Node.h"
+#include "NodeArena.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+//leaf and interior nodes keep all of their state in the Node part, which must fit in the
+//cache line in front of the keys
+static_assert(sizeof(LeafNode) == sizeof(Node) && sizeof(InteriorNode) == sizeof(Node), "nodes must not add members");
+static_assert(sizeof(Node) <= NODE_CACHE_LINE, "the node header must fit in a cache line");
+
+/* Name: roundUp
+ * Params:
+ *	size_t size - a size in bytes
+ *	size_t alignment - the alignment to round to
+ * Description:
+ *	Rounds a size up to the next multiple of the alignment.
+ * Returns: the rounded size
+ */
+static size_t roundUp(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
 
 /* Name: Node Constructor
  * Params:
@@ -9,13 +31,14 @@
  */
 Node::Node() {
 	this->numChildren = 0;
-	this->parent = 0;
 	this->children = 0;
+	this->counts = 0;
 
 	this->numKeys = 0;
 	this->maxKeys = 0;
 	this->keys = 0;
 	this->type = NODE_TYPE_NONE;
+	this->references = 1;
 }
 
 /* Name: Node Constructor
@@ -28,78 +51,120 @@ Node::Node() {
 Node::Node(int maxKeys) 
 {
 	this->numChildren = 0;
-	this->parent = 0;
 	this->children = 0;
+	this->counts = 0;
 	
 	this->numKeys = 0;
 	this->maxKeys = maxKeys;
-	this->keys = new int[maxKeys];
+	//the keys start on the cache line after the node (see Node::allocate)
+	this->keys = reinterpret_cast<int*>(reinterpret_cast<char*>(this) + roundUp(sizeof(Node), NODE_CACHE_LINE));
 	
 	this->type = NODE_TYPE_NONE;
+	this->references = 1;
 }
 
 /* Name: Node Destructor
  * Author: Joshua Campbell
  * Description:
- *	Destroys the Node freeing up any keys or children that were allocated.
+ *	Destroys the Node. Its key, child pointer and child count arrays live in the same block
+ *	as the node and are freed with it. The children themselves are not deleted (see
+ *	BpTree::releaseSubtree() for deleting a node with its children), so destroying a node never
+ *	recurses down the tree.
  */
 Node::~Node() {
-	if (this->keys != 0) {
-		delete[] this->keys;
-		this->keys = 0;
-	}
-	for (int i = 0; i < this->numChildren && this->children != 0; i++) {
-		Node * child = this->children[i];
-		if (child != 0) {
-			delete child;
-		}
+	this->keys = 0;
+	this->children = 0;
+	this->counts = 0;
+}
+
+/* Name: allocate
+ * Params:
+ *	int maxKeys - the maximum number of keys of the node
+ *	int type - the type of the node (leaf or interior)
+ * Description:
+ *	Allocates a cache line aligned block big enough for a node of the type and its key, child
+ *	pointer and child count arrays. The block comes from the NUMA node the calling thread
+ *	places nodes of the type on (see NodePlacementScope), or from the heap by default.
+ * Returns: the block (throws std::bad_alloc if there is no memory left)
+ */
+void* Node::allocate(int maxKeys, int type)
+{
+	size_t size = getAllocationSize(maxKeys, type);
+	void* block = NodeArena::allocate(size, NodeArena::getPlacement(type == NODE_TYPE_LEAF));
+	if (block == 0 && posix_memalign(&block, NODE_CACHE_LINE, size) != 0) {
+		throw std::bad_alloc();
 	}
-	
-	if (this->children != 0) {
-		delete[] this->children;
-		this->children = 0;
+	return block;
+}
+
+/* Name: operator delete (Node)
+ * Params:
+ *	void* block - the block of a destroyed node
+ * Description:
+ *	Frees the block of a leaf or interior node (see Node::allocate), giving it back to the
+ *	NUMA arena if it came from there.
+ * Returns: None
+ */
+void Node::operator delete(void* block)
+{
+	if (NodeArena::owns(block)) {
+		NodeArena::release(block);
+	} else {
+		free(block);
 	}
 }
 
-/* Name: findNeighbours (Node)
+/* Name: operator delete (Node)
  * Params:
- *	None
- * Author: Joshua Campbell
+ *	void* block - the block of a node whose constructor threw
+ *	int - unused
  * Description:
- *	Finds the nodes to the left and right of the current node (based on its position in its
- *	parents children array).
- * Returns: a pointer to the left and right neighbours of the node (based on its position in
- *			its parents children)
- */
-Node** Node::findNeighbours() {
-	bool found = false;
-	if (this->parent != 0) {
-		Node** neighbours = new Node*[2];
-		neighbours[0] = 0;
-		neighbours[1] = 0;
-		Node* parent = this->parent;
-		int identifier = this->keys[0];
-		for (int i = 0; i < parent->getNumKeys(); i++) {
-			int currentKey = parent->getKey(i);
-			if (identifier >= currentKey) {
-				if (i + 1 > 0) {
-					neighbours[0] = parent->getChild(i);
-					found = true;
-				}
-				if (i + 2 < parent->getNumChildren()) {
-					neighbours[1] = parent->getChild(i + 2);
-					found = true;
-				}
-			}
-		}
-		if (parent->getNumKeys() >= 1 && !found) {
-			neighbours[1] = parent->getChild(1);
-		}
-		return neighbours;
+ *	Frees the block of a leaf or interior node whose constructor threw.
+ * Returns: None
+ */
+void Node::operator delete(void* block, int)
+{
+	Node::operator delete(block);
+}
+
+/* Name: getAllocationSize
+ * Params:
+ *	int maxKeys - the maximum number of keys of a node
+ *	int type - the type of the node (leaf or interior)
+ * Description:
+ *	Works out the size of the block of a node: a cache line for the node, then the keys, then
+ *	the child pointers (maxKeys for a leaf, maxKeys + 1 for an interior node), then the
+ *	subtree counts of an interior node, rounded up to whole cache lines.
+ * Returns: the size of the node's block in bytes
+ */
+size_t Node::getAllocationSize(int maxKeys, int type)
+{
+	size_t size = roundUp(sizeof(Node), NODE_CACHE_LINE);
+	size += roundUp(maxKeys * sizeof(int), sizeof(Node*));
+	if (type == NODE_TYPE_INTERIOR) {
+		size += (maxKeys + 1) * sizeof(Node*) + (maxKeys + 1) * sizeof(int);
 	}
 	else {
-		return 0;
+		size += maxKeys * sizeof(Node*);
 	}
+	return roundUp(size, NODE_CACHE_LINE);
+}
+
+/* Name: getMaxKeysForSize
+ * Params:
+ *	size_t size - the size in bytes nodes should fit in (e.g. a few cache lines or a page)
+ * Description:
+ *	Finds the largest maximum number of keys for which both leaf and interior nodes fit in
+ *	the size, for picking the order of a tree from a cache line or page size.
+ * Returns: the largest number of keys that fits (never less than 3)
+ */
+int Node::getMaxKeysForSize(size_t size)
+{
+	int maxKeys = 3;
+	while (getAllocationSize(maxKeys + 1, NODE_TYPE_INTERIOR) <= size && getAllocationSize(maxKeys + 1, NODE_TYPE_LEAF) <= size) {
+		maxKeys += 1;
+	}
+	return maxKeys;
 }
 
 /* Name: findIdentifierKey
@@ -225,19 +290,6 @@ void Node::printKeys() {
 	std::cout << std::endl;
 }
 
-/* Name: getParent
- * Params:
- *	None
- * Author: Joshua Campbell
- * Description:
- *	Returns the parent of the current node.
- * Returns: a pointer to the parent of the current node
- */
-Node* Node::getParent()
-{
-	return this->parent;
-}
-
 /* Name: getKeyIndex
  * Params:
  *	int key - the key to get the index of
@@ -270,9 +322,6 @@ Node* Node::getChild(int child)
 	if (child >= 0 && child < this->numChildren) {
 		return this->children[child];
 	}
-	else if (this->getNodeType() == NODE_TYPE_LEAF && child == this->getMaxKeys()) {
-		return this->children[child];
-	}
 	else {
 		return 0;
 	}
@@ -301,11 +350,12 @@ int Node::getChildIndex(Node* child) {
  *	Node* child - the new child pointer for the specified index
  * Author: Joshua Campbell
  * Description:
- *	Sets the child pointer at the specified index to the new child node pointer
+ *	Sets the child pointer at the specified index to the new child node pointer. The child's
+ *	subtree count is left alone (see InteriorNode::updateCount()).
  * Returns: true if the child is set, false otherwise
  */
 bool Node::setChild(int index, Node* child) {
-	if (index >= 0 && index <= this->maxKeys) {
+	if (index >= 0 && index < (this->type == NODE_TYPE_INTERIOR ? this->maxKeys + 1 : this->maxKeys)) {
 		this->children[index] = child;
 		return true;
 	}
@@ -325,6 +375,9 @@ Node* Node::removeChild(int child)
 	Node* removedChild = this->children[child];
 	for (int i = child; i < this->numChildren - 1; i++) {
 		this->children[i] = this->children[i + 1];
+		if (this->counts != 0) {
+			this->counts[i] = this->counts[i + 1];
+		}
 	}
 	for (int i = numChildren; i < this->maxKeys; i++) {
 		this->children[i] = 0;
@@ -354,6 +407,9 @@ Node* Node::removeChild(Node* node)
 		Node* removedChild = this->children[index];
 		for (int i = index; i < this->numChildren - 1; i++) {
 			this->children[i] = this->children[i + 1];
+			if (this->counts != 0) {
+				this->counts[i] = this->counts[i + 1];
+			}
 		}
 		for (int i = numChildren; i < this->maxKeys; i++) {
 			this->children[i] = 0;
@@ -372,7 +428,7 @@ Node* Node::removeChild(Node* node)
  * Author: Joshua Campbell
  * Description:
  *	Removes and deletes the child from the specified index, shifts all children to the 
- *	right of that index.
+ *	right of that index. The children of the deleted child are not deleted.
  * Returns: None
  */
 void Node::deleteChild(int child)
@@ -381,6 +437,9 @@ void Node::deleteChild(int child)
 	this->children[child] = 0;
 	for (int i = child; i < this->numChildren - 1; i++) {
 		this->children[i] = this->children[i + 1];
+		if (this->counts != 0) {
+			this->counts[i] = this->counts[i + 1];
+		}
 	}
 	for (int i = numChildren; i < this->maxKeys; i++) {
 		this->children[i] = 0;
@@ -394,6 +453,7 @@ void Node::deleteChild(int child)
  * Author: Joshua Campbell
  * Description:
  *	Removes and deletes the child that shares the same pointer as the specified node pointer.
+ *	The children of the deleted child are not deleted.
  * Returns: 0
  */
 Node* Node::deleteChild(Node* node)
@@ -410,6 +470,9 @@ Node* Node::deleteChild(Node* node)
 		this->children[index] = 0;
 		for (int i = index; i < this->numChildren - 1; i++) {
 			this->children[i] = this->children[i + 1];
+			if (this->counts != 0) {
+				this->counts[i] = this->counts[i + 1];
+			}
 		}
 		for (int i = numChildren; i < this->maxKeys; i++) {
 			this->children[i] = 0;
@@ -462,6 +525,64 @@ int Node::getNumChildren() {
 	return this->numChildren;
 }
 
+/* Name: countKeys
+ * Params:
+ *	None
+ * Description:
+ *	Counts the keys held in the node's subtree. A leaf counts its own keys and an interior
+ *	node adds up the subtree counts it stores for its children, so no children are visited.
+ * Returns: the number of keys in the node's subtree
+ */
+int Node::countKeys() {
+	if (this->type == NODE_TYPE_LEAF) {
+		return this->numKeys;
+	}
+	int count = 0;
+	if (this->counts != 0) {
+		for (int i = 0; i < this->numChildren; i++) {
+			count += this->counts[i];
+		}
+	}
+	return count;
+}
+
+/* Name: addReference
+ * Params:
+ *	None
+ * Description:
+ *	Counts one more pointer to the node. A node starts out with one reference (from the node
+ *	or tree it is added to); an interior node copied for another version of a tree adds one
+ *	to each of its children, which are then shared by both versions.
+ * Returns: None
+ */
+void Node::addReference() {
+	this->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Name: dropReference
+ * Params:
+ *	None
+ * Description:
+ *	Counts one pointer to the node less. The caller deletes the node when the last
+ *	reference was dropped (see BpTree::releaseSubtree()).
+ * Returns: true if that was the last reference, false otherwise
+ */
+bool Node::dropReference() {
+	return this->references.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+/* Name: isShared
+ * Params:
+ *	None
+ * Description:
+ *	Checks whether more than one node or tree points at the node, in which case it must not be
+ *	modified but copied (see BpTree::getWritableChild()).
+ * Returns: true if the node has more than one reference, false otherwise
+ */
+bool Node::isShared() {
+	return this->references.load(std::memory_order_acquire) > 1;
+}
+
 /* Name: split (LeafNode)
  * Params:
  *	None
@@ -474,7 +595,7 @@ Node** LeafNode::split()
 {
 	Node** newNodes = new Node*[2];
 	newNodes[0] = this;
-	newNodes[1] = new LeafNode(this->maxKeys);
+	newNodes[1] = new (this->maxKeys) LeafNode(this->maxKeys);
 	int middleKey = -1;
 	if (this->maxKeys % 2 == 1)
 	{
@@ -489,9 +610,8 @@ Node** LeafNode::split()
 			static_cast<LeafNode*>(newNodes[0])->getValue(i));
 	}
 	for (int i = middleKey; i < newNodes[0]->getMaxKeys(); i++) {
-		static_cast<LeafNode*>(newNodes[0])->removePair(i);
+		static_cast<LeafNode*>(newNodes[0])->deletePair(middleKey);
 	}
-	newNodes[0]->setChild(newNodes[0]->getMaxKeys(), newNodes[1]);
 	return newNodes;
 }
 
@@ -509,7 +629,7 @@ Node** LeafNode::split(int key, std::string value)
 {
 	Node** newNodes = new Node*[2];
 	newNodes[0] = this;
-	newNodes[1] = new LeafNode(this->maxKeys);
+	newNodes[1] = new (this->maxKeys) LeafNode(this->maxKeys);
 	int middleKey = -1;
 	if (this->maxKeys % 2 == 1)
 	{
@@ -527,7 +647,7 @@ Node** LeafNode::split(int key, std::string value)
 				static_cast<LeafNode*>(newNodes[0])->getValue(i));
 		}
 		for (int i = middleKey; i < newNodes[0]->getMaxKeys(); i++) {
-			static_cast<LeafNode*>(newNodes[0])->removePair(middleKey);
+			static_cast<LeafNode*>(newNodes[0])->deletePair(middleKey);
 		}
 		static_cast<LeafNode*>(newNodes[0])->addPair(key, value);
 	}
@@ -538,12 +658,10 @@ Node** LeafNode::split(int key, std::string value)
 				static_cast<LeafNode*>(newNodes[0])->getValue(i));
 		}
 		for (int i = middleKey + 1; i < newNodes[0]->getMaxKeys(); i++) {
-			static_cast<LeafNode*>(newNodes[0])->removePair(middleKey + 1);
+			static_cast<LeafNode*>(newNodes[0])->deletePair(middleKey + 1);
 		}
 		static_cast<LeafNode*>(newNodes[1])->addPair(key, value);
 	}
-	newNodes[1]->setChild(newNodes[1]->getMaxKeys(), newNodes[0]->getChild(newNodes[0]->getMaxKeys()));
-	newNodes[0]->setChild(newNodes[0]->getMaxKeys(), newNodes[1]);
 	return newNodes;
 }
 
@@ -566,18 +684,6 @@ bool Node::isFull() {
 	}
 }
 
-/* Name: setParent
- * Params:
- *	Node * parent - the new parent node for the current node
- * Author: Joshua Campbell
- * Description:
- *	Sets the parent pointer of the node to the specified new parent.
- * Returns: None
- */
-void Node::setParent(Node * parent) {
-	this->parent = parent;
-}
-
 /* Name: findNextNode (Node)
  * Params:
  *	int key - placeholder
@@ -594,28 +700,67 @@ Node* Node::findNextNode(int key) { return 0; }
  * Author: Joshua Campbell
  * Description:
  *	Creates a new LeafNode with the specified number of keys and data elements.
- *	One more child pointer is allocated for pointing to its right neighbour leaf.
  */
 LeafNode::LeafNode(int maxKeys) : Node(maxKeys)
 {
 	this->type = NODE_TYPE_LEAF;
-	this->children = new Node*[maxKeys + 1];
-	for (int i = 0; i < maxKeys + 1; i++) {
+	this->children = reinterpret_cast<Node**>(reinterpret_cast<char*>(this->keys) + roundUp(maxKeys * sizeof(int), sizeof(Node*)));
+	for (int i = 0; i < maxKeys; i++) {
 		this->children[i] = 0;
 	}
 }
 
-/* Name: findNextNode (LeafNode)
+/* Name: LeafNode Destructor
+ * Description:
+ *	Destroys the LeafNode along with the DataNodes holding its values.
+ */
+LeafNode::~LeafNode()
+{
+	for (int i = 0; i < this->numChildren; i++) {
+		if (this->children[i] != 0) {
+			delete this->children[i];
+			this->children[i] = 0;
+		}
+	}
+}
+
+/* Name: operator new (LeafNode)
  * Params:
- *	int key - unused
- * Author: Joshua Campbell
+ *	size_t - unused (the size of the node is part of the block's size)
+ *	int maxKeys - the maximum number of keys and data elements of the leaf
  * Description:
- *	Returns the pointer to the right neighbour node of the leaf.
- * Returns: the pointer to the right neighbour node of the leaf
+ *	Allocates the block for a leaf and its arrays (see Node::allocate).
+ * Returns: the block
  */
-Node* LeafNode::findNextNode(int key) 
+void* LeafNode::operator new(size_t, int maxKeys)
 {
-	return this->children[this->maxKeys];
+	return allocate(maxKeys, NODE_TYPE_LEAF);
+}
+
+/* Name: operator delete (LeafNode)
+ * Params:
+ *	void* block - the block of a destroyed leaf
+ * Description:
+ *	Frees the block of a leaf (see Node::operator delete).
+ * Returns: None
+ */
+void LeafNode::operator delete(void* block)
+{
+	Node::operator delete(block);
+}
+
+/* Name: operator delete (LeafNode)
+ * Params:
+ *	void* block - the block of a leaf whose constructor threw
+ *	int maxKeys - unused
+ * Description:
+ *	Frees the block of a leaf whose constructor threw. Declared next to the matching
+ *	operator new so that the compiler pairs the two.
+ * Returns: None
+ */
+void LeafNode::operator delete(void* block, int maxKeys)
+{
+	Node::operator delete(block, maxKeys);
 }
 
 /* Name: addPair
@@ -695,6 +840,33 @@ std::string LeafNode::getValue(int index)
 	return "";
 }
 
+/* Name: getValueReference
+ * Params:
+ *	int index - the index of the string value to retrieve
+ * Description:
+ *	Returns a reference to the string value of the DataNode stored at the specified index
+ *	of the leaf, for callers that read or change the value where it is stored instead of
+ *	copying it. The reference is only valid until the leaf is modified.
+ * Returns: a reference to the string value stored at the specified index of the leaf
+ */
+std::string& LeafNode::getValueReference(int index)
+{
+	return static_cast<DataNode*>(this->children[index])->value;
+}
+
+/* Name: setValue
+ * Params:
+ *	int index - the index of the string value to replace
+ *	std::string value - the new value
+ * Description:
+ *	Replaces the string value stored at the specified index of the leaf.
+ * Returns: None
+ */
+void LeafNode::setValue(int index, std::string value)
+{
+	static_cast<DataNode*>(this->children[index])->value.swap(value);
+}
+
 /* Name: removePair
  * Params:
  *	int index - the index of the key/value pair to remove
@@ -759,48 +931,125 @@ int LeafNode::getNumChildren() {
 	return this->numChildren;
 }
 
+/* Name: copy (LeafNode)
+ * Params:
+ *	None
+ * Description:
+ *	Creates a new leaf holding copies of the key/value pairs of the leaf.
+ * Returns: the pointer to the new leaf
+ */
+LeafNode* LeafNode::copy()
+{
+	LeafNode * leaf = new (this->maxKeys) LeafNode(this->maxKeys);
+	for (int i = 0; i < this->numChildren; i++) {
+		leaf->keys[i] = this->keys[i];
+		leaf->children[i] = new DataNode(static_cast<DataNode*>(this->children[i])->value);
+	}
+	leaf->numKeys = this->numKeys;
+	leaf->numChildren = this->numChildren;
+	return leaf;
+}
+
 /* Name: InteriorNode Constructor
  * Params:
  *	int maxKeys - the maximum number of keys the node can hold
  * Author: Joshua Campbell
  * Description:
- *	Creates a new interior node and allocates memory for maxKeys + 1 children.
+ *	Creates a new interior node with room for maxKeys + 1 children and their subtree counts.
  */
 InteriorNode::InteriorNode(int maxKeys) : Node(maxKeys)
 {
 	this->type = NODE_TYPE_INTERIOR;
-	this->children = new Node*[maxKeys + 1];
+	this->children = reinterpret_cast<Node**>(reinterpret_cast<char*>(this->keys) + roundUp(maxKeys * sizeof(int), sizeof(Node*)));
+	this->counts = reinterpret_cast<int*>(this->children + maxKeys + 1);
 	for (int i = 0; i < maxKeys + 1; i++) {
 		this->children[i] = 0;
+		this->counts[i] = 0;
 	}
 }
 
+/* Name: operator new (InteriorNode)
+ * Params:
+ *	size_t - unused (the size of the node is part of the block's size)
+ *	int maxKeys - the maximum number of keys of the interior node
+ * Description:
+ *	Allocates the block for an interior node and its arrays (see Node::allocate).
+ * Returns: the block
+ */
+void* InteriorNode::operator new(size_t, int maxKeys)
+{
+	return allocate(maxKeys, NODE_TYPE_INTERIOR);
+}
+
+/* Name: operator delete (InteriorNode)
+ * Params:
+ *	void* block - the block of a destroyed interior node
+ * Description:
+ *	Frees the block of an interior node (see Node::operator delete).
+ * Returns: None
+ */
+void InteriorNode::operator delete(void* block)
+{
+	Node::operator delete(block);
+}
+
+/* Name: operator delete (InteriorNode)
+ * Params:
+ *	void* block - the block of an interior node whose constructor threw
+ *	int maxKeys - unused
+ * Description:
+ *	Frees the block of an interior node whose constructor threw. Declared next to the matching
+ *	operator new so that the compiler pairs the two.
+ * Returns: None
+ */
+void InteriorNode::operator delete(void* block, int maxKeys)
+{
+	Node::operator delete(block, maxKeys);
+}
+
 /* Name: findNextNode (InteriorNode)
  * Params:
  *	int key - the key used to find the next immediate child
  * Author: Joshua Campbell
  * Description:
  *	Finds the next immediate child of the interior node that matches the key provided.
+ *	The child's header and keys are prefetched, so a descent that searches the child next
+ *	takes their cache misses at the same time instead of one after the other.
  * Returns: returns the child node that matches the provided key
  */
 Node* InteriorNode::findNextNode(int key) 
 {
+	Node * next = 0;
 	if (this->numChildren > 0) {
-		for (int i = 0; i < this->numKeys; i++) {
+		for (int i = 0; i < this->numKeys && next == 0; i++) {
 			if (key < keys[i] && i < this->numChildren) {
-				return children[i];
+				next = children[i];
 			}
 		}
-		if (this->numChildren > this->numKeys) {
-			return children[this->numKeys];
-		} else if (this->numChildren > 0) {
-			return children[0];
-		} else {
-			return 0;
+		if (next == 0 && this->numChildren > this->numKeys) {
+			next = children[this->numKeys];
+		} else if (next == 0) {
+			next = children[0];
+		}
+		if (next != 0) {
+			next->prefetch(NODE_CACHE_LINE + this->maxKeys * sizeof(int));
 		}
-	} else {
-		return 0;
 	}
+	return next;
+}
+
+/* Name: findChildIndex (InteriorNode)
+ * Params:
+ *	int key - the key being looked for
+ * Description:
+ *	Finds the index of the child whose subtree holds the key (the child findNextNode() would
+ *	return) with a binary search of the keys, without reading the child pointer.
+ * Returns: the index of the child
+ */
+int InteriorNode::findChildIndex(int key)
+{
+	int index = std::upper_bound(this->keys, this->keys + this->numKeys, key) - this->keys;
+	return index < this->numChildren ? index : 0;
 }
 
 /* Name: addChild (InteriorNode)
@@ -809,8 +1058,6 @@ Node* InteriorNode::findNextNode(int key)
  * Author: Joshua Campbell
  * Description:
  *	Adds a child to the rightmost empty child pointer of the node. No new keys are added to the node.
- *  If the child is a leaf node, its rightmost pointer is adjusted to point to the next node and the 
- *	node to the left of the new node is adjusted so that its rightmost pointer points at the new node.
  * Returns: true if the child was inserted, false otherwise
  */
 bool InteriorNode::addChild(Node* child)
@@ -822,11 +1069,7 @@ bool InteriorNode::addChild(Node* child)
 	else
 	{
 		this->children[this->numChildren] = child;
-		if (this->numChildren > 0 && this->children[this->numChildren - 1]->getNodeType() == NODE_TYPE_LEAF) {
-			child->setChild(child->getMaxKeys(), this->children[this->numChildren - 1]->getChild(this->children[this->numChildren - 1]->getMaxKeys()));
-			this->children[this->numChildren - 1]->setChild(this->children[this->numChildren - 1]->getMaxKeys(), child);
-		}
-		child->setParent(this);
+		this->counts[this->numChildren] = child->countKeys();
 		this->numChildren += 1;
 		return true;
 	}
@@ -850,9 +1093,10 @@ bool InteriorNode::addChildToLeft(Node* child)
 	{
 		for (int i = this->numChildren - 1; i >= 0; i--) {
 			this->children[i + 1] = this->children[i];
+			this->counts[i + 1] = this->counts[i];
 		}
 		this->children[0] = child;
-		child->setParent(this);
+		this->counts[0] = child->countKeys();
 		this->numChildren += 1;
 		return true;
 	}
@@ -875,7 +1119,6 @@ bool InteriorNode::addChild(Node* child, int lowestKeyValue)
 	}
 	else
 	{
-		child->setParent(this);	
 		if (this->numKeys == 0) {
 			this->keys[0] = lowestKeyValue;
 			int childKey = child->findIdentifierKey();
@@ -884,14 +1127,18 @@ bool InteriorNode::addChild(Node* child, int lowestKeyValue)
 				int existingChildKey = this->children[0]->findIdentifierKey();
 				if (childKey < existingChildKey) {
 					this->children[1] = this->children[0];
+					this->counts[1] = this->counts[0];
 					this->children[0] = child;
+					this->counts[0] = child->countKeys();
 				}
 				else {
 					this->children[1] = child;
+					this->counts[1] = child->countKeys();
 				}
 			}
 			else {
 				this->children[this->numChildren] = child;
+				this->counts[this->numChildren] = child->countKeys();
 			}
 			this->numChildren += 1;
 			this->numKeys += 1;
@@ -1064,8 +1311,10 @@ bool InteriorNode::insertChild(Node* child, int index)
 	{
 		for (int i = numChildren - 1; i >= index && this->numChildren <= this->maxKeys; i--) {
 			this->children[i + 1] = this->children[i];
+			this->counts[i + 1] = this->counts[i];
 		}
 		this->children[index] = child;
+		this->counts[index] = child->countKeys();
 		/*if (index == numChildren - 1 && index >= 1 && child->getNodeType() == NODE_TYPE_LEAF) {
 			child->setChild(this->maxKeys, this->children[index - 1]->getChild(this->maxKeys));
 		} else if (index + 1 <= numChildren && child->getNodeType() == NODE_TYPE_LEAF) {
@@ -1094,7 +1343,7 @@ Node** InteriorNode::split()
 {
 	Node** newNodes = new Node*[2];
 	newNodes[0] = this;
-	newNodes[1] = new InteriorNode(this->maxKeys);
+	newNodes[1] = new (this->maxKeys) InteriorNode(this->maxKeys);
 	int middleKey = -1;
 	if (this->maxKeys % 2 == 1)
 	{
@@ -1132,7 +1381,7 @@ Node** InteriorNode::split(Node * newChild)
 {
 	Node** newNodes = new Node*[2];
 	newNodes[0] = this;
-	newNodes[1] = new InteriorNode(this->maxKeys);
+	newNodes[1] = new (this->maxKeys) InteriorNode(this->maxKeys);
 	int middleKey = -1;
 	if (this->maxKeys % 2 == 1)
 	{
@@ -1209,7 +1458,7 @@ Node** InteriorNode::split(Node * newChild, int key)
 {
 	Node** newNodes = new Node*[2];
 	newNodes[0] = this;
-	newNodes[1] = new InteriorNode(this->maxKeys);
+	newNodes[1] = new (this->maxKeys) InteriorNode(this->maxKeys);
 
 	int middleKey = -1;
 	if (this->maxKeys % 2 == 1)
@@ -1306,6 +1555,79 @@ int InteriorNode::findLeastLeafKey() {
 	return -1;
 }
 
+/* Name: copy (InteriorNode)
+ * Params:
+ *	None
+ * Description:
+ *	Creates a new interior node with the same keys, subtree counts and number of children as
+ *	the node. The child pointers of the new node are left empty and must be set by the caller.
+ * Returns: the pointer to the new interior node
+ */
+InteriorNode* InteriorNode::copy()
+{
+	InteriorNode * node = new (this->maxKeys) InteriorNode(this->maxKeys);
+	for (int i = 0; i < this->numKeys; i++) {
+		node->keys[i] = this->keys[i];
+	}
+	for (int i = 0; i < this->numChildren; i++) {
+		node->counts[i] = this->counts[i];
+	}
+	node->numKeys = this->numKeys;
+	node->numChildren = this->numChildren;
+	return node;
+}
+
+/* Name: appendChild (InteriorNode)
+ * Params:
+ *	Node* child - the child that will be added to the right end of the node
+ *	int lowestKeyValue - the lowest key of the child's subtree (ignored for the first child)
+ * Description:
+ *	Adds a child after the node's current rightmost child, using lowestKeyValue as the key that
+ *	separates it from the child before it. Children must be appended in key order. Used for
+ *	building nodes from children that are already in order.
+ * Returns: None
+ */
+void InteriorNode::appendChild(Node* child, int lowestKeyValue)
+{
+	if (this->numChildren > 0) {
+		this->keys[this->numKeys] = lowestKeyValue;
+		this->numKeys += 1;
+	}
+	this->children[this->numChildren] = child;
+	this->counts[this->numChildren] = child->countKeys();
+	this->numChildren += 1;
+}
+
+/* Name: getCount (InteriorNode)
+ * Params:
+ *	int index - the index of the child
+ * Description:
+ *	Returns the number of keys stored in the subtree of the child at the specified index.
+ * Returns: the subtree count of the child, 0 if there is no child at the index
+ */
+int InteriorNode::getCount(int index)
+{
+	if (index >= 0 && index < this->numChildren) {
+		return this->counts[index];
+	}
+	return 0;
+}
+
+/* Name: updateCount (InteriorNode)
+ * Params:
+ *	int index - the index of the child
+ * Description:
+ *	Recounts the keys in the subtree of the child at the specified index (see countKeys()).
+ *	Used after keys were added to or removed from the child's subtree.
+ * Returns: None
+ */
+void InteriorNode::updateCount(int index)
+{
+	if (index >= 0 && index < this->numChildren) {
+		this->counts[index] = this->children[index]->countKeys();
+	}
+}
+
 /* Name: printChildren
  * Params:
  *	None
@@ -1340,47 +1662,6 @@ void Node::printChildren() {
 	}
 }
 
-/* Name: findNeighbours (InteriorNode)
- * Params:
- *	None
- * Author: Joshua Campbell
- * Description:
- *	Finds any neighbours if they exist for the current node by looking at the children of its parent.
- *  Neighbours are the nodes that are to the right of the node or the left of the node (or itself in
- *  situations where the node is the only child of the parent).
- * Returns: A pointer (Node**) to two pointers for the neighbour nodes
- */
-Node** InteriorNode::findNeighbours() {
-	bool found = false;
-	if (this->parent != 0) {
-		Node** neighbours = new Node*[2];
-		neighbours[0] = 0;
-		neighbours[1] = 0;
-		Node* parent = this->parent;
-		int identifier = this->keys[0];
-		for (int i = 0; i < parent->getNumKeys(); i++) {
-			int currentKey = parent->getKey(i);
-			if (identifier >= currentKey) {
-				if (i + 1 > 0) {
-					neighbours[0] = parent->getChild(i);
-					found = true;
-				}
-				if (i + 2 < parent->getNumChildren()) {
-					neighbours[1] = parent->getChild(i + 2);
-					found = true;
-				}
-			}
-		}
-		if (parent->getNumKeys() >= 1 && !found) {
-			neighbours[1] = parent->getChild(1);
-		}
-		return neighbours;
-	}
-	else {
-		return 0;
-	}
-}
-
 /* Name: DataNode Constructor
  * Params: 
  *	std::string value - the string value that will be stored in the node
@@ -1391,4 +1672,35 @@ Node** InteriorNode::findNeighbours() {
 DataNode::DataNode(std::string value) {
 	this->type = NODE_TYPE_DATA;
 	this->value = value;
+}
+
+/* Name: operator new (DataNode)
+ * Params:
+ *	size_t size - the size of the node
+ * Description:
+ *	Allocates a data node from the global heap; data nodes have no arrays, so they do not
+ *	use the cache line aligned blocks of leaf and interior nodes. A thread that places leaves
+ *	on a NUMA node (see NodePlacementScope) puts the data nodes of their pairs there too.
+ * Returns: the memory for the node
+ */
+void* DataNode::operator new(size_t size)
+{
+	void* block = NodeArena::allocate(size, NodeArena::getPlacement(true));
+	return block != 0 ? block : ::operator new(size);
+}
+
+/* Name: operator delete (DataNode)
+ * Params:
+ *	void* node - the memory of a destroyed data node
+ * Description:
+ *	Frees the memory of a data node, giving it back to the NUMA arena if it came from there.
+ * Returns: None
+ */
+void DataNode::operator delete(void* node)
+{
+	if (NodeArena::owns(node)) {
+		NodeArena::release(node);
+	} else {
+		::operator delete(node);
+	}
 }
\ No newline at end of file
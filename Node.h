@@ -1,6 +1,8 @@
 #ifndef NODE_H
 #define NODE_H
 
+#include <atomic>
+#include <cstddef>
 #include <string>
 #include <iostream>
 #include <vector>
@@ -11,20 +13,31 @@
 #define NODE_TYPE_INTERIOR      2
 #define NODE_TYPE_DATA			3
 
+/* Size of a cache line; leaf and interior nodes are allocated on cache line boundaries */
+#define NODE_CACHE_LINE			64
+
+/* Leaf and interior nodes are allocated as a single block aligned to a cache line: the node
+ * itself (one cache line holding the counters and array pointers), then its keys starting on
+ * the next cache line, then its child pointers, then (for interior nodes) its subtree counts.
+ * They must be created with new (maxKeys) LeafNode(maxKeys) / new (maxKeys) InteriorNode(maxKeys)
+ * so that the block is big enough for the arrays. Nodes do not point at their parent or at
+ * their neighbours, so a node can be shared by several versions of a tree (see
+ * BpTree::getWritableChild()); it counts the pointers to it instead. */
 class Node {
 public:
 	Node();
-	~Node();
+	virtual ~Node();
 	Node(int);
+	static void operator delete(void*);
+	static void operator delete(void*, int);
+	static size_t getAllocationSize(int, int);
+	static int getMaxKeysForSize(size_t);
 	bool generateChildren(int);
 
 	Node* findNextNode(int);
-	Node** findNeighbours();
 	int findIdentifierKey();
 	int getNodeType();
 
-	Node* getParent();
-
 	Node** split();
 	Node** split(int, std::string);
 
@@ -45,8 +58,13 @@ public:
 	void deleteChild(int);
 	Node* deleteChild(Node*);
 	int getNumChildren();
-	
-	void setParent(Node *);
+	int countKeys();
+
+	void addReference();
+	bool dropReference();
+	bool isShared();
+	void prefetch(size_t);
+	void prefetchChild(int);
 
 	bool isFull();
 
@@ -54,23 +72,28 @@ public:
 	void printKeys();
 	void printChildren();
 protected:
-	Node * parent; //the parent of the node
+	static void* allocate(int, int);
+
 	Node ** children; //the children of the node (allocated array (dynamic memory))
 	int * keys; //the keys for the node (allocated array (dynamic memory))
+	int * counts; //the number of keys in each child's subtree (allocated array for interior nodes, 0 otherwise)
 	int numKeys; //the current number of keys held by the node
 	int maxKeys; //the maximum number of keys held by the node
 	int numChildren; //the current number of children held by the node
 	int type; //the type of the node (leaf, interior, data, or no type); used for casting
+	std::atomic<int> references; //the number of parent nodes and trees pointing at the node (see addReference())
 };
 
 class LeafNode : public Node {
 public:
 	LeafNode(int);
+	~LeafNode();
+	static void* operator new(size_t, int);
+	static void operator delete(void*);
+	static void operator delete(void*, int);
 
 	void addPair(int, std::string);
 
-	Node* findNextNode(int);
-
 	Node** split();
 	Node** split(int, std::string);
 
@@ -78,16 +101,23 @@ public:
 	std::string* getValues();
 	int getKey(int);
 	std::string getValue(int);
+	std::string& getValueReference(int);
+	void setValue(int, std::string);
 	
 	void removePair(int);
 	bool deletePair(int);
 
 	int getNumChildren();
+
+	LeafNode* copy();
 };
 
 class InteriorNode : public Node {
 public:
 	InteriorNode(int);
+	static void* operator new(size_t, int);
+	static void operator delete(void*);
+	static void operator delete(void*, int);
 	int* getKeys();
 	bool addChild(Node*);
 	bool addChild(Node*, int);
@@ -96,19 +126,59 @@ public:
 	int getKeyIndex(int);
 	int getMiddleKey();
 	int getMiddleKey(int);
-	Node** findNeighbours();
 	Node* findNextNode(int);
+	int findChildIndex(int);
 	Node** split();
 	Node** split(Node*);
 	Node** split(Node*, int);
 	int leastChildValue();
 	int findLeastLeafKey();
+
+	InteriorNode* copy();
+	void appendChild(Node*, int);
+
+	int getCount(int);
+	void updateCount(int);
 };
 
 class DataNode : public Node {
 public:
 	DataNode(std::string);
+	static void* operator new(size_t);
+	static void operator delete(void*);
 	std::string value; //the string value that is stored
 };
 
+/* Name: prefetch
+ * Params:
+ *	size_t bytes - the number of bytes from the start of the node's block to prefetch
+ * Description:
+ *	Starts loading the first bytes of the node's block (see Node::allocate) into the cache
+ *	without waiting for them, so that the misses on the node's header and keys overlap with
+ *	each other and with other work. Defined in the header so that it is inlined into descents
+ *	and scans.
+ * Returns: None
+ */
+inline void Node::prefetch(size_t bytes)
+{
+	const char * block = reinterpret_cast<const char*>(this);
+	for (size_t offset = 0; offset < bytes; offset += NODE_CACHE_LINE) {
+		__builtin_prefetch(block + offset);
+	}
+}
+
+/* Name: prefetchChild
+ * Params:
+ *	int index - the index of a child
+ * Description:
+ *	Starts loading the slot holding the pointer to a child (or, for a leaf, to the DataNode
+ *	of a value) into the cache without waiting for it. Interleaved lookups (see
+ *	BpTree::findBatch) use it to overlap the miss on the slot with other lookups' work.
+ * Returns: None
+ */
+inline void Node::prefetchChild(int index)
+{
+	__builtin_prefetch(this->children + index);
+}
+
 #endif
\ No newline at end of file
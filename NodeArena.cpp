@@ -0,0 +1,459 @@
+#include "NodeArena.h"
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <sched.h>
+#include <sys/mman.h>
+#include <utility>
+#include <vector>
+#ifdef BPTREE_NUMA
+#include <numa.h>
+#endif
+
+std::atomic<char*> NodeArena::regionBase(0);
+size_t NodeArena::regionSize = 0;
+thread_local int NodeArena::batchDepth = 0;
+
+//where the nodes allocated by the thread are placed (see NodePlacementScope)
+static thread_local int leafPlacement = NODE_PLACEMENT_DEFAULT;
+static thread_local int interiorPlacement = NODE_PLACEMENT_DEFAULT;
+
+/* The blocks of one size on one placement: the freed blocks, linked through their first
+ * bytes, and the part of the newest chunk that has not been handed out yet */
+struct NodeArena::Pool {
+	std::mutex lock;
+	int node; //the NUMA node of the blocks (or NODE_PLACEMENT_INTERLEAVE)
+	size_t blockSize; //the size of the blocks (a multiple of ARENA_BLOCK_ALIGNMENT)
+	void * freeBlocks; //the most recently freed block (0 for none)
+	char * next; //the next unused block of the newest chunk
+	char * end; //the end of the newest chunk
+};
+
+/* The blocks a thread took from one pool in a batch (see NodeAllocationBatch) and has not
+ * handed out yet, linked through their first bytes */
+struct NodeArena::Batch {
+	Pool * pool; //the pool the blocks were taken from
+	void * blocks; //the next block to hand out (0 once the batch is used up)
+};
+
+thread_local std::vector<NodeArena::Batch> NodeArena::batches;
+
+/* The first ARENA_BLOCK_ALIGNMENT bytes of every chunk; the blocks follow */
+struct NodeArena::Chunk {
+	Pool * pool; //the pool the blocks of the chunk belong to
+};
+
+/* The state shared by all threads: the pools, the NUMA node of every CPU and how much of the
+ * reserved range has been cut into chunks. It is never deleted, so that nodes freed while the
+ * program is shutting down can still find their pools. */
+struct NodeArena::Registry {
+	Registry();
+	std::mutex lock;
+	std::map<std::pair<int, size_t>, Pool*> pools; //the pools by NUMA node and block size
+	std::vector<int> cpuNodes; //the NUMA node of each CPU
+	size_t usedChunks; //the number of chunks cut from the reserved range
+	int numNodes; //the number of NUMA nodes (1 without NUMA support)
+	bool available; //whether libnuma found NUMA support
+};
+
+/* Name: Registry Constructor
+ * Description:
+ *	Asks libnuma (when compiled in) whether the system supports NUMA, and how many nodes it
+ *	has and which CPUs belong to them.
+ */
+NodeArena::Registry::Registry() : usedChunks(0), numNodes(1), available(false)
+{
+#ifdef BPTREE_NUMA
+	this->available = numa_available() != -1;
+	if (this->available) {
+		this->numNodes = numa_max_node() + 1;
+		for (int cpu = 0; cpu < numa_num_configured_cpus(); cpu++) {
+			int node = numa_node_of_cpu(cpu);
+			this->cpuNodes.push_back(node >= 0 ? node : 0);
+		}
+	}
+#endif
+}
+
+/* Name: registry
+ * Params:
+ *	None
+ * Description:
+ *	Finds the shared state of the arena, creating it on first use.
+ * Returns: the registry
+ */
+NodeArena::Registry& NodeArena::registry()
+{
+	static Registry * instance = new Registry();
+	return *instance;
+}
+
+/* Name: allocate
+ * Params:
+ *	size_t size - the size of the block in bytes
+ *	int placement - where the block is placed (a NUMA node or a NODE_PLACEMENT_ constant)
+ * Description:
+ *	Allocates a block aligned to ARENA_BLOCK_ALIGNMENT from the pool of the placement, taking
+ *	the most recently freed block of the pool if there is one and otherwise the next block of
+ *	its newest chunk (adding a chunk when that one is used up). Inside a NodeAllocationBatch
+ *	the block comes from the calling thread's batch for the pool instead.
+ * Returns: the block, or 0 if the placement is NODE_PLACEMENT_DEFAULT, the arena is not
+ *	available or cannot place the block; the caller then allocates from the heap
+ */
+void* NodeArena::allocate(size_t size, int placement)
+{
+	if (placement == NODE_PLACEMENT_DEFAULT || !isNumaAvailable()) {
+		return 0;
+	}
+	size_t blockSize = (size + ARENA_BLOCK_ALIGNMENT - 1) / ARENA_BLOCK_ALIGNMENT * ARENA_BLOCK_ALIGNMENT;
+	int node = placement == NODE_PLACEMENT_LOCAL ? getCurrentNode() : placement;
+	if (blockSize > ARENA_CHUNK_SIZE - ARENA_BLOCK_ALIGNMENT || (node < 0 && node != NODE_PLACEMENT_INTERLEAVE) || node >= getNumNodes()) {
+		return 0;
+	}
+	Pool * pool = findPool(node, blockSize);
+	if (batchDepth > 0) {
+		return allocateFromBatch(pool);
+	}
+	std::lock_guard<std::mutex> guard(pool->lock);
+	if (pool->freeBlocks != 0) {
+		void * block = pool->freeBlocks;
+		pool->freeBlocks = *static_cast<void**>(block);
+		return block;
+	}
+	if (pool->next + blockSize > pool->end && !addChunk(pool)) {
+		return 0;
+	}
+	void * block = pool->next;
+	pool->next += blockSize;
+	return block;
+}
+
+/* Name: allocateFromBatch
+ * Params:
+ *	Pool* pool - the pool of the block's size and placement
+ * Description:
+ *	Hands out the next block of the calling thread's batch for the pool. When the batch is used
+ *	up, the pool is locked once to take up to ARENA_BATCH_BLOCKS blocks for the next one: its
+ *	freed blocks first, then the next blocks of its newest chunk, in address order.
+ * Returns: the block, or 0 if the pool has no block left and cannot get another chunk
+ */
+void* NodeArena::allocateFromBatch(Pool* pool)
+{
+	Batch * batch = 0;
+	for (size_t i = 0; i < batches.size() && batch == 0; i++) {
+		if (batches[i].pool == pool) {
+			batch = &batches[i];
+		}
+	}
+	if (batch == 0) {
+		Batch added = { pool, 0 };
+		batches.push_back(added);
+		batch = &batches.back();
+	}
+	if (batch->blocks == 0) {
+		std::lock_guard<std::mutex> guard(pool->lock);
+		void ** tail = &batch->blocks;
+		for (int i = 0; i < ARENA_BATCH_BLOCKS; i++) {
+			void * block = pool->freeBlocks;
+			if (block != 0) {
+				pool->freeBlocks = *static_cast<void**>(block);
+			}
+			else {
+				if (pool->next + pool->blockSize > pool->end && !addChunk(pool)) {
+					break;
+				}
+				block = pool->next;
+				pool->next += pool->blockSize;
+			}
+			*tail = block;
+			tail = static_cast<void**>(block);
+		}
+		*tail = 0;
+		if (batch->blocks == 0) {
+			return 0;
+		}
+	}
+	void * block = batch->blocks;
+	batch->blocks = *static_cast<void**>(block);
+	return block;
+}
+
+/* Name: releaseBatches
+ * Params:
+ *	None
+ * Description:
+ *	Gives the blocks left in the calling thread's batches back to their pools, locking each
+ *	pool once.
+ * Returns: None
+ */
+void NodeArena::releaseBatches()
+{
+	for (size_t i = 0; i < batches.size(); i++) {
+		void * blocks = batches[i].blocks;
+		if (blocks == 0) {
+			continue;
+		}
+		void * last = blocks;
+		while (*static_cast<void**>(last) != 0) {
+			last = *static_cast<void**>(last);
+		}
+		Pool * pool = batches[i].pool;
+		std::lock_guard<std::mutex> guard(pool->lock);
+		*static_cast<void**>(last) = pool->freeBlocks;
+		pool->freeBlocks = blocks;
+	}
+	batches.clear();
+}
+
+/* Name: release
+ * Params:
+ *	void* block - a block allocated by allocate()
+ * Description:
+ *	Gives a block back to its pool, found through the header of the chunk it was cut from.
+ *	Can be called from any thread.
+ * Returns: None
+ */
+void NodeArena::release(void* block)
+{
+	Chunk * chunk = reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(block) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+	Pool * pool = chunk->pool;
+	std::lock_guard<std::mutex> guard(pool->lock);
+	*static_cast<void**>(block) = pool->freeBlocks;
+	pool->freeBlocks = block;
+}
+
+/* Name: owns
+ * Params:
+ *	const void* block - a block of memory
+ * Description:
+ *	Checks whether a block was allocated by allocate() (and must be freed with release())
+ *	rather than from the heap, by comparing its address with the reserved range. Takes no lock.
+ * Returns: true if the block belongs to the arena, false otherwise
+ */
+bool NodeArena::owns(const void* block)
+{
+	const char * base = regionBase.load(std::memory_order_acquire);
+	const char * address = static_cast<const char*>(block);
+	return base != 0 && address >= base && address < base + regionSize;
+}
+
+/* Name: isNumaAvailable
+ * Params:
+ *	None
+ * Description:
+ *	Checks whether the arena can place blocks: it was compiled with BPTREE_NUMA and libnuma
+ *	found NUMA support (a host with a single node counts).
+ * Returns: true if placements are honoured, false if every node comes from the heap
+ */
+bool NodeArena::isNumaAvailable()
+{
+	return registry().available;
+}
+
+/* Name: getNumNodes
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of NUMA nodes of the system.
+ * Returns: the number of NUMA nodes (1 if NUMA support is not available)
+ */
+int NodeArena::getNumNodes()
+{
+	return registry().numNodes;
+}
+
+/* Name: getNodeOfCpu
+ * Params:
+ *	int cpu - the number of a CPU
+ * Description:
+ *	Finds the NUMA node a CPU belongs to, from the table read when the arena was first used.
+ * Returns: the NUMA node of the CPU (0 if it is unknown or NUMA support is not available)
+ */
+int NodeArena::getNodeOfCpu(int cpu)
+{
+	Registry& arena = registry();
+	return cpu >= 0 && cpu < (int)arena.cpuNodes.size() ? arena.cpuNodes[cpu] : 0;
+}
+
+/* Name: getCurrentNode
+ * Params:
+ *	None
+ * Description:
+ *	Finds the NUMA node of the CPU the calling thread is running on. An unpinned thread may
+ *	have moved by the time the result is used.
+ * Returns: the NUMA node of the calling thread (0 if it is unknown)
+ */
+int NodeArena::getCurrentNode()
+{
+	return getNodeOfCpu(sched_getcpu());
+}
+
+/* Name: getPlacement
+ * Params:
+ *	bool leaf - true for the placement of leaves, false for that of interior nodes
+ * Description:
+ *	Gets where the calling thread places new nodes (see NodePlacementScope).
+ * Returns: a NUMA node or a NODE_PLACEMENT_ constant
+ */
+int NodeArena::getPlacement(bool leaf)
+{
+	return leaf ? leafPlacement : interiorPlacement;
+}
+
+/* Name: getChunkBytes
+ * Params:
+ *	None
+ * Description:
+ *	Gets the amount of memory handed to the pools, used or not.
+ * Returns: the size of all of the chunks in bytes
+ */
+size_t NodeArena::getChunkBytes()
+{
+	Registry& arena = registry();
+	std::lock_guard<std::mutex> guard(arena.lock);
+	return arena.usedChunks * ARENA_CHUNK_SIZE;
+}
+
+/* Name: findPool
+ * Params:
+ *	int node - a NUMA node or NODE_PLACEMENT_INTERLEAVE
+ *	size_t blockSize - the size of the blocks
+ * Description:
+ *	Finds the pool of blocks of a size on a node, creating it on first use. A tree allocates
+ *	nodes of only a few sizes, so each thread remembers the last pool it used and usually
+ *	skips the registry's lock.
+ * Returns: the pool
+ */
+NodeArena::Pool* NodeArena::findPool(int node, size_t blockSize)
+{
+	static thread_local Pool * lastPool = 0;
+	if (lastPool != 0 && lastPool->node == node && lastPool->blockSize == blockSize) {
+		return lastPool;
+	}
+	Registry& arena = registry();
+	std::lock_guard<std::mutex> guard(arena.lock);
+	Pool *& pool = arena.pools[std::make_pair(node, blockSize)];
+	if (pool == 0) {
+		pool = new Pool();
+		pool->node = node;
+		pool->blockSize = blockSize;
+		pool->freeBlocks = 0;
+		pool->next = 0;
+		pool->end = 0;
+	}
+	lastPool = pool;
+	return pool;
+}
+
+/* Name: addChunk
+ * Params:
+ *	Pool* pool - the pool that ran out of blocks (locked by the caller)
+ * Description:
+ *	Cuts the next chunk from the reserved range (reserving it first if needed), makes it
+ *	writable and binds its pages to the pool's NUMA node, or interleaves them over all nodes,
+ *	before anything touches them. The rest of the pool's previous chunk is left unused.
+ * Returns: true if the pool got a new chunk, false if the range is used up or the chunk could
+ *	not be mapped
+ */
+bool NodeArena::addChunk(Pool* pool)
+{
+	char * chunk = 0;
+	{
+		Registry& arena = registry();
+		std::lock_guard<std::mutex> guard(arena.lock);
+		if (regionBase.load(std::memory_order_relaxed) == 0 && !reserve()) {
+			return false;
+		}
+		if ((arena.usedChunks + 1) * ARENA_CHUNK_SIZE > regionSize) {
+			return false;
+		}
+		chunk = regionBase.load(std::memory_order_relaxed) + arena.usedChunks * ARENA_CHUNK_SIZE;
+		arena.usedChunks += 1;
+	}
+	if (mprotect(chunk, ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE) != 0) {
+		return false;
+	}
+#ifdef BPTREE_NUMA
+	if (pool->node == NODE_PLACEMENT_INTERLEAVE) {
+		numa_interleave_memory(chunk, ARENA_CHUNK_SIZE, numa_all_nodes_ptr);
+	} else {
+		numa_tonode_memory(chunk, ARENA_CHUNK_SIZE, pool->node);
+	}
+#endif
+	reinterpret_cast<Chunk*>(chunk)->pool = pool;
+	pool->next = chunk + ARENA_BLOCK_ALIGNMENT;
+	pool->end = chunk + ARENA_CHUNK_SIZE;
+	return true;
+}
+
+/* Name: reserve
+ * Params:
+ *	None
+ * Description:
+ *	Reserves the range of address space the chunks are cut from (called with the registry
+ *	locked). The range is mapped without access or backing memory, so only the chunks that
+ *	are made writable cost anything; if the system refuses ARENA_MAX_RESERVE, smaller ranges
+ *	are tried.
+ * Returns: true if a range was reserved, false otherwise
+ */
+bool NodeArena::reserve()
+{
+	for (size_t size = ARENA_MAX_RESERVE; size >= ARENA_CHUNK_SIZE * 64; size /= 2) {
+		void * range = mmap(0, size + ARENA_CHUNK_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (range != MAP_FAILED) {
+			uintptr_t start = (reinterpret_cast<uintptr_t>(range) + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1);
+			regionSize = size;
+			regionBase.store(reinterpret_cast<char*>(start), std::memory_order_release);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Name: NodePlacementScope Constructor
+ * Params:
+ *	int leaf - where the calling thread places new leaves (and the value nodes of their pairs)
+ *	int interior - where the calling thread places new interior nodes
+ * Description:
+ *	Sets the placement of the nodes allocated by the calling thread (a NUMA node or a
+ *	NODE_PLACEMENT_ constant for each), remembering the previous one.
+ */
+NodePlacementScope::NodePlacementScope(int leaf, int interior)
+{
+	this->previousLeaf = leafPlacement;
+	this->previousInterior = interiorPlacement;
+	leafPlacement = leaf;
+	interiorPlacement = interior;
+}
+
+/* Name: NodePlacementScope Destructor
+ * Description:
+ *	Restores the placement the calling thread had before the scope.
+ */
+NodePlacementScope::~NodePlacementScope()
+{
+	leafPlacement = this->previousLeaf;
+	interiorPlacement = this->previousInterior;
+}
+
+/* Name: NodeAllocationBatch Constructor
+ * Description:
+ *	Makes the calling thread take the blocks it allocates from the arena in batches.
+ */
+NodeAllocationBatch::NodeAllocationBatch()
+{
+	NodeArena::batchDepth += 1;
+}
+
+/* Name: NodeAllocationBatch Destructor
+ * Description:
+ *	Gives the unused blocks of the calling thread's batches back to their pools once the
+ *	outermost batch on the thread ends.
+ */
+NodeAllocationBatch::~NodeAllocationBatch()
+{
+	NodeArena::batchDepth -= 1;
+	if (NodeArena::batchDepth == 0) {
+		NodeArena::releaseBatches();
+	}
+}
@@ -0,0 +1,92 @@
+#ifndef NODEARENA_H
+#define NODEARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* Memory for the blocks of nodes placed on chosen NUMA nodes. A tree built by one thread
+ * otherwise has all of its pages on that thread's NUMA node (Linux places a page on the node
+ * of the thread that first touches it), and threads on the other sockets pay for remote
+ * memory on every level of every descent. The arena hands out blocks from 2MB chunks whose
+ * pages are bound to one NUMA node or interleaved over all of them with libnuma, keeping a
+ * pool of same-sized blocks per node and size. Freed blocks go back to their pool (from any
+ * thread); the chunks are never given back to the system.
+ *
+ * It is only compiled in when BPTREE_NUMA is defined (cmake -DBPTREE_NUMA=ON, needs libnuma)
+ * and libnuma finds NUMA support at run time; otherwise allocate() always returns 0, the
+ * nodes come from the heap as before and the host counts as a single NUMA node.
+ *
+ * The chunks are cut from one range of address space reserved up front, so that freeing a
+ * node only has to compare its address with the range to know where the block came from. */
+
+/* Constants used for where the blocks of new nodes are placed; a value of 0 or more places
+ * them on that NUMA node */
+#define NODE_PLACEMENT_DEFAULT		-1	//the heap (the node of the thread that first touches the page)
+#define NODE_PLACEMENT_LOCAL		-2	//the NUMA node of the CPU the allocating thread is running on
+#define NODE_PLACEMENT_INTERLEAVE	-3	//pages spread round robin over all of the NUMA nodes
+
+/* Constants used for sizing the arena */
+#define ARENA_CHUNK_SIZE			((size_t)1 << 21)	//the unit of memory bound to a placement (aligned to its size)
+#define ARENA_BLOCK_ALIGNMENT		64					//blocks start on cache lines, as nodes need (see Node::allocate)
+#define ARENA_MAX_RESERVE			((size_t)1 << 40)	//the address space reserved for chunks (halved until the
+														//reservation succeeds)
+#define ARENA_BATCH_BLOCKS			64					//blocks a thread takes from a pool at once inside a
+														//NodeAllocationBatch
+
+class NodeArena {
+public:
+	static void* allocate(size_t, int);
+	static void release(void*);
+	static bool owns(const void*);
+	static bool isNumaAvailable();
+	static int getNumNodes();
+	static int getNodeOfCpu(int);
+	static int getCurrentNode();
+	static int getPlacement(bool);
+	static size_t getChunkBytes();
+private:
+	struct Pool;
+	struct Chunk;
+	struct Registry;
+	struct Batch;
+	static Registry& registry();
+	static Pool* findPool(int, size_t);
+	static bool addChunk(Pool*);
+	static bool reserve();
+	static void* allocateFromBatch(Pool*);
+	static void releaseBatches();
+
+	static std::atomic<char*> regionBase; //the start of the reserved range (0 until the first chunk)
+	static size_t regionSize; //the size of the reserved range in bytes
+	static thread_local std::vector<Batch> batches; //the blocks the thread took in batches, one entry per pool
+	static thread_local int batchDepth; //the number of NodeAllocationBatch objects alive on the thread
+
+	friend class NodeAllocationBatch;
+};
+
+/* Sets where the nodes allocated by the calling thread are placed for as long as it is alive,
+ * separately for leaves (with the value nodes of their pairs) and interior nodes; restores the
+ * previous placement when destroyed. Trees open one around every write (see
+ * BpTree::setNodePlacement()). */
+class NodePlacementScope {
+public:
+	NodePlacementScope(int, int);
+	~NodePlacementScope();
+private:
+	int previousLeaf; //the leaf placement to restore
+	int previousInterior; //the interior placement to restore
+};
+
+/* Makes the calling thread take the blocks it allocates from the arena in batches of
+ * ARENA_BATCH_BLOCKS for as long as it is alive, locking each pool once per batch instead of
+ * once per block. The blocks left over are given back to their pools when the outermost
+ * batch on the thread is destroyed. Meant for bulk copies that allocate many nodes at once
+ * (see BpTree::clone()); nodes that come from the heap are not affected. */
+class NodeAllocationBatch {
+public:
+	NodeAllocationBatch();
+	~NodeAllocationBatch();
+};
+
+#endif
@@ -0,0 +1,1065 @@
+#include "PersistentBpTree.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants used for the type of a page */
+#define PERSIST_LEAF		1
+#define PERSIST_INTERIOR	2
+
+/* Header at the start of every node page, followed by the keys */
+struct PersistentNodeHeader {
+	uint32_t type;
+	uint32_t numKeys;
+};
+
+/* Name: Constructor
+ * Params:
+ *	None
+ * Description:
+ *	Creates a PersistentBpTree without a file; create() or open() must be called before use.
+ */
+PersistentBpTree::PersistentBpTree()
+{
+	this->fd = -1;
+	this->map = 0;
+	this->mapSize = 0;
+	std::memset(&this->current, 0, sizeof(this->current));
+	this->currentSlot = 0;
+	this->childrenOffset = 0;
+	this->valuesOffset = 0;
+	this->freePagesKnown = false;
+	this->commitHook = 0;
+	this->commitArgument = 0;
+}
+
+/* Name: Destructor
+ * Params:
+ *	None
+ * Description:
+ *	Closes the file. Every committed update is already on disk.
+ */
+PersistentBpTree::~PersistentBpTree()
+{
+	this->close();
+}
+
+/* Name: create
+ * Params:
+ *	const std::string& path - the file to create (an existing file is overwritten)
+ *	const int maxKeys - the maximum number of keys per node
+ *	const int maxValueSize - the maximum length of a value in bytes
+ * Description:
+ *	Creates a file holding an empty tree and opens it.
+ * Returns: true if the file was created, false otherwise
+ */
+bool PersistentBpTree::create(const std::string& path, const int maxKeys, const int maxValueSize)
+{
+	this->close();
+	if (maxKeys < 2 || maxValueSize < 0) {
+		return false;
+	}
+	this->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (this->fd < 0) {
+		return false;
+	}
+	this->path = path;
+	size_t nodeBytes = sizeof(PersistentNodeHeader) + maxKeys * sizeof(int);
+	nodeBytes = (nodeBytes + 7) / 8 * 8;
+	nodeBytes += std::max((maxKeys + 1) * sizeof(uint64_t), maxKeys * (sizeof(uint32_t) + (size_t)maxValueSize));
+	PersistentSuperblock superblock;
+	std::memset(&superblock, 0, sizeof(superblock));
+	superblock.magic = PERSIST_MAGIC;
+	superblock.version = PERSIST_VERSION;
+	superblock.maxKeys = maxKeys;
+	superblock.maxValueSize = maxValueSize;
+	superblock.pageSize = (nodeBytes + PERSIST_SLOT_SIZE - 1) / PERSIST_SLOT_SIZE * PERSIST_SLOT_SIZE;
+	superblock.checksum = checksum(superblock);
+	//the file starts with room for 16 pages and doubles when it is full
+	if (ftruncate(this->fd, PERSIST_PAGES_OFFSET + 16 * (size_t)superblock.pageSize) != 0 ||
+		!this->mapFile(PERSIST_PAGES_OFFSET + 16 * (size_t)superblock.pageSize)) {
+		this->close();
+		return false;
+	}
+	std::memcpy(this->map, &superblock, sizeof(superblock));
+	if (msync(this->map, PERSIST_SLOT_SIZE, MS_SYNC) != 0 || !this->loadSuperblock()) {
+		this->close();
+		return false;
+	}
+	this->freePagesKnown = true;
+	return true;
+}
+
+/* Name: open
+ * Params:
+ *	const std::string& path - a file made by create()
+ * Description:
+ *	Opens the tree in a file by mapping the file and picking the current superblock. Nothing
+ *	is read or repaired: the tree as of the last commit before the file was closed (or before
+ *	the process holding it crashed) is ready to use.
+ * Returns: true if the file holds a tree, false otherwise
+ */
+bool PersistentBpTree::open(const std::string& path)
+{
+	this->close();
+	this->fd = ::open(path.c_str(), O_RDWR);
+	if (this->fd < 0) {
+		return false;
+	}
+	this->path = path;
+	struct stat status;
+	if (fstat(this->fd, &status) != 0 || (size_t)status.st_size < PERSIST_PAGES_OFFSET ||
+		!this->mapFile(status.st_size) || !this->loadSuperblock()) {
+		this->close();
+		return false;
+	}
+	this->freePagesKnown = false;
+	return true;
+}
+
+/* Name: close
+ * Params:
+ *	None
+ * Description:
+ *	Unmaps and closes the file, if one is open.
+ * Returns: None
+ */
+void PersistentBpTree::close()
+{
+	if (this->map != 0) {
+		munmap(this->map, this->mapSize);
+		this->map = 0;
+		this->mapSize = 0;
+	}
+	if (this->fd >= 0) {
+		::close(this->fd);
+		this->fd = -1;
+	}
+	std::memset(&this->current, 0, sizeof(this->current));
+	this->path.clear();
+	this->freePages.clear();
+	this->replacedPages.clear();
+	this->newPages.clear();
+	this->freePagesKnown = false;
+}
+
+/* Name: isOpen
+ * Params:
+ *	None
+ * Description:
+ *	Checks whether a file is open.
+ * Returns: true if a file is open, false otherwise
+ */
+bool PersistentBpTree::isOpen()
+{
+	return this->map != 0;
+}
+
+/* Name: mapFile
+ * Params:
+ *	size_t size - the size of the file
+ * Description:
+ *	Maps the whole file, replacing the previous mapping (pointers into pages are invalidated).
+ * Returns: true if the file was mapped, false otherwise
+ */
+bool PersistentBpTree::mapFile(size_t size)
+{
+	if (this->map != 0) {
+		munmap(this->map, this->mapSize);
+		this->map = 0;
+		this->mapSize = 0;
+	}
+	void * address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+	if (address == MAP_FAILED) {
+		return false;
+	}
+	this->map = (char *)address;
+	this->mapSize = size;
+	return true;
+}
+
+/* Name: checksum
+ * Params:
+ *	const PersistentSuperblock& superblock - a superblock
+ * Description:
+ *	Computes the FNV-1a hash of the fields of a superblock before its checksum.
+ * Returns: the checksum
+ */
+uint64_t PersistentBpTree::checksum(const PersistentSuperblock& superblock)
+{
+	const unsigned char * bytes = (const unsigned char *)&superblock;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < offsetof(PersistentSuperblock, checksum); i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Name: loadSuperblock
+ * Params:
+ *	None
+ * Description:
+ *	Picks the current superblock: the one with the highest generation among the slots that
+ *	hold an intact superblock describing pages inside the file.
+ * Returns: true if a superblock was found, false otherwise
+ */
+bool PersistentBpTree::loadSuperblock()
+{
+	int found = -1;
+	PersistentSuperblock slots[2];
+	for (int slot = 0; slot < 2; slot++) {
+		std::memcpy(&slots[slot], this->map + slot * PERSIST_SLOT_SIZE, sizeof(PersistentSuperblock));
+		const PersistentSuperblock& superblock = slots[slot];
+		if (superblock.magic != PERSIST_MAGIC || superblock.version != PERSIST_VERSION ||
+			superblock.checksum != checksum(superblock) || superblock.pageSize == 0 ||
+			superblock.pageSize % PERSIST_SLOT_SIZE != 0 ||
+			PERSIST_PAGES_OFFSET + superblock.numPages * superblock.pageSize > this->mapSize) {
+			continue;
+		}
+		if (found == -1 || superblock.generation > slots[found].generation) {
+			found = slot;
+		}
+	}
+	if (found == -1) {
+		return false;
+	}
+	this->current = slots[found];
+	this->currentSlot = found;
+	this->childrenOffset = (sizeof(PersistentNodeHeader) + this->current.maxKeys * sizeof(int) + 7) / 8 * 8;
+	this->valuesOffset = this->childrenOffset + this->current.maxKeys * sizeof(uint32_t);
+	return true;
+}
+
+/* Name: page
+ * Params:
+ *	uint64_t offset - the offset of a page in the file
+ * Description:
+ *	Finds a page in the mapping.
+ * Returns: a pointer to the page
+ */
+char * PersistentBpTree::page(uint64_t offset)
+{
+	return this->map + offset;
+}
+
+/* Name: isLeaf
+ * Params:
+ *	uint64_t offset - the offset of a node page
+ * Description:
+ *	Checks the type of a node.
+ * Returns: true if the node is a leaf, false otherwise
+ */
+bool PersistentBpTree::isLeaf(uint64_t offset)
+{
+	return ((PersistentNodeHeader *)this->page(offset))->type == PERSIST_LEAF;
+}
+
+/* Name: getNumKeys
+ * Params:
+ *	uint64_t offset - the offset of a node page
+ * Description:
+ *	Gets the number of keys in a node.
+ * Returns: the number of keys
+ */
+int PersistentBpTree::getNumKeys(uint64_t offset)
+{
+	return ((PersistentNodeHeader *)this->page(offset))->numKeys;
+}
+
+/* Name: getKeys
+ * Params:
+ *	uint64_t offset - the offset of a node page
+ * Description:
+ *	Finds the keys of a node.
+ * Returns: a pointer to the keys
+ */
+int * PersistentBpTree::getKeys(uint64_t offset)
+{
+	return (int *)(this->page(offset) + sizeof(PersistentNodeHeader));
+}
+
+/* Name: getChildren
+ * Params:
+ *	uint64_t offset - the offset of an interior node page
+ * Description:
+ *	Finds the page offsets of the children of an interior node.
+ * Returns: a pointer to the children
+ */
+uint64_t * PersistentBpTree::getChildren(uint64_t offset)
+{
+	return (uint64_t *)(this->page(offset) + this->childrenOffset);
+}
+
+/* Name: getLengths
+ * Params:
+ *	uint64_t offset - the offset of a leaf page
+ * Description:
+ *	Finds the lengths of the values of a leaf.
+ * Returns: a pointer to the lengths
+ */
+uint32_t * PersistentBpTree::getLengths(uint64_t offset)
+{
+	return (uint32_t *)(this->page(offset) + this->childrenOffset);
+}
+
+/* Name: getValue
+ * Params:
+ *	uint64_t offset - the offset of a leaf page
+ *	int index - the index of a pair in the leaf
+ * Description:
+ *	Finds a value of a leaf. Every value has a slot of maxValueSize bytes.
+ * Returns: a pointer to the value
+ */
+char * PersistentBpTree::getValue(uint64_t offset, int index)
+{
+	return this->page(offset) + this->valuesOffset + (size_t)index * this->current.maxValueSize;
+}
+
+/* Name: findChild
+ * Params:
+ *	uint64_t offset - the offset of an interior node page
+ *	int key - a key
+ * Description:
+ *	Finds the child of an interior node that a key belongs in.
+ * Returns: the index of the child
+ */
+int PersistentBpTree::findChild(uint64_t offset, int key)
+{
+	int * keys = this->getKeys(offset);
+	return std::upper_bound(keys, keys + this->getNumKeys(offset), key) - keys;
+}
+
+/* Name: findLeaf
+ * Params:
+ *	const int key - a key
+ *	std::vector<std::pair<uint64_t, int> >& path - filled with the interior nodes passed
+ *		through and the index of the child taken in each, from the root down
+ * Description:
+ *	Walks from the root to the leaf that a key belongs in. The tree must not be empty.
+ * Returns: the offset of the leaf
+ */
+uint64_t PersistentBpTree::findLeaf(const int key, std::vector<std::pair<uint64_t, int> >& path)
+{
+	path.clear();
+	uint64_t node = this->current.root;
+	while (!this->isLeaf(node)) {
+		int index = this->findChild(node, key);
+		path.push_back(std::make_pair(node, index));
+		node = this->getChildren(node)[index];
+	}
+	return node;
+}
+
+/* Name: readNode
+ * Params:
+ *	uint64_t offset - the offset of a node page
+ * Description:
+ *	Copies a node out of its page, to be changed and written to a new page.
+ * Returns: the copy
+ */
+PersistentBpTree::NodeCopy PersistentBpTree::readNode(uint64_t offset)
+{
+	NodeCopy node;
+	int numKeys = this->getNumKeys(offset);
+	int * keys = this->getKeys(offset);
+	node.leaf = this->isLeaf(offset);
+	node.keys.assign(keys, keys + numKeys);
+	if (node.leaf) {
+		uint32_t * lengths = this->getLengths(offset);
+		for (int i = 0; i < numKeys; i++) {
+			node.values.push_back(std::string(this->getValue(offset, i), lengths[i]));
+		}
+	} else {
+		uint64_t * children = this->getChildren(offset);
+		node.children.assign(children, children + numKeys + 1);
+	}
+	return node;
+}
+
+/* Name: writeNode
+ * Params:
+ *	const NodeCopy& node - a node holding at most maxKeys keys
+ * Description:
+ *	Writes a node into a free page. The page is synced by the next commit.
+ * Returns: the offset of the page
+ */
+uint64_t PersistentBpTree::writeNode(const NodeCopy& node)
+{
+	uint64_t offset = this->allocatePage();
+	PersistentNodeHeader * header = (PersistentNodeHeader *)this->page(offset);
+	header->type = node.leaf ? PERSIST_LEAF : PERSIST_INTERIOR;
+	header->numKeys = node.keys.size();
+	std::copy(node.keys.begin(), node.keys.end(), this->getKeys(offset));
+	if (node.leaf) {
+		for (size_t i = 0; i < node.values.size(); i++) {
+			this->getLengths(offset)[i] = node.values[i].size();
+			std::memcpy(this->getValue(offset, i), node.values[i].data(), node.values[i].size());
+		}
+	} else {
+		std::copy(node.children.begin(), node.children.end(), this->getChildren(offset));
+	}
+	this->newPages.push_back(offset);
+	return offset;
+}
+
+/* Name: copyPath
+ * Params:
+ *	std::vector<std::pair<uint64_t, int> >& path - the path from the root to the leaf (see findLeaf())
+ *	NodeCopy& leaf - the changed copy of the leaf, which may hold one key too many
+ * Description:
+ *	Writes a changed leaf and copies of its ancestors pointing at it into new pages,
+ *	splitting every node that ends up with more than maxKeys keys on the way up. The pages of
+ *	the old path are freed by the commit.
+ * Returns: the offset of the new root
+ */
+uint64_t PersistentBpTree::copyPath(std::vector<std::pair<uint64_t, int> >& path, NodeCopy& leaf)
+{
+	size_t maxKeys = this->current.maxKeys;
+	NodeCopy node(std::move(leaf));
+	uint64_t left = 0;
+	uint64_t right = 0;
+	int separator = 0;
+	for (size_t level = path.size() + 1; level-- > 0;) {
+		if (node.keys.size() > maxKeys) {
+			NodeCopy sibling;
+			sibling.leaf = node.leaf;
+			if (node.leaf) {
+				//left keeps half of the pairs; the first key of the right leaf goes up
+				size_t half = node.keys.size() / 2;
+				sibling.keys.assign(node.keys.begin() + half, node.keys.end());
+				sibling.values.assign(node.values.begin() + half, node.values.end());
+				node.keys.resize(half);
+				node.values.resize(half);
+				separator = sibling.keys[0];
+			} else {
+				//left keeps half of the children; the key between the halves goes up
+				size_t half = (node.children.size() + 1) / 2;
+				separator = node.keys[half - 1];
+				sibling.keys.assign(node.keys.begin() + half, node.keys.end());
+				sibling.children.assign(node.children.begin() + half, node.children.end());
+				node.keys.resize(half - 1);
+				node.children.resize(half);
+			}
+			left = this->writeNode(node);
+			right = this->writeNode(sibling);
+		} else {
+			left = this->writeNode(node);
+			right = 0;
+		}
+		if (level == 0) {
+			break;
+		}
+		NodeCopy parent = this->readNode(path[level - 1].first);
+		int index = path[level - 1].second;
+		parent.children[index] = left;
+		if (right != 0) {
+			parent.keys.insert(parent.keys.begin() + index, separator);
+			parent.children.insert(parent.children.begin() + index + 1, right);
+		}
+		node = std::move(parent);
+	}
+	if (right == 0) {
+		return left;
+	}
+	NodeCopy root;
+	root.leaf = false;
+	root.keys.push_back(separator);
+	root.children.push_back(left);
+	root.children.push_back(right);
+	return this->writeNode(root);
+}
+
+/* Name: rebalance
+ * Params:
+ *	NodeCopy& parent - a copy of an interior node
+ *	const int index - the index in the parent of the left one of two neighbouring children
+ *	NodeCopy& left - a copy of the child at index
+ *	NodeCopy& right - a copy of the child at index + 1
+ * Description:
+ *	Fixes an underfull child by merging it with its neighbour when their pairs (or children)
+ *	fit in one node, and by spreading them evenly over both otherwise. The result is written
+ *	into new pages and the parent is changed to point at them.
+ * Returns: None
+ */
+void PersistentBpTree::rebalance(NodeCopy& parent, const int index, NodeCopy& left, NodeCopy& right)
+{
+	size_t maxKeys = this->current.maxKeys;
+	if (left.leaf) {
+		left.keys.insert(left.keys.end(), right.keys.begin(), right.keys.end());
+		left.values.insert(left.values.end(), right.values.begin(), right.values.end());
+		if (left.keys.size() <= maxKeys) {
+			parent.children[index] = this->writeNode(left);
+			parent.keys.erase(parent.keys.begin() + index);
+			parent.children.erase(parent.children.begin() + index + 1);
+			return;
+		}
+		size_t half = left.keys.size() / 2;
+		right.keys.assign(left.keys.begin() + half, left.keys.end());
+		right.values.assign(left.values.begin() + half, left.values.end());
+		left.keys.resize(half);
+		left.values.resize(half);
+		parent.keys[index] = right.keys[0];
+	} else {
+		//the separator between the two comes down between their keys
+		left.keys.push_back(parent.keys[index]);
+		left.keys.insert(left.keys.end(), right.keys.begin(), right.keys.end());
+		left.children.insert(left.children.end(), right.children.begin(), right.children.end());
+		if (left.children.size() <= maxKeys + 1) {
+			parent.children[index] = this->writeNode(left);
+			parent.keys.erase(parent.keys.begin() + index);
+			parent.children.erase(parent.children.begin() + index + 1);
+			return;
+		}
+		size_t half = left.children.size() / 2;
+		parent.keys[index] = left.keys[half - 1];
+		right.keys.assign(left.keys.begin() + half, left.keys.end());
+		right.children.assign(left.children.begin() + half, left.children.end());
+		left.keys.resize(half - 1);
+		left.children.resize(half);
+	}
+	parent.children[index] = this->writeNode(left);
+	parent.children[index + 1] = this->writeNode(right);
+}
+
+/* Name: reserve
+ * Params:
+ *	size_t pages - the number of pages an update may write
+ * Description:
+ *	Makes sure that an update can write a number of pages without the file growing while it
+ *	runs (growing remaps the file), finding the free pages first if the file was just opened.
+ *	The file is doubled in size when it is too small.
+ * Returns: true if the pages are available, false if the file could not be grown
+ */
+bool PersistentBpTree::reserve(size_t pages)
+{
+	if (!this->freePagesKnown) {
+		this->findFreePages();
+	}
+	size_t capacity = (this->mapSize - PERSIST_PAGES_OFFSET) / this->current.pageSize;
+	size_t available = this->freePages.size() + capacity - this->current.numPages;
+	if (available >= pages) {
+		return true;
+	}
+	size_t newCapacity = std::max(capacity * 2, capacity + pages - available);
+	size_t newSize = PERSIST_PAGES_OFFSET + newCapacity * this->current.pageSize;
+	if (ftruncate(this->fd, newSize) != 0) {
+		return false;
+	}
+	if (!this->mapFile(newSize)) {
+		this->close();
+		return false;
+	}
+	return true;
+}
+
+/* Name: allocatePage
+ * Params:
+ *	None
+ * Description:
+ *	Takes a free page, or the next page that was never used (see reserve()).
+ * Returns: the offset of the page
+ */
+uint64_t PersistentBpTree::allocatePage()
+{
+	if (!this->freePages.empty()) {
+		uint64_t offset = this->freePages.back();
+		this->freePages.pop_back();
+		return offset;
+	}
+	this->current.numPages += 1;
+	return PERSIST_PAGES_OFFSET + (this->current.numPages - 1) * this->current.pageSize;
+}
+
+/* Name: findFreePages
+ * Params:
+ *	None
+ * Description:
+ *	Finds the pages the current tree does not use by walking it. Those pages held older
+ *	versions of the tree, or nodes written by an update that never committed.
+ * Returns: None
+ */
+void PersistentBpTree::findFreePages()
+{
+	std::vector<bool> used(this->current.numPages, false);
+	std::vector<uint64_t> stack;
+	if (this->current.root != 0) {
+		stack.push_back(this->current.root);
+	}
+	while (!stack.empty()) {
+		uint64_t node = stack.back();
+		stack.pop_back();
+		used[(node - PERSIST_PAGES_OFFSET) / this->current.pageSize] = true;
+		if (!this->isLeaf(node)) {
+			uint64_t * children = this->getChildren(node);
+			stack.insert(stack.end(), children, children + this->getNumKeys(node) + 1);
+		}
+	}
+	this->freePages.clear();
+	for (size_t i = used.size(); i-- > 0;) {
+		if (!used[i]) {
+			this->freePages.push_back(PERSIST_PAGES_OFFSET + i * this->current.pageSize);
+		}
+	}
+	this->freePagesKnown = true;
+}
+
+/* Name: commit
+ * Params:
+ *	uint64_t root - the offset of the new root (0 for an empty tree)
+ *	long keysAdded - the change in the number of keys
+ * Description:
+ *	Makes an update durable: syncs the pages it wrote, then writes and syncs a superblock
+ *	pointing at the new root into the slot that does not hold the current superblock. Until
+ *	that superblock is on disk, a crash leaves the previous tree in charge. The pages the
+ *	update replaced become free once it is committed; they cannot be reused earlier, since
+ *	the previous tree still uses them. If the superblock cannot be synced, the file is
+ *	closed, because whether the update reached the disk is unknown.
+ * Returns: true if the update was committed, false otherwise
+ */
+bool PersistentBpTree::commit(uint64_t root, long keysAdded)
+{
+	if (this->commitHook != 0) {
+		this->commitHook(PERSIST_PAGES_WRITTEN, this->commitArgument);
+	}
+	for (size_t i = 0; i < this->newPages.size(); i++) {
+		if (msync(this->page(this->newPages[i]), this->current.pageSize, MS_SYNC) != 0) {
+			this->freePages.insert(this->freePages.end(), this->newPages.begin(), this->newPages.end());
+			this->newPages.clear();
+			this->replacedPages.clear();
+			return false;
+		}
+	}
+	if (this->commitHook != 0) {
+		this->commitHook(PERSIST_PAGES_SYNCED, this->commitArgument);
+	}
+	PersistentSuperblock superblock = this->current;
+	superblock.generation += 1;
+	superblock.root = root;
+	superblock.numKeys += keysAdded;
+	superblock.checksum = checksum(superblock);
+	int slot = 1 - this->currentSlot;
+	std::memcpy(this->map + slot * PERSIST_SLOT_SIZE, &superblock, sizeof(superblock));
+	if (this->commitHook != 0) {
+		this->commitHook(PERSIST_SUPERBLOCK_WRITTEN, this->commitArgument);
+	}
+	if (msync(this->map + slot * PERSIST_SLOT_SIZE, PERSIST_SLOT_SIZE, MS_SYNC) != 0) {
+		this->close();
+		return false;
+	}
+	this->current = superblock;
+	this->currentSlot = slot;
+	this->freePages.insert(this->freePages.end(), this->replacedPages.begin(), this->replacedPages.end());
+	this->replacedPages.clear();
+	this->newPages.clear();
+	if (this->commitHook != 0) {
+		this->commitHook(PERSIST_COMMITTED, this->commitArgument);
+	}
+	return true;
+}
+
+/* Name: insert
+ * Params:
+ *	const int key - the key to insert
+ *	const std::string value - the value to insert, at most maxValueSize bytes long
+ * Description:
+ *	Inserts a key/value pair and commits it: the leaf and its ancestors are copied into new
+ *	pages, with the splits the insert causes, and the new root is committed.
+ * Returns: true if the pair was inserted, false if the key exists, the value is too long or
+ *	the update could not be written
+ */
+bool PersistentBpTree::insert(const int key, const std::string value)
+{
+	if (this->map == 0 || value.size() > this->current.maxValueSize) {
+		return false;
+	}
+	std::vector<std::pair<uint64_t, int> > path;
+	if (this->current.root == 0) {
+		if (!this->reserve(1)) {
+			return false;
+		}
+		NodeCopy leaf;
+		leaf.leaf = true;
+		leaf.keys.push_back(key);
+		leaf.values.push_back(value);
+		return this->commit(this->writeNode(leaf), 1);
+	}
+	//offsets stay valid when reserve() remaps the file; every level may split, and the root
+	//may grow a new level above it
+	uint64_t offset = this->findLeaf(key, path);
+	if (!this->reserve(2 * path.size() + 3)) {
+		return false;
+	}
+	NodeCopy leaf = this->readNode(offset);
+	std::vector<int>::iterator position = std::lower_bound(leaf.keys.begin(), leaf.keys.end(), key);
+	if (position != leaf.keys.end() && *position == key) {
+		return false;
+	}
+	leaf.values.insert(leaf.values.begin() + (position - leaf.keys.begin()), value);
+	leaf.keys.insert(position, key);
+	this->replacedPages.push_back(offset);
+	for (size_t i = 0; i < path.size(); i++) {
+		this->replacedPages.push_back(path[i].first);
+	}
+	return this->commit(this->copyPath(path, leaf), 1);
+}
+
+/* Name: update
+ * Params:
+ *	const int key - the key to update
+ *	const std::string value - the new value, at most maxValueSize bytes long
+ * Description:
+ *	Replaces the value of a key and commits it, copying the leaf and its ancestors.
+ * Returns: true if the value was replaced, false if the key is not in the tree, the value is
+ *	too long or the update could not be written
+ */
+bool PersistentBpTree::update(const int key, const std::string value)
+{
+	if (this->map == 0 || this->current.root == 0 || value.size() > this->current.maxValueSize) {
+		return false;
+	}
+	std::vector<std::pair<uint64_t, int> > path;
+	uint64_t offset = this->findLeaf(key, path);
+	if (!this->reserve(path.size() + 1)) {
+		return false;
+	}
+	NodeCopy leaf = this->readNode(offset);
+	std::vector<int>::iterator position = std::lower_bound(leaf.keys.begin(), leaf.keys.end(), key);
+	if (position == leaf.keys.end() || *position != key) {
+		return false;
+	}
+	leaf.values[position - leaf.keys.begin()] = value;
+	this->replacedPages.push_back(offset);
+	for (size_t i = 0; i < path.size(); i++) {
+		this->replacedPages.push_back(path[i].first);
+	}
+	return this->commit(this->copyPath(path, leaf), 0);
+}
+
+/* Name: remove
+ * Params:
+ *	const int key - the key to remove
+ * Description:
+ *	Removes a key and its value and commits it. The leaf and its ancestors are copied into new
+ *	pages; a copy left underfull is merged with or borrows from a neighbour (which is copied
+ *	too), and a root left with a single child is replaced by that child.
+ * Returns: true if the key was removed, false if it is not in the tree or the update could
+ *	not be written
+ */
+bool PersistentBpTree::remove(const int key)
+{
+	if (this->map == 0 || this->current.root == 0) {
+		return false;
+	}
+	std::vector<std::pair<uint64_t, int> > path;
+	uint64_t offset = this->findLeaf(key, path);
+	//every level writes at most the node and its neighbour
+	if (!this->reserve(2 * path.size() + 2)) {
+		return false;
+	}
+	NodeCopy node = this->readNode(offset);
+	std::vector<int>::iterator position = std::lower_bound(node.keys.begin(), node.keys.end(), key);
+	if (position == node.keys.end() || *position != key) {
+		return false;
+	}
+	node.values.erase(node.values.begin() + (position - node.keys.begin()));
+	node.keys.erase(position);
+	this->replacedPages.push_back(offset);
+	size_t minKeys = (this->current.maxKeys + 1) / 2;
+	size_t minChildren = (this->current.maxKeys + 2) / 2;
+	for (size_t level = path.size(); level > 0; level--) {
+		NodeCopy parent = this->readNode(path[level - 1].first);
+		int index = path[level - 1].second;
+		this->replacedPages.push_back(path[level - 1].first);
+		if (node.leaf ? node.keys.size() >= minKeys : node.children.size() >= minChildren) {
+			parent.children[index] = this->writeNode(node);
+		} else {
+			int neighbour = index > 0 ? index - 1 : index + 1;
+			NodeCopy sibling = this->readNode(parent.children[neighbour]);
+			this->replacedPages.push_back(parent.children[neighbour]);
+			if (neighbour < index) {
+				this->rebalance(parent, neighbour, sibling, node);
+			} else {
+				this->rebalance(parent, index, node, sibling);
+			}
+		}
+		node = std::move(parent);
+	}
+	uint64_t root = 0;
+	if (!node.leaf && node.children.size() == 1) {
+		root = node.children[0];
+	} else if (!node.keys.empty()) {
+		root = this->writeNode(node);
+	}
+	return this->commit(root, -1);
+}
+
+/* Name: find
+ * Params:
+ *	const int key - the key to look for
+ *	std::string& value - set to the value of the key if it is found
+ * Description:
+ *	Looks up a key, reading the pages straight from the mapping.
+ * Returns: true if the key was found, false otherwise
+ */
+bool PersistentBpTree::find(const int key, std::string& value)
+{
+	if (this->map == 0 || this->current.root == 0) {
+		return false;
+	}
+	uint64_t node = this->current.root;
+	int result = this->searchPage(this->page(node), key, node, value);
+	while (result == PERSIST_SEARCH_CHILD) {
+		result = this->searchPage(this->page(node), key, node, value);
+	}
+	return result == PERSIST_SEARCH_FOUND;
+}
+
+/* Name: searchPage
+ * Params:
+ *	const char* page - a copy of a node page of the file (or the page in the mapping)
+ *	const int key - the key to look for
+ *	uint64_t& child - set to the offset of the child the key is under, for an interior node
+ *	std::string& value - set to the value of the key, for a leaf holding it
+ * Description:
+ *	Takes one step of a lookup on a page. Readers that fetch pages themselves (see
+ *	AsyncLookup) use it to walk the tree without the mapping.
+ * Returns: one of the PERSIST_SEARCH_ constants
+ */
+int PersistentBpTree::searchPage(const char* page, const int key, uint64_t& child, std::string& value)
+{
+	const PersistentNodeHeader * header = (const PersistentNodeHeader *)page;
+	const int * keys = (const int *)(page + sizeof(PersistentNodeHeader));
+	const int * end = keys + header->numKeys;
+	if (header->type != PERSIST_LEAF) {
+		child = ((const uint64_t *)(page + this->childrenOffset))[std::upper_bound(keys, end, key) - keys];
+		return PERSIST_SEARCH_CHILD;
+	}
+	const int * position = std::lower_bound(keys, end, key);
+	if (position == end || *position != key) {
+		return PERSIST_SEARCH_MISSING;
+	}
+	size_t index = position - keys;
+	value.assign(page + this->valuesOffset + index * this->current.maxValueSize,
+		((const uint32_t *)(page + this->childrenOffset))[index]);
+	return PERSIST_SEARCH_FOUND;
+}
+
+/* Name: size
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of keys in the tree, which the superblock keeps.
+ * Returns: the number of keys
+ */
+size_t PersistentBpTree::size()
+{
+	return this->current.numKeys;
+}
+
+/* Name: getGeneration
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of updates committed to the file since it was created.
+ * Returns: the generation of the current superblock
+ */
+uint64_t PersistentBpTree::getGeneration()
+{
+	return this->current.generation;
+}
+
+/* Name: getMaxKeys
+ * Params:
+ *	None
+ * Description:
+ *	Gets the maximum number of keys per node the file was created with.
+ * Returns: the maximum number of keys per node
+ */
+int PersistentBpTree::getMaxKeys()
+{
+	return this->current.maxKeys;
+}
+
+/* Name: getMaxValueSize
+ * Params:
+ *	None
+ * Description:
+ *	Gets the maximum length of a value the file was created with.
+ * Returns: the maximum length of a value in bytes
+ */
+int PersistentBpTree::getMaxValueSize()
+{
+	return this->current.maxValueSize;
+}
+
+/* Name: getPath
+ * Params:
+ *	None
+ * Description:
+ *	Gets the path of the file the tree was created in or opened from.
+ * Returns: the path of the file
+ */
+const std::string& PersistentBpTree::getPath()
+{
+	return this->path;
+}
+
+/* Name: getRoot
+ * Params:
+ *	None
+ * Description:
+ *	Gets the offset of the root page of the current tree. The pages under it are not written
+ *	to until an update replaces them and a later update reuses them.
+ * Returns: the offset of the root page, or 0 for an empty tree
+ */
+uint64_t PersistentBpTree::getRoot()
+{
+	return this->current.root;
+}
+
+/* Name: getPageSize
+ * Params:
+ *	None
+ * Description:
+ *	Gets the size of the node pages (a multiple of 4096 bytes).
+ * Returns: the size of a page in bytes
+ */
+size_t PersistentBpTree::getPageSize()
+{
+	return this->current.pageSize;
+}
+
+/* Name: setCommitHook
+ * Params:
+ *	CommitHook hook - called with the PERSIST_ constant of every stage of every commit, or 0
+ *	void* argument - passed to the hook
+ * Description:
+ *	Sets a function to call at each stage of a commit, for injecting crashes in tests.
+ * Returns: None
+ */
+void PersistentBpTree::setCommitHook(CommitHook hook, void* argument)
+{
+	this->commitHook = hook;
+	this->commitArgument = argument;
+}
+
+/* Name: validate
+ * Params:
+ *	std::string& error - set to a description of the first problem found
+ * Description:
+ *	Checks the structure of the current tree: every page offset points at a page inside the
+ *	file that no other node uses, keys are in order and inside the bounds set by the
+ *	separators above them, nodes other than the root are at least half full, every leaf is at
+ *	the same depth, and the number of keys matches the superblock.
+ * Returns: true if the tree is valid, false otherwise
+ */
+bool PersistentBpTree::validate(std::string& error)
+{
+	if (this->map == 0) {
+		error = "no file is open";
+		return false;
+	}
+	if (this->current.root == 0) {
+		if (this->current.numKeys != 0) {
+			error = "empty tree with a key count of " + std::to_string(this->current.numKeys);
+			return false;
+		}
+		return true;
+	}
+	std::vector<bool> used(this->current.numPages, false);
+	int leafDepth = -1;
+	long numKeys = this->validatePage(this->current.root, LONG_MIN, LONG_MAX, 0, leafDepth, used, error);
+	if (numKeys < 0) {
+		return false;
+	}
+	if ((uint64_t)numKeys != this->current.numKeys) {
+		error = "tree holds " + std::to_string(numKeys) + " keys but the superblock counts " +
+			std::to_string(this->current.numKeys);
+		return false;
+	}
+	return true;
+}
+
+/* Name: validatePage
+ * Params:
+ *	uint64_t offset - the offset of a node page
+ *	const long low - the lowest key the node may hold
+ *	const long high - the keys of the node must be below this
+ *	const int depth - the depth of the node (the root is at 0)
+ *	int& leafDepth - the depth of the leaves found so far (-1 before the first)
+ *	std::vector<bool>& used - marks the pages of the nodes checked so far
+ *	std::string& error - set to a description of the first problem found
+ * Description:
+ *	Checks a subtree for validate().
+ * Returns: the number of keys in the subtree's leaves, or -1 if it is not valid
+ */
+long PersistentBpTree::validatePage(uint64_t offset, const long low, const long high, const int depth, int& leafDepth,
+	std::vector<bool>& used, std::string& error)
+{
+	std::string where = "page " + std::to_string(offset) + " at depth " + std::to_string(depth);
+	if (offset < PERSIST_PAGES_OFFSET || (offset - PERSIST_PAGES_OFFSET) % this->current.pageSize != 0 ||
+		(offset - PERSIST_PAGES_OFFSET) / this->current.pageSize >= this->current.numPages) {
+		error = where + " is not a page of the file";
+		return -1;
+	}
+	size_t index = (offset - PERSIST_PAGES_OFFSET) / this->current.pageSize;
+	if (used[index]) {
+		error = where + " is used by two nodes";
+		return -1;
+	}
+	used[index] = true;
+	PersistentNodeHeader * header = (PersistentNodeHeader *)this->page(offset);
+	if (header->type != PERSIST_LEAF && header->type != PERSIST_INTERIOR) {
+		error = where + " has type " + std::to_string(header->type);
+		return -1;
+	}
+	int numKeys = header->numKeys;
+	bool root = offset == this->current.root;
+	bool leaf = header->type == PERSIST_LEAF;
+	int maxKeys = this->current.maxKeys;
+	int minKeys = leaf ? (root ? 1 : (maxKeys + 1) / 2) : (root ? 1 : (maxKeys + 2) / 2 - 1);
+	if (numKeys < minKeys || numKeys > maxKeys) {
+		error = where + " holds " + std::to_string(numKeys) + " keys";
+		return -1;
+	}
+	int * keys = this->getKeys(offset);
+	for (int i = 0; i < numKeys; i++) {
+		if (keys[i] < low || keys[i] >= high || (i > 0 && keys[i] <= keys[i - 1])) {
+			error = where + " has key " + std::to_string(keys[i]) + " out of order or outside [" +
+				std::to_string(low) + ", " + std::to_string(high) + ")";
+			return -1;
+		}
+	}
+	if (leaf) {
+		uint32_t * lengths = this->getLengths(offset);
+		for (int i = 0; i < numKeys; i++) {
+			if (lengths[i] > this->current.maxValueSize) {
+				error = where + " has a value of " + std::to_string(lengths[i]) + " bytes";
+				return -1;
+			}
+		}
+		if (leafDepth == -1) {
+			leafDepth = depth;
+		} else if (leafDepth != depth) {
+			error = where + " is a leaf, but other leaves are at depth " + std::to_string(leafDepth);
+			return -1;
+		}
+		return numKeys;
+	}
+	long total = 0;
+	uint64_t * children = this->getChildren(offset);
+	for (int i = 0; i <= numKeys; i++) {
+		long childKeys = this->validatePage(children[i], i == 0 ? low : keys[i - 1], i == numKeys ? high : keys[i],
+			depth + 1, leafDepth, used, error);
+		if (childKeys < 0) {
+			return -1;
+		}
+		total += childKeys;
+	}
+	return total;
+}
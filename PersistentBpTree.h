@@ -0,0 +1,191 @@
+#ifndef PERSISTENTBPTREE_H
+#define PERSISTENTBPTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Layout of the file: two superblock slots, then the node pages. Every node is one page, and
+ * nodes refer to each other by the file offset of their page, so the file can be mapped at any
+ * address. */
+#define PERSIST_MAGIC				0x5045455254504242ULL	//"BBPTREEP"
+#define PERSIST_VERSION				1
+#define PERSIST_SLOT_SIZE			4096	//each superblock slot fills a page of its own
+#define PERSIST_PAGES_OFFSET		(2 * PERSIST_SLOT_SIZE)
+
+/* Constants used for the stages of a commit reported to the commit hook */
+#define PERSIST_PAGES_WRITTEN		0	//the new pages are written but not synced
+#define PERSIST_PAGES_SYNCED		1	//the new pages are on disk
+#define PERSIST_SUPERBLOCK_WRITTEN	2	//the new superblock is written to its slot but not synced
+#define PERSIST_COMMITTED			3	//the new superblock is on disk
+
+/* Constants used for the result of searching a page (see PersistentBpTree::searchPage()) */
+#define PERSIST_SEARCH_CHILD		0	//the page is an interior node; the key is under the child found
+#define PERSIST_SEARCH_FOUND		1	//the page is a leaf holding the key
+#define PERSIST_SEARCH_MISSING		2	//the page is a leaf without the key
+
+/* Called at every stage of every commit (see setCommitHook()) */
+typedef void (*CommitHook)(int stage, void* argument);
+
+/* The root record of the tree. The two slots are written in turn; the slot with a valid
+ * checksum and the highest generation is the current one, so a superblock that was torn by a
+ * crash while it was written leaves the previous one in charge. */
+struct PersistentSuperblock {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t maxKeys;
+	uint32_t maxValueSize;
+	uint32_t pageSize;
+	uint64_t generation; //the number of commits so far
+	uint64_t root; //offset of the root page (0 for an empty tree)
+	uint64_t numPages; //pages handed out so far, free ones included
+	uint64_t numKeys;
+	uint64_t checksum; //of all of the fields above
+};
+
+/* B+ tree stored in a memory mapped file, durable without a write-ahead log. Updates never
+ * write to a page that the current superblock can reach (shadow paging): insert(), update()
+ * and remove() write copies of the nodes on the path from the leaf to the root into free
+ * pages, sync them, and then commit by syncing a new superblock that points at the new root.
+ * A crash at any point leaves the file holding the tree as of the last commit, and opening
+ * the file is just mapping it and picking the current superblock. The pages the copied nodes
+ * replaced are reused by later updates; after opening, they are found by one walk of the tree
+ * before the first update. Values are stored in the leaves and can be at most maxValueSize
+ * bytes long. Not safe for concurrent use. Cannot be copied, as it owns the file and its
+ * mapping. */
+class PersistentBpTree {
+public:
+	PersistentBpTree();
+	~PersistentBpTree();
+	PersistentBpTree(const PersistentBpTree&) = delete;
+	PersistentBpTree& operator=(const PersistentBpTree&) = delete;
+
+	bool create(const std::string&, const int, const int);
+	bool open(const std::string&);
+	void close();
+	bool isOpen();
+
+	bool insert(const int, const std::string);
+	bool update(const int, const std::string);
+	bool remove(const int);
+	bool find(const int, std::string&);
+	template <typename Visit>
+	int scan(const int, const int, Visit);
+
+	size_t size();
+	uint64_t getGeneration();
+	int getMaxKeys();
+	int getMaxValueSize();
+	const std::string& getPath();
+	uint64_t getRoot();
+	size_t getPageSize();
+	int searchPage(const char*, const int, uint64_t&, std::string&);
+	bool validate(std::string&);
+	void setCommitHook(CommitHook, void*);
+private:
+	/* A node read out of its page, changed in memory and written to new pages */
+	struct NodeCopy {
+		bool leaf;
+		std::vector<int> keys;
+		std::vector<uint64_t> children; //page offsets (interior nodes)
+		std::vector<std::string> values; //(leaves)
+	};
+
+	bool mapFile(size_t);
+	bool loadSuperblock();
+	static uint64_t checksum(const PersistentSuperblock&);
+
+	char * page(uint64_t);
+	bool isLeaf(uint64_t);
+	int getNumKeys(uint64_t);
+	int * getKeys(uint64_t);
+	uint64_t * getChildren(uint64_t);
+	uint32_t * getLengths(uint64_t);
+	char * getValue(uint64_t, int);
+	int findChild(uint64_t, int);
+	uint64_t findLeaf(const int, std::vector<std::pair<uint64_t, int> >&);
+
+	NodeCopy readNode(uint64_t);
+	uint64_t writeNode(const NodeCopy&);
+	uint64_t copyPath(std::vector<std::pair<uint64_t, int> >&, NodeCopy&);
+	void rebalance(NodeCopy&, const int, NodeCopy&, NodeCopy&);
+	bool reserve(size_t);
+	uint64_t allocatePage();
+	void findFreePages();
+	bool commit(uint64_t, long);
+	long validatePage(uint64_t, const long, const long, const int, int&, std::vector<bool>&, std::string&);
+
+	int fd; //the file (-1 while no file is open)
+	std::string path; //the path of the file
+	char * map; //the mapping of the whole file
+	size_t mapSize; //the size of the file and of the mapping
+	PersistentSuperblock current; //copy of the current superblock
+	int currentSlot; //the slot the current superblock is in
+	size_t childrenOffset; //where the children (interior nodes) or value lengths (leaves) start in a page
+	size_t valuesOffset; //where the values start in a leaf page
+	std::vector<uint64_t> freePages; //pages no superblock on disk can reach, free for new nodes
+	std::vector<uint64_t> replacedPages; //pages replaced by the update in progress (free after its commit)
+	std::vector<uint64_t> newPages; //pages written by the update in progress (synced before its commit)
+	bool freePagesKnown; //false until the free pages were found after opening
+	CommitHook commitHook;
+	void * commitArgument;
+};
+
+/* Name: scan
+ * Params:
+ *	const int lo - the lowest key of the scan
+ *	const int hi - the highest key of the scan
+ *	Visit visit - called as visit(int key, const std::string& value) for every pair with
+ *		lo <= key <= hi, in ascending key order; the scan stops early when it returns false
+ * Description:
+ *	Visits a range of key/value pairs. The leaves are not linked to each other (a link would
+ *	have to be rewritten in the neighbour of every copied leaf), so the scan walks the tree
+ *	with a stack of the interior nodes on the path to the current leaf.
+ * Returns: the number of pairs that were visited
+ */
+template <typename Visit>
+int PersistentBpTree::scan(const int lo, const int hi, Visit visit)
+{
+	int visited = 0;
+	if (this->map == 0 || this->current.root == 0 || lo > hi) {
+		return visited;
+	}
+	std::vector<std::pair<uint64_t, int> > path; //interior nodes and the index of the child being scanned
+	uint64_t node = this->current.root;
+	while (!this->isLeaf(node)) {
+		int index = this->findChild(node, lo);
+		path.push_back(std::make_pair(node, index));
+		node = this->getChildren(node)[index];
+	}
+	while (true) {
+		int * keys = this->getKeys(node);
+		for (int i = 0; i < this->getNumKeys(node); i++) {
+			if (keys[i] > hi) {
+				return visited;
+			}
+			if (keys[i] >= lo) {
+				visited += 1;
+				if (!visit(keys[i], std::string(this->getValue(node, i), this->getLengths(node)[i]))) {
+					return visited;
+				}
+			}
+		}
+		//climbing to the nearest ancestor with a child to the right, then down its leftmost path
+		while (!path.empty() && path.back().second >= this->getNumKeys(path.back().first)) {
+			path.pop_back();
+		}
+		if (path.empty()) {
+			return visited;
+		}
+		path.back().second += 1;
+		node = this->getChildren(path.back().first)[path.back().second];
+		while (!this->isLeaf(node)) {
+			path.push_back(std::make_pair(node, 0));
+			node = this->getChildren(node)[0];
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,535 @@
+#include "ShardedBpTree.h"
+#include <climits>
+#include <pthread.h>
+#include <sched.h>
+#include <utility>
+
+/* Name: Constructor
+ * Params:
+ *	const int maxKeys - the maximum number of keys per node of each shard's tree
+ *	const int numShards - the number of shards
+ * Description:
+ *	Creates a container whose shards split the whole int key space into equal ranges. For
+ *	keys that only cover part of it, give the boundaries (or let rebalance() find them).
+ */
+ShardedBpTree::ShardedBpTree(const int maxKeys, const int numShards)
+{
+	int count = numShards > 1 ? numShards : 1;
+	std::vector<int> boundaries;
+	for (int i = 1; i < count; i++) {
+		boundaries.push_back((int)((long long)INT_MIN + (long long)i * (1LL << 32) / count));
+	}
+	this->createShards(maxKeys, boundaries);
+}
+
+/* Name: Constructor
+ * Params:
+ *	const int maxKeys - the maximum number of keys per node of each shard's tree
+ *	const std::vector<int>& boundaries - the lowest key of each shard but the first (a shard
+ *		per boundary plus one; duplicates are dropped)
+ * Description:
+ *	Creates a container with the given shard ranges.
+ */
+ShardedBpTree::ShardedBpTree(const int maxKeys, const std::vector<int>& boundaries)
+{
+	std::vector<int> sorted(boundaries);
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+	//INT_MIN as a boundary would leave the first shard an empty range
+	if (!sorted.empty() && sorted[0] == INT_MIN) {
+		sorted.erase(sorted.begin());
+	}
+	this->createShards(maxKeys, sorted);
+}
+
+/* Name: Destructor
+ * Params:
+ *	None
+ * Description:
+ *	Deletes the shards and their trees.
+ */
+ShardedBpTree::~ShardedBpTree()
+{
+	for (size_t i = 0; i < this->shards.size(); i++) {
+		delete this->shards[i];
+	}
+	delete[] this->boundaries;
+}
+
+/* Name: createShards
+ * Params:
+ *	const int maxKeys - the maximum number of keys per node of each shard's tree
+ *	const std::vector<int>& boundaries - the lowest key of each shard but the first, ascending
+ * Description:
+ *	Creates the shards for the constructors.
+ * Returns: None
+ */
+void ShardedBpTree::createShards(const int maxKeys, const std::vector<int>& boundaries)
+{
+	this->boundaries = new std::atomic<int>[boundaries.size() + 1];
+	for (size_t i = 0; i <= boundaries.size(); i++) {
+		Shard * shard = new Shard(maxKeys);
+		shard->low = i == 0 ? (long)INT_MIN : (long)boundaries[i - 1];
+		shard->high = i == boundaries.size() ? (long)INT_MAX + 1 : (long)boundaries[i];
+		if (i < boundaries.size()) {
+			this->boundaries[i].store(boundaries[i]);
+		}
+		this->shards.push_back(shard);
+	}
+}
+
+/* Name: getShard
+ * Params:
+ *	const int key - a key
+ * Description:
+ *	Finds the shard whose range holds a key with a binary search of the boundaries. A
+ *	boundary may move right after, so operations check the range again under the shard's
+ *	lock (see lockShard()).
+ * Returns: the index of the shard
+ */
+int ShardedBpTree::getShard(const int key)
+{
+	int lo = 0;
+	int hi = (int)this->shards.size() - 1;
+	//the number of boundaries <= key
+	while (lo < hi) {
+		int middle = (lo + hi) / 2;
+		if (this->boundaries[middle].load(std::memory_order_acquire) <= key) {
+			lo = middle + 1;
+		} else {
+			hi = middle;
+		}
+	}
+	return lo;
+}
+
+/* Name: lockShard
+ * Params:
+ *	const int key - a key
+ *	std::unique_lock<std::mutex>& guard - set to hold the lock of the shard
+ * Description:
+ *	Routes a key to its shard and locks the shard, trying again if a boundary moved between
+ *	routing and locking.
+ * Returns: the shard, locked, whose range holds the key
+ */
+ShardedBpTree::Shard& ShardedBpTree::lockShard(const int key, std::unique_lock<std::mutex>& guard)
+{
+	while (true) {
+		Shard& shard = *this->shards[this->getShard(key)];
+		guard = std::unique_lock<std::mutex>(shard.lock);
+		if (key >= shard.low && key < shard.high) {
+			return shard;
+		}
+		guard.unlock();
+	}
+}
+
+/* Name: insert
+ * Params:
+ *	const int key - the key to insert
+ *	const std::string value - the value to insert
+ * Description:
+ *	Inserts a key/value pair into the shard that holds the key (see BpTree::insert).
+ * Returns: true if the pair was inserted, false if the key exists
+ */
+bool ShardedBpTree::insert(const int key, const std::string value)
+{
+	std::unique_lock<std::mutex> guard;
+	Shard& shard = this->lockShard(key, guard);
+	shard.load.fetch_add(1, std::memory_order_relaxed);
+	return shard.tree.insert(key, value);
+}
+
+/* Name: upsert
+ * Params:
+ *	const int key - the key to insert or update
+ *	const std::string value - the value
+ * Description:
+ *	Inserts a key/value pair or replaces the value of an existing key (see BpTree::upsert).
+ * Returns: true if the pair was inserted, false if an existing value was replaced
+ */
+bool ShardedBpTree::upsert(const int key, const std::string value)
+{
+	std::unique_lock<std::mutex> guard;
+	Shard& shard = this->lockShard(key, guard);
+	shard.load.fetch_add(1, std::memory_order_relaxed);
+	return shard.tree.upsert(key, value);
+}
+
+/* Name: update
+ * Params:
+ *	const int key - the key to update
+ *	const std::string value - the new value
+ * Description:
+ *	Replaces the value of an existing key (see BpTree::update).
+ * Returns: true if the value was replaced, false if the key is not in the container
+ */
+bool ShardedBpTree::update(const int key, const std::string value)
+{
+	std::unique_lock<std::mutex> guard;
+	Shard& shard = this->lockShard(key, guard);
+	shard.load.fetch_add(1, std::memory_order_relaxed);
+	return shard.tree.update(key, value);
+}
+
+/* Name: remove
+ * Params:
+ *	const int key - the key to remove
+ * Description:
+ *	Removes a key and its value (see BpTree::remove).
+ * Returns: true if the key was removed, false if it is not in the container
+ */
+bool ShardedBpTree::remove(const int key)
+{
+	std::unique_lock<std::mutex> guard;
+	Shard& shard = this->lockShard(key, guard);
+	shard.load.fetch_add(1, std::memory_order_relaxed);
+	return shard.tree.remove(key);
+}
+
+/* Name: find
+ * Params:
+ *	const int key - the key to look up
+ * Description:
+ *	Looks up the value of a key (see BpTree::find).
+ * Returns: the value of the key, or "" if it is not in the container
+ */
+std::string ShardedBpTree::find(const int key)
+{
+	std::unique_lock<std::mutex> guard;
+	Shard& shard = this->lockShard(key, guard);
+	shard.load.fetch_add(1, std::memory_order_relaxed);
+	return shard.tree.find(key);
+}
+
+/* Name: removeRange
+ * Params:
+ *	const int lo - the lowest key to remove
+ *	const int hi - the highest key to remove
+ * Description:
+ *	Removes the keys with lo <= key <= hi from every shard whose range overlaps them, one
+ *	shard at a time (see scan() for how the shards are walked).
+ * Returns: the number of keys removed
+ */
+int ShardedBpTree::removeRange(const int lo, const int hi)
+{
+	int removed = 0;
+	long cursor = lo;
+	while (cursor <= hi) {
+		std::unique_lock<std::mutex> guard;
+		Shard& shard = this->lockShard((int)cursor, guard);
+		shard.load.fetch_add(1, std::memory_order_relaxed);
+		removed += shard.tree.removeRange((int)cursor, (int)std::min((long)hi, shard.high - 1));
+		cursor = shard.high;
+	}
+	return removed;
+}
+
+/* Name: count
+ * Params:
+ *	const int lo - the lowest key to count
+ *	const int hi - the highest key to count
+ * Description:
+ *	Counts the keys with lo <= key <= hi with the subtree counts of each shard's tree (see
+ *	BpTree::count).
+ * Returns: the number of keys in the range
+ */
+int ShardedBpTree::count(const int lo, const int hi)
+{
+	int total = 0;
+	long cursor = lo;
+	while (cursor <= hi) {
+		std::unique_lock<std::mutex> guard;
+		Shard& shard = this->lockShard((int)cursor, guard);
+		total += shard.tree.count((int)cursor, (int)std::min((long)hi, shard.high - 1));
+		cursor = shard.high;
+	}
+	return total;
+}
+
+/* Name: size
+ * Params:
+ *	None
+ * Description:
+ *	Counts the keys of every shard.
+ * Returns: the number of keys in the container
+ */
+size_t ShardedBpTree::size()
+{
+	size_t total = 0;
+	for (size_t i = 0; i < this->shards.size(); i++) {
+		total += this->getShardSize(i);
+	}
+	return total;
+}
+
+/* Name: getNumShards
+ * Params:
+ *	None
+ * Description:
+ *	Gets the number of shards.
+ * Returns: the number of shards
+ */
+int ShardedBpTree::getNumShards()
+{
+	return this->shards.size();
+}
+
+/* Name: getBoundary
+ * Params:
+ *	const int index - the index of a shard other than the first
+ * Description:
+ *	Gets the lowest key of a shard's range, which is also the boundary between it and the
+ *	shard before it.
+ * Returns: the lowest key of the shard, or INT_MIN for an invalid index
+ */
+int ShardedBpTree::getBoundary(const int index)
+{
+	if (index < 1 || index >= (int)this->shards.size()) {
+		return INT_MIN;
+	}
+	return this->boundaries[index - 1].load(std::memory_order_acquire);
+}
+
+/* Name: getShardSize
+ * Params:
+ *	const int index - the index of a shard
+ * Description:
+ *	Counts the keys of a shard.
+ * Returns: the number of keys in the shard (0 for an invalid index)
+ */
+size_t ShardedBpTree::getShardSize(const int index)
+{
+	if (index < 0 || index >= (int)this->shards.size()) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> guard(this->shards[index]->lock);
+	return this->shards[index]->tree.count(INT_MIN, INT_MAX);
+}
+
+/* Name: getShardLoad
+ * Params:
+ *	const int index - the index of a shard
+ * Description:
+ *	Gets the number of operations routed to a shard since the last rebalance().
+ * Returns: the load of the shard (0 for an invalid index)
+ */
+size_t ShardedBpTree::getShardLoad(const int index)
+{
+	if (index < 0 || index >= (int)this->shards.size()) {
+		return 0;
+	}
+	return this->shards[index]->load.load(std::memory_order_relaxed);
+}
+
+/* Name: moveBoundary
+ * Params:
+ *	const int index - the index of a shard other than the first
+ *	const int key - the new lowest key of that shard
+ * Description:
+ *	Moves the boundary between a shard and the shard before it, moving the pairs between
+ *	the old and the new boundary from one shard's tree to the other's. Only those two shards
+ *	are blocked meanwhile; the others keep serving operations.
+ * Returns: true if the boundary was moved, false if the index is invalid or the key would
+ *	leave either shard an empty range
+ */
+bool ShardedBpTree::moveBoundary(const int index, const int key)
+{
+	std::lock_guard<std::mutex> guard(this->boundaryLock);
+	return this->shiftBoundary(index, key);
+}
+
+/* Name: shiftBoundary
+ * Params:
+ *	const int index - the index of a shard other than the first
+ *	const int key - the new lowest key of that shard
+ * Description:
+ *	Moves a boundary for moveBoundary() and rebalance(), which hold boundaryLock. The two
+ *	shards are locked in index order, as every operation that locks two shards must.
+ * Returns: true if the boundary was moved, false otherwise
+ */
+bool ShardedBpTree::shiftBoundary(const int index, const int key)
+{
+	if (index < 1 || index >= (int)this->shards.size()) {
+		return false;
+	}
+	Shard& left = *this->shards[index - 1];
+	Shard& right = *this->shards[index];
+	std::lock_guard<std::mutex> leftGuard(left.lock);
+	std::lock_guard<std::mutex> rightGuard(right.lock);
+	if (key <= left.low || key >= right.high) {
+		return false;
+	}
+	int old = (int)right.low;
+	if (key == old) {
+		return true;
+	}
+	//the pairs between the two boundaries change shards
+	Shard& from = key < old ? left : right;
+	Shard& to = key < old ? right : left;
+	int lo = std::min(key, old);
+	int hi = std::max(key, old) - 1;
+	std::vector<std::pair<int, std::string> > pairs;
+	from.tree.scan(lo, hi, [&pairs](int k, const std::string& value) {
+		pairs.push_back(std::make_pair(k, value));
+		return true;
+	});
+	from.tree.removeRange(lo, hi);
+	to.tree.insertBatch(pairs, 1);
+	left.high = key;
+	right.low = key;
+	this->boundaries[index - 1].store(key, std::memory_order_release);
+	return true;
+}
+
+/* Name: rebalance
+ * Params:
+ *	const double threshold - how many times its share of the operations the busiest shard
+ *		must have taken for a boundary to move (e.g. 1.5)
+ * Description:
+ *	Evens out the load of the shards: looks at the operations routed to each shard since the
+ *	last call, and if the busiest shard took more than threshold times the average, moves
+ *	its boundary with the less busy of its neighbours. Assuming the load is spread over the
+ *	keys of the shard, it hands over the share of its keys (next to the boundary) that
+ *	leaves the two shards with the same load, finding the new boundary with the tree's order
+ *	statistics (see BpTree::select). Resets the loads. Meant to be called periodically, e.g.
+ *	by a maintenance thread; repeated calls converge on hot ranges.
+ * Returns: true if a boundary was moved, false otherwise
+ */
+bool ShardedBpTree::rebalance(const double threshold)
+{
+	std::lock_guard<std::mutex> guard(this->boundaryLock);
+	int numShards = this->shards.size();
+	std::vector<size_t> loads(numShards);
+	size_t total = 0;
+	int busiest = 0;
+	for (int i = 0; i < numShards; i++) {
+		loads[i] = this->shards[i]->load.exchange(0, std::memory_order_relaxed);
+		total += loads[i];
+		busiest = loads[i] > loads[busiest] ? i : busiest;
+	}
+	if (numShards < 2 || total == 0 || loads[busiest] <= threshold * total / numShards) {
+		return false;
+	}
+	int neighbour = busiest == 0 ? 1 : busiest - 1;
+	if (busiest > 0 && busiest + 1 < numShards && loads[busiest + 1] < loads[busiest - 1]) {
+		neighbour = busiest + 1;
+	}
+	double fraction = (double)(loads[busiest] - loads[neighbour]) / (2.0 * loads[busiest]);
+	int key = 0;
+	std::string value;
+	{
+		Shard& shard = *this->shards[busiest];
+		std::lock_guard<std::mutex> shardGuard(shard.lock);
+		int numKeys = shard.tree.count(INT_MIN, INT_MAX);
+		int moved = (int)(numKeys * fraction);
+		//the first key to stay in the busiest shard (moving left) or to move (moving right)
+		if (moved == 0 || !shard.tree.select(neighbour < busiest ? moved : numKeys - moved, key, value)) {
+			return false;
+		}
+	}
+	return this->shiftBoundary(neighbour < busiest ? busiest : neighbour, key);
+}
+
+/* Name: setShardCpus
+ * Params:
+ *	const std::vector<int>& cpus - CPUs to hand out to the shards in turn (shard i gets
+ *		cpus[i % cpus.size()]); empty to clear them
+ * Description:
+ *	Assigns each shard a CPU for the threads that serve it (see pinToShard()), and places the
+ *	shard's new leaves on the NUMA node of that CPU and its new interior nodes interleaved over
+ *	all nodes (see BpTree::setNodePlacement()), so that the threads serving a shard find its
+ *	pairs in local memory whichever thread inserted them. Shards without a CPU go back to
+ *	the heap. Without NUMA support in the build, Linux still places the pages of a shard on
+ *	the node of the pinned thread that first touches them.
+ * Returns: None
+ */
+void ShardedBpTree::setShardCpus(const std::vector<int>& cpus)
+{
+	for (size_t i = 0; i < this->shards.size(); i++) {
+		Shard& shard = *this->shards[i];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		shard.cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+		if (shard.cpu < 0) {
+			shard.tree.setNodePlacement(NODE_PLACEMENT_DEFAULT, NODE_PLACEMENT_DEFAULT);
+		} else {
+			shard.tree.setNodePlacement(NodeArena::getNodeOfCpu(shard.cpu), NODE_PLACEMENT_INTERLEAVE);
+		}
+	}
+}
+
+/* Name: getShardCpu
+ * Params:
+ *	const int index - the index of a shard
+ * Description:
+ *	Gets the CPU assigned to a shard by setShardCpus().
+ * Returns: the CPU, or -1 if the shard has none or the index is invalid
+ */
+int ShardedBpTree::getShardCpu(const int index)
+{
+	if (index < 0 || index >= (int)this->shards.size()) {
+		return -1;
+	}
+	return this->shards[index]->cpu;
+}
+
+/* Name: pinToShard
+ * Params:
+ *	const int index - the index of a shard
+ * Description:
+ *	Pins the calling thread to the CPU assigned to a shard, for a thread that serves the
+ *	operations of that shard.
+ * Returns: true if the thread was pinned, false if the shard has no CPU or pinning failed
+ */
+bool ShardedBpTree::pinToShard(const int index)
+{
+	int cpu = this->getShardCpu(index);
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		return false;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/* Name: validate
+ * Params:
+ *	std::string& error - set to a description of the first problem found
+ * Description:
+ *	Checks every shard's tree (see BpTree::validate), that the shard ranges cover the key
+ *	space without gaps or overlaps and agree with the routing boundaries, and that every key
+ *	lies in the range of its shard. Locks one shard at a time.
+ * Returns: true if the container is valid, false otherwise
+ */
+bool ShardedBpTree::validate(std::string& error)
+{
+	std::lock_guard<std::mutex> guard(this->boundaryLock);
+	long expectedLow = INT_MIN;
+	for (size_t i = 0; i < this->shards.size(); i++) {
+		Shard& shard = *this->shards[i];
+		std::lock_guard<std::mutex> shardGuard(shard.lock);
+		std::string where = "shard " + std::to_string(i);
+		if (shard.low != expectedLow || shard.high <= shard.low ||
+			(i > 0 && this->boundaries[i - 1].load() != shard.low)) {
+			error = where + " has range [" + std::to_string(shard.low) + ", " + std::to_string(shard.high) + ")";
+			return false;
+		}
+		expectedLow = shard.high;
+		if (!shard.tree.validate(error)) {
+			error = where + ": " + error;
+			return false;
+		}
+		int key = 0;
+		std::string value;
+		if ((shard.tree.first(key, value) && key < shard.low) || (shard.tree.last(key, value) && key >= shard.high)) {
+			error = where + " holds key " + std::to_string(key) + " outside its range";
+			return false;
+		}
+	}
+	if (expectedLow != (long)INT_MAX + 1) {
+		error = "the shards end at " + std::to_string(expectedLow);
+		return false;
+	}
+	return true;
+}
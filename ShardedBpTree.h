@@ -0,0 +1,108 @@
+#ifndef SHARDEDBPTREE_H
+#define SHARDEDBPTREE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BpTree.h"
+
+/* Set of BpTrees that each hold one range of the key space (a shard), so that writers of
+ * different ranges do not contend on one tree. Every operation is routed by its key to the
+ * shard whose range holds it and runs under that shard's lock only. Scans and range
+ * operations walk the shards in key order, so their results come out sorted. The boundaries
+ * between the shards can be moved while the container is in use (moveBoundary()), which
+ * only blocks the two shards involved, and rebalance() moves them on its own when one shard
+ * takes much more than its share of the operations. A shard can be given a CPU for worker
+ * threads that serve it to pin themselves to, and its leaves are then kept on that CPU's NUMA
+ * node. Safe for concurrent use; each operation sees a consistent shard, but a scan over
+ * several shards is not an atomic snapshot of the whole container. */
+class ShardedBpTree {
+public:
+	ShardedBpTree(const int, const int);
+	ShardedBpTree(const int, const std::vector<int>&);
+	~ShardedBpTree();
+
+	bool insert(const int, const std::string);
+	bool upsert(const int, const std::string);
+	bool update(const int, const std::string);
+	bool remove(const int);
+	int removeRange(const int, const int);
+	std::string find(const int);
+	int count(const int, const int);
+	size_t size();
+	template <typename Visit>
+	int scan(const int, const int, Visit);
+
+	int getNumShards();
+	int getShard(const int);
+	int getBoundary(const int);
+	size_t getShardSize(const int);
+	size_t getShardLoad(const int);
+	bool moveBoundary(const int, const int);
+	bool rebalance(const double);
+	void setShardCpus(const std::vector<int>&);
+	int getShardCpu(const int);
+	bool pinToShard(const int);
+	bool validate(std::string&);
+private:
+	struct Shard {
+		Shard(int maxKeys) : tree(maxKeys), low(0), high(0), load(0), cpu(-1) {}
+		std::mutex lock;
+		BpTree tree;
+		long low; //the lowest key of the shard's range (changed under the lock)
+		long high; //the keys of the shard's range are below this (changed under the lock)
+		std::atomic<size_t> load; //operations routed to the shard since the last rebalance()
+		int cpu; //the CPU for threads serving the shard (-1 for none)
+		char padding[64]; //keeps neighbouring shards' locks and counters off the same cache line
+	};
+
+	void createShards(const int, const std::vector<int>&);
+	Shard& lockShard(const int, std::unique_lock<std::mutex>&);
+	bool shiftBoundary(const int, const int);
+
+	std::vector<Shard*> shards; //the shards in key order
+	std::atomic<int> * boundaries; //the lowest key of each shard but the first (allocated array (dynamic memory))
+	std::mutex boundaryLock; //held while a boundary is moved, so only one moves at a time
+};
+
+/* Name: scan
+ * Params:
+ *	const int lo - the lowest key of the scan
+ *	const int hi - the highest key of the scan
+ *	Visit visit - called as visit(int key, const std::string& value) for every pair in range,
+ *		in ascending key order; the scan stops early when it returns false. It runs under a
+ *		shard's lock, so it must not call back into the container.
+ * Description:
+ *	Visits the key/value pairs with lo <= key <= hi across the shards. The shards hold
+ *	disjoint ranges, so merging their pairs in order is visiting them one after the other.
+ *	The next shard is found by routing the first key past the shard just visited rather than
+ *	by taking the next shard in the list, so that a boundary moved in between neither skips
+ *	keys nor visits them twice.
+ * Returns: the number of pairs that were visited
+ */
+template <typename Visit>
+int ShardedBpTree::scan(const int lo, const int hi, Visit visit)
+{
+	int visited = 0;
+	bool stopped = false;
+	long cursor = lo;
+	while (cursor <= hi && !stopped) {
+		std::unique_lock<std::mutex> guard;
+		Shard& shard = this->lockShard((int)cursor, guard);
+		shard.load.fetch_add(1, std::memory_order_relaxed);
+		long end = std::min((long)hi, shard.high - 1);
+		visited += shard.tree.scan((int)cursor, (int)end, [&visit, &stopped](int key, const std::string& value) {
+			if (!visit(key, value)) {
+				stopped = true;
+			}
+			return !stopped;
+		});
+		cursor = shard.high;
+	}
+	return visited;
+}
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+/* Helpers shared by the benchmark drivers: key distributions, latency percentiles, peak
+ * memory and JSON output. Header only, so each benchmark stays a single translation unit. */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/* Constants used for picking the distribution of the keys a benchmark uses */
+#define KEYS_UNIFORM			0
+#define KEYS_ZIPFIAN			1
+#define KEYS_SEQUENTIAL			2
+#define KEYS_REVERSE			3
+#define KEYS_LATEST				4
+
+/* Name: secondsSince
+ * Params:
+ *	std::chrono::steady_clock::time_point start - the start of the timed section
+ * Description:
+ *	Measures the time since start.
+ * Returns: the elapsed time in seconds
+ */
+inline double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Name: distributionName
+ * Params:
+ *	int distribution - one of the KEYS_ constants
+ * Description:
+ *	Names a key distribution for reports.
+ * Returns: the name of the distribution
+ */
+inline const char* distributionName(int distribution) {
+	switch (distribution) {
+	case KEYS_UNIFORM: return "uniform";
+	case KEYS_ZIPFIAN: return "zipfian";
+	case KEYS_SEQUENTIAL: return "sequential";
+	case KEYS_REVERSE: return "reverse";
+	case KEYS_LATEST: return "latest";
+	default: return "unknown";
+	}
+}
+
+/* Draws keys from 0 .. numKeys - 1 with one of the KEYS_ distributions:
+ *	uniform - every key is equally likely
+ *	zipfian - key ranks follow a Zipf distribution (the YCSB generator of Gray et al.), and
+ *		ranks are mapped to keys by a fixed shuffle so the hot keys are spread over the tree
+ *	sequential / reverse - the keys in ascending / descending order, wrapping around
+ *	latest - Zipf distributed distance below the newest key (see setNewest()), for workloads
+ *		that mostly read what was just written */
+class KeyGenerator {
+public:
+	KeyGenerator(int numKeys, int distribution, double skew, unsigned int seed)
+		: random(seed), numKeys(numKeys > 0 ? numKeys : 1), distribution(distribution), skew(skew), position(0) {
+		this->newest = this->numKeys - 1;
+		if (distribution == KEYS_ZIPFIAN || distribution == KEYS_LATEST) {
+			this->zeta2 = 1.0 + std::pow(0.5, skew);
+			this->zetaN = 0;
+			for (int i = 1; i <= this->numKeys; i++) {
+				this->zetaN += 1.0 / std::pow((double)i, skew);
+			}
+			this->alpha = 1.0 / (1.0 - skew);
+			this->eta = (1.0 - std::pow(2.0 / this->numKeys, 1.0 - skew)) / (1.0 - this->zeta2 / this->zetaN);
+		}
+		if (distribution == KEYS_ZIPFIAN) {
+			this->keyOfRank.resize(this->numKeys);
+			for (int i = 0; i < this->numKeys; i++) {
+				this->keyOfRank[i] = i;
+			}
+			//the same shuffle for every seed, so that generators of different threads agree on the hot keys
+			std::shuffle(this->keyOfRank.begin(), this->keyOfRank.end(), std::mt19937(this->numKeys));
+		}
+	}
+
+	int next() {
+		switch (this->distribution) {
+		case KEYS_ZIPFIAN:
+			return this->keyOfRank[this->nextRank()];
+		case KEYS_SEQUENTIAL:
+			return (int)(this->position++ % this->numKeys);
+		case KEYS_REVERSE:
+			return this->numKeys - 1 - (int)(this->position++ % this->numKeys);
+		case KEYS_LATEST: {
+			int key = this->newest - this->nextRank();
+			return key >= 0 ? key : 0;
+		}
+		default:
+			return (int)(this->random() % (unsigned int)this->numKeys);
+		}
+	}
+
+	//the newest key for the latest distribution
+	void setNewest(int key) {
+		this->newest = key;
+	}
+
+	//a uniformly distributed number in 0 .. bound - 1 from the generator's random source
+	unsigned int nextUniform(unsigned int bound) {
+		return bound > 0 ? (unsigned int)(this->random() % bound) : 0;
+	}
+private:
+	//rank 0 is the most popular; the ranks past the newest key are folded back for latest
+	int nextRank() {
+		double u = std::uniform_real_distribution<double>(0.0, 1.0)(this->random);
+		double uz = u * this->zetaN;
+		int rank;
+		if (uz < 1.0) {
+			rank = 0;
+		}
+		else if (uz < this->zeta2) {
+			rank = 1;
+		}
+		else {
+			rank = (int)(this->numKeys * std::pow(this->eta * u - this->eta + 1.0, this->alpha));
+		}
+		return rank < this->numKeys ? rank : this->numKeys - 1;
+	}
+
+	std::mt19937 random;
+	int numKeys;
+	int distribution;
+	double skew;
+	long long position;
+	int newest;
+	double zeta2, zetaN, alpha, eta;
+	std::vector<int> keyOfRank;
+};
+
+/* Collects per-operation latencies and reports percentiles of them */
+class LatencyRecorder {
+public:
+	void reserve(size_t count) {
+		this->samples.reserve(count);
+	}
+
+	void add(double nanoseconds) {
+		this->samples.push_back(nanoseconds);
+		this->sorted = false;
+	}
+
+	//the latency below which the fraction q (0 .. 1) of the samples fall, in nanoseconds
+	double percentile(double q) {
+		if (this->samples.empty()) {
+			return 0;
+		}
+		if (!this->sorted) {
+			std::sort(this->samples.begin(), this->samples.end());
+			this->sorted = true;
+		}
+		size_t index = (size_t)(q * (this->samples.size() - 1) + 0.5);
+		return this->samples[index < this->samples.size() ? index : this->samples.size() - 1];
+	}
+
+	size_t count() const {
+		return this->samples.size();
+	}
+
+	void clear() {
+		this->samples.clear();
+		this->sorted = false;
+	}
+private:
+	std::vector<double> samples;
+	bool sorted = false;
+};
+
+/* Histogram of latencies with four buckets per power of two (so every bucket is at most 19%
+ * wide), taking constant memory however many operations are recorded. Each thread records
+ * into its own histogram and the histograms are merged at the end. */
+class LatencyHistogram {
+public:
+	LatencyHistogram() : buckets(NUM_BUCKETS, 0), total(0), maximum(0) {}
+
+	void add(double nanoseconds) {
+		int bucket = nanoseconds < 1 ? 0 : (int)(std::log2(nanoseconds) * 4);
+		this->buckets[bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1] += 1;
+		this->total += 1;
+		this->maximum = nanoseconds > this->maximum ? nanoseconds : this->maximum;
+	}
+
+	void merge(const LatencyHistogram& other) {
+		for (int i = 0; i < NUM_BUCKETS; i++) {
+			this->buckets[i] += other.buckets[i];
+		}
+		this->total += other.total;
+		this->maximum = other.maximum > this->maximum ? other.maximum : this->maximum;
+	}
+
+	//the upper bound of the bucket holding the fraction q (0 .. 1) of the samples, in nanoseconds
+	double percentile(double q) const {
+		long long rank = (long long)(q * this->total + 0.5);
+		long long seen = 0;
+		for (int i = 0; i < NUM_BUCKETS; i++) {
+			seen += this->buckets[i];
+			if (seen >= rank && seen > 0) {
+				double upper = upperBound(i);
+				return upper < this->maximum ? upper : this->maximum;
+			}
+		}
+		return this->maximum;
+	}
+
+	long long count() const {
+		return this->total;
+	}
+
+	double max() const {
+		return this->maximum;
+	}
+
+	//the non-empty buckets as a JSON array of [upper bound in ns, count] pairs
+	std::string json() const {
+		std::string array = "[";
+		for (int i = 0; i < NUM_BUCKETS; i++) {
+			if (this->buckets[i] > 0) {
+				char bucket[64];
+				snprintf(bucket, sizeof(bucket), "%s[%.0f, %lld]", array.size() > 1 ? ", " : "", upperBound(i), this->buckets[i]);
+				array += bucket;
+			}
+		}
+		return array + "]";
+	}
+private:
+	static const int NUM_BUCKETS = 160; //up to 2^40 ns
+
+	static double upperBound(int bucket) {
+		return std::pow(2.0, (bucket + 1) / 4.0);
+	}
+
+	std::vector<long long> buckets;
+	long long total;
+	double maximum;
+};
+
+/* Name: readStatusKb
+ * Params:
+ *	const char* field - the name of a field of /proc/self/status (e.g. "VmHWM")
+ * Description:
+ *	Reads a memory figure of the process from /proc/self/status.
+ * Returns: the value of the field in KB, -1 if it could not be read
+ */
+inline long readStatusKb(const char* field) {
+	FILE * status = fopen("/proc/self/status", "r");
+	if (status == 0) {
+		return -1;
+	}
+	char line[256];
+	long value = -1;
+	std::string prefix = std::string(field) + ":";
+	while (fgets(line, sizeof(line), status) != 0) {
+		if (prefix.compare(0, prefix.size(), line, prefix.size()) == 0) {
+			value = atol(line + prefix.size());
+			break;
+		}
+	}
+	fclose(status);
+	return value;
+}
+
+/* Name: peakRssKb
+ * Params:
+ *	None
+ * Description:
+ *	Reads the peak resident set size of the process since it started (or since the last
+ *	resetPeakRss()).
+ * Returns: the peak resident set size in KB, -1 if it could not be read
+ */
+inline long peakRssKb() {
+	return readStatusKb("VmHWM");
+}
+
+/* Name: resetPeakRss
+ * Params:
+ *	None
+ * Description:
+ *	Resets the peak resident set size to the current resident set size, so the peak of each
+ *	benchmark run can be measured on its own (Linux 4.0 and later). Memory freed by earlier
+ *	runs is handed back to the system first where the allocator allows it (glibc).
+ * Returns: true if the peak was reset, false otherwise
+ */
+inline bool resetPeakRss() {
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+	FILE * clearRefs = fopen("/proc/self/clear_refs", "w");
+	if (clearRefs == 0) {
+		return false;
+	}
+	bool reset = fputs("5", clearRefs) >= 0;
+	return fclose(clearRefs) == 0 && reset;
+}
+
+/* Builds one JSON object of string and number fields, e.g.
+ *	JsonObject().add("op", "find").add("opsPerSec", 1.5e6).str()
+ * Fields whose value is already JSON (arrays, nested objects) are added with addRaw(). */
+class JsonObject {
+public:
+	JsonObject& add(const std::string& name, const std::string& value) {
+		std::string escaped;
+		for (size_t i = 0; i < value.size(); i++) {
+			if (value[i] == '"' || value[i] == '\\') {
+				escaped += '\\';
+			}
+			escaped += value[i];
+		}
+		return this->addRaw(name, "\"" + escaped + "\"");
+	}
+
+	JsonObject& add(const std::string& name, const char* value) {
+		return this->add(name, std::string(value));
+	}
+
+	JsonObject& add(const std::string& name, double value) {
+		char number[64];
+		snprintf(number, sizeof(number), "%.6g", value);
+		return this->addRaw(name, number);
+	}
+
+	JsonObject& add(const std::string& name, long value) {
+		return this->addRaw(name, std::to_string(value));
+	}
+
+	JsonObject& add(const std::string& name, int value) {
+		return this->addRaw(name, std::to_string(value));
+	}
+
+	JsonObject& addRaw(const std::string& name, const std::string& value) {
+		if (!this->fields.empty()) {
+			this->fields += ", ";
+		}
+		this->fields += "\"" + name + "\": " + value;
+		return *this;
+	}
+
+	std::string str() const {
+		return "{" + this->fields + "}";
+	}
+private:
+	std::string fields;
+};
+
+/* Name: writeJson
+ * Params:
+ *	const std::string& path - the file to write, "-" for standard output
+ *	const std::string& benchmark - the name of the benchmark
+ *	const std::vector<std::string>& results - the results, one JSON object each
+ * Description:
+ *	Writes the results of a benchmark as {"benchmark": ..., "results": [...]}, one result per
+ *	line so that runs of different versions can be compared with a line diff.
+ * Returns: true if the file was written, false otherwise
+ */
+inline bool writeJson(const std::string& path, const std::string& benchmark, const std::vector<std::string>& results) {
+	FILE * out = path == "-" ? stdout : fopen(path.c_str(), "w");
+	if (out == 0) {
+		return false;
+	}
+	fprintf(out, "{\"benchmark\": \"%s\", \"results\": [\n", benchmark.c_str());
+	for (size_t i = 0; i < results.size(); i++) {
+		fprintf(out, "  %s%s\n", results[i].c_str(), i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "]}\n");
+	return out == stdout ? fflush(out) == 0 : fclose(out) == 0;
+}
+
+#endif
@@ -0,0 +1,123 @@
+/* Asynchronous lookup benchmark
+ * Description:
+ *	Times random lookups in a PersistentBpTree file read through AsyncLookup with a small
+ *	page cache, at increasing queue depths. At depth 1 every lookup waits for each of its
+ *	page reads in turn, as a synchronous reader would; at higher depths one thread keeps that
+ *	many reads in flight. By default the file is read with O_DIRECT so the reads reach the
+ *	drive instead of the kernel's page cache. The file is built on the first run and reused
+ *	by later runs with the same number of keys.
+ *
+ *	Usage: async_lookup_bench [path=async_lookup_bench.db] [numKeys=200000] [numLookups=50000]
+ *		[depths=1,4,16,64] [cachePages=16] [direct=1]
+ */
+#include "../AsyncLookup.h"
+#include "../PersistentBpTree.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//the state of a closed loop of lookups: every finished lookup starts the next one
+struct LookupLoop {
+	AsyncLookup* lookup;
+	std::mt19937 random;
+	int numKeys;
+	long started;
+	long total;
+	long found;
+	long wrong;
+};
+
+static void lookupDone(int key, bool found, const std::string& value, void* argument) {
+	LookupLoop* loop = (LookupLoop*)argument;
+	if (found) {
+		loop->found += 1;
+		loop->wrong += value == std::to_string(key) ? 0 : 1;
+	}
+	if (loop->started < loop->total) {
+		loop->started += 1;
+		loop->lookup->find(loop->random() % loop->numKeys, lookupDone, loop);
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string path = argc > 1 ? argv[1] : "async_lookup_bench.db";
+	int numKeys = argc > 2 ? atoi(argv[2]) : 200000;
+	long numLookups = argc > 3 ? atol(argv[3]) : 50000;
+	std::string depthList = argc > 4 ? argv[4] : "1,4,16,64";
+	size_t cachePages = argc > 5 ? atol(argv[5]) : 16;
+	bool direct = argc > 6 ? atoi(argv[6]) != 0 : true;
+
+	PersistentBpTree tree;
+	if (!tree.open(path) || tree.size() != (size_t)numKeys) {
+		//small values and many keys per page keep the file to a few pages per thousand keys
+		if (!tree.create(path, 200, 8)) {
+			fprintf(stderr, "cannot create %s\n", path.c_str());
+			return 1;
+		}
+		std::mt19937 random(42);
+		std::vector<int> keys;
+		for (int i = 0; i < numKeys; i++) {
+			keys.push_back(i);
+		}
+		for (size_t i = keys.size() - 1; i > 0; i--) {
+			std::swap(keys[i], keys[random() % (i + 1)]);
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < keys.size(); i++) {
+			tree.insert(keys[i], std::to_string(keys[i]));
+		}
+		printf("built %s in %.2fs (%.0f committed inserts/s)\n", path.c_str(), secondsSince(start), numKeys / secondsSince(start));
+	}
+
+	std::vector<int> depths;
+	std::stringstream stream(depthList);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		depths.push_back(atoi(item.c_str()));
+	}
+	printf("%d keys, page %zu bytes, %ld lookups, cache %zu pages, %s reads\n", numKeys, tree.getPageSize(), numLookups,
+		cachePages, direct ? "direct" : "buffered");
+	printf("depth  engine  lookups/s    reads/lookup  cache hits/lookup  speedup\n");
+	double baseline = 0;
+	for (size_t d = 0; d < depths.size(); d++) {
+		AsyncLookup lookup(tree, depths[d], cachePages, direct);
+		if (!lookup.isReady()) {
+			fprintf(stderr, "cannot read %s\n", path.c_str());
+			return 1;
+		}
+		LookupLoop loop;
+		loop.lookup = &lookup;
+		loop.random.seed(7);
+		loop.numKeys = numKeys;
+		loop.started = 0;
+		loop.total = numLookups;
+		loop.found = 0;
+		loop.wrong = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = 0; i < depths[d] && loop.started < loop.total; i++) {
+			loop.started += 1;
+			lookup.find(loop.random() % numKeys, lookupDone, &loop);
+		}
+		lookup.wait();
+		double rate = numLookups / secondsSince(start);
+		if (d == 0) {
+			baseline = rate;
+		}
+		printf("%5d  %-6s  %11.0f  %12.2f  %17.2f  %6.2fx\n", depths[d], lookup.getEngine() == IO_ENGINE_URING ? "uring" : "pread",
+			rate, (double)lookup.getReads() / numLookups, (double)lookup.getCacheHits() / numLookups, rate / baseline);
+		if (loop.found != numLookups || loop.wrong != 0 || lookup.getErrors() != 0) {
+			fprintf(stderr, "lookups went wrong: %ld of %ld found, %ld wrong values, %zu read errors\n", loop.found, numLookups,
+				loop.wrong, lookup.getErrors());
+			return 1;
+		}
+	}
+	return 0;
+}
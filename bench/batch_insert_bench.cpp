@@ -0,0 +1,63 @@
+/* Batch insert benchmark
+ * Description:
+ *	Inserts a number of batches of unsorted key/value pairs, first with one insert() call per
+ *	pair and then with insertBatch() using 1, 2, 4, ... threads, and reports the throughput.
+ *
+ *	Usage: batch_insert_bench [batchSize=1000000] [numBatches=4] [maxKeys=64] [maxThreads=hardware threads]
+ */
+#include "../BpTree.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int batchSize = argc > 1 ? atoi(argv[1]) : 1000000;
+	int numBatches = argc > 2 ? atoi(argv[2]) : 4;
+	int maxKeys = argc > 3 ? atoi(argv[3]) : 64;
+	int maxThreads = argc > 4 ? atoi(argv[4]) : (int)std::thread::hardware_concurrency();
+	if (maxThreads < 1) {
+		maxThreads = 1;
+	}
+
+	std::mt19937 random(42);
+	std::vector<std::vector<std::pair<int, std::string> > > batches(numBatches);
+	for (int b = 0; b < numBatches; b++) {
+		for (int i = 0; i < batchSize; i++) {
+			int key = (int)(random() & 0x7fffffff);
+			batches[b].push_back(std::make_pair(key, std::to_string(key)));
+		}
+	}
+	double totalPairs = (double)batchSize * numBatches;
+
+	{
+		BpTree tree(maxKeys);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int b = 0; b < numBatches; b++) {
+			for (size_t i = 0; i < batches[b].size(); i++) {
+				tree.insert(batches[b][i].first, batches[b][i].second);
+			}
+		}
+		double elapsed = secondsSince(start);
+		printf("insert loop             %8.3f s  %12.0f pairs/s\n", elapsed, totalPairs / elapsed);
+	}
+
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		BpTree tree(maxKeys);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int b = 0; b < numBatches; b++) {
+			tree.insertBatch(batches[b], threads);
+		}
+		double elapsed = secondsSince(start);
+		printf("insertBatch %2d threads  %8.3f s  %12.0f pairs/s\n", threads, elapsed, totalPairs / elapsed);
+	}
+	return 0;
+}
@@ -0,0 +1,204 @@
+/* Benchmark suite
+ * Description:
+ *	Runs insert, find, scan (leaf to leaf traversal through scanParallel with one thread) and
+ *	remove workloads for every combination of key distribution, maxKeys and value size, and
+ *	reports the throughput, the p50/p99/p999 latency of single operations and the peak
+ *	resident set size of each run. The results are also written as JSON (one object per
+ *	workload) so that runs on different versions can be compared.
+ *
+ *	Every run inserts the keys 0 .. numKeys - 1 into an empty tree, in ascending order for the
+ *	sequential distribution, descending order for reverse and a random order for uniform and
+ *	zipfian. The finds and scan starts are then drawn from the distribution (see KeyGenerator),
+ *	and finally every key is removed in the order it was inserted.
+ *
+ *	When the tree is built with BPTREE_METRICS, the JSON object of each workload also holds the
+ *	tree's counters for it (descents, nodes visited, splits, redistributions, coalesces, ...).
+ *
+ *	Usage: bench_suite [numKeys=1000000] [maxKeys=16,64,256] [valueSizes=8,128,1024]
+ *	                   [json=bench_suite.json ("-" for standard output)] [numOps=numKeys]
+ *	                   [scanLength=1000]
+ */
+#include "../BpTree.h"
+#include "BenchUtil.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+//parses a comma separated list of numbers
+static std::vector<int> parseList(const char* list) {
+	std::vector<int> values;
+	std::string text(list);
+	size_t begin = 0;
+	while (begin <= text.size()) {
+		size_t end = text.find(',', begin);
+		if (end == std::string::npos) {
+			end = text.size();
+		}
+		if (end > begin) {
+			values.push_back(atoi(text.substr(begin, end - begin).c_str()));
+		}
+		begin = end + 1;
+	}
+	return values;
+}
+
+//the nanoseconds between two points in time
+static double nanosecondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+	return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+struct RunConfig {
+	int distribution;
+	int maxKeys;
+	int valueSize;
+	int numKeys;
+};
+
+//the counters of a metrics snapshot as a JSON object
+static std::string metricsJson(const MetricsSnapshot& metrics) {
+	JsonObject object;
+	for (int i = 0; i < NUM_METRICS; i++) {
+		object.add(MetricsSnapshot::metricName(i), (long)metrics.counters[i]);
+	}
+	object.add("maxSplitDepth", (long)metrics.maxSplitDepth);
+	return object.str();
+}
+
+//reports one workload of a run as a table row and a JSON object, and starts the metrics of
+//the next workload
+static void report(FILE* table, std::vector<std::string>& results, const RunConfig& config, const char* workload,
+	long ops, double seconds, LatencyRecorder& latencies, long items) {
+	double p50 = latencies.percentile(0.5);
+	double p99 = latencies.percentile(0.99);
+	double p999 = latencies.percentile(0.999);
+	long rss = peakRssKb();
+	MetricsSnapshot metrics = BpTree::metrics();
+	BpTree::resetMetrics();
+	fprintf(table, "%-10s %7d %6d  %-7s %12.0f %10.0f %10.0f %10.0f %10ld\n", distributionName(config.distribution),
+		config.maxKeys, config.valueSize, workload, ops / seconds, p50, p99, p999, rss);
+	JsonObject result;
+	result.add("distribution", distributionName(config.distribution))
+		.add("maxKeys", config.maxKeys)
+		.add("valueSize", config.valueSize)
+		.add("numKeys", config.numKeys)
+		.add("workload", workload)
+		.add("ops", ops)
+		.add("items", items)
+		.add("seconds", seconds)
+		.add("opsPerSec", ops / seconds)
+		.add("p50Ns", p50)
+		.add("p99Ns", p99)
+		.add("p999Ns", p999)
+		.add("peakRssKb", rss);
+	if (metrics.enabled) {
+		result.addRaw("metrics", metricsJson(metrics));
+	}
+	results.push_back(result.str());
+}
+
+//runs the four workloads for one configuration; returns false if the tree gave a wrong answer
+static bool run(FILE* table, std::vector<std::string>& results, const RunConfig& config, int numOps, int scanLength) {
+	std::vector<int> order(config.numKeys);
+	for (int i = 0; i < config.numKeys; i++) {
+		order[i] = config.distribution == KEYS_REVERSE ? config.numKeys - 1 - i : i;
+	}
+	if (config.distribution == KEYS_UNIFORM || config.distribution == KEYS_ZIPFIAN) {
+		std::shuffle(order.begin(), order.end(), std::mt19937(42));
+	}
+	std::string value(config.valueSize, 'v');
+	LatencyRecorder latencies;
+	latencies.reserve(numOps > config.numKeys ? numOps : config.numKeys);
+	resetPeakRss();
+	BpTree::resetMetrics();
+	BpTree tree(config.maxKeys);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < config.numKeys; i++) {
+		std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+		bool inserted = tree.insert(order[i], value);
+		latencies.add(nanosecondsBetween(before, std::chrono::steady_clock::now()));
+		if (!inserted) {
+			fprintf(stderr, "insert of %d failed\n", order[i]);
+			return false;
+		}
+	}
+	report(table, results, config, "insert", config.numKeys, secondsSince(start), latencies, config.numKeys);
+
+	KeyGenerator keys(config.numKeys, config.distribution, 0.99, 7);
+	latencies.clear();
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numOps; i++) {
+		int key = keys.next();
+		std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+		std::string found = tree.find(key);
+		latencies.add(nanosecondsBetween(before, std::chrono::steady_clock::now()));
+		if (found.size() != value.size()) {
+			fprintf(stderr, "find of %d failed\n", key);
+			return false;
+		}
+	}
+	report(table, results, config, "find", numOps, secondsSince(start), latencies, numOps);
+
+	int numScans = numOps / scanLength > 0 ? numOps / scanLength : 1;
+	long scanned = 0;
+	latencies.clear();
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numScans; i++) {
+		int lo = keys.next();
+		std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+		scanned += tree.scanParallel(lo, lo + scanLength - 1, 0L,
+			[](long& n, int, const std::string&) { n++; }, [](long& n, const long& partial) { n += partial; }, 1);
+		latencies.add(nanosecondsBetween(before, std::chrono::steady_clock::now()));
+	}
+	report(table, results, config, "scan", numScans, secondsSince(start), latencies, scanned);
+
+	latencies.clear();
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < config.numKeys; i++) {
+		std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+		bool removed = tree.remove(order[i]);
+		latencies.add(nanosecondsBetween(before, std::chrono::steady_clock::now()));
+		if (!removed) {
+			fprintf(stderr, "remove of %d failed\n", order[i]);
+			return false;
+		}
+	}
+	report(table, results, config, "remove", config.numKeys, secondsSince(start), latencies, config.numKeys);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 1000000;
+	std::vector<int> fanouts = parseList(argc > 2 ? argv[2] : "16,64,256");
+	std::vector<int> valueSizes = parseList(argc > 3 ? argv[3] : "8,128,1024");
+	std::string jsonPath = argc > 4 ? argv[4] : "bench_suite.json";
+	int numOps = argc > 5 ? atoi(argv[5]) : numKeys;
+	int scanLength = argc > 6 ? atoi(argv[6]) : 1000;
+	if (scanLength < 1) {
+		scanLength = 1;
+	}
+
+	//the table goes to standard error when the JSON is written to standard output
+	FILE * table = jsonPath == "-" ? stderr : stdout;
+	fprintf(table, "%d keys, %d ops, scans of %d keys; latencies in ns, peak RSS in KB\n", numKeys, numOps, scanLength);
+	fprintf(table, "%-10s %7s %6s  %-7s %12s %10s %10s %10s %10s\n", "keys", "maxKeys", "value", "op", "ops/s",
+		"p50", "p99", "p999", "peak RSS");
+	std::vector<std::string> results;
+	int distributions[] = { KEYS_UNIFORM, KEYS_ZIPFIAN, KEYS_SEQUENTIAL, KEYS_REVERSE };
+	for (size_t d = 0; d < sizeof(distributions) / sizeof(distributions[0]); d++) {
+		for (size_t f = 0; f < fanouts.size(); f++) {
+			for (size_t v = 0; v < valueSizes.size(); v++) {
+				RunConfig config = { distributions[d], fanouts[f], valueSizes[v], numKeys };
+				if (!run(table, results, config, numOps, scanLength)) {
+					return 1;
+				}
+			}
+		}
+	}
+	if (!writeJson(jsonPath, "bench_suite", results)) {
+		fprintf(stderr, "could not write %s\n", jsonPath.c_str());
+		return 1;
+	}
+	return 0;
+}
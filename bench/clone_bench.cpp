@@ -0,0 +1,58 @@
+/* Clone benchmark
+ * Description:
+ *	Measures how long it takes to copy a tree: taking a snapshot (copy constructor), the
+ *	first write to a tree that is shared with a snapshot (which copies only the path to the
+ *	leaf it changes), and deep clones with an increasing number of threads. The clones place
+ *	their nodes like the tree (a NUMA node or NODE_PLACEMENT_ constant, see NodeArena.h); nodes
+ *	placed through the arena are allocated in batches (see NodeAllocationBatch).
+ *
+ *	Usage: clone_bench [numKeys=10000000] [maxKeys=64] [maxThreads=hardware threads] [placement=-1]
+ */
+#include "../BpTree.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 10000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 64;
+	int maxThreads = argc > 3 ? atoi(argv[3]) : (int)std::thread::hardware_concurrency();
+	int placement = argc > 4 ? atoi(argv[4]) : NODE_PLACEMENT_DEFAULT;
+	if (maxThreads < 1) {
+		maxThreads = 1;
+	}
+
+	BpTree tree(maxKeys);
+	tree.setNodePlacement(placement, placement);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numKeys; i++) {
+		tree.insert(i, std::to_string(i));
+	}
+	printf("build        %d keys, maxKeys %d: %.3f s\n", numKeys, maxKeys, secondsSince(start));
+
+	start = std::chrono::steady_clock::now();
+	BpTree snapshot(tree);
+	printf("snapshot     %.6f s\n", secondsSince(start));
+
+	start = std::chrono::steady_clock::now();
+	tree.insert(numKeys, std::to_string(numKeys));
+	printf("first write  %.6f s\n", secondsSince(start));
+
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		start = std::chrono::steady_clock::now();
+		BpTree copy = tree.clone(threads);
+		double elapsed = secondsSince(start);
+		if (copy.find(numKeys / 2) != std::to_string(numKeys / 2)) {
+			printf("clone is missing key %d\n", numKeys / 2);
+			return 1;
+		}
+		printf("clone        %2d threads: %.3f s\n", threads, elapsed);
+	}
+	return 0;
+}
@@ -0,0 +1,77 @@
+/* Interleaved lookup benchmark
+ * Description:
+ *	Builds a tree from shuffled keys that is meant to be much larger than the last level
+ *	cache, then times batches of random lookups with find() one key at a time and with
+ *	findBatch() at group sizes 1 to 32 (the number of lookups whose cache misses overlap).
+ *	Every run looks up the same keys and checks that the values match.
+ *
+ *	Usage: interleaved_lookup_bench [numKeys=4000000] [maxKeys=32] [numLookups=2000000]
+ *		[groupSizes=1,2,4,6,8,12,16,24,32]
+ */
+#include "../BpTree.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 4000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 32;
+	int numLookups = argc > 3 ? atoi(argv[3]) : 2000000;
+	std::string groupList = argc > 4 ? argv[4] : "1,2,4,6,8,12,16,24,32";
+
+	std::mt19937 random(42);
+	std::vector<int> keys;
+	for (int i = 0; i < numKeys; i++) {
+		keys.push_back(i);
+	}
+	for (size_t i = keys.size() - 1; i > 0; i--) {
+		std::swap(keys[i], keys[random() % (i + 1)]);
+	}
+	BpTree tree(maxKeys);
+	for (size_t i = 0; i < keys.size(); i++) {
+		tree.insert(keys[i], std::to_string(keys[i]));
+	}
+	//one in eight lookups is for a key that is not in the tree
+	std::vector<int> lookups;
+	for (int i = 0; i < numLookups; i++) {
+		int key = random() % numKeys;
+		lookups.push_back(random() % 8 == 0 ? numKeys + key : key);
+	}
+	printf("%d keys, maxKeys %d, %d lookups\n", numKeys, maxKeys, numLookups);
+
+	std::vector<std::string> expected(lookups.size());
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < lookups.size(); i++) {
+		expected[i] = tree.find(lookups[i]);
+	}
+	double baseline = secondsSince(start);
+	printf("%10s %12s %10s\n", "group size", "ns/lookup", "speedup");
+	printf("%10s %12.1f %9.2fx\n", "find()", baseline * 1e9 / numLookups, 1.0);
+
+	std::vector<int> groupSizes;
+	std::stringstream stream(groupList);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		groupSizes.push_back(atoi(item.c_str()));
+	}
+	std::vector<std::string> values;
+	for (size_t g = 0; g < groupSizes.size(); g++) {
+		start = std::chrono::steady_clock::now();
+		tree.findBatch(lookups, values, groupSizes[g]);
+		double elapsed = secondsSince(start);
+		if (values != expected) {
+			fprintf(stderr, "findBatch with group size %d returned different values than find()\n", groupSizes[g]);
+			return 1;
+		}
+		printf("%10d %12.1f %9.2fx\n", groupSizes[g], elapsed * 1e9 / numLookups, baseline / elapsed);
+	}
+	return 0;
+}
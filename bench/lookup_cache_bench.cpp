@@ -0,0 +1,95 @@
+/* Lookup cache benchmark
+ * Description:
+ *	Runs Zipf-distributed find() calls from 1, 2, 4, ... threads against a tree without a
+ *	lookup cache and with caches of a few sizes, and reports the lookup rate and hit ratio once
+ *	the cache has been warmed up.
+ *
+ *	Usage: lookup_cache_bench [numKeys=1000000] [maxKeys=64] [lookupsPerThread=1000000]
+ *	                          [skew=0.99] [maxThreads=hardware threads]
+ */
+#include "../BpTree.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 1000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 64;
+	int lookupsPerThread = argc > 3 ? atoi(argv[3]) : 1000000;
+	double skew = argc > 4 ? atof(argv[4]) : 0.99;
+	int maxThreads = argc > 5 ? atoi(argv[5]) : (int)std::thread::hardware_concurrency();
+	if (maxThreads < 1) {
+		maxThreads = 1;
+	}
+
+	BpTree tree(maxKeys);
+	for (int i = 0; i < numKeys; i++) {
+		tree.insert(i, std::string(32, 'a' + i % 26));
+	}
+
+	//rank r of the Zipf distribution is drawn with probability proportional to 1 / r^skew;
+	//ranks are mapped to keys by a fixed shuffle so that hot keys are spread over the tree
+	std::vector<double> cumulative(numKeys);
+	double total = 0;
+	for (int r = 0; r < numKeys; r++) {
+		total += 1.0 / std::pow(r + 1.0, skew);
+		cumulative[r] = total;
+	}
+	std::vector<int> keyOfRank(numKeys);
+	for (int i = 0; i < numKeys; i++) {
+		keyOfRank[i] = i;
+	}
+	std::shuffle(keyOfRank.begin(), keyOfRank.end(), std::mt19937(7));
+	std::vector<std::vector<int> > lookups(maxThreads);
+	for (int t = 0; t < maxThreads; t++) {
+		std::mt19937 random(t + 1);
+		std::uniform_real_distribution<double> uniform(0, total);
+		for (int i = 0; i < lookupsPerThread; i++) {
+			int rank = (int)(std::lower_bound(cumulative.begin(), cumulative.end(), uniform(random)) - cumulative.begin());
+			lookups[t].push_back(keyOfRank[rank < numKeys ? rank : numKeys - 1]);
+		}
+	}
+
+	printf("%d keys, maxKeys %d, zipf skew %.2f, %d lookups per thread\n", numKeys, maxKeys, skew, lookupsPerThread);
+	size_t cacheSizes[] = { 0, 1 << 20, 8 << 20, 64 << 20 };
+	for (size_t c = 0; c < sizeof(cacheSizes) / sizeof(cacheSizes[0]); c++) {
+		for (int threads = 1; threads <= maxThreads; threads *= 2) {
+			//warming the cache up with one pass over the first thread's lookups
+			tree.setCache(cacheSizes[c], 64);
+			for (size_t i = 0; i < lookups[0].size(); i++) {
+				tree.find(lookups[0][i]);
+			}
+			size_t warmHits = tree.getCacheHits();
+			size_t warmMisses = tree.getCacheMisses();
+			std::vector<std::thread> workers;
+			std::vector<size_t> found(threads, 0);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int t = 0; t < threads; t++) {
+				workers.push_back(std::thread([&tree, &lookups, &found, t]() {
+					for (size_t i = 0; i < lookups[t].size(); i++) {
+						found[t] += tree.find(lookups[t][i]).size();
+					}
+				}));
+			}
+			for (int t = 0; t < threads; t++) {
+				workers[t].join();
+			}
+			double elapsed = secondsSince(start);
+			size_t hits = tree.getCacheHits() - warmHits;
+			size_t misses = tree.getCacheMisses() - warmMisses;
+			printf("cache %6zu KB  %2d threads  %12.0f lookups/s  hit ratio %.3f\n", cacheSizes[c] >> 10, threads,
+				(double)threads * lookupsPerThread / elapsed, hits + misses > 0 ? (double)hits / (hits + misses) : 0.0);
+		}
+	}
+	return 0;
+}
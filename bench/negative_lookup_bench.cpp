@@ -0,0 +1,87 @@
+/* Negative lookup benchmark
+ * Description:
+ *	Times find() for keys that are not in the tree (and for keys that are) without a key
+ *	filter and with filters of increasing bits per key, and reports each filter's memory and
+ *	measured false positive rate.
+ *
+ *	Usage: negative_lookup_bench [numKeys=1000000] [maxKeys=64] [numLookups=1000000]
+ */
+#include "../BpTree.h"
+#include "../BloomFilter.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 1000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 64;
+	int numLookups = argc > 3 ? atoi(argv[3]) : 1000000;
+
+	//the tree holds the even keys, the misses are odd keys
+	BpTree tree(maxKeys);
+	std::mt19937 random(42);
+	std::vector<int> keys;
+	for (int i = 0; i < numKeys; i++) {
+		keys.push_back(i * 2);
+	}
+	for (size_t i = keys.size() - 1; i > 0; i--) {
+		std::swap(keys[i], keys[random() % (i + 1)]);
+	}
+	for (size_t i = 0; i < keys.size(); i++) {
+		tree.insert(keys[i], std::to_string(keys[i]));
+	}
+	std::vector<int> hits;
+	std::vector<int> misses;
+	for (int i = 0; i < numLookups; i++) {
+		int key = (int)(random() % (unsigned)numKeys) * 2;
+		hits.push_back(key);
+		misses.push_back(key + 1);
+	}
+
+	printf("%d keys, maxKeys %d, %d lookups\n", numKeys, maxKeys, numLookups);
+	printf("bits/key  filter bytes  bytes/key  false positives  misses/s      hits/s\n");
+	int settings[] = { 0, 4, 6, 8, 10, 12, 16 };
+	for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); s++) {
+		int bitsPerKey = settings[s];
+		tree.setFilter(bitsPerKey);
+
+		double falsePositives = 0;
+		if (bitsPerKey > 0) {
+			//measured on a filter of the same size and load as the tree's
+			BloomFilter filter(tree.getFilterBytes() * 8 / bitsPerKey, bitsPerKey);
+			for (size_t i = 0; i < keys.size(); i++) {
+				filter.add(keys[i]);
+			}
+			int positives = 0;
+			for (size_t i = 0; i < misses.size(); i++) {
+				if (filter.mayContain(misses[i])) {
+					positives += 1;
+				}
+			}
+			falsePositives = (double)positives / misses.size();
+		}
+
+		size_t found = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < misses.size(); i++) {
+			found += tree.find(misses[i]).size();
+		}
+		double missTime = secondsSince(start);
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < hits.size(); i++) {
+			found += tree.find(hits[i]).size();
+		}
+		double hitTime = secondsSince(start);
+		printf("%8d  %12zu  %9.2f  %14.3f%%  %10.0f  %10.0f  (%zu)\n", bitsPerKey, tree.getFilterBytes(),
+			(double)tree.getFilterBytes() / numKeys, falsePositives * 100, misses.size() / missTime,
+			hits.size() / hitTime, found);
+	}
+	return 0;
+}
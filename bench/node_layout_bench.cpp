@@ -0,0 +1,122 @@
+/* Node layout benchmark
+ * Description:
+ *	Times random find() calls on trees whose nodes are sized to whole numbers of cache lines
+ *	or a page (see Node::getMaxKeysForSize), and reports the cache misses per lookup from the
+ *	hardware performance counters when the kernel gives access to them.
+ *
+ *	Usage: node_layout_bench [numKeys=1000000] [numLookups=1000000] [maxKeys...]
+ *	(with no maxKeys given, node sizes of 2, 4, 8 and 16 cache lines and 4 KB are used)
+ */
+#include "../BpTree.h"
+#include "../Node.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//opens a counter for the calling thread, or returns -1 if the event is not available
+static int openCounter(unsigned int type, unsigned long long config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long readCounter(int fd) {
+	long long value = 0;
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+		return -1;
+	}
+	return value;
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 1000000;
+	int numLookups = argc > 2 ? atoi(argv[2]) : 1000000;
+	std::vector<int> orders;
+	for (int i = 3; i < argc; i++) {
+		orders.push_back(atoi(argv[i]));
+	}
+	if (orders.empty()) {
+		for (int lines = 2; lines <= 16; lines *= 2) {
+			orders.push_back(Node::getMaxKeysForSize(lines * NODE_CACHE_LINE));
+		}
+		orders.push_back(Node::getMaxKeysForSize(4096));
+	}
+
+	std::mt19937 random(42);
+	std::vector<int> keys;
+	for (int i = 0; i < numKeys; i++) {
+		keys.push_back(i);
+	}
+	for (size_t i = keys.size() - 1; i > 0; i--) {
+		std::swap(keys[i], keys[random() % (i + 1)]);
+	}
+	std::vector<int> lookups;
+	for (int i = 0; i < numLookups; i++) {
+		lookups.push_back(random() % numKeys);
+	}
+
+	int cacheMisses = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	int l1Misses = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	if (cacheMisses < 0) {
+		printf("hardware cache miss counters are not available, only times are reported\n");
+	}
+
+	printf("%d keys, %d random lookups\n", numKeys, numLookups);
+	printf("%8s %12s %12s %14s %14s\n", "maxKeys", "leaf bytes", "ns/lookup", "LLC miss/op", "L1D miss/op");
+	for (size_t o = 0; o < orders.size(); o++) {
+		BpTree tree(orders[o]);
+		for (size_t i = 0; i < keys.size(); i++) {
+			tree.insert(keys[i], "v");
+		}
+		size_t found = 0;
+		ioctl(cacheMisses, PERF_EVENT_IOC_RESET, 0);
+		ioctl(l1Misses, PERF_EVENT_IOC_RESET, 0);
+		ioctl(cacheMisses, PERF_EVENT_IOC_ENABLE, 0);
+		ioctl(l1Misses, PERF_EVENT_IOC_ENABLE, 0);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < lookups.size(); i++) {
+			found += tree.find(lookups[i]).size();
+		}
+		double elapsed = secondsSince(start);
+		ioctl(cacheMisses, PERF_EVENT_IOC_DISABLE, 0);
+		ioctl(l1Misses, PERF_EVENT_IOC_DISABLE, 0);
+		long long llc = readCounter(cacheMisses);
+		long long l1 = readCounter(l1Misses);
+		printf("%8d %12zu %12.1f", orders[o], Node::getAllocationSize(orders[o], NODE_TYPE_LEAF), elapsed * 1e9 / lookups.size());
+		if (llc >= 0) {
+			printf(" %14.2f", (double)llc / lookups.size());
+		}
+		else {
+			printf(" %14s", "n/a");
+		}
+		if (l1 >= 0) {
+			printf(" %14.2f\n", (double)l1 / lookups.size());
+		}
+		else {
+			printf(" %14s\n", "n/a");
+		}
+		if (found != lookups.size()) {
+			printf("lookups failed\n");
+			return 1;
+		}
+	}
+	return 0;
+}
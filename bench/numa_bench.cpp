@@ -0,0 +1,177 @@
+/* NUMA placement benchmark
+ * Description:
+ *	Builds a tree from one thread pinned to the first NUMA node, as a loader thread would,
+ *	then times random lookups from a thread pinned to a CPU of each NUMA node in turn, with
+ *	the nodes placed in different ways (see NodeArena and BpTree::setNodePlacement()):
+ *	- heap: the default, every page on the loader's node (first touch)
+ *	- node 0: every node bound to the first NUMA node with libnuma, which simulates a tree
+ *	  built elsewhere for the readers on the other nodes of a single multi-socket host
+ *	- interleaved: leaves on the first node, interior nodes interleaved over all nodes
+ *	- replicas: the same, plus a copy of the top interior levels on every node (see
+ *	  BpTree::setReplicas())
+ *	- sharded: a ShardedBpTree with a shard per NUMA node whose leaves are placed on its node
+ *	  (see ShardedBpTree::setShardCpus()); the thread of each node only looks up the keys of
+ *	  its own shard, as the workers of a partitioned data set would
+ *	A reader on the node holding the memory sees local latency and the others remote latency,
+ *	so the spread between the columns is the cost of remote memory. Needs a build with
+ *	BPTREE_NUMA (cmake -DBPTREE_NUMA=ON) on a host with more than one NUMA node to show a
+ *	difference; elsewhere every placement falls back to the heap and the rows only compare
+ *	the overheads.
+ *
+ *	Usage: numa_bench [numKeys=4000000] [maxKeys=32] [numLookups=2000000] [replicaLevels=2]
+ */
+#include "../BpTree.h"
+#include "../NodeArena.h"
+#include "../ShardedBpTree.h"
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <random>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//pins the calling thread to a CPU
+static void pinToCpu(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+//runs work on a new thread pinned to a CPU and waits for it
+template <typename Work>
+static void runOn(int cpu, Work work) {
+	std::thread thread([cpu, &work]() {
+		pinToCpu(cpu);
+		work();
+	});
+	thread.join();
+}
+
+//times the lookups of each node's keys from a thread on that node; returns false if a key is missing
+template <typename Find>
+static bool timeLookups(const char* name, const std::vector<int>& cpus, const std::vector<std::vector<int> >& lookups, Find find) {
+	printf("%-12s", name);
+	for (size_t node = 0; node < cpus.size(); node++) {
+		long missing = 0;
+		double elapsed = 0;
+		runOn(cpus[node], [&]() {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < lookups[node].size(); i++) {
+				missing += find(lookups[node][i]).empty() ? 1 : 0;
+			}
+			elapsed = secondsSince(start);
+		});
+		if (missing != 0) {
+			printf("\n%ld lookups from node %zu found nothing\n", missing, node);
+			return false;
+		}
+		printf(" %12.1f", elapsed * 1e9 / lookups[node].size());
+	}
+	printf("   (%zu MB of chunks)\n", NodeArena::getChunkBytes() >> 20);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 4000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 32;
+	int numLookups = argc > 3 ? atoi(argv[3]) : 2000000;
+	int replicaLevels = argc > 4 ? atoi(argv[4]) : 2;
+
+	//the first CPU of every NUMA node the process may run on
+	int numNodes = NodeArena::getNumNodes();
+	std::vector<int> cpus(numNodes, -1);
+	cpu_set_t allowed;
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	for (int cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--) {
+		if (CPU_ISSET(cpu, &allowed) && NodeArena::getNodeOfCpu(cpu) < numNodes) {
+			cpus[NodeArena::getNodeOfCpu(cpu)] = cpu;
+		}
+	}
+	for (int node = numNodes - 1; node >= 0; node--) {
+		if (cpus[node] == -1) {
+			cpus.erase(cpus.begin() + node);
+		}
+	}
+	printf("%d keys, maxKeys %d, %d lookups per node, NUMA %s, %d nodes\n", numKeys, maxKeys, numLookups,
+		NodeArena::isNumaAvailable() ? "available" : "not available (placements fall back to the heap)", numNodes);
+
+	std::mt19937 random(42);
+	std::vector<int> keys;
+	for (int i = 0; i < numKeys; i++) {
+		keys.push_back(i);
+	}
+	for (size_t i = keys.size() - 1; i > 0; i--) {
+		std::swap(keys[i], keys[random() % (i + 1)]);
+	}
+	//uniform lookups for the single trees, and the keys of each node's shard for the sharded tree
+	std::vector<int> boundaries;
+	std::vector<std::vector<int> > uniform(cpus.size());
+	std::vector<std::vector<int> > partitioned(cpus.size());
+	for (size_t node = 0; node < cpus.size(); node++) {
+		int low = (int)((long)numKeys * node / cpus.size());
+		int high = (int)((long)numKeys * (node + 1) / cpus.size());
+		if (node > 0) {
+			boundaries.push_back(low);
+		}
+		for (int i = 0; i < numLookups; i++) {
+			uniform[node].push_back(random() % numKeys);
+			partitioned[node].push_back(low + random() % (high - low));
+		}
+	}
+
+	printf("%-12s", "placement");
+	for (size_t node = 0; node < cpus.size(); node++) {
+		printf("  node %d ns/op", NodeArena::getNodeOfCpu(cpus[node]));
+	}
+	printf("\n");
+	//the single tree placements: leaves, interior nodes and whether to add replicas
+	const char * names[] = { "heap", "node 0", "interleaved", "replicas" };
+	int leafPlacements[] = { NODE_PLACEMENT_DEFAULT, 0, 0, 0 };
+	int interiorPlacements[] = { NODE_PLACEMENT_DEFAULT, 0, NODE_PLACEMENT_INTERLEAVE, NODE_PLACEMENT_INTERLEAVE };
+	for (int p = 0; p < 4; p++) {
+		BpTree tree(maxKeys);
+		tree.setNodePlacement(leafPlacements[p], interiorPlacements[p]);
+		runOn(cpus[0], [&]() {
+			for (size_t i = 0; i < keys.size(); i++) {
+				tree.insert(keys[i], std::to_string(keys[i]));
+			}
+			if (p == 3) {
+				tree.setReplicas(replicaLevels);
+			}
+		});
+		std::string problem;
+		if (!tree.validate(problem)) {
+			fprintf(stderr, "invalid tree: %s\n", problem.c_str());
+			return 1;
+		}
+		if (!timeLookups(names[p], cpus, uniform, [&tree](int key) { return tree.find(key); })) {
+			return 1;
+		}
+	}
+
+	ShardedBpTree sharded(maxKeys, boundaries);
+	sharded.setShardCpus(cpus);
+	runOn(cpus[0], [&]() {
+		for (size_t i = 0; i < keys.size(); i++) {
+			sharded.insert(keys[i], std::to_string(keys[i]));
+		}
+	});
+	std::string error;
+	if (!sharded.validate(error)) {
+		fprintf(stderr, "invalid sharded tree: %s\n", error.c_str());
+		return 1;
+	}
+	if (!timeLookups("sharded", cpus, partitioned, [&sharded](int key) { return sharded.find(key); })) {
+		return 1;
+	}
+	return 0;
+}
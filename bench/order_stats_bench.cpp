@@ -0,0 +1,89 @@
+/* Order statistics benchmark
+ * Description:
+ *	Builds a tree and times random count(lo, hi), rank() and select() queries against
+ *	answering the same questions with a linear scan of the leaves, for a few range widths.
+ *
+ *	Usage: order_stats_bench [numKeys=1000000] [maxKeys=64] [numQueries=1000]
+ */
+#include "../BpTree.h"
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static long scanCount(BpTree& tree, int lo, int hi) {
+	return tree.scanParallel(lo, hi, 0L,
+		[](long& n, int, const std::string&) { n++; },
+		[](long& n, const long& partial) { n += partial; }, 1);
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 1000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 64;
+	int numQueries = argc > 3 ? atoi(argv[3]) : 1000;
+
+	BpTree tree(maxKeys);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numKeys; i++) {
+		tree.insert(i * 2, std::to_string(i));
+	}
+	printf("build %d keys, maxKeys %d: %.3f s\n", numKeys, maxKeys, secondsSince(start));
+
+	std::mt19937 random(42);
+	long checksum = 0;
+	for (int width = 100; width <= numKeys * 2; width *= 100) {
+		std::vector<int> starts;
+		for (int i = 0; i < numQueries; i++) {
+			starts.push_back((int)(random() % (unsigned)(numKeys * 2)));
+		}
+		start = std::chrono::steady_clock::now();
+		long counted = 0;
+		for (int i = 0; i < numQueries; i++) {
+			counted += tree.count(starts[i], starts[i] + width);
+		}
+		double treeTime = secondsSince(start);
+		start = std::chrono::steady_clock::now();
+		long scanned = 0;
+		for (int i = 0; i < numQueries; i++) {
+			scanned += scanCount(tree, starts[i], starts[i] + width);
+		}
+		double scanTime = secondsSince(start);
+		if (counted != scanned) {
+			printf("count mismatch: %ld vs %ld\n", counted, scanned);
+			return 1;
+		}
+		printf("count width %9d  %10.0f queries/s  scan %10.0f queries/s  speedup %.1f\n",
+			width, numQueries / treeTime, numQueries / scanTime, scanTime / treeTime);
+	}
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numQueries; i++) {
+		checksum += tree.rank((int)(random() % (unsigned)(numKeys * 2)));
+	}
+	double rankTime = secondsSince(start);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numQueries; i++) {
+		checksum += scanCount(tree, INT_MIN, (int)(random() % (unsigned)(numKeys * 2)) - 1);
+	}
+	double rankScanTime = secondsSince(start);
+	printf("rank                   %10.0f queries/s  scan %10.0f queries/s  speedup %.1f\n",
+		numQueries / rankTime, numQueries / rankScanTime, rankScanTime / rankTime);
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numQueries; i++) {
+		int key;
+		std::string value;
+		if (tree.select((int)(random() % (unsigned)numKeys), key, value)) {
+			checksum += key;
+		}
+	}
+	printf("select                 %10.0f queries/s\n", numQueries / secondsSince(start));
+	printf("(checksum %ld)\n", checksum);
+	return 0;
+}
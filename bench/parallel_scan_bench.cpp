@@ -0,0 +1,59 @@
+/* Parallel scan benchmark
+ * Description:
+ *	Runs full-tree aggregations (count, sum of value lengths, and a filtered count) with
+ *	scanParallel() using 1, 2, 4, ... threads and reports the scan rate and the speedup over
+ *	a single thread.
+ *
+ *	Usage: parallel_scan_bench [numKeys=100000000] [maxKeys=64] [maxThreads=hardware threads]
+ */
+#include "../BpTree.h"
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 100000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 64;
+	int maxThreads = argc > 3 ? atoi(argv[3]) : (int)std::thread::hardware_concurrency();
+	if (maxThreads < 1) {
+		maxThreads = 1;
+	}
+
+	BpTree tree(maxKeys);
+	std::vector<std::pair<int, std::string> > batch;
+	for (int i = 0; i < numKeys; i++) {
+		batch.push_back(std::make_pair(i, std::to_string(i)));
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	tree.insertBatch(batch, maxThreads);
+	batch.clear();
+	printf("build %d keys, maxKeys %d: %.3f s\n", numKeys, maxKeys, secondsSince(start));
+
+	double baseline = 0;
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		start = std::chrono::steady_clock::now();
+		long count = tree.scanParallel(INT_MIN, INT_MAX, 0L,
+			[](long& n, int, const std::string&) { n++; },
+			[](long& n, const long& partial) { n += partial; }, threads);
+		long lengths = tree.scanParallel(INT_MIN, INT_MAX, 0L,
+			[](long& n, int, const std::string& value) { n += (long)value.size(); },
+			[](long& n, const long& partial) { n += partial; }, threads);
+		long matches = tree.scanParallel(INT_MIN, INT_MAX, 0L,
+			[](long& n, int key, const std::string&) { if (key % 7 == 0) n++; },
+			[](long& n, const long& partial) { n += partial; }, threads);
+		double elapsed = secondsSince(start);
+		if (threads == 1) {
+			baseline = elapsed;
+		}
+		printf("%2d threads: %.3f s for 3 scans, %.0f pairs/s, speedup %.2f (count %ld, lengths %ld, key %% 7 == 0: %ld)\n",
+			threads, elapsed, 3.0 * count / elapsed, baseline / elapsed, count, lengths, matches);
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+/* Prefetch benchmark
+ * Description:
+ *	Builds a tree from shuffled keys (so that neighbouring leaves are scattered through memory)
+ *	that is meant to be much larger than the last level cache, then times random find() calls
+ *	(whose descents prefetch each child's header and keys) and long forward and backward scans
+ *	at increasing leaf prefetch distances (see BpTree::setScanPrefetch).
+ *
+ *	Usage: prefetch_bench [numKeys=8000000] [maxKeys=64] [numLookups=1000000] [scanLength=100000]
+ */
+#include "../BpTree.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 8000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 64;
+	int numLookups = argc > 3 ? atoi(argv[3]) : 1000000;
+	int scanLength = argc > 4 ? atoi(argv[4]) : 100000;
+
+	std::mt19937 random(42);
+	std::vector<int> keys;
+	for (int i = 0; i < numKeys; i++) {
+		keys.push_back(i);
+	}
+	for (size_t i = keys.size() - 1; i > 0; i--) {
+		std::swap(keys[i], keys[random() % (i + 1)]);
+	}
+	BpTree tree(maxKeys);
+	for (size_t i = 0; i < keys.size(); i++) {
+		tree.insert(keys[i], "v");
+	}
+	printf("%d keys, maxKeys %d\n", numKeys, maxKeys);
+
+	size_t found = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numLookups; i++) {
+		found += tree.find(random() % numKeys).size();
+	}
+	printf("find: %.1f ns/lookup (%zu found)\n", secondsSince(start) * 1e9 / numLookups, found);
+
+	//the same scan starts are used for every distance
+	int numScans = (int)(20000000LL / scanLength) + 1;
+	std::vector<int> starts;
+	for (int i = 0; i < numScans; i++) {
+		starts.push_back(random() % (numKeys > scanLength ? numKeys - scanLength : 1));
+	}
+	printf("%d scans of %d keys\n", numScans, scanLength);
+	printf("%9s %16s %16s\n", "distance", "forward ns/key", "backward ns/key");
+	int distances[] = { 0, 1, 2, 4, 8, 16, 32 };
+	for (size_t d = 0; d < sizeof(distances) / sizeof(distances[0]); d++) {
+		tree.setScanPrefetch(distances[d]);
+		long forwardKeys = 0;
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < numScans; i++) {
+			forwardKeys += tree.scanParallel(starts[i], starts[i] + scanLength - 1, 0L,
+				[](long& n, int, const std::string&) { n++; }, [](long& n, const long& partial) { n += partial; }, 1);
+		}
+		double forward = secondsSince(start);
+		long backwardKeys = 0;
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < numScans; i++) {
+			backwardKeys += tree.scanBackward(starts[i] + scanLength - 1, starts[i], [](int, const std::string&) { return true; });
+		}
+		double backward = secondsSince(start);
+		printf("%9d %16.2f %16.2f\n", distances[d], forward * 1e9 / forwardKeys, backward * 1e9 / backwardKeys);
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+/* Sharded tree benchmark
+ * Description:
+ *	Times concurrent inserts and lookups of random keys in a ShardedBpTree with one shard (a
+ *	single tree behind one lock) and with more shards, with a thread per shard pinned to the
+ *	shard's CPU when cpus allows. Then sends nine in ten operations to a narrow hot range and
+ *	shows the load of the shards before and after a few rounds of rebalance(). Every run is
+ *	checked with validate() and a full scan.
+ *
+ *	Usage: sharded_bench [numKeys=2000000] [maxKeys=32] [threads=4] [shards=1,4,16]
+ *		[cpus=0 (none; N hands out CPUs 0..N-1)]
+ */
+#include "../ShardedBpTree.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//runs work(thread) on numThreads threads, pinned to the CPU of shard thread % numShards
+template <typename Work>
+static double runThreads(ShardedBpTree& tree, int numThreads, Work work) {
+	std::vector<std::thread> threads;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int t = 0; t < numThreads; t++) {
+		threads.push_back(std::thread([&tree, &work, t]() {
+			tree.pinToShard(t % tree.getNumShards());
+			work(t);
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); t++) {
+		threads[t].join();
+	}
+	return secondsSince(start);
+}
+
+//checks the tree and that a full scan sees numKeys keys in ascending order
+static bool check(ShardedBpTree& tree, int numKeys) {
+	std::string error;
+	if (!tree.validate(error)) {
+		fprintf(stderr, "invalid tree: %s\n", error.c_str());
+		return false;
+	}
+	long previous = (long)INT_MIN - 1;
+	bool ordered = true;
+	int scanned = tree.scan(INT_MIN, INT_MAX, [&previous, &ordered](int key, const std::string&) {
+		ordered = ordered && key > previous;
+		previous = key;
+		return true;
+	});
+	if (scanned != numKeys || !ordered || tree.size() != (size_t)numKeys) {
+		fprintf(stderr, "scan saw %d keys (%s), expected %d\n", scanned, ordered ? "in order" : "out of order", numKeys);
+		return false;
+	}
+	return true;
+}
+
+//prints the share of the operations each shard took since the last rebalance()
+static void printLoads(ShardedBpTree& tree) {
+	size_t total = 0;
+	for (int i = 0; i < tree.getNumShards(); i++) {
+		total += tree.getShardLoad(i);
+	}
+	printf("  load %%:");
+	for (int i = 0; i < tree.getNumShards(); i++) {
+		printf(" %5.1f", total == 0 ? 0.0 : 100.0 * tree.getShardLoad(i) / total);
+	}
+	printf("\n");
+}
+
+int main(int argc, char** argv) {
+	int numKeys = argc > 1 ? atoi(argv[1]) : 2000000;
+	int maxKeys = argc > 2 ? atoi(argv[2]) : 32;
+	int numThreads = argc > 3 ? atoi(argv[3]) : 4;
+	std::string shardList = argc > 4 ? argv[4] : "1,4,16";
+	int numCpus = argc > 5 ? atoi(argv[5]) : 0;
+
+	//every thread inserts its own shuffled slice of the keys, spread over the whole int range
+	std::mt19937 random(42);
+	std::vector<int> keys;
+	for (int i = 0; i < numKeys; i++) {
+		keys.push_back((int)((long long)INT_MIN + (long long)i * ((1LL << 32) / numKeys)));
+	}
+	for (size_t i = keys.size() - 1; i > 0; i--) {
+		std::swap(keys[i], keys[random() % (i + 1)]);
+	}
+	std::vector<int> cpus;
+	for (int i = 0; i < numCpus; i++) {
+		cpus.push_back(i);
+	}
+	std::vector<int> shardCounts;
+	std::stringstream stream(shardList);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		shardCounts.push_back(atoi(item.c_str()));
+	}
+
+	printf("%d keys, maxKeys %d, %d threads, %d cpus\n", numKeys, maxKeys, numThreads, numCpus);
+	printf("%6s %14s %14s %9s\n", "shards", "inserts/s", "finds/s", "speedup");
+	double baseline = 0;
+	for (size_t s = 0; s < shardCounts.size(); s++) {
+		ShardedBpTree tree(maxKeys, shardCounts[s]);
+		tree.setShardCpus(cpus);
+		double insertTime = runThreads(tree, numThreads, [&tree, &keys, numThreads](int t) {
+			for (size_t i = t; i < keys.size(); i += numThreads) {
+				tree.insert(keys[i], "value");
+			}
+		});
+		std::vector<long> found(numThreads, 0);
+		double findTime = runThreads(tree, numThreads, [&tree, &keys, &found, numThreads](int t) {
+			std::mt19937 generator(t);
+			for (size_t i = t; i < keys.size(); i += numThreads) {
+				found[t] += tree.find(keys[generator() % keys.size()]).empty() ? 0 : 1;
+			}
+		});
+		long totalFound = 0;
+		for (int t = 0; t < numThreads; t++) {
+			totalFound += found[t];
+		}
+		if (totalFound != (long)keys.size() || !check(tree, numKeys)) {
+			fprintf(stderr, "%d shards: %ld of %zu lookups found\n", shardCounts[s], totalFound, keys.size());
+			return 1;
+		}
+		double rate = numKeys / insertTime;
+		if (s == 0) {
+			baseline = rate;
+		}
+		printf("%6d %14.0f %14.0f %8.2fx\n", shardCounts[s], rate, numKeys / findTime, rate / baseline);
+	}
+
+	//a hot range of 1/64 of the keys takes nine in ten operations
+	int numShards = shardCounts.back() > 1 ? shardCounts.back() : 4;
+	ShardedBpTree tree(maxKeys, numShards);
+	tree.setShardCpus(cpus);
+	for (size_t i = 0; i < keys.size(); i++) {
+		tree.insert(keys[i], "value");
+	}
+	std::vector<int> sorted(keys);
+	std::sort(sorted.begin(), sorted.end());
+	size_t hotStart = sorted.size() / 3;
+	size_t hotSize = sorted.size() / 64 > 0 ? sorted.size() / 64 : 1;
+	printf("skewed updates, %d shards, hot range [%d, %d]\n", numShards, sorted[hotStart], sorted[hotStart + hotSize - 1]);
+	for (int round = 0; round <= 8; round++) {
+		double elapsed = runThreads(tree, numThreads, [&tree, &sorted, hotStart, hotSize, round](int t) {
+			std::mt19937 generator(round * 1000 + t);
+			for (int i = 0; i < 100000; i++) {
+				size_t index = generator() % 10 != 0 ? hotStart + generator() % hotSize : generator() % sorted.size();
+				tree.update(sorted[index], "updated");
+			}
+		});
+		printf("round %d: %.0f updates/s\n", round, numThreads * 100000 / elapsed);
+		printLoads(tree);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool moved = tree.rebalance(1.5);
+		printf("  rebalance %s in %.2fms\n", moved ? "moved a boundary" : "moved nothing", secondsSince(start) * 1e3);
+		if (!check(tree, numKeys)) {
+			return 1;
+		}
+	}
+	return 0;
+}
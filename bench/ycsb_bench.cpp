@@ -0,0 +1,312 @@
+/* YCSB workload driver
+ * Description:
+ *	Loads records into a tree with insert() and then runs one of the YCSB core workloads (or a
+ *	custom mix of operations) from 1, 2, 4, ... threads, reporting the throughput and the
+ *	latency histogram and percentiles of each kind of operation:
+ *		A - 50% read, 50% update (zipfian)
+ *		B - 95% read, 5% update (zipfian)
+ *		C - 100% read (zipfian)
+ *		D - 95% read, 5% insert of new records (latest: recently inserted records are read most)
+ *		E - 95% short range scan, 5% insert (zipfian scan starts, scans of 1 .. maxScanLength records)
+ *		F - 50% read, 50% read-modify-write (zipfian)
+ *	A custom mix is given as e.g. "read=0.7,update=0.1,insert=0.1,scan=0.05,rmw=0.05". Reads are
+ *	find(), updates update(), inserts insert() of keys above the loaded ones, scans walk the leaves
+ *	through scanBackward() and read-modify-writes use modify(). Readers share the tree and
+ *	writers take it exclusively through a reader/writer lock, since the tree itself leaves
+ *	concurrent writes to the caller.
+ *
+ *	Usage: ycsb_bench [workload=A] [records=1000000] [ops=1000000] [maxThreads=hardware threads]
+ *	                  [distribution=workload default (uniform, zipfian or latest)] [maxKeys=64]
+ *	                  [valueSize=100] [json=ycsb.json ("-" for standard output)] [maxScanLength=100]
+ */
+#include "../BpTree.h"
+#include "BenchUtil.h"
+#include <pthread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Constants used for the kinds of operations of a mix */
+#define OP_READ					0
+#define OP_UPDATE				1
+#define OP_INSERT				2
+#define OP_SCAN					3
+#define OP_RMW					4
+#define NUM_OPS					5
+
+static const char* opNames[NUM_OPS] = { "read", "update", "insert", "scan", "rmw" };
+
+//the share of each kind of operation and the distribution of the keys they use
+struct Mix {
+	double shares[NUM_OPS];
+	int distribution;
+};
+
+//fills in the mix of a core workload letter or a custom "name=share,..." list
+static bool parseMix(const std::string& workload, Mix& mix) {
+	memset(mix.shares, 0, sizeof(mix.shares));
+	mix.distribution = KEYS_ZIPFIAN;
+	if (workload == "A") {
+		mix.shares[OP_READ] = 0.5;
+		mix.shares[OP_UPDATE] = 0.5;
+	}
+	else if (workload == "B") {
+		mix.shares[OP_READ] = 0.95;
+		mix.shares[OP_UPDATE] = 0.05;
+	}
+	else if (workload == "C") {
+		mix.shares[OP_READ] = 1.0;
+	}
+	else if (workload == "D") {
+		mix.shares[OP_READ] = 0.95;
+		mix.shares[OP_INSERT] = 0.05;
+		mix.distribution = KEYS_LATEST;
+	}
+	else if (workload == "E") {
+		mix.shares[OP_SCAN] = 0.95;
+		mix.shares[OP_INSERT] = 0.05;
+	}
+	else if (workload == "F") {
+		mix.shares[OP_READ] = 0.5;
+		mix.shares[OP_RMW] = 0.5;
+	}
+	else {
+		size_t begin = 0;
+		while (begin < workload.size()) {
+			size_t end = workload.find(',', begin);
+			if (end == std::string::npos) {
+				end = workload.size();
+			}
+			std::string field = workload.substr(begin, end - begin);
+			size_t equals = field.find('=');
+			int op = -1;
+			for (int i = 0; i < NUM_OPS && equals != std::string::npos; i++) {
+				if (field.compare(0, equals, opNames[i]) == 0) {
+					op = i;
+				}
+			}
+			if (op == -1) {
+				return false;
+			}
+			mix.shares[op] = atof(field.c_str() + equals + 1);
+			begin = end + 1;
+		}
+	}
+	double total = 0;
+	for (int i = 0; i < NUM_OPS; i++) {
+		total += mix.shares[i];
+	}
+	return total > 0;
+}
+
+//picks a kind of operation with the probabilities of the mix
+static int pickOp(const Mix& mix, double u) {
+	double total = 0;
+	for (int i = 0; i < NUM_OPS; i++) {
+		total += mix.shares[i];
+	}
+	u *= total;
+	for (int i = 0; i < NUM_OPS; i++) {
+		if (u < mix.shares[i]) {
+			return i;
+		}
+		u -= mix.shares[i];
+	}
+	return OP_READ;
+}
+
+struct Run {
+	BpTree* tree;
+	pthread_rwlock_t* lock;
+	std::atomic<int>* nextKey;
+	Mix mix;
+	int records;
+	int maxScanLength;
+	std::string value;
+};
+
+//runs ops operations of the mix, recording the latency of each in the histogram of its kind
+static void runThread(Run* run, int thread, long ops, std::vector<LatencyHistogram>* histograms, long* failures) {
+	KeyGenerator keys(run->records, run->mix.distribution, 0.99, 1000 + thread);
+	std::mt19937 random(2000 + thread);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::string updated = run->value;
+	updated[0] = 'u';
+	for (long i = 0; i < ops; i++) {
+		int op = pickOp(run->mix, uniform(random));
+		keys.setNewest(run->nextKey->load() - 1);
+		int key = keys.next();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool ok = true;
+		switch (op) {
+		case OP_READ:
+			pthread_rwlock_rdlock(run->lock);
+			ok = !run->tree->find(key).empty();
+			pthread_rwlock_unlock(run->lock);
+			break;
+		case OP_UPDATE:
+			pthread_rwlock_wrlock(run->lock);
+			ok = run->tree->update(key, updated);
+			pthread_rwlock_unlock(run->lock);
+			break;
+		case OP_INSERT:
+			pthread_rwlock_wrlock(run->lock);
+			ok = run->tree->insert(run->nextKey->fetch_add(1), run->value);
+			pthread_rwlock_unlock(run->lock);
+			break;
+		case OP_SCAN: {
+			int length = 1 + (int)keys.nextUniform((unsigned int)run->maxScanLength);
+			long bytes = 0;
+			pthread_rwlock_rdlock(run->lock);
+			run->tree->scanBackward(key + length - 1, key, [&bytes](int, const std::string& value) {
+				bytes += value.size();
+				return true;
+			});
+			pthread_rwlock_unlock(run->lock);
+			break;
+		}
+		case OP_RMW:
+			pthread_rwlock_wrlock(run->lock);
+			ok = run->tree->modify(key, [](std::string& value) { value[value.size() - 1] += 1; });
+			pthread_rwlock_unlock(run->lock);
+			break;
+		}
+		(*histograms)[op].add(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+		if (!ok) {
+			*failures += 1;
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string workload = argc > 1 ? argv[1] : "A";
+	int records = argc > 2 ? atoi(argv[2]) : 1000000;
+	long ops = argc > 3 ? atol(argv[3]) : 1000000;
+	int maxThreads = argc > 4 ? atoi(argv[4]) : (int)std::thread::hardware_concurrency();
+	std::string distribution = argc > 5 ? argv[5] : "";
+	int maxKeys = argc > 6 ? atoi(argv[6]) : 64;
+	int valueSize = argc > 7 ? atoi(argv[7]) : 100;
+	std::string jsonPath = argc > 8 ? argv[8] : "ycsb.json";
+	int maxScanLength = argc > 9 ? atoi(argv[9]) : 100;
+	if (maxThreads < 1) {
+		maxThreads = 1;
+	}
+	if (valueSize < 1) {
+		valueSize = 1;
+	}
+	if (maxScanLength < 1) {
+		maxScanLength = 1;
+	}
+
+	Mix mix;
+	if (!parseMix(workload, mix)) {
+		fprintf(stderr, "unknown workload %s\n", workload.c_str());
+		return 1;
+	}
+	if (distribution == "uniform") {
+		mix.distribution = KEYS_UNIFORM;
+	}
+	else if (distribution == "zipfian") {
+		mix.distribution = KEYS_ZIPFIAN;
+	}
+	else if (distribution == "latest") {
+		mix.distribution = KEYS_LATEST;
+	}
+	else if (!distribution.empty() && distribution != "-") {
+		fprintf(stderr, "unknown distribution %s\n", distribution.c_str());
+		return 1;
+	}
+
+	FILE * table = jsonPath == "-" ? stderr : stdout;
+	fprintf(table, "workload %s, %d records, %ld ops, %s keys, maxKeys %d, %d byte values; latencies in ns\n",
+		workload.c_str(), records, ops, distributionName(mix.distribution), maxKeys, valueSize);
+	fprintf(table, "%7s %-6s %12s %12s %10s %10s %10s %10s %10s\n", "threads", "op", "count", "ops/s",
+		"p50", "p95", "p99", "p999", "max");
+	std::vector<std::string> results;
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		//every thread count starts from a freshly loaded tree, in random key order
+		std::vector<int> order(records);
+		for (int i = 0; i < records; i++) {
+			order[i] = i;
+		}
+		std::shuffle(order.begin(), order.end(), std::mt19937(42));
+		BpTree tree(maxKeys);
+		Run run;
+		run.tree = &tree;
+		run.mix = mix;
+		run.records = records;
+		run.maxScanLength = maxScanLength;
+		run.value = std::string(valueSize, 'v');
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = 0; i < records; i++) {
+			tree.insert(order[i], run.value);
+		}
+		double loadSeconds = secondsSince(start);
+		fprintf(table, "%7d %-6s %12d %12.0f\n", threads, "load", records, records / loadSeconds);
+
+		pthread_rwlock_t lock;
+		pthread_rwlock_init(&lock, 0);
+		std::atomic<int> nextKey(records);
+		run.lock = &lock;
+		run.nextKey = &nextKey;
+		std::vector<std::vector<LatencyHistogram> > histograms(threads, std::vector<LatencyHistogram>(NUM_OPS));
+		std::vector<long> failures(threads, 0);
+		std::vector<std::thread> workers;
+		start = std::chrono::steady_clock::now();
+		for (int t = 0; t < threads; t++) {
+			long share = ops / threads + (t < ops % threads ? 1 : 0);
+			workers.push_back(std::thread(runThread, &run, t, share, &histograms[t], &failures[t]));
+		}
+		for (int t = 0; t < threads; t++) {
+			workers[t].join();
+		}
+		double seconds = secondsSince(start);
+		pthread_rwlock_destroy(&lock);
+
+		long failed = 0;
+		for (int t = 0; t < threads; t++) {
+			failed += failures[t];
+		}
+		fprintf(table, "%7d %-6s %12ld %12.0f   (%ld failed)\n", threads, "all", ops, ops / seconds, failed);
+		for (int op = 0; op < NUM_OPS; op++) {
+			LatencyHistogram merged;
+			for (int t = 0; t < threads; t++) {
+				merged.merge(histograms[t][op]);
+			}
+			if (merged.count() == 0) {
+				continue;
+			}
+			fprintf(table, "%7d %-6s %12lld %12.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n", threads, opNames[op], merged.count(),
+				merged.count() / seconds, merged.percentile(0.5), merged.percentile(0.95), merged.percentile(0.99),
+				merged.percentile(0.999), merged.max());
+			results.push_back(JsonObject()
+				.add("workload", workload)
+				.add("distribution", distributionName(mix.distribution))
+				.add("records", records)
+				.add("maxKeys", maxKeys)
+				.add("valueSize", valueSize)
+				.add("threads", threads)
+				.add("op", opNames[op])
+				.add("count", (long)merged.count())
+				.add("seconds", seconds)
+				.add("opsPerSec", merged.count() / seconds)
+				.add("loadOpsPerSec", records / loadSeconds)
+				.add("p50Ns", merged.percentile(0.5))
+				.add("p95Ns", merged.percentile(0.95))
+				.add("p99Ns", merged.percentile(0.99))
+				.add("p999Ns", merged.percentile(0.999))
+				.add("maxNs", merged.max())
+				.addRaw("histogramNs", merged.json())
+				.str());
+		}
+	}
+	if (!writeJson(jsonPath, "ycsb_" + workload, results)) {
+		fprintf(stderr, "could not write %s\n", jsonPath.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,520 @@
+/* Differential fuzz harness
+ * Description:
+ *	Runs a stream of operations against a BpTree and a std::map at the same time and stops at
+ *	the first difference in their answers or the first structural problem reported by
+ *	BpTree::validate() (which runs after every operation that changes the tree). The stream is
+ *	decoded from bytes: the first bytes pick maxKeys and the key range (small ranges keep the
+ *	tree busy splitting and merging the same nodes), then every operation is an opcode byte
+ *	followed by two key bytes. Inserts and removes make up most of the stream; the rest are
+ *	upserts, updates, modifies, finds, bound queries, order statistics, range removes, batch
+ *	inserts, scans (forward, backward and parallel, which must agree), snapshots (copies that
+ *	must not see later changes to the tree, and whose own changes the tree must not see),
+ *	writes to the snapshot, deep clones, moves, swaps and clears, and switching the key filter
+ *	and the lookup cache on and off (which validate() checks against the tree). Some finds
+ *	first give the tree replicas of its top interior levels (see BpTree::setReplicas()).
+ *
+ *	Built as a plain program it feeds itself random streams:
+ *		bptree_fuzz [runs=1000] [opsPerRun=2000] [seed=1]
+ *	and saves the stream of a failing run as bptree_fuzz-<seed>-<run>.bin. Given file names
+ *	instead, it replays them:
+ *		bptree_fuzz bptree_fuzz-1-42.bin
+ *	Built with -DBPTREE_LIBFUZZER and -fsanitize=fuzzer (clang, cmake -DBPTREE_LIBFUZZER=ON) the
+ *	same decoder is driven by libFuzzer through LLVMFuzzerTestOneInput.
+ */
+#include "../BpTree.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Constants used for the opcodes of the stream (opcode byte % NUM_FUZZ_OPS) */
+#define FUZZ_INSERT				0
+#define FUZZ_REMOVE				4
+#define FUZZ_UPSERT				8
+#define FUZZ_UPDATE				9
+#define FUZZ_MODIFY				10
+#define FUZZ_FIND				11
+#define FUZZ_BOUNDS				12
+#define FUZZ_ORDER				13
+#define FUZZ_REMOVE_RANGE		14
+#define FUZZ_INSERT_BATCH		15
+#define FUZZ_SCAN				16
+#define FUZZ_SNAPSHOT			17
+#define FUZZ_SNAPSHOT_WRITE		18
+#define FUZZ_CLONE				19
+#define FUZZ_FILTER				20
+#define FUZZ_CACHE				21
+#define FUZZ_MOVE				22
+#define NUM_FUZZ_OPS			23
+
+typedef std::map<int, std::string> Model;
+
+//reads the stream one byte at a time, as zeros past its end
+struct Stream {
+	const uint8_t* data;
+	size_t size;
+	size_t position;
+
+	int next() {
+		return this->position < this->size ? this->data[this->position++] : 0;
+	}
+	bool done() const {
+		return this->position >= this->size;
+	}
+};
+
+//the harness's state: the tree, its model and the snapshot taken last (if any)
+struct Fuzz {
+	BpTree* tree;
+	Model model;
+	BpTree* snapshot;
+	Model snapshotModel;
+	int maxKeys;
+	int keyRange;
+	long step;
+	char failure[512];
+};
+
+//records the first failure of a run
+static bool fail(Fuzz& fuzz, const char* what, int key) {
+	if (fuzz.failure[0] == 0) {
+		snprintf(fuzz.failure, sizeof(fuzz.failure), "step %ld: %s (key %d)", fuzz.step, what, key);
+	}
+	return false;
+}
+
+//the value stored by the operation at a step, different on every step
+static std::string valueFor(long step, int key) {
+	return std::to_string(key) + ":" + std::to_string(step);
+}
+
+//checks that every key of the model is in the tree with its value, and the order statistics agree
+static bool compareAll(Fuzz& fuzz, BpTree& tree, Model& model) {
+	std::string problem;
+	if (!tree.validate(problem)) {
+		return fail(fuzz, problem.c_str(), 0);
+	}
+	if (tree.count(-fuzz.keyRange, fuzz.keyRange * 2) != (int)model.size()) {
+		return fail(fuzz, "count over all keys differs", 0);
+	}
+	int index = 0;
+	for (Model::iterator it = model.begin(); it != model.end(); ++it, ++index) {
+		if (tree.find(it->first) != it->second) {
+			return fail(fuzz, "find differs", it->first);
+		}
+		int key = 0;
+		std::string value;
+		if (!tree.select(index, key, value) || key != it->first || value != it->second) {
+			return fail(fuzz, "select differs", it->first);
+		}
+	}
+	return true;
+}
+
+//runs one operation on the tree and the model; returns false on the first difference
+static bool step(Fuzz& fuzz, int op, int key, int argument) {
+	BpTree& tree = *fuzz.tree;
+	Model& model = fuzz.model;
+	std::string value = valueFor(fuzz.step, key);
+	bool changed = false;
+	if (op < FUZZ_REMOVE) {
+		bool expected = model.insert(std::make_pair(key, value)).second;
+		if (tree.insert(key, value) != expected) {
+			return fail(fuzz, "insert result differs", key);
+		}
+		changed = expected;
+	}
+	else if (op < FUZZ_UPSERT) {
+		bool expected = model.erase(key) > 0;
+		if (tree.remove(key) != expected) {
+			return fail(fuzz, "remove result differs", key);
+		}
+		changed = expected;
+	}
+	else if (op == FUZZ_UPSERT) {
+		bool expected = model.find(key) == model.end();
+		model[key] = value;
+		if (tree.upsert(key, value) != expected) {
+			return fail(fuzz, "upsert result differs", key);
+		}
+		changed = true;
+	}
+	else if (op == FUZZ_UPDATE) {
+		Model::iterator it = model.find(key);
+		if (it != model.end()) {
+			it->second = value;
+		}
+		if (tree.update(key, value) != (it != model.end())) {
+			return fail(fuzz, "update result differs", key);
+		}
+	}
+	else if (op == FUZZ_MODIFY) {
+		Model::iterator it = model.find(key);
+		if (it != model.end()) {
+			it->second += "+";
+		}
+		if (tree.modify(key, [](std::string& stored) { stored += "+"; }) != (it != model.end())) {
+			return fail(fuzz, "modify result differs", key);
+		}
+	}
+	else if (op == FUZZ_FIND) {
+		//every so often the lookups start in fresh replicas of the top 1 to 3 interior levels,
+		//which the writes that follow must drop before they restructure the tree
+		if (argument % 8 == 0) {
+			tree.setReplicas(argument / 8 % 3 + 1);
+			changed = true;
+		}
+		Model::iterator it = model.find(key);
+		if (tree.find(key) != (it != model.end() ? it->second : std::string())) {
+			return fail(fuzz, "find differs", key);
+		}
+		//the neighbouring keys interleaved, in groups of 1 to 5 lookups
+		std::vector<int> keys;
+		std::vector<std::string> values;
+		for (int k = key - 4; k <= key + 4; k++) {
+			keys.push_back(k);
+		}
+		tree.findBatch(keys, values, key % 5 + 1);
+		for (size_t i = 0; i < keys.size(); i++) {
+			it = model.find(keys[i]);
+			if (values[i] != (it != model.end() ? it->second : std::string())) {
+				return fail(fuzz, "findBatch differs", keys[i]);
+			}
+		}
+	}
+	else if (op == FUZZ_BOUNDS) {
+		int found = 0;
+		std::string foundValue;
+		Model::iterator lower = model.lower_bound(key);
+		bool expected = lower != model.end();
+		if (tree.lowerBound(key, found, foundValue) != expected || (expected && (found != lower->first || foundValue != lower->second))) {
+			return fail(fuzz, "lowerBound differs", key);
+		}
+		Model::iterator upper = model.upper_bound(key);
+		expected = upper != model.end();
+		if (tree.upperBound(key, found, foundValue) != expected || (expected && found != upper->first)) {
+			return fail(fuzz, "upperBound differs", key);
+		}
+		expected = upper != model.begin();
+		if (tree.floor(key, found, foundValue) != expected || (expected && found != std::prev(upper)->first)) {
+			return fail(fuzz, "floor differs", key);
+		}
+		expected = !model.empty();
+		if (tree.first(found, foundValue) != expected || (expected && found != model.begin()->first)) {
+			return fail(fuzz, "first differs", key);
+		}
+		if (tree.last(found, foundValue) != expected || (expected && found != model.rbegin()->first)) {
+			return fail(fuzz, "last differs", key);
+		}
+		expected = lower != model.end();
+		if (tree.ceiling(key, found, foundValue) != expected || (expected && found != lower->first)) {
+			return fail(fuzz, "ceiling differs", key);
+		}
+	}
+	else if (op == FUZZ_ORDER) {
+		int hi = key + argument;
+		int expectedRank = (int)std::distance(model.begin(), model.lower_bound(key));
+		if (tree.rank(key) != expectedRank) {
+			return fail(fuzz, "rank differs", key);
+		}
+		int expectedCount = (int)std::distance(model.lower_bound(key), model.upper_bound(hi));
+		if (tree.count(key, hi) != expectedCount) {
+			return fail(fuzz, "count differs", key);
+		}
+		int found = 0;
+		std::string foundValue;
+		bool expected = argument < (int)model.size();
+		if (tree.select(argument, found, foundValue) != expected ||
+			(expected && found != std::next(model.begin(), argument)->first)) {
+			return fail(fuzz, "select differs", argument);
+		}
+	}
+	else if (op == FUZZ_REMOVE_RANGE) {
+		int hi = key + argument / 8;
+		Model::iterator begin = model.lower_bound(key);
+		Model::iterator end = model.upper_bound(hi);
+		int expected = (int)std::distance(begin, end);
+		model.erase(begin, end);
+		if (tree.removeRange(key, hi) != expected) {
+			return fail(fuzz, "removeRange result differs", key);
+		}
+		changed = expected > 0;
+	}
+	else if (op == FUZZ_INSERT_BATCH) {
+		std::vector<std::pair<int, std::string> > pairs;
+		int expected = 0;
+		for (int i = 0; i < argument % 32; i++) {
+			int batchKey = (key + i * (1 + argument % 5)) % fuzz.keyRange;
+			std::string batchValue = valueFor(fuzz.step, batchKey);
+			pairs.push_back(std::make_pair(batchKey, batchValue));
+			expected += model.insert(std::make_pair(batchKey, batchValue)).second ? 1 : 0;
+		}
+		if (tree.insertBatch(pairs, 1 + argument % 2) != expected) {
+			return fail(fuzz, "insertBatch result differs", key);
+		}
+		changed = expected > 0;
+	}
+	else if (op == FUZZ_SCAN) {
+		int lo = key - argument;
+		std::vector<std::pair<int, std::string> > visited;
+		tree.scanBackward(key, lo, [&visited](int visitedKey, const std::string& visitedValue) {
+			visited.push_back(std::make_pair(visitedKey, visitedValue));
+			return true;
+		});
+		std::vector<std::pair<int, std::string> > expected;
+		for (Model::iterator it = model.upper_bound(key); it != model.begin() && std::prev(it)->first >= lo; --it) {
+			expected.push_back(*std::prev(it));
+		}
+		if (visited != expected) {
+			return fail(fuzz, "scanBackward differs", key);
+		}
+		//the same range forward, and split between 1 to 4 threads (whose parts are joined in order)
+		std::vector<std::pair<int, std::string> > forward;
+		tree.scan(lo, key, [&forward](int visitedKey, const std::string& visitedValue) {
+			forward.push_back(std::make_pair(visitedKey, visitedValue));
+			return true;
+		});
+		std::reverse(expected.begin(), expected.end());
+		if (forward != expected) {
+			return fail(fuzz, "scan differs", key);
+		}
+		typedef std::vector<std::pair<int, std::string> > Pairs;
+		Pairs parallel = tree.scanParallel(lo, key, Pairs(),
+			[](Pairs& partial, int visitedKey, const std::string& visitedValue) {
+				partial.push_back(std::make_pair(visitedKey, visitedValue));
+			},
+			[](Pairs& result, const Pairs& partial) { result.insert(result.end(), partial.begin(), partial.end()); },
+			1 + argument % 4);
+		if (parallel != forward) {
+			return fail(fuzz, "scanParallel differs from scan", key);
+		}
+	}
+	else if (op == FUZZ_SNAPSHOT) {
+		//the previous snapshot must not have seen any of the changes made since it was taken
+		if (fuzz.snapshot != 0 && !compareAll(fuzz, *fuzz.snapshot, fuzz.snapshotModel)) {
+			return false;
+		}
+		if (fuzz.snapshot != 0 && argument % 2 == 1) {
+			*fuzz.snapshot = tree;
+		}
+		else {
+			delete fuzz.snapshot;
+			fuzz.snapshot = new BpTree(tree);
+		}
+		fuzz.snapshotModel = model;
+	}
+	else if (op == FUZZ_SNAPSHOT_WRITE) {
+		//changes to the snapshot copy the nodes it shares with the tree, which must not see them
+		if (fuzz.snapshot == 0) {
+			return true;
+		}
+		BpTree& snapshot = *fuzz.snapshot;
+		Model& snapshotModel = fuzz.snapshotModel;
+		if (argument % 3 == 0) {
+			bool expected = snapshotModel.insert(std::make_pair(key, value)).second;
+			if (snapshot.insert(key, value) != expected) {
+				return fail(fuzz, "snapshot insert result differs", key);
+			}
+		}
+		else if (argument % 3 == 1) {
+			bool expected = snapshotModel.erase(key) > 0;
+			if (snapshot.remove(key) != expected) {
+				return fail(fuzz, "snapshot remove result differs", key);
+			}
+		}
+		else {
+			int hi = key + argument / 8;
+			Model::iterator begin = snapshotModel.lower_bound(key);
+			Model::iterator end = snapshotModel.upper_bound(hi);
+			int expected = (int)std::distance(begin, end);
+			snapshotModel.erase(begin, end);
+			if (snapshot.removeRange(key, hi) != expected) {
+				return fail(fuzz, "snapshot removeRange result differs", key);
+			}
+		}
+		std::string problem;
+		if (!snapshot.validate(problem)) {
+			return fail(fuzz, ("snapshot: " + problem).c_str(), key);
+		}
+		if (argument % 4 == 0 && !compareAll(fuzz, tree, model)) {
+			return false;
+		}
+	}
+	else if (op == FUZZ_CLONE) {
+		//a deep copy holds the same pairs, and changes to it do not reach the tree
+		BpTree copy = tree.clone(1 + argument % 3);
+		if (!compareAll(fuzz, copy, model)) {
+			return false;
+		}
+		copy.remove(key);
+		copy.insert(key + 1, value);
+		Model::iterator it = model.find(key);
+		if (tree.find(key) != (it != model.end() ? it->second : std::string())) {
+			return fail(fuzz, "a change to a clone reached the tree", key);
+		}
+	}
+	else if (op == FUZZ_FILTER) {
+		//switches the key filter off or rebuilds it with 1 to 15 bits per key
+		tree.setFilter(argument % 16);
+		changed = true;
+	}
+	else if (op == FUZZ_CACHE) {
+		//switches the lookup cache off or replaces it with an empty one of 1 to 4 shards
+		tree.setCache(argument % 4 == 0 ? 0 : (size_t)argument * 64, 1 + argument % 4);
+		changed = true;
+	}
+	else if (op == FUZZ_MOVE) {
+		if (argument % 4 == 0) {
+			//move construction, which leaves the old tree empty, and back
+			BpTree moved(std::move(tree));
+			if (tree.count(-fuzz.keyRange, fuzz.keyRange * 2) != 0 || !tree.find(key).empty()) {
+				return fail(fuzz, "a moved-from tree is not empty", key);
+			}
+			tree = std::move(moved);
+		}
+		else if (argument % 4 == 1) {
+			//move assignment through a temporary and back
+			BpTree other(fuzz.maxKeys);
+			other.insert(key, value);
+			other = std::move(tree);
+			tree = std::move(other);
+		}
+		else if (argument % 4 == 2) {
+			//swapping with the snapshot, both ways round so that they end up where they started
+			if (fuzz.snapshot == 0) {
+				return true;
+			}
+			tree.swap(*fuzz.snapshot);
+			if (!compareAll(fuzz, *fuzz.snapshot, model) || !compareAll(fuzz, tree, fuzz.snapshotModel)) {
+				return false;
+			}
+			fuzz.snapshot->swap(tree);
+		}
+		else {
+			//clearing with one thread or several
+			if (argument % 8 == 3) {
+				tree.clear();
+			}
+			else {
+				tree.clear(1 + argument % 3);
+			}
+			model.clear();
+		}
+		changed = true;
+	}
+	if (changed) {
+		std::string problem;
+		if (!tree.validate(problem)) {
+			return fail(fuzz, problem.c_str(), key);
+		}
+	}
+	return true;
+}
+
+//runs the operations encoded by a stream; returns false and describes the failure on a difference
+static bool run(const uint8_t* data, size_t size, char* failure, size_t failureSize) {
+	Stream stream = { data, size, 0 };
+	int maxKeys = 3 + stream.next() % 14;
+	int keyRange = 16 << (stream.next() % 9);
+	Fuzz fuzz;
+	fuzz.tree = new BpTree(maxKeys);
+	fuzz.snapshot = 0;
+	fuzz.maxKeys = maxKeys;
+	fuzz.keyRange = keyRange;
+	fuzz.step = 0;
+	fuzz.failure[0] = 0;
+	bool ok = true;
+	while (ok && !stream.done()) {
+		int op = stream.next() % NUM_FUZZ_OPS;
+		int high = stream.next();
+		int low = stream.next();
+		int key = ((high << 8) | low) % keyRange;
+		ok = step(fuzz, op, key, low);
+		fuzz.step++;
+	}
+	if (ok) {
+		ok = compareAll(fuzz, *fuzz.tree, fuzz.model);
+	}
+	if (ok && fuzz.snapshot != 0) {
+		ok = compareAll(fuzz, *fuzz.snapshot, fuzz.snapshotModel);
+	}
+	if (!ok) {
+		snprintf(failure, failureSize, "maxKeys %d, keys 0..%d, %s", maxKeys, keyRange - 1, fuzz.failure);
+	}
+	delete fuzz.snapshot;
+	delete fuzz.tree;
+	return ok;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	char failure[640];
+	if (!run(data, size, failure, sizeof(failure))) {
+		fprintf(stderr, "%s\n", failure);
+		abort();
+	}
+	return 0;
+}
+
+#ifndef BPTREE_LIBFUZZER
+//replays a saved stream
+static bool replay(const char* path) {
+	FILE * file = fopen(path, "rb");
+	if (file == 0) {
+		fprintf(stderr, "could not open %s\n", path);
+		return false;
+	}
+	std::vector<uint8_t> data;
+	int c;
+	while ((c = fgetc(file)) != EOF) {
+		data.push_back((uint8_t)c);
+	}
+	fclose(file);
+	char failure[640];
+	if (!run(data.data(), data.size(), failure, sizeof(failure))) {
+		printf("%s: %s\n", path, failure);
+		return false;
+	}
+	printf("%s: ok\n", path);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && (argv[1][0] < '0' || argv[1][0] > '9')) {
+		bool ok = true;
+		for (int i = 1; i < argc; i++) {
+			ok = replay(argv[i]) && ok;
+		}
+		return ok ? 0 : 1;
+	}
+	long runs = argc > 1 ? atol(argv[1]) : 1000;
+	long opsPerRun = argc > 2 ? atol(argv[2]) : 2000;
+	unsigned int seed = argc > 3 ? (unsigned int)atol(argv[3]) : 1;
+	std::mt19937 random(seed);
+	std::vector<uint8_t> data(2 + opsPerRun * 3);
+	for (long r = 0; r < runs; r++) {
+		for (size_t i = 0; i < data.size(); i++) {
+			data[i] = (uint8_t)random();
+		}
+		char failure[640];
+		if (!run(data.data(), data.size(), failure, sizeof(failure))) {
+			char path[64];
+			snprintf(path, sizeof(path), "bptree_fuzz-%u-%ld.bin", seed, r);
+			FILE * file = fopen(path, "wb");
+			if (file != 0) {
+				fwrite(data.data(), 1, data.size(), file);
+				fclose(file);
+			}
+			printf("run %ld failed: %s (stream saved as %s)\n", r, failure, path);
+			return 1;
+		}
+	}
+	printf("%ld runs of %ld operations passed\n", runs, opsPerRun);
+	return 0;
+}
+#endif
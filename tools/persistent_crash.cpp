@@ -0,0 +1,228 @@
+/* Crash-injection test of the persistent tree
+ * Description:
+ *	Checks that a PersistentBpTree file always opens as a valid tree holding exactly the
+ *	committed updates, however the process updating it dies. Every round forks a child that
+ *	applies the next operations of a deterministic stream (inserts, removes and updates of a
+ *	small key range, so that nodes keep splitting and merging) to the file and counts each
+ *	finished operation in shared memory. The child is killed in one of three ways, in turn:
+ *		- the parent sends it SIGKILL after a random delay
+ *		- it kills itself at a random stage of a random commit (through the commit hook)
+ *		- it tears the new superblock (overwrites half of it with garbage, as if only part of
+ *		  it reached the disk) before the superblock is synced, then kills itself
+ *	The parent then reopens the file, runs validate() and compares the contents with a
+ *	std::map that replayed the stream: they must match the operations the child finished,
+ *	or those plus the one it was in the middle of (never for a torn superblock). The next
+ *	round carries on from there.
+ *		persistent_crash [path=persistent_crash.db] [rounds=100] [opsPerRound=200] [seed=1]
+ */
+#include "../PersistentBpTree.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <random>
+#include <signal.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants used for the ways the child is killed */
+#define CRASH_PARENT_KILL		0
+#define CRASH_IN_COMMIT			1
+#define CRASH_TORN_SUPERBLOCK	2
+#define NUM_CRASH_MODES			3
+
+#define CRASH_KEY_RANGE			512
+#define CRASH_MAX_KEYS			4
+#define CRASH_MAX_VALUE_SIZE	24
+
+typedef std::map<int, std::string> Model;
+
+//how the child dies, set by the parent before the fork
+struct CrashPlan {
+	int mode;
+	long commitsLeft; //commits to let through before crashing (CRASH_IN_COMMIT and CRASH_TORN_SUPERBLOCK)
+	int stage; //the PERSIST_ stage to crash at (CRASH_IN_COMMIT)
+	int fd; //the file, for tearing the superblock
+	PersistentBpTree* tree;
+};
+
+//mixes a seed and an operation number into the random bits of the operation
+static uint64_t mix(uint64_t seed, uint64_t index) {
+	uint64_t z = seed * 0x9E3779B97F4A7C15ULL + index + 1;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+//the operation at an index of the stream: 0 insert, 1 remove, 2 update; its key and value
+static int operationAt(uint64_t seed, uint64_t index, int& key, std::string& value) {
+	uint64_t bits = mix(seed, index);
+	int roll = bits % 100;
+	key = (bits >> 8) % CRASH_KEY_RANGE;
+	value = "v" + std::to_string(index) + std::string((bits >> 32) % 12, 'x');
+	return roll < 50 ? 0 : (roll < 85 ? 1 : 2);
+}
+
+//applies an operation of the stream to the tree
+static void apply(PersistentBpTree& tree, uint64_t seed, uint64_t index) {
+	int key;
+	std::string value;
+	int operation = operationAt(seed, index, key, value);
+	if (operation == 0) {
+		tree.insert(key, value);
+	} else if (operation == 1) {
+		tree.remove(key);
+	} else {
+		tree.update(key, value);
+	}
+}
+
+//applies an operation of the stream to the model
+static void apply(Model& model, uint64_t seed, uint64_t index) {
+	int key;
+	std::string value;
+	int operation = operationAt(seed, index, key, value);
+	if (operation == 0) {
+		model.insert(std::make_pair(key, value));
+	} else if (operation == 1) {
+		model.erase(key);
+	} else if (model.count(key) != 0) {
+		model[key] = value;
+	}
+}
+
+//the commit hook of the child: dies as planned
+static void crashHook(int stage, void* argument) {
+	CrashPlan* plan = (CrashPlan*)argument;
+	if (stage == PERSIST_PAGES_WRITTEN && plan->commitsLeft-- > 0) {
+		return;
+	}
+	if (plan->commitsLeft >= 0) {
+		return;
+	}
+	if (plan->mode == CRASH_IN_COMMIT && stage == plan->stage) {
+		raise(SIGKILL);
+	}
+	if (plan->mode == CRASH_TORN_SUPERBLOCK && stage == PERSIST_SUPERBLOCK_WRITTEN) {
+		//the new superblock is the one a generation ahead of the current one
+		for (int slot = 0; slot < 2; slot++) {
+			PersistentSuperblock superblock;
+			if (pread(plan->fd, &superblock, sizeof(superblock), slot * PERSIST_SLOT_SIZE) == (ssize_t)sizeof(superblock) &&
+				superblock.generation == plan->tree->getGeneration() + 1) {
+				char garbage[sizeof(PersistentSuperblock)];
+				memset(garbage, 0xA5, sizeof(garbage));
+				size_t half = offsetof(PersistentSuperblock, root);
+				if (pwrite(plan->fd, garbage, sizeof(garbage) - half, slot * PERSIST_SLOT_SIZE + half) < 0) {
+					perror("pwrite");
+				}
+			}
+		}
+		raise(SIGKILL);
+	}
+}
+
+//reads the whole tree and compares it with a model
+static bool matches(PersistentBpTree& tree, const Model& model) {
+	Model contents;
+	tree.scan(INT32_MIN, INT32_MAX, [&contents](int key, const std::string& value) {
+		contents[key] = value;
+		return true;
+	});
+	return contents == model && tree.size() == model.size();
+}
+
+int main(int argc, char** argv) {
+	std::string path = argc > 1 ? argv[1] : "persistent_crash.db";
+	long rounds = argc > 2 ? atol(argv[2]) : 100;
+	long opsPerRound = argc > 3 ? atol(argv[3]) : 200;
+	uint64_t seed = argc > 4 ? (uint64_t)atoll(argv[4]) : 1;
+	std::mt19937 random(seed);
+
+	PersistentBpTree tree;
+	if (!tree.create(path, CRASH_MAX_KEYS, CRASH_MAX_VALUE_SIZE)) {
+		fprintf(stderr, "cannot create %s\n", path.c_str());
+		return 1;
+	}
+	tree.close();
+	std::atomic<uint64_t>* acked = (std::atomic<uint64_t>*)mmap(0, sizeof(std::atomic<uint64_t>),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (acked == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	Model model; //the contents after the first done operations
+	uint64_t done = 0;
+	long crashes = 0;
+	long inFlightCommitted = 0;
+	for (long round = 0; round < rounds; round++) {
+		CrashPlan plan;
+		plan.mode = round % NUM_CRASH_MODES;
+		plan.commitsLeft = random() % opsPerRound;
+		plan.stage = random() % (PERSIST_COMMITTED + 1);
+		plan.tree = &tree;
+		acked->store(done);
+		pid_t child = fork();
+		if (child < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (child == 0) {
+			if (!tree.open(path)) {
+				_exit(2);
+			}
+			plan.fd = open(path.c_str(), O_RDWR);
+			if (plan.mode != CRASH_PARENT_KILL) {
+				tree.setCommitHook(crashHook, &plan);
+			}
+			for (uint64_t i = done; i < done + opsPerRound; i++) {
+				apply(tree, seed, i);
+				acked->store(i + 1);
+			}
+			_exit(0);
+		}
+		if (plan.mode == CRASH_PARENT_KILL) {
+			usleep(random() % 20000);
+			kill(child, SIGKILL);
+		}
+		int status;
+		waitpid(child, &status, 0);
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "round %ld: the child could not open %s\n", round, path.c_str());
+			return 1;
+		}
+		crashes += WIFSIGNALED(status) ? 1 : 0;
+
+		std::string error;
+		if (!tree.open(path) || !tree.validate(error)) {
+			fprintf(stderr, "round %ld: the tree is not valid after the crash: %s\n", round,
+				tree.isOpen() ? error.c_str() : "cannot open the file");
+			return 1;
+		}
+		uint64_t finished = acked->load();
+		for (; done < finished; done++) {
+			apply(model, seed, done);
+		}
+		if (!matches(tree, model)) {
+			Model next = model;
+			apply(next, seed, done);
+			if (plan.mode == CRASH_TORN_SUPERBLOCK || !WIFSIGNALED(status) || !matches(tree, next)) {
+				fprintf(stderr, "round %ld: the tree does not hold the %lu finished operations%s\n", round,
+					(unsigned long)finished, plan.mode == CRASH_TORN_SUPERBLOCK ? "" : " (nor the one in flight)");
+				return 1;
+			}
+			model.swap(next);
+			done += 1;
+			inFlightCommitted += 1;
+		}
+		tree.close();
+	}
+	printf("%ld rounds, %ld crashes, %lu operations: the tree was valid and held every committed operation "
+		"(%ld operations in flight at a crash had committed)\n", rounds, crashes, (unsigned long)done, inFlightCommitted);
+	return 0;
+}